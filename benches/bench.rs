@@ -0,0 +1,626 @@
+//! Benchmark suite for the limited-memory claim.
+//!
+//! Every case runs against each engine at each memory budget and reports
+//! throughput, latency percentiles, the process's peak resident set and
+//! the budget's own high-water mark. The report is printed and written to
+//! `bench_output.txt` at the crate root.
+//!
+//! ```text
+//! cargo bench                      # everything
+//! cargo bench -- ycsb-a scan       # cases whose name contains a filter
+//! ```
+//!
+//! Sizes come from the environment:
+//!
+//! | variable             | default      | meaning                              |
+//! |----------------------|--------------|--------------------------------------|
+//! | `BENCH_BUDGETS_MIB`  | `16,64,256`  | `max_resident_bytes` of each run     |
+//! | `BENCH_ENGINES`      | `btree,lsm`  | engines to run                       |
+//! | `BENCH_RECORDS`      | `100000`     | records loaded before YCSB runs      |
+//! | `BENCH_OPS`          | `100000`     | operations per YCSB run              |
+//! | `BENCH_THREADS`      | `4`          | client threads                       |
+//! | `BENCH_SPILL_ROWS`   | `1000000`    | rows sorted and joined               |
+//!
+//! The YCSB workloads follow the core package: records of 10 fields of
+//! 20 bytes, keys drawn from a scrambled Zipfian distribution (latest-
+//! biased for D), scans of up to 100 records. The `scan` case reads 1000
+//! records from a uniformly chosen key, `BENCH_OPS / 100` times.
+//!
+//! | workload | mix                                  |
+//! |----------|--------------------------------------|
+//! | A        | 50% read, 50% update                 |
+//! | B        | 95% read, 5% update                  |
+//! | C        | 100% read                            |
+//! | D        | 95% read latest, 5% insert           |
+//! | E        | 95% short scan, 5% insert            |
+//! | F        | 50% read, 50% read-modify-write      |
+
+use std::fmt::Write as _;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use digestive_database::hash::hash64;
+use digestive_database::{Database, Engine, Options, Result};
+
+const FIELDS: usize = 10;
+const FIELD_BYTES: usize = 20;
+const MAX_SCAN: u64 = 100;
+const ZIPFIAN_THETA: f64 = 0.99;
+
+struct Config {
+    budgets_mib: Vec<usize>,
+    engines: Vec<Engine>,
+    records: u64,
+    ops: u64,
+    threads: usize,
+    spill_rows: u64,
+    filters: Vec<String>,
+}
+
+impl Config {
+    fn from_env() -> Self {
+        fn var<T: std::str::FromStr>(name: &str, default: T) -> T {
+            std::env::var(name)
+                .ok()
+                .and_then(|v| v.parse().ok())
+                .unwrap_or(default)
+        }
+        let budgets = std::env::var("BENCH_BUDGETS_MIB").unwrap_or_else(|_| "16,64,256".into());
+        let engines = std::env::var("BENCH_ENGINES").unwrap_or_else(|_| "btree,lsm".into());
+        Config {
+            budgets_mib: budgets
+                .split(',')
+                .filter_map(|b| b.trim().parse().ok())
+                .collect(),
+            engines: engines
+                .split(',')
+                .filter_map(|e| match e.trim() {
+                    "btree" => Some(Engine::BTree),
+                    "lsm" => Some(Engine::Lsm),
+                    _ => None,
+                })
+                .collect(),
+            records: var("BENCH_RECORDS", 100_000),
+            ops: var("BENCH_OPS", 100_000),
+            threads: var("BENCH_THREADS", 4usize).max(1),
+            spill_rows: var("BENCH_SPILL_ROWS", 1_000_000),
+            // `cargo bench` passes `--bench`; anything else is a filter.
+            filters: std::env::args()
+                .skip(1)
+                .filter(|a| !a.starts_with("--"))
+                .collect(),
+        }
+    }
+
+    fn selected(&self, case: &str) -> bool {
+        self.filters.is_empty() || self.filters.iter().any(|f| case.contains(f.as_str()))
+    }
+}
+
+/// xorshift64*; each client thread has its own.
+struct Rng(u64);
+
+impl Rng {
+    fn new(seed: u64) -> Self {
+        Rng(hash64(&seed.to_le_bytes(), 0x9e37_79b9) | 1)
+    }
+
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    fn below(&mut self, n: u64) -> u64 {
+        self.next() % n.max(1)
+    }
+
+    fn unit(&mut self) -> f64 {
+        (self.next() >> 11) as f64 / (1u64 << 53) as f64
+    }
+}
+
+/// Zipfian ranks over `0..items`, rank 0 the most popular (Gray et al.,
+/// as used by YCSB).
+struct Zipfian {
+    items: u64,
+    alpha: f64,
+    zetan: f64,
+    eta: f64,
+}
+
+impl Zipfian {
+    fn new(items: u64) -> Self {
+        let zeta = |n: u64| {
+            (1..=n)
+                .map(|i| 1.0 / (i as f64).powf(ZIPFIAN_THETA))
+                .sum::<f64>()
+        };
+        let zetan = zeta(items);
+        let zeta2 = zeta(2);
+        Zipfian {
+            items,
+            alpha: 1.0 / (1.0 - ZIPFIAN_THETA),
+            zetan,
+            eta: (1.0 - (2.0 / items as f64).powf(1.0 - ZIPFIAN_THETA)) / (1.0 - zeta2 / zetan),
+        }
+    }
+
+    fn next(&self, rng: &mut Rng) -> u64 {
+        let u = rng.unit();
+        let uz = u * self.zetan;
+        if uz < 1.0 {
+            return 0;
+        }
+        if uz < 1.0 + 0.5f64.powf(ZIPFIAN_THETA) {
+            return 1;
+        }
+        let rank = (self.items as f64 * (self.eta * u - self.eta + 1.0).powf(self.alpha)) as u64;
+        rank.min(self.items - 1)
+    }
+}
+
+/// Record numbers are hashed into keys so that load order is not key order.
+fn key(record: u64) -> Vec<u8> {
+    format!("user{:016x}", hash64(&record.to_le_bytes(), 0)).into_bytes()
+}
+
+fn value(rng: &mut Rng) -> Vec<u8> {
+    let mut value = vec![0u8; FIELDS * FIELD_BYTES];
+    for byte in &mut value {
+        *byte = b'a' + (rng.next() % 26) as u8;
+    }
+    value
+}
+
+/// Per-operation latencies of one run, in nanoseconds.
+#[derive(Default)]
+struct Latencies(Vec<u64>);
+
+impl Latencies {
+    fn time<T>(&mut self, f: impl FnOnce() -> T) -> T {
+        let started = Instant::now();
+        let out = f();
+        self.0.push(started.elapsed().as_nanos() as u64);
+        out
+    }
+
+    fn merge(&mut self, other: Latencies) {
+        self.0.extend(other.0);
+    }
+
+    fn percentile(&self, p: f64) -> Option<Duration> {
+        if self.0.is_empty() {
+            return None;
+        }
+        let at = ((self.0.len() as f64 * p).ceil() as usize).clamp(1, self.0.len()) - 1;
+        Some(Duration::from_nanos(self.0[at]))
+    }
+}
+
+struct Row {
+    case: String,
+    engine: Engine,
+    budget_mib: usize,
+    ops: u64,
+    elapsed: Duration,
+    latencies: Latencies,
+    peak_rss: Option<u64>,
+    budget_peak: usize,
+    note: String,
+}
+
+/// Resets the process's peak RSS and the budget's peak of `db` so the next
+/// readings cover one case only.
+fn reset_peaks(db: &Database) {
+    reset_peak_rss();
+    db.budget().reset_peak();
+}
+
+/// Resets the kernel's peak-RSS counter so the next reading covers one
+/// case only. Linux-specific; elsewhere peaks accumulate.
+fn reset_peak_rss() {
+    let _ = std::fs::write("/proc/self/clear_refs", "5");
+}
+
+fn peak_rss() -> Option<u64> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    let kib: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kib << 10)
+}
+
+struct Bench {
+    config: Config,
+    root: PathBuf,
+    rows: Vec<Row>,
+}
+
+impl Bench {
+    fn options(&self, engine: Engine, budget_mib: usize) -> Options {
+        let budget = budget_mib << 20;
+        Options {
+            engine,
+            max_resident_bytes: budget,
+            sort_memory_bytes: budget / 8,
+            join_memory_bytes: budget / 8,
+            ..Options::default()
+        }
+    }
+
+    fn fresh_dir(&self, name: &str) -> PathBuf {
+        let dir = self.root.join(name);
+        let _ = std::fs::remove_dir_all(&dir);
+        dir
+    }
+
+    /// Splits `ops` operations over the client threads, timing each one.
+    fn drive(
+        &self,
+        ops: u64,
+        op: impl Fn(&mut Rng, &mut Latencies) -> Result<()> + Sync,
+    ) -> Result<(Duration, Latencies)> {
+        let threads = self.config.threads as u64;
+        let started = Instant::now();
+        let per_thread: Vec<Result<Latencies>> = std::thread::scope(|scope| {
+            let handles: Vec<_> = (0..threads)
+                .map(|t| {
+                    let op = &op;
+                    scope.spawn(move || {
+                        let mut rng = Rng::new(t + 1);
+                        let mut latencies = Latencies::default();
+                        let share = ops / threads + u64::from(t < ops % threads);
+                        for _ in 0..share {
+                            op(&mut rng, &mut latencies)?;
+                        }
+                        Ok(latencies)
+                    })
+                })
+                .collect();
+            handles.into_iter().map(|h| h.join().unwrap()).collect()
+        });
+        let elapsed = started.elapsed();
+        let mut latencies = Latencies::default();
+        for part in per_thread {
+            latencies.merge(part?);
+        }
+        latencies.0.sort_unstable();
+        Ok((elapsed, latencies))
+    }
+
+    #[allow(clippy::too_many_arguments)]
+    fn record(
+        &mut self,
+        case: &str,
+        engine: Engine,
+        budget_mib: usize,
+        ops: u64,
+        elapsed: Duration,
+        latencies: Latencies,
+        budget_peak: usize,
+        note: String,
+    ) {
+        let row = Row {
+            case: case.into(),
+            engine,
+            budget_mib,
+            ops,
+            elapsed,
+            latencies,
+            peak_rss: peak_rss(),
+            budget_peak,
+            note,
+        };
+        println!("{}", format_row(&row));
+        self.rows.push(row);
+    }
+
+    /// Loads the records, then runs the YCSB workloads and range scans on
+    /// the loaded database.
+    fn run_ycsb(&mut self, engine: Engine, budget_mib: usize) -> Result<()> {
+        let workloads = [
+            "ycsb-a", "ycsb-b", "ycsb-c", "ycsb-f", "ycsb-d", "ycsb-e", "scan",
+        ];
+        if !self.config.selected("load") && !workloads.iter().any(|w| self.config.selected(w)) {
+            return Ok(());
+        }
+        let dir = self.fresh_dir(&format!("ycsb-{engine:?}-{budget_mib}"));
+        let db = Database::open(&dir, self.options(engine, budget_mib))?;
+        let records = self.config.records;
+
+        reset_peaks(&db);
+        let next = AtomicU64::new(0);
+        let (elapsed, latencies) = self.drive(records, |rng, lat| {
+            let record = next.fetch_add(1, Ordering::Relaxed);
+            let value = value(rng);
+            lat.time(|| db.put(&key(record), &value))
+        })?;
+        let note = format!("{records} records");
+        self.record(
+            "load",
+            engine,
+            budget_mib,
+            records,
+            elapsed,
+            latencies,
+            db.budget().peak(),
+            note,
+        );
+
+        let inserted = AtomicU64::new(records);
+        let zipf = Zipfian::new(records);
+        for workload in workloads {
+            if !self.config.selected(workload) {
+                continue;
+            }
+            // Long scans read a thousand records each.
+            let ops = match workload {
+                "scan" => (self.config.ops / 100).max(1),
+                _ => self.config.ops,
+            };
+            reset_peaks(&db);
+            let scanned = AtomicU64::new(0);
+            let (elapsed, latencies) = self.drive(ops, |rng, lat| {
+                // Scrambled Zipfian over the loaded records, or for D a
+                // Zipfian distance back from the newest insert.
+                let popular = |rng: &mut Rng| {
+                    let rank = zipf.next(rng);
+                    if workload == "ycsb-d" {
+                        inserted.load(Ordering::Relaxed).saturating_sub(rank + 1)
+                    } else {
+                        hash64(&rank.to_le_bytes(), 1) % records
+                    }
+                };
+                let roll = rng.below(100);
+                match workload {
+                    "ycsb-a" | "ycsb-b" => {
+                        let update_pct = if workload == "ycsb-a" { 50 } else { 5 };
+                        let k = key(popular(rng));
+                        if roll < update_pct {
+                            let v = value(rng);
+                            lat.time(|| db.put(&k, &v))
+                        } else {
+                            lat.time(|| db.get(&k)).map(drop)
+                        }
+                    }
+                    "ycsb-c" => {
+                        let k = key(popular(rng));
+                        lat.time(|| db.get(&k)).map(drop)
+                    }
+                    "ycsb-d" | "ycsb-e" if roll < 5 => {
+                        let record = inserted.fetch_add(1, Ordering::Relaxed);
+                        let v = value(rng);
+                        lat.time(|| db.put(&key(record), &v))
+                    }
+                    "ycsb-d" => {
+                        let k = key(popular(rng));
+                        lat.time(|| db.get(&k)).map(drop)
+                    }
+                    "ycsb-e" => {
+                        let k = key(popular(rng));
+                        let len = 1 + rng.below(MAX_SCAN);
+                        lat.time(|| scan(&db, &k, len, &scanned))
+                    }
+                    "ycsb-f" => {
+                        let k = key(popular(rng));
+                        let v = value(rng);
+                        lat.time(|| {
+                            let mut record = db.get(&k)?.unwrap_or_default();
+                            let field = FIELD_BYTES.min(record.len());
+                            record[..field].copy_from_slice(&v[..field]);
+                            db.put(&k, &record)
+                        })
+                    }
+                    _ => {
+                        let start = key(rng.below(records));
+                        lat.time(|| scan(&db, &start, 1000, &scanned))
+                    }
+                }
+            })?;
+            let note = match scanned.load(Ordering::Relaxed) {
+                0 => String::new(),
+                rows => format!("{rows} rows scanned"),
+            };
+            self.record(
+                workload,
+                engine,
+                budget_mib,
+                ops,
+                elapsed,
+                latencies,
+                db.budget().peak(),
+                note,
+            );
+        }
+        drop(db);
+        let _ = std::fs::remove_dir_all(&dir);
+        Ok(())
+    }
+
+    fn run_sort(&mut self, engine: Engine, budget_mib: usize) -> Result<()> {
+        if !self.config.selected("sort-spill") {
+            return Ok(());
+        }
+        let dir = self.fresh_dir(&format!("sort-{engine:?}-{budget_mib}"));
+        let db = Database::open(&dir, self.options(engine, budget_mib))?;
+        let rows = self.config.spill_rows;
+        reset_peaks(&db);
+        let mut rng = Rng::new(7);
+        let started = Instant::now();
+        let mut sorter = db.sorter()?;
+        for record in 0..rows {
+            sorter.push(key(record), value(&mut rng))?;
+        }
+        let output = sorter.finish()?;
+        let stats = output.stats();
+        let mut previous = Vec::new();
+        for entry in output {
+            let (key, _) = entry?;
+            assert!(key >= previous, "sort output out of order");
+            previous = key;
+        }
+        let elapsed = started.elapsed();
+        let note = format!(
+            "{} runs, {} merge passes, {} MiB spilled",
+            stats.runs,
+            stats.merge_passes,
+            stats.spilled_bytes >> 20
+        );
+        let peak = db.budget().peak();
+        self.record(
+            "sort-spill",
+            engine,
+            budget_mib,
+            rows,
+            elapsed,
+            Latencies::default(),
+            peak,
+            note,
+        );
+        drop(db);
+        let _ = std::fs::remove_dir_all(&dir);
+        Ok(())
+    }
+
+    fn run_join(&mut self, engine: Engine, budget_mib: usize) -> Result<()> {
+        if !self.config.selected("join-spill") {
+            return Ok(());
+        }
+        let dir = self.fresh_dir(&format!("join-{engine:?}-{budget_mib}"));
+        let db = Database::open(&dir, self.options(engine, budget_mib))?;
+        // Every build row matches two probe rows.
+        let build_rows = self.config.spill_rows / 2;
+        reset_peaks(&db);
+        let mut rng = Rng::new(11);
+        let started = Instant::now();
+        let mut join = db.hash_join()?;
+        for record in 0..build_rows {
+            join.push_build(key(record), value(&mut rng))?;
+        }
+        let mut probe_rng = Rng::new(13);
+        let probe = (0..2 * build_rows).map(move |i| Ok((key(i / 2), value(&mut probe_rng))));
+        let mut matches = 0u64;
+        let mut output = join.probe(probe)?;
+        for row in output.by_ref() {
+            row?;
+            matches += 1;
+        }
+        let stats = output.stats();
+        assert_eq!(matches, 2 * build_rows, "join lost rows");
+        let elapsed = started.elapsed();
+        let note = format!(
+            "{} spilled partitions, {} repartitions, {} MiB spilled",
+            stats.spilled_partitions,
+            stats.repartitions,
+            stats.spilled_bytes >> 20
+        );
+        drop(output);
+        let peak = db.budget().peak();
+        self.record(
+            "join-spill",
+            engine,
+            budget_mib,
+            3 * build_rows,
+            elapsed,
+            Latencies::default(),
+            peak,
+            note,
+        );
+        drop(db);
+        let _ = std::fs::remove_dir_all(&dir);
+        Ok(())
+    }
+}
+
+fn scan(db: &Database, start: &[u8], len: u64, scanned: &AtomicU64) -> Result<()> {
+    let mut rows = 0;
+    for entry in db.scan_from(start)?.take(len as usize) {
+        entry?;
+        rows += 1;
+    }
+    scanned.fetch_add(rows, Ordering::Relaxed);
+    Ok(())
+}
+
+fn micros(d: Option<Duration>) -> String {
+    d.map_or_else(|| "-".into(), |d| format!("{:.1}", d.as_secs_f64() * 1e6))
+}
+
+fn mib(bytes: u64) -> String {
+    format!("{:.1}", bytes as f64 / (1 << 20) as f64)
+}
+
+const HEADER: &str = "case        engine budget_mib        ops      ops/s   p50_us   p99_us  p999_us  rss_peak_mib  budget_peak_mib  notes";
+
+fn format_row(row: &Row) -> String {
+    let throughput = row.ops as f64 / row.elapsed.as_secs_f64().max(1e-9);
+    format!(
+        "{:<11} {:<6} {:>10} {:>10} {:>10.0} {:>8} {:>8} {:>8} {:>13} {:>16}  {}",
+        row.case,
+        format!("{:?}", row.engine).to_lowercase(),
+        row.budget_mib,
+        row.ops,
+        throughput,
+        micros(row.latencies.percentile(0.50)),
+        micros(row.latencies.percentile(0.99)),
+        micros(row.latencies.percentile(0.999)),
+        row.peak_rss.map_or_else(|| "-".into(), mib),
+        mib(row.budget_peak as u64),
+        row.note,
+    )
+    .trim_end()
+    .to_string()
+}
+
+fn report(bench: &Bench, path: &Path) -> std::io::Result<()> {
+    let config = &bench.config;
+    let mut out = String::new();
+    let unix = std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |d| d.as_secs());
+    let _ = writeln!(out, "# digestive-database benchmark report");
+    let _ = writeln!(out, "# unix_time {unix}");
+    let _ = writeln!(
+        out,
+        "# records {} ops {} threads {} spill_rows {} value_bytes {}",
+        config.records,
+        config.ops,
+        config.threads,
+        config.spill_rows,
+        FIELDS * FIELD_BYTES
+    );
+    let _ = writeln!(
+        out,
+        "# rss_peak_mib is the process high-water mark during the case; budget_peak_mib is the most memory the database reserved during the case."
+    );
+    let _ = writeln!(out, "{HEADER}");
+    for row in &bench.rows {
+        let _ = writeln!(out, "{}", format_row(row));
+    }
+    std::fs::write(path, out)
+}
+
+fn main() -> Result<()> {
+    let config = Config::from_env();
+    let root = std::env::temp_dir().join(format!("digestive-bench-{}", std::process::id()));
+    let mut bench = Bench {
+        config,
+        root,
+        rows: Vec::new(),
+    };
+    println!("{HEADER}");
+    for engine in bench.config.engines.clone() {
+        for budget_mib in bench.config.budgets_mib.clone() {
+            bench.run_ycsb(engine, budget_mib)?;
+            bench.run_sort(engine, budget_mib)?;
+            bench.run_join(engine, budget_mib)?;
+        }
+    }
+    let _ = std::fs::remove_dir_all(&bench.root);
+    let path = Path::new(env!("CARGO_MANIFEST_DIR")).join("bench_output.txt");
+    report(&bench, &path)?;
+    println!("report written to {}", path.display());
+    Ok(())
+}
@@ -0,0 +1,608 @@
+//! Batched and overlapped file I/O.
+//!
+//! A single read or write is cheapest as a plain `pread` or `pwrite`, and
+//! the engine issues those directly. [`IoQueue`] is for transfers that can
+//! be in flight together: a batch of page reads or write-backs, a log write
+//! and the sync behind it, or the next block of a spill file read while the
+//! current one is consumed. On Linux 5.6 and later a batch goes to the
+//! kernel through io_uring in one system call; elsewhere, or where io_uring
+//! is disabled, a pool of threads issues the calls instead, so a batch
+//! still keeps several requests outstanding at the device. Should the ring
+//! fail while in use, the queue switches to a thread pool for good.
+//!
+//! Batches borrow their buffers and return only once every request has
+//! completed. Overlapped requests own their buffers instead, and dropping
+//! a [`Pending`] waits for it, so no buffer is freed while the kernel may
+//! still write to it.
+
+mod threads;
+#[cfg(target_os = "linux")]
+mod uring;
+
+use std::fs::File;
+use std::io;
+use std::ops::DerefMut;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, OnceLock};
+
+use threads::{Completion, Workers};
+#[cfg(target_os = "linux")]
+use uring::Ring;
+
+/// Requests one io_uring submission or worker hand-off carries at most.
+pub const QUEUE_DEPTH: usize = 128;
+/// Threads in the fallback pool.
+const IO_THREADS: usize = 16;
+
+const ECANCELED: i32 = 125;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Kind {
+    Read,
+    Write,
+    Sync,
+}
+
+/// A request with its buffer reduced to a raw pointer, as handed to a
+/// backend.
+#[derive(Debug, Clone, Copy)]
+struct RawOp {
+    kind: Kind,
+    fd: RawFd,
+    offset: u64,
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl RawOp {
+    /// The part of the request left after `done` bytes were transferred.
+    fn rest(&self, done: usize) -> RawOp {
+        RawOp {
+            offset: self.offset + done as u64,
+            // SAFETY: `done` never exceeds the buffer length.
+            ptr: unsafe { self.ptr.add(done) },
+            len: self.len - done,
+            ..*self
+        }
+    }
+}
+
+/// One transfer in a batch passed to [`IoQueue::run`].
+#[derive(Debug)]
+pub enum Request<'a> {
+    /// Reads into `buf` from `offset`, stopping early at the end of the
+    /// file.
+    Read {
+        file: &'a File,
+        offset: u64,
+        buf: &'a mut [u8],
+    },
+    /// Writes all of `buf` at `offset`.
+    Write {
+        file: &'a File,
+        offset: u64,
+        buf: &'a [u8],
+    },
+    /// Flushes the file's data to stable storage.
+    Sync { file: &'a File },
+}
+
+impl Request<'_> {
+    fn raw(&mut self) -> RawOp {
+        match self {
+            Request::Read { file, offset, buf } => RawOp {
+                kind: Kind::Read,
+                fd: file.as_raw_fd(),
+                offset: *offset,
+                ptr: buf.as_mut_ptr(),
+                len: buf.len(),
+            },
+            Request::Write { file, offset, buf } => RawOp {
+                kind: Kind::Write,
+                fd: file.as_raw_fd(),
+                offset: *offset,
+                ptr: buf.as_ptr() as *mut u8,
+                len: buf.len(),
+            },
+            Request::Sync { file } => RawOp {
+                kind: Kind::Sync,
+                fd: file.as_raw_fd(),
+                offset: 0,
+                ptr: std::ptr::null_mut(),
+                len: 0,
+            },
+        }
+    }
+}
+
+/// The mechanism behind an [`IoQueue`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Backend {
+    Uring,
+    Threads,
+}
+
+impl Backend {
+    /// Stable lower-case name used in reports.
+    pub fn name(self) -> &'static str {
+        match self {
+            Backend::Uring => "io_uring",
+            Backend::Threads => "threads",
+        }
+    }
+}
+
+/// Counters describing queue activity since it was created.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct IoStats {
+    /// Batches and overlapped requests submitted.
+    pub submissions: u64,
+    /// Requests across all of them.
+    pub requests: u64,
+    /// Most requests submitted together.
+    pub max_batch: u64,
+}
+
+#[derive(Debug)]
+enum Engine {
+    #[cfg(target_os = "linux")]
+    Uring(Ring),
+    Threads(Workers),
+}
+
+/// Where a submitted request's result will appear.
+#[derive(Debug)]
+enum Ticket {
+    #[cfg(target_os = "linux")]
+    Uring(u64),
+    Threads(Arc<Completion>, usize),
+}
+
+/// Submits file I/O through io_uring or a thread pool.
+#[derive(Debug)]
+pub struct IoQueue {
+    engine: Engine,
+    /// Takes over from a ring that failed, started when that happens. If
+    /// even its threads cannot be started, requests run on the caller's.
+    fallback: OnceLock<Option<Workers>>,
+    submissions: AtomicU64,
+    requests: AtomicU64,
+    max_batch: AtomicU64,
+}
+
+impl IoQueue {
+    /// Uses io_uring if the kernel offers it, and a thread pool otherwise.
+    pub fn new() -> io::Result<Self> {
+        #[cfg(target_os = "linux")]
+        if let Ok(ring) = Ring::new(QUEUE_DEPTH as u32) {
+            return Ok(Self::with_engine(Engine::Uring(ring)));
+        }
+        Self::with_threads(IO_THREADS)
+    }
+
+    /// Uses a pool of `threads` threads regardless of the platform.
+    pub fn with_threads(threads: usize) -> io::Result<Self> {
+        Ok(Self::with_engine(Engine::Threads(Workers::new(
+            threads.max(1),
+        )?)))
+    }
+
+    fn with_engine(engine: Engine) -> Self {
+        IoQueue {
+            engine,
+            fallback: OnceLock::new(),
+            submissions: AtomicU64::new(0),
+            requests: AtomicU64::new(0),
+            max_batch: AtomicU64::new(0),
+        }
+    }
+
+    /// Which mechanism this queue submits through.
+    pub fn backend(&self) -> Backend {
+        match &self.engine {
+            #[cfg(target_os = "linux")]
+            Engine::Uring(ring) if !ring.failed() => Backend::Uring,
+            _ => Backend::Threads,
+        }
+    }
+
+    /// Requests kept in flight at once: the ring size or the thread count.
+    pub fn depth(&self) -> usize {
+        match &self.engine {
+            #[cfg(target_os = "linux")]
+            Engine::Uring(ring) if !ring.failed() => QUEUE_DEPTH,
+            #[cfg(target_os = "linux")]
+            Engine::Uring(_) => self.fallback().map_or(1, Workers::threads),
+            Engine::Threads(workers) => workers.threads(),
+        }
+    }
+
+    /// The pool taking over from a failed ring.
+    #[cfg(target_os = "linux")]
+    fn fallback(&self) -> Option<&Workers> {
+        self.fallback
+            .get_or_init(|| Workers::new(IO_THREADS).ok())
+            .as_ref()
+    }
+
+    /// Snapshot of the submission counters.
+    pub fn stats(&self) -> IoStats {
+        IoStats {
+            submissions: self.submissions.load(Ordering::Relaxed),
+            requests: self.requests.load(Ordering::Relaxed),
+            max_batch: self.max_batch.load(Ordering::Relaxed),
+        }
+    }
+
+    /// # Safety
+    ///
+    /// Every buffer and descriptor in `ops` must stay valid until each
+    /// returned ticket has been passed to [`IoQueue::complete`].
+    unsafe fn submit(&self, ops: Vec<RawOp>, chain: bool) -> Vec<(RawOp, Ticket)> {
+        let n = ops.len() as u64;
+        self.submissions.fetch_add(1, Ordering::Relaxed);
+        self.requests.fetch_add(n, Ordering::Relaxed);
+        self.max_batch.fetch_max(n, Ordering::Relaxed);
+        let workers = match &self.engine {
+            #[cfg(target_os = "linux")]
+            Engine::Uring(ring) => {
+                if let Some(ids) = ring.submit(&ops, chain) {
+                    return ops
+                        .into_iter()
+                        .zip(ids)
+                        .map(|(op, id)| (op, Ticket::Uring(id)))
+                        .collect();
+                }
+                self.fallback()
+            }
+            Engine::Threads(workers) => Some(workers),
+        };
+        let completion = match workers {
+            Some(workers) => workers.submit(ops.clone(), chain),
+            None => threads::run_now(ops.clone(), chain),
+        };
+        ops.into_iter()
+            .enumerate()
+            .map(|(i, op)| (op, Ticket::Threads(Arc::clone(&completion), i)))
+            .collect()
+    }
+
+    /// Waits for a request and finishes what the kernel left undone: the
+    /// rest of a short write, or of a short read that did not reach the end
+    /// of the file.
+    fn complete(&self, op: &RawOp, ticket: Ticket) -> io::Result<usize> {
+        match ticket {
+            #[cfg(target_os = "linux")]
+            Ticket::Uring(id) => {
+                let Engine::Uring(ring) = &self.engine else {
+                    unreachable!()
+                };
+                let res = ring.wait(id);
+                if res < 0 {
+                    return Err(io::Error::from_raw_os_error(-res));
+                }
+                let done = res as usize;
+                if op.kind == Kind::Sync || done == op.len || (op.kind == Kind::Read && done == 0) {
+                    return Ok(done);
+                }
+                threads::run(&op.rest(done)).map(|rest| done + rest)
+            }
+            Ticket::Threads(completion, i) => completion.wait(i),
+        }
+    }
+
+    /// Runs every request, keeping up to [`QUEUE_DEPTH`] of them in flight,
+    /// and returns the bytes each transferred. Returns once all have
+    /// completed, whatever their outcome.
+    pub fn run(&self, mut requests: Vec<Request<'_>>) -> Vec<io::Result<usize>> {
+        let mut results = Vec::with_capacity(requests.len());
+        for chunk in requests.chunks_mut(QUEUE_DEPTH) {
+            let ops = chunk.iter_mut().map(Request::raw).collect();
+            // SAFETY: the borrowed buffers outlive this call, and every
+            // ticket is completed before it returns.
+            let tickets = unsafe { self.submit(ops, false) };
+            for (op, ticket) in tickets {
+                results.push(self.complete(&op, ticket));
+            }
+        }
+        results
+    }
+
+    /// Runs the requests one after another, each starting only once the
+    /// previous one succeeded, as a single submission. Returns the first
+    /// error.
+    pub fn run_chain(&self, mut requests: Vec<Request<'_>>) -> io::Result<()> {
+        assert!(requests.len() <= QUEUE_DEPTH, "chain longer than the queue");
+        let ops = requests.iter_mut().map(Request::raw).collect();
+        // SAFETY: as in `run`.
+        let tickets = unsafe { self.submit(ops, true) };
+        let mut first_error = None;
+        for (op, ticket) in tickets {
+            let result = match self.complete(&op, ticket) {
+                // The kernel breaks a chain at a short transfer, which
+                // `complete` then finished; only a real failure may stop
+                // the rest, so run what was cancelled after a success.
+                Err(err) if err.raw_os_error() == Some(ECANCELED) && first_error.is_none() => {
+                    threads::run(&op).map(drop)
+                }
+                result => result.map(drop),
+            };
+            if let Err(err) = result {
+                first_error.get_or_insert(err);
+            }
+        }
+        first_error.map_or(Ok(()), Err)
+    }
+
+    /// Starts reading `buf.len()` bytes of `file` at `offset` in the
+    /// background.
+    pub fn read<B: IoBuf>(&self, file: Arc<File>, offset: u64, buf: B) -> Pending<'_, B> {
+        self.start(Kind::Read, file, offset, buf)
+    }
+
+    /// Starts writing all of `buf` to `file` at `offset` in the background.
+    pub fn write<B: IoBuf>(&self, file: Arc<File>, offset: u64, buf: B) -> Pending<'_, B> {
+        self.start(Kind::Write, file, offset, buf)
+    }
+
+    /// Starts several background reads of `file`, each an offset and the
+    /// buffer to fill from it, submitting up to [`QUEUE_DEPTH`] at a time.
+    pub fn read_batch<B: IoBuf>(
+        &self,
+        file: &Arc<File>,
+        mut reads: Vec<(u64, B)>,
+    ) -> Vec<Pending<'_, B>> {
+        let ops = reads
+            .iter_mut()
+            .map(|(offset, buf)| RawOp {
+                kind: Kind::Read,
+                fd: file.as_raw_fd(),
+                offset: *offset,
+                ptr: buf.as_mut_ptr(),
+                len: buf.len(),
+            })
+            .collect::<Vec<_>>();
+        let tickets = ops.chunks(QUEUE_DEPTH).flat_map(|chunk| {
+            // SAFETY: as in `start`.
+            unsafe { self.submit(chunk.to_vec(), false) }
+        });
+        tickets
+            .zip(reads)
+            .map(|((op, ticket), (_, buf))| Pending {
+                queue: self,
+                op,
+                ticket: Some(ticket),
+                buf,
+                _file: Arc::clone(file),
+            })
+            .collect()
+    }
+
+    fn start<B: IoBuf>(
+        &self,
+        kind: Kind,
+        file: Arc<File>,
+        offset: u64,
+        mut buf: B,
+    ) -> Pending<'_, B> {
+        let op = RawOp {
+            kind,
+            fd: file.as_raw_fd(),
+            offset,
+            ptr: buf.as_mut_ptr(),
+            len: buf.len(),
+        };
+        // SAFETY: the pending request owns the file and the buffer, whose
+        // bytes do not move with it, and completes the ticket before
+        // releasing either.
+        let (op, ticket) = unsafe { self.submit(vec![op], false) }.pop().unwrap();
+        Pending {
+            queue: self,
+            op,
+            ticket: Some(ticket),
+            buf,
+            _file: file,
+        }
+    }
+}
+
+/// A buffer that an overlapped request can own.
+///
+/// # Safety
+///
+/// The bytes the buffer dereferences to must stay where they are when the
+/// buffer itself is moved, as they do for a heap allocation.
+pub unsafe trait IoBuf: DerefMut<Target = [u8]> + Default + Send {}
+
+// SAFETY: a vector's elements live on the heap.
+unsafe impl IoBuf for Vec<u8> {}
+
+/// A background request started by [`IoQueue::read`] or
+/// [`IoQueue::write`]. Dropping it waits for the request.
+#[derive(Debug)]
+pub struct Pending<'q, B: IoBuf = Vec<u8>> {
+    queue: &'q IoQueue,
+    op: RawOp,
+    ticket: Option<Ticket>,
+    buf: B,
+    _file: Arc<File>,
+}
+
+// SAFETY: the raw pointer in `op` refers to `buf`, which the request owns.
+unsafe impl<B: IoBuf> Send for Pending<'_, B> {}
+
+impl<B: IoBuf> Pending<'_, B> {
+    /// Waits for the request and returns its buffer with the number of
+    /// bytes transferred.
+    pub fn wait(mut self) -> io::Result<(B, usize)> {
+        let ticket = self.ticket.take().unwrap();
+        let done = self.queue.complete(&self.op, ticket)?;
+        Ok((std::mem::take(&mut self.buf), done))
+    }
+}
+
+impl<B: IoBuf> Drop for Pending<'_, B> {
+    fn drop(&mut self) {
+        if let Some(ticket) = self.ticket.take() {
+            let _ = self.queue.complete(&self.op, ticket);
+        }
+    }
+}
+
+static SHARED: OnceLock<IoQueue> = OnceLock::new();
+
+/// The process-wide queue the engine submits through, created on first
+/// use.
+pub fn shared() -> &'static IoQueue {
+    SHARED.get_or_init(|| IoQueue::new().expect("cannot start I/O threads"))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::OpenOptions;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn open(path: &std::path::Path) -> File {
+        OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)
+            .unwrap()
+    }
+
+    /// Runs the same mix of batches, chains and overlapped requests on
+    /// `queue` and returns every outcome with the file's final contents.
+    fn exercise(queue: &IoQueue, dir: &TempDir) -> (Vec<Result<usize, Option<i32>>>, Vec<u8>) {
+        let path = dir.path().join(queue.backend().name());
+        let file = Arc::new(open(&path));
+        let outcome = |r: io::Result<usize>| r.map_err(|e| e.raw_os_error());
+        let mut outcomes = Vec::new();
+
+        // More writes than one submission carries, of uneven lengths.
+        let pages: Vec<Vec<u8>> = (0..300u32)
+            .map(|i| vec![i as u8; 1000 + i as usize])
+            .collect();
+        let mut offset = 0;
+        let writes = pages
+            .iter()
+            .map(|buf| {
+                offset += buf.len() as u64;
+                Request::Write {
+                    file: &file,
+                    offset: offset - buf.len() as u64,
+                    buf,
+                }
+            })
+            .collect();
+        outcomes.extend(queue.run(writes).into_iter().map(outcome));
+        let chain = vec![
+            Request::Write {
+                file: &file,
+                offset,
+                buf: b"tail",
+            },
+            Request::Sync { file: &file },
+        ];
+        outcomes.push(
+            queue
+                .run_chain(chain)
+                .map(|()| 0)
+                .map_err(|e| e.raw_os_error()),
+        );
+        let len = offset + 4;
+
+        // Reads across the end of the file stop short or find nothing.
+        let mut bufs = vec![vec![0u8; 4096]; 3];
+        let reads = bufs
+            .iter_mut()
+            .zip([0, len - 100, len + 10])
+            .map(|(buf, offset)| Request::Read {
+                file: &file,
+                offset,
+                buf,
+            })
+            .collect();
+        outcomes.extend(queue.run(reads).into_iter().map(outcome));
+        let read_only = File::open(&path).unwrap();
+        let refused = queue.run(vec![Request::Write {
+            file: &read_only,
+            offset: 0,
+            buf: b"no",
+        }]);
+        outcomes.extend(refused.into_iter().map(outcome));
+
+        let written = queue.write(Arc::clone(&file), 10, vec![0xee; 50]);
+        outcomes.push(outcome(written.wait().map(|(_, n)| n)));
+        let batch = queue.read_batch(&file, (0..4).map(|i| (i * 5000, vec![0; 5000])).collect());
+        for pending in batch {
+            let (buf, n) = pending.wait().unwrap();
+            outcomes.push(Ok(n));
+            outcomes.push(Ok(buf.iter().map(|&b| b as usize).sum()));
+        }
+        (outcomes, std::fs::read(&path).unwrap())
+    }
+
+    #[test]
+    fn every_backend_gives_the_same_results() {
+        let dir = TempDir::new("aio-backends");
+        let threads = IoQueue::with_threads(4).unwrap();
+        let expected = exercise(&threads, &dir);
+        assert_eq!(expected.0[300..304], [Ok(0), Ok(4096), Ok(100), Ok(0)]);
+        // EBADF: the file was not opened for writing.
+        assert_eq!(expected.0[304], Err(Some(9)));
+        let stats = threads.stats();
+        assert!(stats.submissions < stats.requests);
+        assert_eq!(stats.max_batch, QUEUE_DEPTH as u64);
+
+        let queue = IoQueue::new().unwrap();
+        if queue.backend() == Backend::Uring {
+            assert_eq!(exercise(&queue, &dir), expected);
+            assert_eq!(queue.backend(), Backend::Uring);
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn a_failed_ring_hands_over_to_threads() {
+        let queue = IoQueue::new().unwrap();
+        let Engine::Uring(ring) = &queue.engine else {
+            return;
+        };
+        let dir = TempDir::new("aio-fallback");
+        let file = open(&dir.path().join("file"));
+        ring.fail_for_test();
+        assert_eq!(queue.backend(), Backend::Threads);
+
+        let pages: Vec<Vec<u8>> = (0..4u8).map(|i| vec![i; 4096]).collect();
+        let writes = pages
+            .iter()
+            .enumerate()
+            .map(|(i, buf)| Request::Write {
+                file: &file,
+                offset: i as u64 * 4096,
+                buf,
+            })
+            .collect();
+        assert!(queue.run(writes).into_iter().all(|r| r.unwrap() == 4096));
+        queue
+            .run_chain(vec![Request::Sync { file: &file }])
+            .unwrap();
+        let mut read = vec![vec![0u8; 4096]; 4];
+        let reads = read
+            .iter_mut()
+            .enumerate()
+            .map(|(i, buf)| Request::Read {
+                file: &file,
+                offset: i as u64 * 4096,
+                buf,
+            })
+            .collect();
+        assert!(queue.run(reads).into_iter().all(|r| r.unwrap() == 4096));
+        assert_eq!(read, pages);
+    }
+}
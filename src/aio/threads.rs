@@ -0,0 +1,219 @@
+//! The portable backend: a fixed pool of threads issuing `pread`,
+//! `pwrite` and `fdatasync` on behalf of the submitter.
+
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io;
+use std::mem::ManuallyDrop;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::FromRawFd;
+use std::sync::{Arc, Condvar, Mutex};
+
+use super::{Kind, RawOp};
+
+/// Where a job reports the result of each of its requests.
+#[derive(Debug, Default)]
+pub(super) struct Completion {
+    results: Mutex<Vec<Option<io::Result<usize>>>>,
+    done: Condvar,
+}
+
+impl Completion {
+    pub(super) fn new(n: usize) -> Arc<Self> {
+        Arc::new(Completion {
+            results: Mutex::new((0..n).map(|_| None).collect()),
+            done: Condvar::new(),
+        })
+    }
+
+    /// Blocks until request `i` has finished and takes its result.
+    pub(super) fn wait(&self, i: usize) -> io::Result<usize> {
+        let mut results = self.results.lock().unwrap();
+        loop {
+            if let Some(result) = results[i].take() {
+                return result;
+            }
+            results = self.done.wait(results).unwrap();
+        }
+    }
+
+    fn set(&self, i: usize, result: io::Result<usize>) {
+        self.results.lock().unwrap()[i] = Some(result);
+        self.done.notify_all();
+    }
+}
+
+/// Requests run in order by one worker, reporting to `completion` from
+/// index `first` on.
+struct Job {
+    ops: Vec<RawOp>,
+    chain: bool,
+    completion: Arc<Completion>,
+    first: usize,
+}
+
+// SAFETY: the submitter keeps every buffer and descriptor alive until the
+// job's results have been collected.
+unsafe impl Send for Job {}
+
+#[derive(Default)]
+struct Queue {
+    jobs: VecDeque<Job>,
+    closed: bool,
+}
+
+/// A pool of I/O threads.
+#[derive(Debug)]
+pub(super) struct Workers {
+    queue: Arc<(Mutex<Queue>, Condvar)>,
+    threads: usize,
+}
+
+impl std::fmt::Debug for Queue {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("Queue")
+            .field("jobs", &self.jobs.len())
+            .field("closed", &self.closed)
+            .finish()
+    }
+}
+
+impl Workers {
+    pub(super) fn new(threads: usize) -> io::Result<Self> {
+        let queue = Arc::new((Mutex::new(Queue::default()), Condvar::new()));
+        for i in 0..threads {
+            let queue = Arc::clone(&queue);
+            std::thread::Builder::new()
+                .name(format!("digestive-io-{i}"))
+                .spawn(move || work(&queue))?;
+        }
+        Ok(Workers { queue, threads })
+    }
+
+    pub(super) fn threads(&self) -> usize {
+        self.threads
+    }
+
+    /// Hands `ops` to the pool: each on its own when independent, or all to
+    /// one worker in order when they form a chain.
+    ///
+    /// # Safety
+    ///
+    /// Every buffer and file descriptor in `ops` must stay valid until the
+    /// results have been collected from the returned completion.
+    pub(super) unsafe fn submit(&self, ops: Vec<RawOp>, chain: bool) -> Arc<Completion> {
+        let completion = Completion::new(ops.len());
+        let (lock, ready) = &*self.queue;
+        let mut queue = lock.lock().unwrap();
+        if chain {
+            queue.jobs.push_back(Job {
+                ops,
+                chain,
+                completion: Arc::clone(&completion),
+                first: 0,
+            });
+        } else {
+            for (i, op) in ops.into_iter().enumerate() {
+                queue.jobs.push_back(Job {
+                    ops: vec![op],
+                    chain,
+                    completion: Arc::clone(&completion),
+                    first: i,
+                });
+            }
+        }
+        drop(queue);
+        ready.notify_all();
+        completion
+    }
+}
+
+impl Drop for Workers {
+    fn drop(&mut self) {
+        let (lock, ready) = &*self.queue;
+        lock.lock().unwrap().closed = true;
+        ready.notify_all();
+    }
+}
+
+fn work(queue: &(Mutex<Queue>, Condvar)) {
+    let (lock, ready) = queue;
+    loop {
+        let job = {
+            let mut queue = lock.lock().unwrap();
+            loop {
+                if let Some(job) = queue.jobs.pop_front() {
+                    break job;
+                }
+                if queue.closed {
+                    return;
+                }
+                queue = ready.wait(queue).unwrap();
+            }
+        };
+        run_job(&job);
+    }
+}
+
+fn run_job(job: &Job) {
+    let mut failed = false;
+    for (i, op) in job.ops.iter().enumerate() {
+        let result = if failed {
+            Err(io::Error::from_raw_os_error(super::ECANCELED))
+        } else {
+            run(op)
+        };
+        failed |= job.chain && result.is_err();
+        job.completion.set(job.first + i, result);
+    }
+}
+
+/// Runs `ops` on the calling thread, in order, stopping at the first
+/// failure if they form a chain, and returns the completion holding their
+/// results.
+///
+/// # Safety
+///
+/// Every buffer and file descriptor in `ops` must be valid.
+pub(super) unsafe fn run_now(ops: Vec<RawOp>, chain: bool) -> Arc<Completion> {
+    let completion = Completion::new(ops.len());
+    run_job(&Job {
+        ops,
+        chain,
+        completion: Arc::clone(&completion),
+        first: 0,
+    });
+    completion
+}
+
+/// Performs one request synchronously. Reads stop early only at the end of
+/// the file; writes always complete.
+pub(super) fn run(op: &RawOp) -> io::Result<usize> {
+    // SAFETY: the descriptor stays open for the call and is not closed by
+    // the temporary `File`.
+    let file = ManuallyDrop::new(unsafe { File::from_raw_fd(op.fd) });
+    match op.kind {
+        Kind::Read => {
+            // SAFETY: the submitter guarantees the buffer is valid and not
+            // otherwise accessed until the request completes.
+            let buf = unsafe { std::slice::from_raw_parts_mut(op.ptr, op.len) };
+            let mut done = 0;
+            while done < buf.len() {
+                match file.read_at(&mut buf[done..], op.offset + done as u64) {
+                    Ok(0) => break,
+                    Ok(n) => done += n,
+                    Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                    Err(err) => return Err(err),
+                }
+            }
+            Ok(done)
+        }
+        Kind::Write => {
+            // SAFETY: as above.
+            let buf = unsafe { std::slice::from_raw_parts(op.ptr, op.len) };
+            file.write_all_at(buf, op.offset)?;
+            Ok(buf.len())
+        }
+        Kind::Sync => file.sync_data().map(|()| 0),
+    }
+}
@@ -0,0 +1,562 @@
+//! A minimal io_uring driver over raw system calls.
+//!
+//! Only what the engine needs is implemented: `READ`, `WRITE` and `FSYNC`
+//! requests, optionally linked into chains, submitted from any thread and
+//! completed by whichever waiter is reaping at the time. The submission
+//! queue is protected by the ring mutex; one waiter at a time blocks in
+//! `io_uring_enter` for completions while the others wait on a condition
+//! variable, so submissions never queue behind a blocked reaper.
+//!
+//! If `io_uring_enter` fails for any reason other than a transient one, the
+//! ring is given up: requests still in the submission queue, which the
+//! kernel never took, complete with the error, and those it took are
+//! reaped by polling the completion queue until they finish, since their
+//! buffers may be in use until then. Later submissions are refused, and
+//! the caller turns to threads instead.
+
+use std::collections::HashMap;
+use std::io;
+use std::os::raw::{c_int, c_long, c_void};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Condvar, Mutex, MutexGuard};
+use std::time::Duration;
+
+use super::{Kind, RawOp};
+
+const SYS_IO_URING_SETUP: c_long = 425;
+const SYS_IO_URING_ENTER: c_long = 426;
+
+const IORING_OFF_SQ_RING: i64 = 0;
+const IORING_OFF_SQES: i64 = 0x1000_0000;
+
+const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+const IORING_FEAT_NODROP: u32 = 1 << 1;
+/// Also implies `IORING_OP_READ` and `IORING_OP_WRITE` (Linux 5.6).
+const IORING_FEAT_RW_CUR_POS: u32 = 1 << 3;
+
+const IORING_ENTER_GETEVENTS: u32 = 1;
+const IOSQE_IO_LINK: u8 = 1 << 2;
+const IORING_FSYNC_DATASYNC: u32 = 1;
+
+const IORING_OP_FSYNC: u8 = 3;
+const IORING_OP_READ: u8 = 22;
+const IORING_OP_WRITE: u8 = 23;
+
+const PROT_READ: c_int = 1;
+const PROT_WRITE: c_int = 2;
+const MAP_SHARED: c_int = 1;
+const MAP_POPULATE: c_int = 0x8000;
+
+const EINTR: i32 = 4;
+const EIO: i32 = 5;
+const EAGAIN: i32 = 11;
+const EBUSY: i32 = 16;
+
+/// How often a failed ring's completion queue is checked.
+const FAILED_POLL_INTERVAL: Duration = Duration::from_micros(100);
+
+extern "C" {
+    fn syscall(number: c_long, ...) -> c_long;
+    fn mmap(
+        addr: *mut c_void,
+        len: usize,
+        prot: c_int,
+        flags: c_int,
+        fd: c_int,
+        offset: i64,
+    ) -> *mut c_void;
+    fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    fn close(fd: c_int) -> c_int;
+}
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct SqOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct CqOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqOffsets,
+    cq_off: CqOffsets,
+}
+
+#[repr(C)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    op_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    splice_fd_in: i32,
+    addr3: u64,
+    pad: u64,
+}
+
+#[repr(C)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+/// One mmap'ed region of the ring, unmapped on drop.
+#[derive(Debug)]
+struct Region {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Region {
+    fn map(fd: c_int, len: usize, offset: i64) -> io::Result<Region> {
+        // SAFETY: a fresh shared mapping of the ring fd aliases no Rust
+        // memory; failure is reported through MAP_FAILED.
+        let ptr = unsafe {
+            mmap(
+                std::ptr::null_mut(),
+                len,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                fd,
+                offset,
+            )
+        };
+        if ptr as isize == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Region {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    /// A field of the region at byte offset `off`.
+    fn at<T>(&self, off: u32) -> *mut T {
+        debug_assert!(off as usize + std::mem::size_of::<T>() <= self.len);
+        // SAFETY: offsets come from the kernel and lie inside the mapping.
+        unsafe { self.ptr.add(off as usize) as *mut T }
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        // SAFETY: the region is a live mapping that nothing borrows once
+        // the ring is dropped.
+        unsafe {
+            munmap(self.ptr as *mut c_void, self.len);
+        }
+    }
+}
+
+#[derive(Debug)]
+struct State {
+    next_id: u64,
+    /// Results of reaped requests not yet collected by their waiter.
+    completed: HashMap<u64, i32>,
+    in_flight: usize,
+    /// Whether a waiter is blocked in `io_uring_enter`.
+    reaping: bool,
+    /// The errno `io_uring_enter` failed with, after which it is never
+    /// called again.
+    failed: Option<i32>,
+}
+
+/// An io_uring instance shared by every thread.
+#[derive(Debug)]
+pub(super) struct Ring {
+    fd: c_int,
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    sqes: *mut Sqe,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cq_entries: u32,
+    cqes: *const Cqe,
+    state: Mutex<State>,
+    reaped: Condvar,
+    // Declared last so the pointers above are never used after unmapping.
+    _ring: Region,
+    _sqe_region: Region,
+}
+
+// SAFETY: the raw pointers address the ring mappings, which live as long as
+// the ring; the submission queue is only touched under `state`, and the
+// completion queue only by the reaper under `state`.
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+fn enter(fd: c_int, to_submit: u32, min_complete: u32, flags: u32) -> io::Result<u32> {
+    // SAFETY: io_uring_enter takes plain integers and a null signal mask.
+    let n = unsafe {
+        syscall(
+            SYS_IO_URING_ENTER,
+            fd as c_long,
+            to_submit as c_long,
+            min_complete as c_long,
+            flags as c_long,
+            std::ptr::null::<c_void>(),
+            0 as c_long,
+        )
+    };
+    if n < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(n as u32)
+}
+
+impl Ring {
+    /// Sets up a ring with `entries` submission slots. Fails on kernels
+    /// without io_uring or older than 5.6, or where it is disabled.
+    pub(super) fn new(entries: u32) -> io::Result<Ring> {
+        let mut params = Params::default();
+        // SAFETY: `params` is a valid, writable io_uring_params.
+        let fd = unsafe {
+            syscall(
+                SYS_IO_URING_SETUP,
+                entries as c_long,
+                &mut params as *mut Params,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = fd as c_int;
+        let ring = Self::map(fd, &params);
+        if ring.is_err() {
+            // SAFETY: the fd is ours and nothing else refers to it.
+            unsafe {
+                close(fd);
+            }
+        }
+        ring
+    }
+
+    fn map(fd: c_int, p: &Params) -> io::Result<Ring> {
+        let required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+        if p.features & required != required {
+            return Err(io::Error::new(
+                io::ErrorKind::Unsupported,
+                "io_uring is too old",
+            ));
+        }
+        let sq_len = p.sq_off.array as usize + p.sq_entries as usize * 4;
+        let cq_len = p.cq_off.cqes as usize + p.cq_entries as usize * std::mem::size_of::<Cqe>();
+        // With SINGLE_MMAP one mapping holds both the submission and the
+        // completion ring.
+        let ring = Region::map(fd, sq_len.max(cq_len), IORING_OFF_SQ_RING)?;
+        let sqe_region = Region::map(
+            fd,
+            p.sq_entries as usize * std::mem::size_of::<Sqe>(),
+            IORING_OFF_SQES,
+        )?;
+        Ok(Ring {
+            fd,
+            sq_head: ring.at(p.sq_off.head),
+            sq_tail: ring.at(p.sq_off.tail),
+            // SAFETY: the kernel initialised these fields before returning.
+            sq_mask: unsafe { *ring.at::<u32>(p.sq_off.ring_mask) },
+            sq_entries: p.sq_entries,
+            sq_array: ring.at(p.sq_off.array),
+            sqes: sqe_region.ptr as *mut Sqe,
+            cq_head: ring.at(p.cq_off.head),
+            cq_tail: ring.at(p.cq_off.tail),
+            // SAFETY: as above.
+            cq_mask: unsafe { *ring.at::<u32>(p.cq_off.ring_mask) },
+            cq_entries: p.cq_entries,
+            cqes: ring.at(p.cq_off.cqes),
+            state: Mutex::new(State {
+                next_id: 0,
+                completed: HashMap::new(),
+                in_flight: 0,
+                reaping: false,
+                failed: None,
+            }),
+            reaped: Condvar::new(),
+            _ring: ring,
+            _sqe_region: sqe_region,
+        })
+    }
+
+    /// Submits `ops` with one system call, linking each to the next when
+    /// `chain` is set, and returns their ids, or `None` if the ring has
+    /// failed. Should it fail meanwhile, requests the kernel did not take
+    /// complete with its error.
+    ///
+    /// # Safety
+    ///
+    /// Every buffer and file descriptor in `ops` must stay valid until the
+    /// request's result has been collected with [`Ring::wait`].
+    pub(super) unsafe fn submit(&self, ops: &[RawOp], chain: bool) -> Option<Vec<u64>> {
+        let mut state = self.state.lock().unwrap();
+        let n = ops.len();
+        // Never have more requests in flight than the completion queue
+        // holds, so completions are not pushed to the overflow list.
+        while state.in_flight + n > self.cq_entries as usize && state.in_flight > 0 {
+            state = self.progress(state);
+        }
+        if state.failed.is_some() {
+            return None;
+        }
+        let mut ids = Vec::with_capacity(n);
+        let mut queued = 0u32;
+        for (i, op) in ops.iter().enumerate() {
+            let id = state.next_id;
+            state.next_id += 1;
+            ids.push(id);
+            if let Some(errno) = state.failed {
+                state.completed.insert(id, -errno);
+                continue;
+            }
+            state.in_flight += 1;
+            let tail = (*self.sq_tail).load(Ordering::Relaxed);
+            if tail.wrapping_sub((*self.sq_head).load(Ordering::Acquire)) == self.sq_entries {
+                self.flush(&mut state, queued);
+                queued = 0;
+                if let Some(errno) = state.failed {
+                    state.in_flight -= 1;
+                    state.completed.insert(id, -errno);
+                    continue;
+                }
+            }
+            let index = tail & self.sq_mask;
+            let (opcode, op_flags) = match op.kind {
+                Kind::Read => (IORING_OP_READ, 0),
+                Kind::Write => (IORING_OP_WRITE, 0),
+                Kind::Sync => (IORING_OP_FSYNC, IORING_FSYNC_DATASYNC),
+            };
+            let flags = if chain && i + 1 < n { IOSQE_IO_LINK } else { 0 };
+            self.sqes.add(index as usize).write(Sqe {
+                opcode,
+                flags,
+                ioprio: 0,
+                fd: op.fd,
+                off: op.offset,
+                addr: op.ptr as u64,
+                len: op.len as u32,
+                op_flags,
+                user_data: id,
+                buf_index: 0,
+                personality: 0,
+                splice_fd_in: 0,
+                addr3: 0,
+                pad: 0,
+            });
+            *self.sq_array.add(index as usize) = index;
+            (*self.sq_tail).store(tail.wrapping_add(1), Ordering::Release);
+            queued += 1;
+        }
+        self.flush(&mut state, queued);
+        Some(ids)
+    }
+
+    /// Hands `queued` new entries to the kernel, or gives up on the ring.
+    fn flush(&self, state: &mut State, mut queued: u32) {
+        while queued > 0 {
+            match enter(self.fd, queued, 0, 0) {
+                Ok(n) => queued -= n.min(queued),
+                Err(err) if matches!(err.raw_os_error(), Some(EINTR | EAGAIN | EBUSY)) => {
+                    std::thread::yield_now()
+                }
+                Err(err) => {
+                    self.fail(state, err.raw_os_error().unwrap_or(EIO));
+                    return;
+                }
+            }
+        }
+    }
+
+    /// Gives up on the ring after `io_uring_enter` failed with `errno`. The
+    /// requests left in the submission queue complete with that error:
+    /// entries are only consumed inside `io_uring_enter`, always called
+    /// with the ring mutex held to submit, so the kernel has not started
+    /// them and, once withdrawn, never will.
+    fn fail(&self, state: &mut State, errno: i32) {
+        state.failed = Some(errno);
+        // SAFETY: the submission queue is only touched under `state`, and
+        // the kernel reads it only when entries are submitted.
+        unsafe {
+            let head = (*self.sq_head).load(Ordering::Acquire);
+            let tail = (*self.sq_tail).load(Ordering::Relaxed);
+            let mut at = head;
+            while at != tail {
+                let index = *self.sq_array.add((at & self.sq_mask) as usize);
+                let id = (*self.sqes.add(index as usize)).user_data;
+                state.completed.insert(id, -errno);
+                state.in_flight -= 1;
+                at = at.wrapping_add(1);
+            }
+            (*self.sq_tail).store(head, Ordering::Release);
+        }
+        self.reaped.notify_all();
+    }
+
+    /// Gives up on the ring as if `io_uring_enter` had failed with EIO.
+    #[cfg(test)]
+    pub(super) fn fail_for_test(&self) {
+        self.fail(&mut self.state.lock().unwrap(), EIO);
+    }
+
+    /// Whether the ring has been given up.
+    pub(super) fn failed(&self) -> bool {
+        self.state.lock().unwrap().failed.is_some()
+    }
+
+    /// Blocks until request `id` completes and returns its result: bytes
+    /// transferred, or a negated errno.
+    pub(super) fn wait(&self, id: u64) -> i32 {
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if let Some(res) = state.completed.remove(&id) {
+                return res;
+            }
+            state = self.progress(state);
+        }
+    }
+
+    /// Moves finished requests from the completion queue to `completed`,
+    /// returning whether there were any.
+    fn drain(&self, state: &mut State) -> bool {
+        // SAFETY: the completion ring is only consumed under `state`.
+        unsafe {
+            let mut head = (*self.cq_head).load(Ordering::Relaxed);
+            let tail = (*self.cq_tail).load(Ordering::Acquire);
+            if head == tail {
+                return false;
+            }
+            while head != tail {
+                let cqe = &*self.cqes.add((head & self.cq_mask) as usize);
+                state.completed.insert(cqe.user_data, cqe.res);
+                head = head.wrapping_add(1);
+                state.in_flight -= 1;
+            }
+            (*self.cq_head).store(head, Ordering::Release);
+        }
+        true
+    }
+
+    /// Makes progress towards some completion: waits for the current
+    /// reaper, or reaps what is ready, or becomes the reaper and blocks in
+    /// the kernel.
+    fn progress<'a>(&'a self, mut state: MutexGuard<'a, State>) -> MutexGuard<'a, State> {
+        // Only the reaper drains while it is in the kernel: a completion
+        // drained by another thread could be the one it is blocked on.
+        if state.reaping {
+            return self.reaped.wait(state).unwrap();
+        }
+        if self.drain(&mut state) {
+            self.reaped.notify_all();
+            return state;
+        }
+        if state.failed.is_some() {
+            // The kernel still posts the completions of requests it took.
+            drop(state);
+            std::thread::sleep(FAILED_POLL_INTERVAL);
+            return self.state.lock().unwrap();
+        }
+        state.reaping = true;
+        drop(state);
+        let result = enter(self.fd, 0, 1, IORING_ENTER_GETEVENTS);
+        let mut state = self.state.lock().unwrap();
+        state.reaping = false;
+        if let Err(err) = result {
+            if !matches!(err.raw_os_error(), Some(EINTR | EAGAIN | EBUSY)) {
+                self.fail(&mut state, err.raw_os_error().unwrap_or(EIO));
+            }
+        }
+        self.drain(&mut state);
+        self.reaped.notify_all();
+        state
+    }
+}
+
+impl Drop for Ring {
+    fn drop(&mut self) {
+        // SAFETY: the fd is owned by the ring; the regions unmap after it.
+        unsafe {
+            close(self.fd);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::OpenOptions;
+    use std::io::Write;
+    use std::os::unix::io::AsRawFd;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    #[test]
+    fn a_failed_ring_finishes_what_the_kernel_took() {
+        let Ok(ring) = Ring::new(8) else {
+            return;
+        };
+        let dir = TempDir::new("uring-fail");
+        let mut file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(dir.path().join("file"))
+            .unwrap();
+        file.write_all(&[7; 4096]).unwrap();
+        let mut buf = vec![0u8; 4096];
+        let op = RawOp {
+            kind: Kind::Read,
+            fd: file.as_raw_fd(),
+            offset: 0,
+            ptr: buf.as_mut_ptr(),
+            len: buf.len(),
+        };
+        // SAFETY: `buf` and `file` outlive the wait below.
+        let ids = unsafe { ring.submit(&[op], false) }.unwrap();
+        ring.fail_for_test();
+        assert!(ring.failed());
+        assert_eq!(ring.wait(ids[0]), 4096);
+        assert!(buf.iter().all(|&b| b == 7));
+        // SAFETY: nothing is submitted to a failed ring.
+        assert!(unsafe { ring.submit(&[op], false) }.is_none());
+    }
+}
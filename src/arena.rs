@@ -0,0 +1,472 @@
+//! Arena and slab allocation for transient objects.
+//!
+//! An [`Arena`] hands out byte ranges carved from large chunks and frees
+//! them all in one step, when it is reset or dropped. A [`Slab`] keeps
+//! fixed-size records in pages of slots and reuses the slots of removed
+//! records. Neither makes a heap allocation per object, so short-lived
+//! keys, values and headers do not fragment the heap of a long-running
+//! process, and memory goes back to the allocator in large uniform blocks.
+//!
+//! Both charge the chunks and pages they hold, not the bytes handed out, to
+//! a [`Reservation`], so the budget sees what the allocator actually holds.
+//! An arena can also be capped: an allocation past its limit fails with
+//! [`Error::MemoryExhausted`], which stops a runaway operator before it
+//! takes memory from everyone else.
+
+use crate::error::{Error, Result};
+use crate::memory::Reservation;
+
+/// Size of arena chunks. Larger allocations get a chunk of their own.
+pub const ARENA_CHUNK_BYTES: usize = 64 << 10;
+/// Approximate size of slab pages.
+pub const SLAB_PAGE_BYTES: usize = 16 << 10;
+
+/// A byte range handed out by an [`Arena`]. The default span is empty and
+/// valid in any arena.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct Span {
+    chunk: u32,
+    offset: u32,
+    len: u32,
+}
+
+impl Span {
+    /// Length of the range in bytes.
+    pub fn len(&self) -> usize {
+        self.len as usize
+    }
+
+    /// Whether the range is empty.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Splits the range into its first `mid` bytes and the rest.
+    pub fn split_at(self, mid: usize) -> (Span, Span) {
+        assert!(mid <= self.len());
+        let mid = mid as u32;
+        (
+            Span { len: mid, ..self },
+            Span {
+                offset: self.offset + mid,
+                len: self.len - mid,
+                ..self
+            },
+        )
+    }
+}
+
+/// A bump allocator of byte ranges, freed all at once.
+#[derive(Debug)]
+pub struct Arena {
+    chunks: Vec<Vec<u8>>,
+    /// Bytes of chunks held.
+    held: usize,
+    /// Bytes handed out.
+    used: usize,
+    limit: usize,
+    /// Size of the reservation when the arena was created, kept on reset.
+    floor: usize,
+    reservation: Reservation,
+}
+
+impl Arena {
+    /// Creates an empty arena that charges its chunks to `reservation`,
+    /// growing it when they outgrow its initial size, and holds at most
+    /// `limit` bytes of chunks.
+    pub fn new(reservation: Reservation, limit: usize) -> Self {
+        Arena {
+            chunks: Vec::new(),
+            held: 0,
+            used: 0,
+            limit,
+            floor: reservation.size(),
+            reservation,
+        }
+    }
+
+    /// Bytes of chunks held, as charged to the reservation.
+    pub fn held_bytes(&self) -> usize {
+        self.held
+    }
+
+    /// Bytes handed out since the last reset.
+    pub fn used_bytes(&self) -> usize {
+        self.used
+    }
+
+    /// Bytes of chunks the arena would hold after allocating `len` more.
+    pub fn held_after(&self, len: usize) -> usize {
+        match self.chunks.last() {
+            Some(chunk) if chunk.capacity() - chunk.len() >= len => self.held,
+            _ => self.held + len.max(ARENA_CHUNK_BYTES),
+        }
+    }
+
+    /// Charges to the reservation ahead of time whatever a following
+    /// allocation of `len` bytes would need, so that it cannot fail. Fails
+    /// with [`Error::MemoryExhausted`] like [`Arena::alloc`].
+    pub fn reserve(&mut self, len: usize) -> Result<()> {
+        let held = self.held_after(len);
+        if held > self.limit {
+            return Err(Error::MemoryExhausted {
+                requested: held - self.held,
+                available: self.limit - self.held,
+            });
+        }
+        if held > self.reservation.size() {
+            self.reservation.try_grow(held - self.reservation.size())?;
+        }
+        Ok(())
+    }
+
+    /// Allocates `len` zeroed bytes. Fails with
+    /// [`Error::MemoryExhausted`], leaving the arena unchanged, if a new
+    /// chunk would pass the limit or the budget cannot cover it.
+    pub fn alloc(&mut self, len: usize) -> Result<Span> {
+        let held = self.held_after(len);
+        if held > self.held {
+            if held > self.limit {
+                return Err(Error::MemoryExhausted {
+                    requested: held - self.held,
+                    available: self.limit - self.held,
+                });
+            }
+            if held > self.reservation.size() {
+                self.reservation.try_grow(held - self.reservation.size())?;
+            }
+            self.chunks.push(Vec::with_capacity(held - self.held));
+            self.held = held;
+        }
+        let chunk = self.chunks.len() - 1;
+        let data = &mut self.chunks[chunk];
+        let offset = data.len();
+        data.resize(offset + len, 0);
+        self.used += len;
+        Ok(Span {
+            chunk: chunk as u32,
+            offset: offset as u32,
+            len: len as u32,
+        })
+    }
+
+    /// Allocates a copy of `bytes`.
+    pub fn push(&mut self, bytes: &[u8]) -> Result<Span> {
+        let span = self.alloc(bytes.len())?;
+        self.get_mut(span).copy_from_slice(bytes);
+        Ok(span)
+    }
+
+    /// The bytes of `span`.
+    pub fn get(&self, span: Span) -> &[u8] {
+        if span.is_empty() {
+            return &[];
+        }
+        let offset = span.offset as usize;
+        &self.chunks[span.chunk as usize][offset..offset + span.len()]
+    }
+
+    /// The bytes of `span`, for writing.
+    pub fn get_mut(&mut self, span: Span) -> &mut [u8] {
+        if span.is_empty() {
+            return &mut [];
+        }
+        let offset = span.offset as usize;
+        &mut self.chunks[span.chunk as usize][offset..offset + span.len()]
+    }
+
+    /// Frees every allocation at once, returning chunk memory beyond the
+    /// reservation's initial size to the budget. Earlier spans are invalid.
+    pub fn reset(&mut self) {
+        self.chunks = Vec::new();
+        self.held = 0;
+        self.used = 0;
+        let excess = self.reservation.size() - self.floor;
+        self.reservation.shrink(excess);
+    }
+
+    /// Frees every allocation and returns the reservation at its initial
+    /// size.
+    pub fn into_reservation(mut self) -> Reservation {
+        self.reset();
+        self.reservation
+    }
+}
+
+/// Identifies a record stored in a [`Slab`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct SlabKey(u32);
+
+const NO_SLOT: u32 = u32::MAX;
+
+#[derive(Debug)]
+enum Slot<T> {
+    Used(T),
+    /// Free, linked to the next free slot.
+    Free(u32),
+}
+
+/// Fixed-size records stored in pages of slots. Removed records' slots are
+/// reused before a new page is added, and pages are freed together by
+/// [`Slab::clear`].
+#[derive(Debug)]
+pub struct Slab<T> {
+    pages: Vec<Vec<Slot<T>>>,
+    per_page: usize,
+    free: u32,
+    len: usize,
+    reservation: Reservation,
+}
+
+impl<T> Slab<T> {
+    /// Creates an empty slab that charges its pages to `reservation`.
+    pub fn new(reservation: Reservation) -> Self {
+        Slab {
+            pages: Vec::new(),
+            per_page: (SLAB_PAGE_BYTES / std::mem::size_of::<Slot<T>>()).max(1),
+            free: NO_SLOT,
+            len: 0,
+            reservation,
+        }
+    }
+
+    fn page_bytes(&self) -> usize {
+        self.per_page * std::mem::size_of::<Slot<T>>()
+    }
+
+    /// Number of records.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Whether the slab holds no records.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Bytes of pages held, as charged to the reservation.
+    pub fn held_bytes(&self) -> usize {
+        self.pages.len() * self.page_bytes()
+    }
+
+    /// Bytes the slab would hold after inserting one more record.
+    pub fn held_after_insert(&self) -> usize {
+        let full = self
+            .pages
+            .last()
+            .is_none_or(|page| page.len() == self.per_page);
+        if self.free == NO_SLOT && full {
+            self.held_bytes() + self.page_bytes()
+        } else {
+            self.held_bytes()
+        }
+    }
+
+    /// Stores `value`, adding a page if no slot is free. Fails with
+    /// [`Error::MemoryExhausted`] if the budget cannot cover the page.
+    pub fn insert(&mut self, value: T) -> Result<SlabKey> {
+        let index = if self.free != NO_SLOT {
+            let index = self.free;
+            let slot = self.slot_mut(index);
+            let Slot::Free(next) = *slot else {
+                unreachable!("free list points at a used slot");
+            };
+            *slot = Slot::Used(value);
+            self.free = next;
+            index
+        } else {
+            if self.held_after_insert() > self.held_bytes() {
+                self.reservation.try_grow(self.page_bytes())?;
+                self.pages.push(Vec::with_capacity(self.per_page));
+            }
+            let page = self.pages.len() - 1;
+            let index = page * self.per_page + self.pages[page].len();
+            self.pages[page].push(Slot::Used(value));
+            index as u32
+        };
+        self.len += 1;
+        Ok(SlabKey(index))
+    }
+
+    fn slot(&self, index: u32) -> &Slot<T> {
+        let index = index as usize;
+        &self.pages[index / self.per_page][index % self.per_page]
+    }
+
+    fn slot_mut(&mut self, index: u32) -> &mut Slot<T> {
+        let index = index as usize;
+        &mut self.pages[index / self.per_page][index % self.per_page]
+    }
+
+    /// The record under `key`.
+    pub fn get(&self, key: SlabKey) -> &T {
+        match self.slot(key.0) {
+            Slot::Used(value) => value,
+            Slot::Free(_) => panic!("slab key {} refers to a removed record", key.0),
+        }
+    }
+
+    /// The record under `key`, for writing.
+    pub fn get_mut(&mut self, key: SlabKey) -> &mut T {
+        match self.slot_mut(key.0) {
+            Slot::Used(value) => value,
+            Slot::Free(_) => panic!("slab key {} refers to a removed record", key.0),
+        }
+    }
+
+    /// Removes and returns the record under `key`; its slot is reused by
+    /// the next insert.
+    pub fn remove(&mut self, key: SlabKey) -> T {
+        let free = self.free;
+        let slot = std::mem::replace(self.slot_mut(key.0), Slot::Free(free));
+        let Slot::Used(value) = slot else {
+            panic!("slab key {} refers to a removed record", key.0);
+        };
+        self.free = key.0;
+        self.len -= 1;
+        value
+    }
+
+    /// Removes every record and frees every page.
+    pub fn clear(&mut self) {
+        self.pages = Vec::new();
+        self.free = NO_SLOT;
+        self.len = 0;
+        let held = self.reservation.size();
+        self.reservation.shrink(held);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use super::*;
+    use crate::memory::{Consumer, MemoryBudget};
+
+    fn arena(budget: &Arc<MemoryBudget>, initial: usize, limit: usize) -> Arena {
+        Arena::new(budget.try_reserve(Consumer::Other, initial).unwrap(), limit)
+    }
+
+    #[test]
+    fn an_arena_charges_chunks_not_allocations() {
+        let budget = MemoryBudget::new(1 << 20);
+        let mut arena = arena(&budget, 0, usize::MAX);
+        let spans: Vec<Span> = (0..1000u32)
+            .map(|i| arena.push(&i.to_le_bytes().repeat(15)).unwrap())
+            .collect();
+        assert_eq!(arena.used_bytes(), 60_000);
+        assert_eq!(arena.held_bytes(), ARENA_CHUNK_BYTES);
+        assert_eq!(budget.used(), ARENA_CHUNK_BYTES);
+        for (i, &span) in spans.iter().enumerate() {
+            assert_eq!(arena.get(span), (i as u32).to_le_bytes().repeat(15));
+        }
+
+        // The next allocation does not fit the chunk; a large one gets a
+        // chunk of its own size.
+        let (head, tail) = arena.alloc(10_000).unwrap().split_at(4);
+        assert_eq!((head.len(), tail.len()), (4, 9996));
+        let big = arena.alloc(3 * ARENA_CHUNK_BYTES).unwrap();
+        assert_eq!(arena.get(big).len(), 3 * ARENA_CHUNK_BYTES);
+        assert_eq!(arena.held_bytes(), 5 * ARENA_CHUNK_BYTES);
+        assert_eq!(budget.used(), arena.held_bytes());
+        assert_eq!(arena.get(spans[999]), 999u32.to_le_bytes().repeat(15));
+        assert!(arena.get(Span::default()).is_empty());
+    }
+
+    #[test]
+    fn a_reset_keeps_only_the_initial_reservation() {
+        let budget = MemoryBudget::new(1 << 20);
+        let mut arena = arena(&budget, 1000, usize::MAX);
+        arena.alloc(200_000).unwrap();
+        assert_eq!(budget.used(), 200_000);
+        arena.reset();
+        assert_eq!((arena.held_bytes(), arena.used_bytes()), (0, 0));
+        assert_eq!(budget.used(), 1000);
+        assert_eq!(arena.into_reservation().size(), 1000);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn an_allocation_past_the_limit_or_budget_fails_cleanly() {
+        let budget = MemoryBudget::new(1 << 20);
+        let mut capped = arena(&budget, 0, 2 * ARENA_CHUNK_BYTES);
+        capped.alloc(ARENA_CHUNK_BYTES).unwrap();
+        capped.alloc(ARENA_CHUNK_BYTES).unwrap();
+        let err = capped.alloc(1).unwrap_err();
+        assert!(matches!(err, Error::MemoryExhausted { .. }), "{err:?}");
+        assert!(capped.reserve(1).is_err());
+        assert_eq!(capped.used_bytes(), 2 * ARENA_CHUNK_BYTES);
+        assert_eq!(budget.used(), 2 * ARENA_CHUNK_BYTES);
+
+        let tight = MemoryBudget::new(ARENA_CHUNK_BYTES + 100);
+        let mut arena = arena(&tight, 0, usize::MAX);
+        arena.alloc(ARENA_CHUNK_BYTES).unwrap();
+        assert!(arena.alloc(1).is_err());
+        assert_eq!(arena.held_bytes(), ARENA_CHUNK_BYTES);
+        // Reserved ahead of time, the allocation cannot fail even if the
+        // budget is then used up.
+        tight.set_limit(2 * ARENA_CHUNK_BYTES);
+        arena.reserve(10).unwrap();
+        let _other = tight
+            .try_reserve(Consumer::Other, tight.available())
+            .unwrap();
+        arena.push(b"reserved").unwrap();
+    }
+
+    #[test]
+    fn a_slab_reuses_slots_and_charges_pages() {
+        let budget = MemoryBudget::new(1 << 20);
+        let mut slab = Slab::new(budget.try_reserve(Consumer::Other, 0).unwrap());
+        let page = slab.page_bytes();
+        assert!(page <= SLAB_PAGE_BYTES);
+        let keys: Vec<SlabKey> = (0..slab.per_page as u64 + 1)
+            .map(|i| slab.insert(i).unwrap())
+            .collect();
+        assert_eq!(slab.held_bytes(), 2 * page);
+        assert_eq!(budget.used(), 2 * page);
+        assert_eq!(*slab.get(keys[5]), 5);
+        *slab.get_mut(keys[5]) += 100;
+
+        // Removed slots are taken before the partly full page is extended.
+        assert_eq!(slab.remove(keys[5]), 105);
+        assert_eq!(slab.remove(keys[3]), 3);
+        assert_eq!(slab.insert(7).unwrap(), keys[3]);
+        assert_eq!(slab.insert(8).unwrap(), keys[5]);
+        assert_eq!(slab.len(), keys.len());
+        assert_eq!(slab.held_after_insert(), 2 * page);
+
+        slab.clear();
+        assert!(slab.is_empty());
+        assert_eq!(budget.used(), 0);
+        slab.insert(1).unwrap();
+        drop(slab);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn a_slab_insert_past_the_budget_fails_cleanly() {
+        let budget = MemoryBudget::new(SLAB_PAGE_BYTES);
+        let mut slab = Slab::new(budget.try_reserve(Consumer::Other, 0).unwrap());
+        let mut inserted = 0u64;
+        let err = loop {
+            match slab.insert(inserted) {
+                Ok(_) => inserted += 1,
+                Err(err) => break err,
+            }
+        };
+        assert!(matches!(err, Error::MemoryExhausted { .. }), "{err:?}");
+        assert_eq!(slab.len() as u64, inserted);
+        assert_eq!(slab.held_bytes(), slab.page_bytes());
+    }
+
+    #[test]
+    #[should_panic(expected = "removed record")]
+    fn a_removed_key_cannot_be_read() {
+        let budget = MemoryBudget::new(1 << 20);
+        let mut slab = Slab::new(budget.try_reserve(Consumer::Other, 0).unwrap());
+        let key = slab.insert("value").unwrap();
+        slab.remove(key);
+        slab.get(key);
+    }
+}
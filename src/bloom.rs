@@ -0,0 +1,164 @@
+//! Bloom filters over byte-string keys.
+//!
+//! Probe positions are derived from one 64-bit hash by double hashing, so
+//! a lookup costs a single hash of the key however many probes are used.
+//!
+//! Filters stored on disk are blocked: the filter is cut into fixed-size
+//! blocks, the high bits of a key's hash pick one block, and all of the
+//! key's probes fall inside it. A lookup then reads a single block, which
+//! can be cached and evicted like any other page.
+
+use crate::hash::hash64;
+
+const SEED: u64 = 0x626c_6f6f_6d00_0000;
+
+/// A fixed-size Bloom filter.
+#[derive(Debug, Clone)]
+pub struct BloomFilter {
+    words: Vec<u64>,
+    num_bits: u64,
+    probes: u32,
+}
+
+impl BloomFilter {
+    /// Creates an empty filter occupying about `bytes` bytes that sets
+    /// `probes` bits per key. Six probes suit roughly ten bits per key.
+    pub fn new(bytes: usize, probes: u32) -> Self {
+        let words = bytes.div_ceil(8).max(1);
+        BloomFilter {
+            words: vec![0; words],
+            num_bits: words as u64 * 64,
+            probes: probes.max(1),
+        }
+    }
+
+    /// Bytes of filter storage.
+    pub fn memory_bytes(&self) -> usize {
+        self.words.len() * 8
+    }
+
+    /// Adds `key`.
+    pub fn insert(&mut self, key: &[u8]) {
+        for bit in positions(key, self.num_bits, self.probes) {
+            self.words[(bit / 64) as usize] |= 1 << (bit % 64);
+        }
+    }
+
+    /// Whether `key` may have been added. `false` is always correct.
+    pub fn may_contain(&self, key: &[u8]) -> bool {
+        positions(key, self.num_bits, self.probes)
+            .all(|bit| self.words[(bit / 64) as usize] & (1 << (bit % 64)) != 0)
+    }
+}
+
+/// Bits per key of blocked filters, for about a 1% false-positive rate.
+pub const BLOCKED_BITS_PER_KEY: usize = 10;
+/// Probes per key of blocked filters.
+pub const BLOCKED_PROBES: u32 = 6;
+
+/// Hashes `key` for a blocked filter.
+pub fn key_hash(key: &[u8]) -> u64 {
+    hash64(key, SEED)
+}
+
+/// Number of `block_bytes` blocks a blocked filter of `keys` keys takes.
+pub fn blocked_blocks(keys: usize, block_bytes: usize) -> usize {
+    (keys * BLOCKED_BITS_PER_KEY).div_ceil(block_bytes * 8)
+}
+
+/// Index of the block of `blocks` holding the probes of `hash`.
+pub fn block_of(hash: u64, blocks: usize) -> usize {
+    ((hash as u128 * blocks as u128) >> 64) as usize
+}
+
+/// Builds a blocked filter of `blocks` blocks of `block_bytes` bytes from
+/// the [`key_hash`] of every key.
+pub fn build_blocked(hashes: &[u64], blocks: usize, block_bytes: usize) -> Vec<u8> {
+    let mut filter = vec![0u8; blocks * block_bytes];
+    if blocks == 0 {
+        return filter;
+    }
+    let num_bits = block_bytes as u64 * 8;
+    for &hash in hashes {
+        let block = &mut filter[block_of(hash, blocks) * block_bytes..][..block_bytes];
+        for bit in block_positions(hash, num_bits) {
+            block[(bit / 8) as usize] |= 1 << (bit % 8);
+        }
+    }
+    filter
+}
+
+/// Whether the key with [`key_hash`] `hash` may be in the filter, given
+/// the block [`block_of`] picks for it. `false` is always correct.
+pub fn block_may_contain(block: &[u8], hash: u64) -> bool {
+    block_positions(hash, block.len() as u64 * 8)
+        .all(|bit| block[(bit / 8) as usize] & (1 << (bit % 8)) != 0)
+}
+
+/// Probe positions within a block. The block was chosen by the high bits
+/// of `hash`, so the positions come from its low and middle bits.
+fn block_positions(hash: u64, num_bits: u64) -> impl Iterator<Item = u64> {
+    let h = hash.wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    let delta = (hash >> 24) | 1;
+    (0..BLOCKED_PROBES as u64).map(move |i| h.wrapping_add(i.wrapping_mul(delta)) % num_bits)
+}
+
+fn positions(key: &[u8], num_bits: u64, probes: u32) -> impl Iterator<Item = u64> {
+    let h = hash64(key, SEED);
+    let delta = h.rotate_left(32) | 1;
+    (0..probes as u64).map(move |i| h.wrapping_add(i.wrapping_mul(delta)) % num_bits)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const KEYS: usize = 100_000;
+
+    fn key(i: usize) -> Vec<u8> {
+        format!("key{i:08}").into_bytes()
+    }
+
+    /// Share of `KEYS` keys never added for which `may_contain` holds.
+    fn false_positive_rate(may_contain: impl Fn(&[u8]) -> bool) -> f64 {
+        let hits = (KEYS..2 * KEYS).filter(|&i| may_contain(&key(i))).count();
+        hits as f64 / KEYS as f64
+    }
+
+    #[test]
+    fn a_filter_has_no_false_negatives() {
+        let mut filter = BloomFilter::new(KEYS * BLOCKED_BITS_PER_KEY / 8, BLOCKED_PROBES);
+        for i in 0..KEYS {
+            filter.insert(&key(i));
+        }
+        assert!((0..KEYS).all(|i| filter.may_contain(&key(i))));
+        let rate = false_positive_rate(|key| filter.may_contain(key));
+        assert!(rate < 0.015, "false-positive rate {rate}");
+    }
+
+    #[test]
+    fn a_blocked_filter_is_near_one_percent() {
+        const BLOCK: usize = 4096;
+        let hashes: Vec<u64> = (0..KEYS).map(|i| key_hash(&key(i))).collect();
+        let blocks = blocked_blocks(KEYS, BLOCK);
+        let filter = build_blocked(&hashes, blocks, BLOCK);
+        assert_eq!(filter.len(), blocks * BLOCK);
+        let may_contain = |key: &[u8]| {
+            let hash = key_hash(key);
+            let block = block_of(hash, blocks);
+            block_may_contain(&filter[block * BLOCK..][..BLOCK], hash)
+        };
+        assert!((0..KEYS).all(|i| may_contain(&key(i))));
+        // A page-sized block holds thousands of keys, enough to even out
+        // how many land in each.
+        let rate = false_positive_rate(may_contain);
+        assert!(rate < 0.015, "false-positive rate {rate}");
+    }
+
+    #[test]
+    fn no_keys_take_no_blocks() {
+        assert_eq!(blocked_blocks(0, 4096), 0);
+        assert!(build_blocked(&[], 0, 4096).is_empty());
+        assert_eq!(blocked_blocks(1, 4096), 1);
+    }
+}
@@ -0,0 +1,635 @@
+//! Encoding of a single column chunk.
+//!
+//! A chunk is stored as `[encoding u8]` followed by one of:
+//!
+//! ```text
+//! plain:       values(rows)
+//! run-length:  [runs u32][length u32 * runs] values(runs)
+//! dictionary:  values(distinct) [code width u8][code * rows]
+//! ```
+//!
+//! where `values(n)` is `n` little-endian `i64`s for integer columns and
+//! `[offset u32 * (n + 1)][bytes]` for byte-string columns. Dictionary codes
+//! are one byte wide for up to 256 distinct values and two bytes otherwise.
+
+use std::collections::HashMap;
+
+use super::kernels::{self, Selection};
+use super::{CmpOp, ColumnType, Datum};
+use crate::error::{Error, Result};
+
+const PLAIN: u8 = 0;
+const RLE: u8 = 1;
+const DICT: u8 = 2;
+
+/// Most distinct values a dictionary-encoded chunk can hold.
+const MAX_DICT_LEN: usize = 1 << 16;
+
+/// A flat array of values of one type.
+#[derive(Debug, Clone)]
+pub(crate) enum Values {
+    Int(Vec<i64>),
+    /// Value `i` is `data[offsets[i]..offsets[i + 1]]`.
+    Bytes {
+        offsets: Vec<u32>,
+        data: Vec<u8>,
+    },
+}
+
+impl Values {
+    pub(crate) fn new(kind: ColumnType) -> Self {
+        match kind {
+            ColumnType::Int => Values::Int(Vec::new()),
+            ColumnType::Bytes => Values::Bytes {
+                offsets: vec![0],
+                data: Vec::new(),
+            },
+        }
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        match self {
+            Values::Int(values) => values.len(),
+            Values::Bytes { offsets, .. } => offsets.len() - 1,
+        }
+    }
+
+    fn kind(&self) -> ColumnType {
+        match self {
+            Values::Int(_) => ColumnType::Int,
+            Values::Bytes { .. } => ColumnType::Bytes,
+        }
+    }
+
+    fn bytes(&self, i: usize) -> &[u8] {
+        match self {
+            Values::Int(_) => unreachable!("not a byte-string column"),
+            Values::Bytes { offsets, data } => &data[offsets[i] as usize..offsets[i + 1] as usize],
+        }
+    }
+
+    /// Appends `datum`, which the caller has checked is of this type.
+    pub(crate) fn push(&mut self, datum: &Datum) {
+        match (self, datum) {
+            (Values::Int(values), Datum::Int(v)) => values.push(*v),
+            (Values::Bytes { offsets, data }, Datum::Bytes(v)) => {
+                data.extend_from_slice(v);
+                offsets.push(data.len() as u32);
+            }
+            _ => unreachable!("value of the wrong type"),
+        }
+    }
+
+    fn push_from(&mut self, other: &Values, i: usize) {
+        match (self, other) {
+            (Values::Int(values), Values::Int(other)) => values.push(other[i]),
+            (Values::Bytes { offsets, data }, other) => {
+                data.extend_from_slice(other.bytes(i));
+                offsets.push(data.len() as u32);
+            }
+            _ => unreachable!("value of the wrong type"),
+        }
+    }
+
+    /// Keeps the first `len` values.
+    pub(crate) fn truncate(&mut self, len: usize) {
+        match self {
+            Values::Int(values) => values.truncate(len),
+            Values::Bytes { offsets, data } => {
+                offsets.truncate(len + 1);
+                data.truncate(offsets[len] as usize);
+            }
+        }
+    }
+
+    pub(crate) fn clear(&mut self) {
+        match self {
+            Values::Int(values) => values.clear(),
+            Values::Bytes { offsets, data } => {
+                offsets.truncate(1);
+                data.clear();
+            }
+        }
+    }
+
+    fn get(&self, i: usize) -> Datum {
+        match self {
+            Values::Int(values) => Datum::Int(values[i]),
+            Values::Bytes { .. } => Datum::Bytes(self.bytes(i).to_vec()),
+        }
+    }
+
+    fn same(&self, i: usize, j: usize) -> bool {
+        match self {
+            Values::Int(values) => values[i] == values[j],
+            Values::Bytes { .. } => self.bytes(i) == self.bytes(j),
+        }
+    }
+
+    /// Memory held by the values.
+    pub(crate) fn heap_bytes(&self) -> usize {
+        match self {
+            Values::Int(values) => values.capacity() * 8,
+            Values::Bytes { offsets, data } => offsets.capacity() * 4 + data.capacity(),
+        }
+    }
+
+    /// The smallest and largest value, if there are any.
+    pub(crate) fn min_max(&self) -> Option<(Datum, Datum)> {
+        match self {
+            Values::Int(values) => {
+                let min = *values.iter().min()?;
+                let max = *values.iter().max()?;
+                Some((Datum::Int(min), Datum::Int(max)))
+            }
+            Values::Bytes { .. } => {
+                let all = (0..self.len()).map(|i| self.bytes(i));
+                let min = all.clone().min()?;
+                let max = all.max()?;
+                Some((Datum::Bytes(min.to_vec()), Datum::Bytes(max.to_vec())))
+            }
+        }
+    }
+
+    /// Whether each value satisfies `value op constant`.
+    fn matches(&self, op: CmpOp, constant: &Datum) -> Vec<bool> {
+        match (self, constant) {
+            (Values::Int(values), Datum::Int(c)) => values.iter().map(|v| op.test(v, c)).collect(),
+            (Values::Bytes { .. }, Datum::Bytes(c)) => (0..self.len())
+                .map(|i| op.test(self.bytes(i), c.as_slice()))
+                .collect(),
+            _ => vec![false; self.len()],
+        }
+    }
+
+    fn encoded_len(&self) -> usize {
+        match self {
+            Values::Int(values) => values.len() * 8,
+            Values::Bytes { offsets, data } => offsets.len() * 4 + data.len(),
+        }
+    }
+
+    fn encode(&self, out: &mut Vec<u8>) {
+        match self {
+            Values::Int(values) => {
+                for v in values {
+                    out.extend_from_slice(&v.to_le_bytes());
+                }
+            }
+            Values::Bytes { offsets, data } => {
+                for offset in offsets {
+                    out.extend_from_slice(&offset.to_le_bytes());
+                }
+                out.extend_from_slice(data);
+            }
+        }
+    }
+
+    fn decode(kind: ColumnType, n: usize, data: &[u8], at: &mut usize) -> Result<Values> {
+        let take = |at: &mut usize, len: usize| -> Result<&[u8]> {
+            let bytes = data
+                .get(*at..*at + len)
+                .ok_or_else(|| damaged("ends early"))?;
+            *at += len;
+            Ok(bytes)
+        };
+        match kind {
+            ColumnType::Int => Ok(Values::Int(
+                take(at, n * 8)?
+                    .chunks_exact(8)
+                    .map(|b| i64::from_le_bytes(b.try_into().unwrap()))
+                    .collect(),
+            )),
+            ColumnType::Bytes => {
+                let offsets: Vec<u32> = take(at, (n + 1) * 4)?
+                    .chunks_exact(4)
+                    .map(|b| u32::from_le_bytes(b.try_into().unwrap()))
+                    .collect();
+                if offsets[0] != 0 || offsets.windows(2).any(|w| w[0] > w[1]) {
+                    return Err(damaged("has damaged offsets"));
+                }
+                let data = take(at, offsets[n] as usize)?.to_vec();
+                Ok(Values::Bytes { offsets, data })
+            }
+        }
+    }
+}
+
+fn damaged(what: &str) -> Error {
+    Error::Corruption(format!("column chunk {what}"))
+}
+
+/// Encodes `values` as whichever of plain, run-length and dictionary
+/// encoding takes the fewest bytes.
+pub(crate) fn encode(values: &Values, out: &mut Vec<u8>) {
+    let n = values.len();
+    let mut lengths: Vec<u32> = Vec::new();
+    let mut runs = Values::new(values.kind());
+    for i in 0..n {
+        if i > 0 && values.same(i, i - 1) {
+            *lengths.last_mut().unwrap() += 1;
+        } else {
+            lengths.push(1);
+            runs.push_from(values, i);
+        }
+    }
+    let (dict, codes) = dictionary(values);
+
+    let plain_len = values.encoded_len();
+    let rle_len = 4 + 4 * lengths.len() + runs.encoded_len();
+    let dict_len = dict.as_ref().map_or(usize::MAX, |dict| {
+        dict.encoded_len() + 1 + code_width(dict.len()) * n
+    });
+    if rle_len <= plain_len && rle_len <= dict_len {
+        out.push(RLE);
+        out.extend_from_slice(&(lengths.len() as u32).to_le_bytes());
+        for len in &lengths {
+            out.extend_from_slice(&len.to_le_bytes());
+        }
+        runs.encode(out);
+    } else if let (Some(dict), true) = (&dict, dict_len < plain_len) {
+        out.push(DICT);
+        out.extend_from_slice(&(dict.len() as u32).to_le_bytes());
+        dict.encode(out);
+        let width = code_width(dict.len());
+        out.push(width as u8);
+        for code in &codes {
+            out.extend_from_slice(&code.to_le_bytes()[..width]);
+        }
+    } else {
+        out.push(PLAIN);
+        values.encode(out);
+    }
+}
+
+fn code_width(distinct: usize) -> usize {
+    if distinct <= 256 {
+        1
+    } else {
+        2
+    }
+}
+
+/// The distinct values in order of first appearance and the code of each
+/// value, or `None` if there are too many to encode.
+fn dictionary(values: &Values) -> (Option<Values>, Vec<u16>) {
+    let mut dict = Values::new(values.kind());
+    let mut codes = Vec::with_capacity(values.len());
+    match values {
+        Values::Int(ints) => {
+            let mut seen: HashMap<i64, u16> = HashMap::new();
+            for (i, v) in ints.iter().enumerate() {
+                if !seen.contains_key(v) && seen.len() == MAX_DICT_LEN {
+                    return (None, Vec::new());
+                }
+                let next = seen.len() as u16;
+                let code = *seen.entry(*v).or_insert_with(|| {
+                    dict.push_from(values, i);
+                    next
+                });
+                codes.push(code);
+            }
+        }
+        Values::Bytes { .. } => {
+            let mut seen: HashMap<&[u8], u16> = HashMap::new();
+            for i in 0..values.len() {
+                let v = values.bytes(i);
+                if !seen.contains_key(v) && seen.len() == MAX_DICT_LEN {
+                    return (None, Vec::new());
+                }
+                let next = seen.len() as u16;
+                let code = *seen.entry(v).or_insert_with(|| {
+                    dict.push_from(values, i);
+                    next
+                });
+                codes.push(code);
+            }
+        }
+    }
+    (Some(dict), codes)
+}
+
+#[derive(Debug)]
+enum Form {
+    Plain(Values),
+    Rle { lengths: Vec<u32>, runs: Values },
+    Dict { dict: Values, codes: Vec<u16> },
+}
+
+/// One decoded column chunk, still in its plain, run-length or dictionary
+/// form.
+#[derive(Debug)]
+pub struct Chunk {
+    rows: usize,
+    form: Form,
+}
+
+impl Chunk {
+    /// Parses a chunk of `rows` rows of type `kind` from its stored bytes.
+    pub(crate) fn decode(kind: ColumnType, rows: usize, data: &[u8]) -> Result<Chunk> {
+        let Some((&encoding, data)) = data.split_first() else {
+            return Err(damaged("is empty"));
+        };
+        let mut at = 0;
+        let read_u32 = |at: &mut usize| -> Result<usize> {
+            let bytes = data
+                .get(*at..*at + 4)
+                .ok_or_else(|| damaged("ends early"))?;
+            *at += 4;
+            Ok(u32::from_le_bytes(bytes.try_into().unwrap()) as usize)
+        };
+        let form = match encoding {
+            PLAIN => Form::Plain(Values::decode(kind, rows, data, &mut at)?),
+            RLE => {
+                let count = read_u32(&mut at)?;
+                let lengths = (0..count)
+                    .map(|_| read_u32(&mut at).map(|len| len as u32))
+                    .collect::<Result<Vec<u32>>>()?;
+                if lengths.iter().map(|&len| len as usize).sum::<usize>() != rows {
+                    return Err(damaged("has runs of the wrong length"));
+                }
+                let runs = Values::decode(kind, count, data, &mut at)?;
+                Form::Rle { lengths, runs }
+            }
+            DICT => {
+                let distinct = read_u32(&mut at)?;
+                let dict = Values::decode(kind, distinct, data, &mut at)?;
+                let width = *data.get(at).ok_or_else(|| damaged("ends early"))? as usize;
+                at += 1;
+                let raw = data
+                    .get(at..at + width * rows)
+                    .ok_or_else(|| damaged("ends early"))?;
+                let codes: Vec<u16> = match width {
+                    1 => raw.iter().map(|&c| c as u16).collect(),
+                    2 => raw
+                        .chunks_exact(2)
+                        .map(|b| u16::from_le_bytes([b[0], b[1]]))
+                        .collect(),
+                    _ => return Err(damaged("has a bad code width")),
+                };
+                if codes.iter().any(|&code| code as usize >= distinct) {
+                    return Err(damaged("has a code outside its dictionary"));
+                }
+                Form::Dict { dict, codes }
+            }
+            _ => return Err(damaged("has an unknown encoding")),
+        };
+        Ok(Chunk { rows, form })
+    }
+
+    /// Number of rows in the chunk.
+    pub fn rows(&self) -> usize {
+        self.rows
+    }
+
+    /// Name of the chunk's encoding: `plain`, `rle` or `dict`.
+    pub fn encoding(&self) -> &'static str {
+        match self.form {
+            Form::Plain(_) => "plain",
+            Form::Rle { .. } => "rle",
+            Form::Dict { .. } => "dict",
+        }
+    }
+
+    /// The value in row `row`.
+    pub fn value(&self, row: usize) -> Datum {
+        match &self.form {
+            Form::Plain(values) => values.get(row),
+            Form::Rle { lengths, runs } => {
+                let mut end = 0;
+                let run = lengths
+                    .iter()
+                    .position(|&len| {
+                        end += len as usize;
+                        row < end
+                    })
+                    .unwrap();
+                runs.get(run)
+            }
+            Form::Dict { dict, codes } => dict.get(codes[row] as usize),
+        }
+    }
+
+    /// The values of the selected rows, in row order.
+    pub fn values(&self, selection: &Selection) -> Vec<Datum> {
+        selection.iter().map(|row| self.value(row)).collect()
+    }
+
+    /// Selects the rows whose value satisfies `value op constant`. Runs and
+    /// dictionary entries are compared once each. A constant of the wrong
+    /// type selects nothing.
+    pub fn filter(&self, op: CmpOp, constant: &Datum) -> Selection {
+        match &self.form {
+            Form::Plain(Values::Int(values)) => match constant {
+                Datum::Int(c) => kernels::compare_ints(values, op, *c),
+                Datum::Bytes(_) => Selection::none(self.rows),
+            },
+            Form::Plain(values) => {
+                let matches = values.matches(op, constant);
+                let mut selection = Selection::none(self.rows);
+                for (row, _) in matches.iter().enumerate().filter(|(_, &m)| m) {
+                    selection.set_range(row, row + 1);
+                }
+                selection
+            }
+            Form::Rle { lengths, runs } => {
+                let matches = runs.matches(op, constant);
+                let mut selection = Selection::none(self.rows);
+                let mut start = 0;
+                for (&len, matched) in lengths.iter().zip(matches) {
+                    let end = start + len as usize;
+                    if matched {
+                        selection.set_range(start, end);
+                    }
+                    start = end;
+                }
+                selection
+            }
+            Form::Dict { dict, codes } => kernels::lookup_codes(codes, &dict.matches(op, constant)),
+        }
+    }
+
+    /// Sum of the selected values of an integer chunk; `None` for byte
+    /// strings. Runs and dictionary entries are multiplied by the number of
+    /// selected rows holding them rather than added row by row.
+    pub fn sum(&self, selection: &Selection) -> Option<i128> {
+        match &self.form {
+            Form::Plain(Values::Int(values)) => Some(kernels::sum_ints(values, selection)),
+            Form::Rle {
+                lengths,
+                runs: Values::Int(runs),
+            } => {
+                let mut start = 0;
+                let mut sum = 0i128;
+                for (&len, &value) in lengths.iter().zip(runs) {
+                    let end = start + len as usize;
+                    sum += value as i128 * selection.count_range(start, end) as i128;
+                    start = end;
+                }
+                Some(sum)
+            }
+            Form::Dict {
+                dict: Values::Int(dict),
+                codes,
+            } => {
+                let counts = kernels::count_codes(codes, selection, dict.len());
+                Some(
+                    dict.iter()
+                        .zip(counts)
+                        .map(|(&value, count)| value as i128 * count as i128)
+                        .sum(),
+                )
+            }
+            _ => None,
+        }
+    }
+
+    /// Memory held by the decoded chunk.
+    pub(crate) fn heap_bytes(&self) -> usize {
+        match &self.form {
+            Form::Plain(values) => values.heap_bytes(),
+            Form::Rle { lengths, runs } => lengths.capacity() * 4 + runs.heap_bytes(),
+            Form::Dict { dict, codes } => dict.heap_bytes() + codes.capacity() * 2,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const OPS: [CmpOp; 6] = [
+        CmpOp::Eq,
+        CmpOp::Ne,
+        CmpOp::Lt,
+        CmpOp::Le,
+        CmpOp::Gt,
+        CmpOp::Ge,
+    ];
+
+    fn round_trip(kind: ColumnType, data: &[Datum]) -> Chunk {
+        let mut values = Values::new(kind);
+        for datum in data {
+            values.push(datum);
+        }
+        let mut out = Vec::new();
+        encode(&values, &mut out);
+        Chunk::decode(kind, data.len(), &out).unwrap()
+    }
+
+    /// Every third row, to check kernels against partial selections.
+    fn every_third(rows: usize) -> Selection {
+        let mut selection = Selection::none(rows);
+        for row in (0..rows).step_by(3) {
+            selection.set_range(row, row + 1);
+        }
+        selection
+    }
+
+    /// Checks the chunk against row-by-row evaluation; a constant of the
+    /// wrong type matches nothing.
+    fn check(chunk: &Chunk, data: &[Datum], constants: &[Datum]) {
+        assert_eq!(chunk.rows(), data.len());
+        assert_eq!(chunk.values(&Selection::all(data.len())), data);
+        for constant in constants {
+            for op in OPS {
+                let selected: Vec<usize> = chunk.filter(op, constant).iter().collect();
+                let expected: Vec<usize> = (0..data.len())
+                    .filter(|&row| {
+                        data[row].kind() == constant.kind() && op.test(&data[row], constant)
+                    })
+                    .collect();
+                assert_eq!(selected, expected, "{op:?} {constant:?}");
+            }
+        }
+        let selection = every_third(data.len());
+        let expected = data
+            .iter()
+            .enumerate()
+            .map(|(row, datum)| match datum {
+                Datum::Int(v) if selection.contains(row) => Some(*v as i128),
+                Datum::Int(_) => Some(0),
+                Datum::Bytes(_) => None,
+            })
+            .sum::<Option<i128>>();
+        assert_eq!(chunk.sum(&selection), expected);
+    }
+
+    fn ints(values: impl IntoIterator<Item = i64>) -> Vec<Datum> {
+        values.into_iter().map(Datum::Int).collect()
+    }
+
+    #[test]
+    fn the_smallest_encoding_is_chosen_and_reads_back() {
+        let constants = ints([-1, 0, 7, 500, i64::MAX]);
+        let runs = ints((0..1000).map(|i| i / 100));
+        let chunk = round_trip(ColumnType::Int, &runs);
+        assert_eq!(chunk.encoding(), "rle");
+        check(&chunk, &runs, &constants);
+
+        let few = ints((0..1000).map(|i| (i * 7919 % 13) << 40));
+        let chunk = round_trip(ColumnType::Int, &few);
+        assert_eq!(chunk.encoding(), "dict");
+        check(&chunk, &few, &constants);
+
+        let distinct = ints((0..1000).map(|i| i * 1_000_003 - 500_000_000));
+        let chunk = round_trip(ColumnType::Int, &distinct);
+        assert_eq!(chunk.encoding(), "plain");
+        check(&chunk, &distinct, &constants);
+    }
+
+    #[test]
+    fn byte_strings_use_every_encoding() {
+        let datum = |i: usize| Datum::Bytes(format!("name {i}").into_bytes());
+        let constants = [
+            datum(5),
+            datum(300),
+            Datum::Bytes(Vec::new()),
+            Datum::Int(5),
+        ];
+        for (data, encoding) in [
+            ((0..2000).map(|i| datum(i / 500)).collect::<Vec<_>>(), "rle"),
+            // More than 256 distinct values need two-byte codes.
+            ((0..4000).map(|i| datum(i * 31 % 400)).collect(), "dict"),
+            ((0..1000).map(datum).collect(), "plain"),
+        ] {
+            let chunk = round_trip(ColumnType::Bytes, &data);
+            assert_eq!(chunk.encoding(), encoding);
+            check(&chunk, &data, &constants);
+        }
+    }
+
+    #[test]
+    fn a_damaged_chunk_is_reported() {
+        let data = ints((0..1000).map(|i| i % 10));
+        let mut values = Values::new(ColumnType::Int);
+        for datum in &data {
+            values.push(datum);
+        }
+        let mut out = Vec::new();
+        encode(&values, &mut out);
+        assert_eq!(out[0], DICT);
+
+        let is_corruption = |r: Result<Chunk>| matches!(r, Err(Error::Corruption(_)));
+        assert!(is_corruption(Chunk::decode(
+            ColumnType::Int,
+            1000,
+            &out[..out.len() - 1]
+        )));
+        assert!(is_corruption(Chunk::decode(ColumnType::Int, 1000, &[])));
+        let mut bad_code = out.clone();
+        *bad_code.last_mut().unwrap() = 10;
+        assert!(is_corruption(Chunk::decode(
+            ColumnType::Int,
+            1000,
+            &bad_code
+        )));
+        let mut bad_kind = out;
+        bad_kind[0] = 9;
+        assert!(is_corruption(Chunk::decode(
+            ColumnType::Int,
+            1000,
+            &bad_kind
+        )));
+    }
+}
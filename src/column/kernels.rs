@@ -0,0 +1,275 @@
+//! Batch kernels over flat value arrays and selection bitmaps.
+//!
+//! Every kernel handles a whole chunk in a loop with no data-dependent
+//! branches: comparisons are packed into 64-bit selection words, and sums
+//! mask values instead of skipping them. The comparison is chosen once per
+//! chunk, outside the loop, so each loop body is simple enough for the
+//! compiler to vectorize.
+
+use super::CmpOp;
+
+/// Which rows of a chunk are selected, one bit per row.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Selection {
+    words: Vec<u64>,
+    rows: usize,
+}
+
+impl Selection {
+    /// Selects every one of `rows` rows.
+    pub fn all(rows: usize) -> Self {
+        let mut words = vec![!0u64; rows.div_ceil(64)];
+        if !rows.is_multiple_of(64) {
+            *words.last_mut().unwrap() = (1u64 << (rows % 64)) - 1;
+        }
+        Selection { words, rows }
+    }
+
+    /// Selects none of `rows` rows.
+    pub fn none(rows: usize) -> Self {
+        Selection {
+            words: vec![0; rows.div_ceil(64)],
+            rows,
+        }
+    }
+
+    /// Number of rows the selection covers, selected or not.
+    pub fn rows(&self) -> usize {
+        self.rows
+    }
+
+    /// Number of selected rows.
+    pub fn count(&self) -> u64 {
+        self.words.iter().map(|w| w.count_ones() as u64).sum()
+    }
+
+    /// Whether no row is selected.
+    pub fn is_empty(&self) -> bool {
+        self.words.iter().all(|&w| w == 0)
+    }
+
+    /// Whether row `row` is selected.
+    pub fn contains(&self, row: usize) -> bool {
+        self.words[row / 64] & (1 << (row % 64)) != 0
+    }
+
+    /// The selected rows in ascending order.
+    pub fn iter(&self) -> impl Iterator<Item = usize> + '_ {
+        self.words.iter().enumerate().flat_map(|(i, &word)| {
+            let mut word = word;
+            std::iter::from_fn(move || {
+                if word == 0 {
+                    return None;
+                }
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                Some(i * 64 + bit)
+            })
+        })
+    }
+
+    /// Keeps only the rows also selected by `other`.
+    pub fn and(&mut self, other: &Selection) {
+        debug_assert_eq!(self.rows, other.rows);
+        for (word, &other) in self.words.iter_mut().zip(&other.words) {
+            *word &= other;
+        }
+    }
+
+    pub(crate) fn words(&self) -> &[u64] {
+        &self.words
+    }
+
+    /// Selects rows `start..end`.
+    pub(crate) fn set_range(&mut self, start: usize, end: usize) {
+        let end = end.min(self.rows);
+        let mut row = start;
+        while row < end {
+            let bit = row % 64;
+            let n = (64 - bit).min(end - row);
+            let mask = if n == 64 {
+                !0
+            } else {
+                ((1u64 << n) - 1) << bit
+            };
+            self.words[row / 64] |= mask;
+            row += n;
+        }
+    }
+
+    /// Number of selected rows in `start..end`.
+    pub(crate) fn count_range(&self, start: usize, end: usize) -> u64 {
+        if start >= end {
+            return 0;
+        }
+        let (first, last) = (start / 64, (end - 1) / 64);
+        let mut count = 0;
+        for (i, &word) in self.words[first..=last].iter().enumerate() {
+            let i = first + i;
+            let mut word = word;
+            if i == first {
+                word &= !0u64 << (start % 64);
+            }
+            if i == last && !end.is_multiple_of(64) {
+                word &= (1u64 << (end % 64)) - 1;
+            }
+            count += word.count_ones() as u64;
+        }
+        count
+    }
+}
+
+/// Packs `f` of each value of a block of at most 64 into a selection word.
+#[inline(always)]
+fn pack(block: &[i64], f: impl Fn(i64) -> bool) -> u64 {
+    let mut word = 0;
+    for (i, &value) in block.iter().enumerate() {
+        word |= (f(value) as u64) << i;
+    }
+    word
+}
+
+/// Selects the values satisfying `value op constant`.
+pub fn compare_ints(values: &[i64], op: CmpOp, constant: i64) -> Selection {
+    let mut selection = Selection::none(values.len());
+    let c = constant;
+    for (word, block) in selection.words.iter_mut().zip(values.chunks(64)) {
+        *word = match op {
+            CmpOp::Eq => pack(block, |v| v == c),
+            CmpOp::Ne => pack(block, |v| v != c),
+            CmpOp::Lt => pack(block, |v| v < c),
+            CmpOp::Le => pack(block, |v| v <= c),
+            CmpOp::Gt => pack(block, |v| v > c),
+            CmpOp::Ge => pack(block, |v| v >= c),
+        };
+    }
+    selection
+}
+
+/// Selects the rows whose code maps to `true` in `table`.
+pub fn lookup_codes(codes: &[u16], table: &[bool]) -> Selection {
+    let mut selection = Selection::none(codes.len());
+    for (word, block) in selection.words.iter_mut().zip(codes.chunks(64)) {
+        let mut bits = 0;
+        for (i, &code) in block.iter().enumerate() {
+            bits |= (table[code as usize] as u64) << i;
+        }
+        *word = bits;
+    }
+    selection
+}
+
+/// Sums the selected values without overflow. Each value is split into its
+/// low and high 32 bits, summed in separate 64-bit lanes that cannot
+/// overflow for fewer than 2^31 values.
+pub fn sum_ints(values: &[i64], selection: &Selection) -> i128 {
+    debug_assert!(values.len() < 1 << 31);
+    let mut low = 0u64;
+    let mut high = 0i64;
+    for (block, &word) in values.chunks(64).zip(selection.words()) {
+        for (i, &value) in block.iter().enumerate() {
+            let mask = ((word >> i) & 1).wrapping_neg();
+            low += value as u64 & 0xffff_ffff & mask;
+            high += (value >> 32) & mask as i64;
+        }
+    }
+    ((high as i128) << 32) + low as i128
+}
+
+/// Counts the selected rows holding each of `distinct` codes.
+pub fn count_codes(codes: &[u16], selection: &Selection, distinct: usize) -> Vec<u64> {
+    let mut counts = vec![0u64; distinct];
+    for (block, &word) in codes.chunks(64).zip(selection.words()) {
+        for (i, &code) in block.iter().enumerate() {
+            counts[code as usize] += (word >> i) & 1;
+        }
+    }
+    counts
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Values spread across the whole `i64` range, `n` of them.
+    fn values(n: usize) -> Vec<i64> {
+        let mut x = 0x2545_f491_4f6c_dd1du64;
+        (0..n)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                x as i64
+            })
+            .collect()
+    }
+
+    #[test]
+    fn comparisons_match_a_row_by_row_loop() {
+        let values = values(1000);
+        for constant in [i64::MIN, -1, 0, values[17], i64::MAX] {
+            for op in [
+                CmpOp::Eq,
+                CmpOp::Ne,
+                CmpOp::Lt,
+                CmpOp::Le,
+                CmpOp::Gt,
+                CmpOp::Ge,
+            ] {
+                let selection = compare_ints(&values, op, constant);
+                assert_eq!(selection.rows(), 1000);
+                for (row, value) in values.iter().enumerate() {
+                    assert_eq!(selection.contains(row), op.test(value, &constant));
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn sums_do_not_overflow() {
+        let mut values = values(1000);
+        values[..10].fill(i64::MAX);
+        values[10..20].fill(i64::MIN);
+        let selection = compare_ints(&values, CmpOp::Ne, values[500]);
+        let expected: i128 = values
+            .iter()
+            .filter(|&&v| v != values[500])
+            .map(|&v| v as i128)
+            .sum();
+        assert_eq!(sum_ints(&values, &selection), expected);
+        assert_eq!(
+            sum_ints(&[i64::MAX; 3], &Selection::all(3)),
+            3 * i64::MAX as i128
+        );
+        assert_eq!(sum_ints(&values, &Selection::none(1000)), 0);
+    }
+
+    #[test]
+    fn codes_are_looked_up_and_counted() {
+        let codes: Vec<u16> = (0..1000).map(|i| (i * 7 % 5) as u16).collect();
+        let selection = lookup_codes(&codes, &[false, true, false, true, false]);
+        let expected: Vec<usize> = (0..1000).filter(|&i| codes[i] % 2 == 1).collect();
+        assert_eq!(selection.iter().collect::<Vec<_>>(), expected);
+        assert_eq!(count_codes(&codes, &selection, 5), [0, 200, 0, 200, 0]);
+    }
+
+    #[test]
+    fn selection_ranges() {
+        let all = Selection::all(130);
+        assert_eq!(all.count(), 130);
+        assert_eq!(all.iter().last(), Some(129));
+        let mut selection = Selection::none(130);
+        assert!(selection.is_empty());
+        selection.set_range(3, 70);
+        selection.set_range(128, 200);
+        assert_eq!(selection.count(), 69);
+        assert_eq!(selection.count_range(0, 64), 61);
+        assert_eq!(selection.count_range(60, 129), 11);
+        assert_eq!(selection.count_range(70, 128), 0);
+        selection.and(&compare_ints(&(0..130).collect::<Vec<_>>(), CmpOp::Ge, 64));
+        assert_eq!(
+            selection.iter().collect::<Vec<_>>(),
+            [64, 65, 66, 67, 68, 69, 128, 129]
+        );
+    }
+}
@@ -0,0 +1,154 @@
+//! An optional column-oriented table format for analytical scans.
+//!
+//! A column table is written once, front to back, and then read through the
+//! shared buffer pool like a sorted run. Rows are cut into chunks of
+//! [`CHUNK_ROWS`], and the chunks of each column are stored together, so a
+//! query reads only the pages of the columns it touches:
+//!
+//! ```text
+//! +-----------------+-----+-----------------+-----------+--------+
+//! | column 0 chunks | ... | column n chunks | directory | footer |
+//! +-----------------+-----+-----------------+-----------+--------+
+//! ```
+//!
+//! Each chunk is encoded on its own as plain values, runs, or dictionary
+//! codes, whichever is smallest, and its minimum and maximum are kept in the
+//! directory as a zone map. The directory stays in memory, charged to the
+//! budget, while the table is open.
+//!
+//! A [`ColumnScan`] skips chunks whose zone maps rule out a filter,
+//! evaluates filters on the encoded data (once per run or dictionary entry
+//! rather than per row where it can), and loads the other columns only for
+//! chunks that still have selected rows. The [`kernels`] work on flat arrays
+//! and selection bitmaps, a chunk at a time, in loops the compiler can
+//! vectorize.
+
+mod encoding;
+pub mod kernels;
+mod table;
+
+pub use encoding::Chunk;
+pub use kernels::Selection;
+pub use table::{Batch, ColumnScan, ColumnStats, ColumnTable, ColumnTableWriter};
+
+/// Rows per chunk; the last chunk of a table may hold fewer.
+pub const CHUNK_ROWS: usize = 4096;
+
+/// The type of a column.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ColumnType {
+    /// 64-bit signed integers.
+    Int,
+    /// Byte strings.
+    Bytes,
+}
+
+impl ColumnType {
+    fn id(self) -> u8 {
+        match self {
+            ColumnType::Int => 0,
+            ColumnType::Bytes => 1,
+        }
+    }
+
+    fn from_id(id: u8) -> Option<Self> {
+        match id {
+            0 => Some(ColumnType::Int),
+            1 => Some(ColumnType::Bytes),
+            _ => None,
+        }
+    }
+}
+
+/// A named, typed column of a table.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ColumnDef {
+    pub name: String,
+    pub kind: ColumnType,
+}
+
+impl ColumnDef {
+    /// An integer column.
+    pub fn int(name: impl Into<String>) -> Self {
+        ColumnDef {
+            name: name.into(),
+            kind: ColumnType::Int,
+        }
+    }
+
+    /// A byte-string column.
+    pub fn bytes(name: impl Into<String>) -> Self {
+        ColumnDef {
+            name: name.into(),
+            kind: ColumnType::Bytes,
+        }
+    }
+}
+
+/// One value of a row.
+#[derive(Debug, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum Datum {
+    Int(i64),
+    Bytes(Vec<u8>),
+}
+
+impl Datum {
+    /// The type of column that can hold this value.
+    pub fn kind(&self) -> ColumnType {
+        match self {
+            Datum::Int(_) => ColumnType::Int,
+            Datum::Bytes(_) => ColumnType::Bytes,
+        }
+    }
+}
+
+/// A comparison applied by a [`Predicate`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CmpOp {
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+}
+
+impl CmpOp {
+    /// Whether `a op b` holds.
+    pub fn test<T: Ord + ?Sized>(self, a: &T, b: &T) -> bool {
+        match self {
+            CmpOp::Eq => a == b,
+            CmpOp::Ne => a != b,
+            CmpOp::Lt => a < b,
+            CmpOp::Le => a <= b,
+            CmpOp::Gt => a > b,
+            CmpOp::Ge => a >= b,
+        }
+    }
+
+    /// Whether some value in `[min, max]` may satisfy `value op constant`.
+    fn may_match<T: Ord + ?Sized>(self, min: &T, max: &T, constant: &T) -> bool {
+        match self {
+            CmpOp::Eq => min <= constant && constant <= max,
+            CmpOp::Ne => !(min == constant && max == constant),
+            CmpOp::Lt => min < constant,
+            CmpOp::Le => min <= constant,
+            CmpOp::Gt => max > constant,
+            CmpOp::Ge => max >= constant,
+        }
+    }
+}
+
+/// A filter `column op value` on one column of a table.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Predicate {
+    pub column: usize,
+    pub op: CmpOp,
+    pub value: Datum,
+}
+
+impl Predicate {
+    pub fn new(column: usize, op: CmpOp, value: Datum) -> Self {
+        Predicate { column, op, value }
+    }
+}
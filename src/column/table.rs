@@ -0,0 +1,727 @@
+//! Writing and scanning column table files.
+//!
+//! ```text
+//! directory: [columns u16] { [kind u8][name_len u16][name] } ...
+//!            [chunks u32] { [rows u32] } ...
+//!            for each column, for each chunk: [offset u64][len u32][min][max]
+//! footer:    [magic 8][data_pages u64][directory_len u64][rows u64]
+//! ```
+//!
+//! Zone-map bounds are stored as an `i64` for integer columns and as
+//! `[len u32][bytes]` for byte-string columns. The directory starts on the
+//! page after the last chunk and the footer fills the last page.
+
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Seek, SeekFrom, Write};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use super::encoding::{self, Chunk, Values};
+use super::kernels::Selection;
+use super::{ColumnDef, ColumnType, Datum, Predicate, CHUNK_ROWS};
+use crate::error::{Error, Result};
+use crate::exec::run::temp_file;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::storage::{BufferPool, FileId, PageId, ScanRing, PAGE_SIZE, SCAN_RING_PAGES};
+
+const MAGIC: &[u8; 8] = b"DIGCOLMN";
+const FOOTER_LEN: usize = 32;
+
+/// Where one chunk of one column is stored, and its zone map.
+#[derive(Debug)]
+struct ChunkHandle {
+    offset: u64,
+    len: u32,
+    min: Datum,
+    max: Datum,
+}
+
+impl ChunkHandle {
+    fn heap_bytes(&self) -> usize {
+        let datum = |d: &Datum| match d {
+            Datum::Int(_) => 0,
+            Datum::Bytes(b) => b.len(),
+        };
+        std::mem::size_of::<ChunkHandle>() + datum(&self.min) + datum(&self.max)
+    }
+}
+
+fn encode_datum(datum: &Datum, out: &mut Vec<u8>) {
+    match datum {
+        Datum::Int(v) => out.extend_from_slice(&v.to_le_bytes()),
+        Datum::Bytes(v) => {
+            out.extend_from_slice(&(v.len() as u32).to_le_bytes());
+            out.extend_from_slice(v);
+        }
+    }
+}
+
+/// Streams rows into a new column table file. Each column's encoded chunks
+/// are spooled to an anonymous temporary file, so only the chunk being
+/// filled is held in memory, charged to the budget.
+#[derive(Debug)]
+pub struct ColumnTableWriter {
+    path: PathBuf,
+    columns: Vec<ColumnDef>,
+    spools: Vec<File>,
+    spooled: Vec<u64>,
+    pending: Vec<Values>,
+    pending_rows: usize,
+    chunk_rows: Vec<u32>,
+    chunks: Vec<Vec<ChunkHandle>>,
+    directory_bytes: usize,
+    encoded: Vec<u8>,
+    rows: u64,
+    reservation: Reservation,
+}
+
+impl ColumnTableWriter {
+    /// Creates a writer of a table with `columns` that is stored at `path`
+    /// once finished, spooling chunks to `temp_dir`.
+    pub fn create(
+        path: impl AsRef<Path>,
+        columns: Vec<ColumnDef>,
+        temp_dir: &Path,
+        budget: &Arc<MemoryBudget>,
+    ) -> Result<Self> {
+        if columns.is_empty() || columns.len() > u16::MAX as usize {
+            return Err(Error::InvalidArgument(format!(
+                "a column table needs 1 to {} columns, not {}",
+                u16::MAX,
+                columns.len()
+            )));
+        }
+        for (i, column) in columns.iter().enumerate() {
+            if column.name.len() > u16::MAX as usize
+                || columns[..i].iter().any(|c| c.name == column.name)
+            {
+                return Err(Error::InvalidArgument(format!(
+                    "bad or duplicate column name {:?}",
+                    column.name
+                )));
+            }
+        }
+        let spools = columns
+            .iter()
+            .map(|_| temp_file(temp_dir))
+            .collect::<Result<Vec<File>>>()?;
+        Ok(ColumnTableWriter {
+            path: path.as_ref().to_path_buf(),
+            pending: columns.iter().map(|c| Values::new(c.kind)).collect(),
+            spooled: vec![0; columns.len()],
+            chunks: columns.iter().map(|_| Vec::new()).collect(),
+            columns,
+            spools,
+            pending_rows: 0,
+            chunk_rows: Vec::new(),
+            directory_bytes: 0,
+            encoded: Vec::new(),
+            rows: 0,
+            reservation: budget.try_reserve(Consumer::Other, 0)?,
+        })
+    }
+
+    /// Appends one row, which must hold a value of the right type for every
+    /// column.
+    pub fn push(&mut self, row: &[Datum]) -> Result<()> {
+        if row.len() != self.columns.len() {
+            return Err(Error::InvalidArgument(format!(
+                "row has {} values for {} columns",
+                row.len(),
+                self.columns.len()
+            )));
+        }
+        if let Some((column, _)) = self
+            .columns
+            .iter()
+            .zip(row)
+            .find(|(column, datum)| column.kind != datum.kind())
+        {
+            return Err(Error::InvalidArgument(format!(
+                "value of the wrong type for column {:?}",
+                column.name
+            )));
+        }
+        for (values, datum) in self.pending.iter_mut().zip(row) {
+            values.push(datum);
+        }
+        self.pending_rows += 1;
+        self.rows += 1;
+        let needed = self.heap_bytes();
+        if needed > self.reservation.size() {
+            if let Err(err) = self.reservation.try_grow(needed - self.reservation.size()) {
+                for values in &mut self.pending {
+                    values.truncate(self.pending_rows - 1);
+                }
+                self.pending_rows -= 1;
+                self.rows -= 1;
+                return Err(err);
+            }
+        }
+        if self.pending_rows == CHUNK_ROWS {
+            self.finish_chunk()?;
+        }
+        Ok(())
+    }
+
+    /// Number of rows pushed so far.
+    pub fn rows(&self) -> u64 {
+        self.rows
+    }
+
+    fn heap_bytes(&self) -> usize {
+        self.pending.iter().map(Values::heap_bytes).sum::<usize>()
+            + self.encoded.capacity()
+            + self.directory_bytes
+    }
+
+    fn finish_chunk(&mut self) -> Result<()> {
+        for column in 0..self.columns.len() {
+            let values = &mut self.pending[column];
+            let (min, max) = values.min_max().unwrap();
+            self.encoded.clear();
+            encoding::encode(values, &mut self.encoded);
+            self.spools[column].write_all(&self.encoded)?;
+            let handle = ChunkHandle {
+                offset: self.spooled[column],
+                len: self.encoded.len() as u32,
+                min,
+                max,
+            };
+            self.spooled[column] += self.encoded.len() as u64;
+            self.directory_bytes += handle.heap_bytes();
+            self.chunks[column].push(handle);
+            values.clear();
+        }
+        self.chunk_rows.push(self.pending_rows as u32);
+        self.directory_bytes += 4;
+        self.pending_rows = 0;
+        Ok(())
+    }
+
+    /// Writes the columns, directory and footer to a temporary file, syncs
+    /// it and moves it into place.
+    pub fn finish(mut self) -> Result<PathBuf> {
+        if self.pending_rows > 0 {
+            self.finish_chunk()?;
+        }
+        let tmp = self.path.with_extension("tmp");
+        let mut out = BufWriter::with_capacity(4 * PAGE_SIZE, File::create(&tmp)?);
+        let mut data_bytes = 0u64;
+        for (spool, handles) in self.spools.iter_mut().zip(&mut self.chunks) {
+            for handle in handles.iter_mut() {
+                handle.offset += data_bytes;
+            }
+            spool.seek(SeekFrom::Start(0))?;
+            data_bytes += io::copy(spool, &mut out)?;
+        }
+        let padding = data_bytes.next_multiple_of(PAGE_SIZE as u64) - data_bytes;
+        out.write_all(&vec![0u8; padding as usize])?;
+        let data_pages = (data_bytes + padding) / PAGE_SIZE as u64;
+
+        let mut directory = Vec::new();
+        directory.extend_from_slice(&(self.columns.len() as u16).to_le_bytes());
+        for column in &self.columns {
+            directory.push(column.kind.id());
+            directory.extend_from_slice(&(column.name.len() as u16).to_le_bytes());
+            directory.extend_from_slice(column.name.as_bytes());
+        }
+        directory.extend_from_slice(&(self.chunk_rows.len() as u32).to_le_bytes());
+        for rows in &self.chunk_rows {
+            directory.extend_from_slice(&rows.to_le_bytes());
+        }
+        for handle in self.chunks.iter().flatten() {
+            directory.extend_from_slice(&handle.offset.to_le_bytes());
+            directory.extend_from_slice(&handle.len.to_le_bytes());
+            encode_datum(&handle.min, &mut directory);
+            encode_datum(&handle.max, &mut directory);
+        }
+        let directory_len = directory.len() as u64;
+        directory.resize(directory.len().div_ceil(PAGE_SIZE) * PAGE_SIZE, 0);
+        out.write_all(&directory)?;
+
+        let mut footer = Vec::with_capacity(PAGE_SIZE);
+        footer.extend_from_slice(MAGIC);
+        footer.extend_from_slice(&data_pages.to_le_bytes());
+        footer.extend_from_slice(&directory_len.to_le_bytes());
+        footer.extend_from_slice(&self.rows.to_le_bytes());
+        footer.resize(PAGE_SIZE, 0);
+        out.write_all(&footer)?;
+        out.flush()?;
+        out.get_ref().sync_all()?;
+        drop(out);
+        fs::rename(&tmp, &self.path)?;
+        if let Some(dir) = self.path.parent() {
+            File::open(dir)?.sync_all()?;
+        }
+        Ok(self.path)
+    }
+}
+
+/// Work done by the scans of a column table.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ColumnStats {
+    /// Column chunks read and decoded.
+    pub chunks_read: u64,
+    /// Row chunks passed over because a zone map ruled out a filter.
+    pub chunks_skipped: u64,
+    /// Stored bytes of the chunks read.
+    pub bytes_read: u64,
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    chunks_read: AtomicU64,
+    chunks_skipped: AtomicU64,
+    bytes_read: AtomicU64,
+}
+
+/// An open column table whose pages are served by the buffer pool.
+#[derive(Debug)]
+pub struct ColumnTable {
+    pool: Arc<BufferPool>,
+    budget: Arc<MemoryBudget>,
+    file_id: FileId,
+    columns: Vec<ColumnDef>,
+    chunk_rows: Vec<u32>,
+    /// Chunk handles by column, then by chunk.
+    chunks: Vec<Vec<ChunkHandle>>,
+    rows: u64,
+    counters: Counters,
+    _reservation: Reservation,
+}
+
+impl ColumnTable {
+    /// Opens the table stored at `path`, charging its directory to `budget`.
+    pub fn open(
+        path: impl AsRef<Path>,
+        pool: &Arc<BufferPool>,
+        budget: &Arc<MemoryBudget>,
+    ) -> Result<Self> {
+        let path = path.as_ref();
+        let file = File::open(path)?;
+        let file_size = file.metadata()?.len();
+        let damaged = |what: &str| Error::Corruption(format!("{} {what}", path.display()));
+        if file_size < PAGE_SIZE as u64 || file_size % PAGE_SIZE as u64 != 0 {
+            return Err(damaged("is truncated"));
+        }
+        let mut footer = [0u8; FOOTER_LEN];
+        file.read_exact_at(&mut footer, file_size - PAGE_SIZE as u64)?;
+        if &footer[..8] != MAGIC {
+            return Err(damaged("is not a column table"));
+        }
+        let read_u64 = |at: usize| u64::from_le_bytes(footer[at..at + 8].try_into().unwrap());
+        let data_pages = read_u64(8);
+        let directory_len = read_u64(16);
+        let rows = read_u64(24);
+        if (data_pages + 1) * PAGE_SIZE as u64 + directory_len > file_size {
+            return Err(damaged("has a damaged footer"));
+        }
+        let mut raw = vec![0u8; directory_len as usize];
+        file.read_exact_at(&mut raw, data_pages * PAGE_SIZE as u64)?;
+        drop(file);
+
+        let Directory {
+            columns,
+            chunk_rows,
+            chunks,
+        } = Directory::parse(&raw, data_pages * PAGE_SIZE as u64)
+            .ok_or_else(|| damaged("has a damaged directory"))?;
+        if columns.is_empty()
+            || chunk_rows.iter().map(|&r| r as u64).sum::<u64>() != rows
+            || chunk_rows
+                .iter()
+                .any(|&r| r == 0 || r as usize > CHUNK_ROWS)
+        {
+            return Err(damaged("has a damaged directory"));
+        }
+        let directory_bytes = chunks
+            .iter()
+            .flatten()
+            .map(ChunkHandle::heap_bytes)
+            .sum::<usize>()
+            + chunk_rows.len() * 4
+            + columns.iter().map(|c| c.name.len()).sum::<usize>();
+        let reservation = budget.try_reserve(Consumer::Index, directory_bytes)?;
+
+        let file_id = pool.open_file(path)?;
+        Ok(ColumnTable {
+            pool: Arc::clone(pool),
+            budget: Arc::clone(budget),
+            file_id,
+            columns,
+            chunk_rows,
+            chunks,
+            rows,
+            counters: Counters::default(),
+            _reservation: reservation,
+        })
+    }
+
+    /// The table's columns.
+    pub fn schema(&self) -> &[ColumnDef] {
+        &self.columns
+    }
+
+    /// Position of the column named `name`.
+    pub fn column(&self, name: &str) -> Option<usize> {
+        self.columns.iter().position(|c| c.name == name)
+    }
+
+    /// Number of rows.
+    pub fn rows(&self) -> u64 {
+        self.rows
+    }
+
+    /// Number of row chunks.
+    pub fn chunks(&self) -> usize {
+        self.chunk_rows.len()
+    }
+
+    /// Chunks read and skipped by scans so far.
+    pub fn stats(&self) -> ColumnStats {
+        ColumnStats {
+            chunks_read: self.counters.chunks_read.load(Ordering::Relaxed),
+            chunks_skipped: self.counters.chunks_skipped.load(Ordering::Relaxed),
+            bytes_read: self.counters.bytes_read.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Scans the columns in `projection` of the rows satisfying every one of
+    /// `filters`, a chunk at a time.
+    pub fn scan(&self, projection: &[usize], filters: &[Predicate]) -> Result<ColumnScan<'_>> {
+        if let Some(&column) = projection.iter().find(|&&c| c >= self.columns.len()) {
+            return Err(Error::InvalidArgument(format!(
+                "no column {column} in a table of {}",
+                self.columns.len()
+            )));
+        }
+        for filter in filters {
+            match self.columns.get(filter.column) {
+                Some(column) if column.kind == filter.value.kind() => {}
+                Some(column) => {
+                    return Err(Error::InvalidArgument(format!(
+                        "filter value of the wrong type for column {:?}",
+                        column.name
+                    )))
+                }
+                None => {
+                    return Err(Error::InvalidArgument(format!(
+                        "no column {} in a table of {}",
+                        filter.column,
+                        self.columns.len()
+                    )))
+                }
+            }
+        }
+        Ok(ColumnScan {
+            table: self,
+            projection: projection.to_vec(),
+            filters: filters.to_vec(),
+            next_chunk: 0,
+            first_row: 0,
+            pages: 0,
+            ring: None,
+            reservation: None,
+        })
+    }
+
+    /// Number of rows satisfying every one of `filters`. Only the filtered
+    /// columns are read.
+    pub fn count(&self, filters: &[Predicate]) -> Result<u64> {
+        if filters.is_empty() {
+            return Ok(self.rows);
+        }
+        let mut count = 0;
+        for batch in self.scan(&[], filters)? {
+            count += batch?.selection.count();
+        }
+        Ok(count)
+    }
+
+    /// Sum of integer column `column` over the rows satisfying every one of
+    /// `filters`.
+    pub fn sum(&self, column: usize, filters: &[Predicate]) -> Result<i128> {
+        if self.columns.get(column).map(|c| c.kind) != Some(ColumnType::Int) {
+            return Err(Error::InvalidArgument(format!(
+                "column {column} is not an integer column"
+            )));
+        }
+        let mut sum = 0;
+        for batch in self.scan(&[column], filters)? {
+            let batch = batch?;
+            sum += batch.columns[0].sum(&batch.selection).unwrap();
+        }
+        Ok(sum)
+    }
+
+    /// Reads and decodes chunk `chunk` of column `column`, reading pages that
+    /// are not resident through `ring` if given. Pages are pinned a ring's
+    /// worth at a time, so a chunk larger than the pool can still be read.
+    fn read_chunk(
+        &self,
+        column: usize,
+        chunk: usize,
+        mut ring: Option<&mut ScanRing>,
+    ) -> Result<Chunk> {
+        let handle = &self.chunks[column][chunk];
+        let page_size = PAGE_SIZE as u64;
+        let end = handle.offset + handle.len as u64;
+        let page_ids: Vec<PageId> = (handle.offset / page_size..=(end - 1) / page_size).collect();
+        let mut stored = Vec::with_capacity(handle.len as usize);
+        for batch in page_ids.chunks(SCAN_RING_PAGES) {
+            let guards = match ring.as_deref_mut() {
+                Some(ring) => ring.fetch_file_pages(self.file_id, batch)?,
+                None => self.pool.fetch_file_pages(self.file_id, batch)?,
+            };
+            for (&page, guard) in batch.iter().zip(&guards) {
+                let data = guard.read();
+                let from = handle.offset.max(page * page_size) - page * page_size;
+                let to = end.min((page + 1) * page_size) - page * page_size;
+                stored.extend_from_slice(&data[from as usize..to as usize]);
+            }
+        }
+        self.counters.chunks_read.fetch_add(1, Ordering::Relaxed);
+        self.counters
+            .bytes_read
+            .fetch_add(handle.len as u64, Ordering::Relaxed);
+        Chunk::decode(
+            self.columns[column].kind,
+            self.chunk_rows[chunk] as usize,
+            &stored,
+        )
+    }
+}
+
+impl Drop for ColumnTable {
+    fn drop(&mut self) {
+        self.pool.detach(self.file_id);
+    }
+}
+
+/// The parsed directory of a table file.
+struct Directory {
+    columns: Vec<ColumnDef>,
+    chunk_rows: Vec<u32>,
+    chunks: Vec<Vec<ChunkHandle>>,
+}
+
+impl Directory {
+    /// Parses `raw`, checking that every chunk lies within the first
+    /// `data_bytes` of the file.
+    fn parse(raw: &[u8], data_bytes: u64) -> Option<Directory> {
+        let mut cursor = Cursor { data: raw, at: 0 };
+        let count = cursor.u16()? as usize;
+        let mut columns = Vec::with_capacity(count);
+        for _ in 0..count {
+            let kind = ColumnType::from_id(cursor.take(1)?[0])?;
+            let len = cursor.u16()? as usize;
+            let name = String::from_utf8(cursor.take(len)?.to_vec()).ok()?;
+            columns.push(ColumnDef { name, kind });
+        }
+        let chunk_count = cursor.u32()? as usize;
+        let chunk_rows = (0..chunk_count)
+            .map(|_| cursor.u32())
+            .collect::<Option<Vec<u32>>>()?;
+        let mut chunks = Vec::with_capacity(count);
+        for column in &columns {
+            let mut handles = Vec::with_capacity(chunk_count);
+            for _ in 0..chunk_count {
+                let handle = ChunkHandle {
+                    offset: cursor.u64()?,
+                    len: cursor.u32()?,
+                    min: cursor.datum(column.kind)?,
+                    max: cursor.datum(column.kind)?,
+                };
+                if handle.len == 0 || handle.offset + handle.len as u64 > data_bytes {
+                    return None;
+                }
+                handles.push(handle);
+            }
+            chunks.push(handles);
+        }
+        Some(Directory {
+            columns,
+            chunk_rows,
+            chunks,
+        })
+    }
+}
+
+struct Cursor<'a> {
+    data: &'a [u8],
+    at: usize,
+}
+
+impl<'a> Cursor<'a> {
+    fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        let bytes = self.data.get(self.at..self.at.checked_add(len)?)?;
+        self.at += len;
+        Some(bytes)
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        Some(u16::from_le_bytes(self.take(2)?.try_into().unwrap()))
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().unwrap()))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().unwrap()))
+    }
+
+    fn datum(&mut self, kind: ColumnType) -> Option<Datum> {
+        Some(match kind {
+            ColumnType::Int => Datum::Int(self.u64()? as i64),
+            ColumnType::Bytes => {
+                let len = self.u32()? as usize;
+                Datum::Bytes(self.take(len)?.to_vec())
+            }
+        })
+    }
+}
+
+/// The selected rows of one chunk of a scan.
+#[derive(Debug)]
+pub struct Batch {
+    /// Position in the table of the chunk's first row.
+    pub first_row: u64,
+    /// Which of the chunk's rows satisfy the scan's filters.
+    pub selection: Selection,
+    /// The chunks of the projected columns, in projection order.
+    pub columns: Vec<Chunk>,
+}
+
+impl Batch {
+    /// The selected rows, each with the projected values in order.
+    pub fn rows(&self) -> Vec<Vec<Datum>> {
+        let columns: Vec<Vec<Datum>> = self
+            .columns
+            .iter()
+            .map(|chunk| chunk.values(&self.selection))
+            .collect();
+        (0..self.selection.count() as usize)
+            .map(|i| columns.iter().map(|values| values[i].clone()).collect())
+            .collect()
+    }
+}
+
+/// A scan over the chunks of a column table that skips chunks by zone map,
+/// evaluates filters on the encoded chunks, and reads projected columns only
+/// for chunks with selected rows. The largest batch produced is charged to
+/// the budget as scratch memory.
+#[derive(Debug)]
+pub struct ColumnScan<'a> {
+    table: &'a ColumnTable,
+    projection: Vec<usize>,
+    filters: Vec<Predicate>,
+    next_chunk: usize,
+    first_row: u64,
+    /// Pages read so far, to decide when to switch to a scan ring.
+    pages: usize,
+    ring: Option<ScanRing>,
+    reservation: Option<Reservation>,
+}
+
+impl ColumnScan<'_> {
+    /// Whether the zone maps of chunk `chunk` allow every filter to match.
+    fn may_match(&self, chunk: usize) -> bool {
+        self.filters.iter().all(|filter| {
+            let handle = &self.table.chunks[filter.column][chunk];
+            filter.op.may_match(&handle.min, &handle.max, &filter.value)
+        })
+    }
+
+    fn read(&mut self, column: usize, chunk: usize) -> Result<Chunk> {
+        let handle = &self.table.chunks[column][chunk];
+        let page_size = PAGE_SIZE as u64;
+        let pages = ((handle.offset + handle.len as u64 - 1) / page_size
+            - handle.offset / page_size
+            + 1) as usize;
+        let threshold = self.table.pool.scan_ring_threshold();
+        if self.pages < threshold && self.pages + pages >= threshold {
+            self.ring = self.table.pool.scan_ring();
+        }
+        self.pages += pages;
+        self.table.read_chunk(column, chunk, self.ring.as_mut())
+    }
+
+    fn next_batch(&mut self, chunk: usize, first_row: u64) -> Result<Option<Batch>> {
+        let rows = self.table.chunk_rows[chunk] as usize;
+        let mut loaded: Vec<Option<Chunk>> = (0..self.table.columns.len()).map(|_| None).collect();
+        let mut selection = Selection::all(rows);
+        for i in 0..self.filters.len() {
+            let column = self.filters[i].column;
+            if loaded[column].is_none() {
+                loaded[column] = Some(self.read(column, chunk)?);
+            }
+            let filter = &self.filters[i];
+            let matched = loaded[column]
+                .as_ref()
+                .unwrap()
+                .filter(filter.op, &filter.value);
+            selection.and(&matched);
+            if selection.is_empty() {
+                return Ok(None);
+            }
+        }
+        let mut columns = Vec::with_capacity(self.projection.len());
+        for i in 0..self.projection.len() {
+            let column = self.projection[i];
+            let reused = match self.projection[i + 1..].contains(&column) {
+                true => None,
+                false => loaded[column].take(),
+            };
+            columns.push(match reused {
+                Some(chunk) => chunk,
+                None => self.read(column, chunk)?,
+            });
+        }
+        let bytes = columns.iter().map(Chunk::heap_bytes).sum::<usize>() + rows / 8;
+        match &mut self.reservation {
+            Some(reservation) if reservation.size() < bytes => {
+                reservation.try_grow(bytes - reservation.size())?
+            }
+            Some(_) => {}
+            None => self.reservation = Some(self.table.budget.try_reserve(Consumer::Other, bytes)?),
+        }
+        Ok(Some(Batch {
+            first_row,
+            selection,
+            columns,
+        }))
+    }
+}
+
+impl Iterator for ColumnScan<'_> {
+    type Item = Result<Batch>;
+
+    fn next(&mut self) -> Option<Result<Batch>> {
+        while self.next_chunk < self.table.chunk_rows.len() {
+            let chunk = self.next_chunk;
+            let first_row = self.first_row;
+            self.next_chunk += 1;
+            self.first_row += self.table.chunk_rows[chunk] as u64;
+            if !self.may_match(chunk) {
+                self.table
+                    .counters
+                    .chunks_skipped
+                    .fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+            match self.next_batch(chunk, first_row) {
+                Ok(Some(batch)) => return Some(Ok(batch)),
+                Ok(None) => {}
+                Err(err) => {
+                    self.next_chunk = self.table.chunk_rows.len();
+                    return Some(Err(err));
+                }
+            }
+        }
+        None
+    }
+}
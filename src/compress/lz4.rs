@@ -0,0 +1,235 @@
+//! The LZ4 block format.
+//!
+//! A block is a series of sequences, each a token byte holding the literal
+//! and match lengths (extended by 255-valued bytes when they reach 15), the
+//! literals themselves, and a two-byte back-reference offset. The last
+//! sequence carries literals only. The compressor is the classic greedy
+//! single-probe hash search, which favours speed over ratio.
+
+use crate::error::{Error, Result};
+
+const MIN_MATCH: usize = 4;
+/// The last five bytes are always literals.
+const LAST_LITERALS: usize = 5;
+/// No match may start within the last twelve bytes.
+const MF_LIMIT: usize = 12;
+const MAX_OFFSET: usize = 65_535;
+const HASH_BITS: u32 = 12;
+
+fn read_u32(data: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes(data[at..at + 4].try_into().unwrap())
+}
+
+fn hash(sequence: u32) -> usize {
+    (sequence.wrapping_mul(2_654_435_761) >> (32 - HASH_BITS)) as usize
+}
+
+fn push_length(out: &mut Vec<u8>, mut len: usize) {
+    while len >= 255 {
+        out.push(255);
+        len -= 255;
+    }
+    out.push(len as u8);
+}
+
+fn push_sequence(out: &mut Vec<u8>, literals: &[u8], offset: usize, match_len: usize) {
+    let extra = match_len - MIN_MATCH;
+    out.push(((literals.len().min(15) as u8) << 4) | extra.min(15) as u8);
+    if literals.len() >= 15 {
+        push_length(out, literals.len() - 15);
+    }
+    out.extend_from_slice(literals);
+    out.extend_from_slice(&(offset as u16).to_le_bytes());
+    if extra >= 15 {
+        push_length(out, extra - 15);
+    }
+}
+
+/// Appends the compressed form of `input` to `out`.
+pub fn compress(input: &[u8], out: &mut Vec<u8>) {
+    let n = input.len();
+    let mut anchor = 0;
+    if n > MF_LIMIT {
+        let mut table = vec![0u32; 1 << HASH_BITS];
+        let mut at = 0;
+        while at < n - MF_LIMIT {
+            let sequence = read_u32(input, at);
+            let slot = hash(sequence);
+            let candidate = table[slot] as usize;
+            table[slot] = at as u32;
+            if candidate < at
+                && at - candidate <= MAX_OFFSET
+                && read_u32(input, candidate) == sequence
+            {
+                let limit = n - LAST_LITERALS - at;
+                let mut len = MIN_MATCH;
+                while len < limit && input[candidate + len] == input[at + len] {
+                    len += 1;
+                }
+                push_sequence(out, &input[anchor..at], at - candidate, len);
+                at += len;
+                anchor = at;
+            } else {
+                // Skip ahead faster through data that does not compress.
+                at += 1 + ((at - anchor) >> 6);
+            }
+        }
+    }
+    let literals = &input[anchor..];
+    out.push((literals.len().min(15) as u8) << 4);
+    if literals.len() >= 15 {
+        push_length(out, literals.len() - 15);
+    }
+    out.extend_from_slice(literals);
+}
+
+fn corrupt() -> Error {
+    Error::Corruption("malformed LZ4 block".into())
+}
+
+fn read_length(input: &[u8], at: &mut usize, mut len: usize) -> Result<usize> {
+    loop {
+        let byte = *input.get(*at).ok_or_else(corrupt)?;
+        *at += 1;
+        len += byte as usize;
+        if byte != 255 {
+            return Ok(len);
+        }
+    }
+}
+
+/// Restores exactly `len` bytes from a compressed block.
+pub fn decompress(input: &[u8], len: usize) -> Result<Vec<u8>> {
+    let mut out = Vec::with_capacity(len);
+    let mut at = 0;
+    loop {
+        let token = *input.get(at).ok_or_else(corrupt)?;
+        at += 1;
+        let mut literals = (token >> 4) as usize;
+        if literals == 15 {
+            literals = read_length(input, &mut at, literals)?;
+        }
+        let literal_end = at.checked_add(literals).ok_or_else(corrupt)?;
+        if literal_end > input.len() || out.len() + literals > len {
+            return Err(corrupt());
+        }
+        out.extend_from_slice(&input[at..literal_end]);
+        at = literal_end;
+        if at == input.len() {
+            break;
+        }
+        if at + 2 > input.len() {
+            return Err(corrupt());
+        }
+        let offset = u16::from_le_bytes([input[at], input[at + 1]]) as usize;
+        at += 2;
+        let mut match_len = (token & 15) as usize;
+        if match_len == 15 {
+            match_len = read_length(input, &mut at, match_len)?;
+        }
+        match_len += MIN_MATCH;
+        if offset == 0 || offset > out.len() || out.len() + match_len > len {
+            return Err(corrupt());
+        }
+        let start = out.len() - offset;
+        if offset >= match_len {
+            out.extend_from_within(start..start + match_len);
+        } else {
+            // Overlapping copy: the match repeats bytes it produces.
+            for i in 0..match_len {
+                out.push(out[start + i]);
+            }
+        }
+    }
+    if out.len() != len {
+        return Err(corrupt());
+    }
+    Ok(out)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn round_trip(input: &[u8]) -> usize {
+        let mut out = Vec::new();
+        compress(input, &mut out);
+        assert_eq!(decompress(&out, input.len()).unwrap(), input);
+        out.len()
+    }
+
+    /// Bytes from a xorshift generator, which do not compress.
+    fn noise(len: usize) -> Vec<u8> {
+        let mut state = 0x9e37_79b9_7f4a_7c15u64;
+        (0..len)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                state as u8
+            })
+            .collect()
+    }
+
+    #[test]
+    fn blocks_round_trip() {
+        round_trip(b"");
+        round_trip(b"short");
+        round_trip(b"just over the twelve byte limit");
+        // Incompressible input grows only by its length bytes.
+        let random = noise(64 << 10);
+        assert!(round_trip(&random) <= random.len() + random.len() / 255 + 16);
+        // A single run of zeros: one long, self-overlapping match.
+        assert!(round_trip(&vec![0; 100_000]) < 500);
+        // A short period repeated: offset 3, matches far longer than that.
+        let periodic: Vec<u8> = b"abc".iter().copied().cycle().take(10_000).collect();
+        assert!(round_trip(&periodic) < 100);
+        // Repeated text with long literal runs between matches.
+        let mut text = noise(300);
+        for i in 0..50u8 {
+            text.extend_from_slice(b"the quick brown fox jumps over the lazy dog ");
+            text.extend_from_slice(&noise(20 + i as usize));
+        }
+        round_trip(&text);
+    }
+
+    #[test]
+    fn overlapping_copies_repeat_their_own_output() {
+        // "ab", then a 10-byte match at offset 2, then "!" as the last
+        // literal.
+        let block = [0x26, b'a', b'b', 2, 0, 0x10, b'!'];
+        assert_eq!(decompress(&block, 13).unwrap(), b"abababababab!");
+    }
+
+    #[test]
+    fn malformed_blocks_are_rejected() {
+        let mut input = noise(2000);
+        input.extend_from_within(500..1500);
+        let mut block = Vec::new();
+        compress(&input, &mut block);
+        // Every truncation fails cleanly.
+        for len in 0..block.len() {
+            assert!(
+                matches!(
+                    decompress(&block[..len], input.len()),
+                    Err(Error::Corruption(_))
+                ),
+                "truncated to {len}"
+            );
+        }
+        // So does the wrong expected length, either way.
+        assert!(decompress(&block, input.len() - 1).is_err());
+        assert!(decompress(&block, input.len() + 1).is_err());
+        // A zero offset, and an offset reaching before the output.
+        assert!(decompress(&[0x10, b'a', 0, 0, 0x00], 5).is_err());
+        assert!(decompress(&[0x10, b'a', 2, 0, 0x00], 5).is_err());
+        // Damage anywhere never panics, whatever it decodes to.
+        for at in 0..block.len() {
+            for flip in [0x01, 0x10, 0x80, 0xff] {
+                let mut damaged = block.clone();
+                damaged[at] ^= flip;
+                let _ = decompress(&damaged, input.len());
+            }
+        }
+    }
+}
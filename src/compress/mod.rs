@@ -0,0 +1,63 @@
+//! Block compression codecs.
+//!
+//! Codecs are identified on disk by a one-byte id, so every stored block
+//! records how it was written and data written under one setting stays
+//! readable after the setting changes.
+
+mod lz4;
+
+use crate::error::{Error, Result};
+
+/// A block compression codec.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum Codec {
+    /// Blocks are stored as they are.
+    #[default]
+    None,
+    /// The LZ4 block format: fast to decode, moderate ratio.
+    Lz4,
+}
+
+impl Codec {
+    /// Stable lower-case name used in reports.
+    pub fn name(self) -> &'static str {
+        match self {
+            Codec::None => "none",
+            Codec::Lz4 => "lz4",
+        }
+    }
+
+    /// On-disk identifier.
+    pub fn id(self) -> u8 {
+        match self {
+            Codec::None => 0,
+            Codec::Lz4 => 1,
+        }
+    }
+
+    /// The codec with on-disk identifier `id`.
+    pub fn from_id(id: u8) -> Result<Self> {
+        match id {
+            0 => Ok(Codec::None),
+            1 => Ok(Codec::Lz4),
+            _ => Err(Error::Corruption(format!("unknown compression codec {id}"))),
+        }
+    }
+
+    /// Appends the compressed form of `input` to `out`.
+    pub fn compress(self, input: &[u8], out: &mut Vec<u8>) {
+        match self {
+            Codec::None => out.extend_from_slice(input),
+            Codec::Lz4 => lz4::compress(input, out),
+        }
+    }
+
+    /// Restores `len` bytes compressed by [`Codec::compress`].
+    pub fn decompress(self, input: &[u8], len: usize) -> Result<Vec<u8>> {
+        match self {
+            Codec::None if input.len() == len => Ok(input.to_vec()),
+            Codec::None => Err(Error::Corruption("stored block has the wrong size".into())),
+            Codec::Lz4 => lz4::decompress(input, len),
+        }
+    }
+}
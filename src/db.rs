@@ -0,0 +1,741 @@
+//! The top-level database handle.
+//!
+//! Opening a database recovers it: the page store is brought back to its
+//! last checkpoint, then the log is streamed from the checkpoint LSN and
+//! every complete record is applied again. Writes are logged before they
+//! reach the engine, and the log is only truncated behind a checkpoint.
+//! Other processes can read the checkpointed state through a
+//! [`Snapshot`](crate::Snapshot); within the process, a
+//! [`ReadView`](crate::ReadView) reads a consistent state while writers
+//! continue.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
+
+use crate::aio;
+use crate::column::{ColumnDef, ColumnTable, ColumnTableWriter};
+use crate::error::{Error, Result};
+use crate::exec::{ExternalSorter, GrantBroker, HashJoin, MIN_JOIN_MEMORY, MIN_SORT_MEMORY};
+use crate::index::{BTree, BTreeIter};
+use crate::lsm::{CompressionStats, FilterStats, LsmIter, LsmTree};
+use crate::memory::{Consumer, MemoryBudget};
+use crate::mvcc::{Mvcc, ReadView};
+use crate::options::{Engine, Options};
+use crate::pressure::{Cgroup, MemoryMonitor, PressureStats};
+use crate::rebalance::{Rebalance, RebalanceStats, Rebalancer};
+use crate::recovery;
+use crate::row_cache::{Probe, RowCache, RowCacheStats};
+use crate::stats::{DatabaseStats, Histogram, MemoryStats};
+use crate::storage::{BufferPool, DiskManager};
+use crate::wal::{LogRecord, Lsn, Wal, WalReader};
+
+pub(crate) const DATA_FILE: &str = "data.db";
+const TEMP_DIR: &str = "tmp";
+const COLUMNS_DIR: &str = "columns";
+/// The primary index is the first structure created in a new data file.
+pub(crate) const PRIMARY_INDEX_META_PAGE: u64 = 0;
+/// Fewest frames the B+tree engine runs with. Modified pages stay resident
+/// until the next checkpoint, which is taken once half the frames are dirty.
+const MIN_BTREE_POOL_FRAMES: usize = 32;
+
+/// Times a logged write that fails for want of frames or memory is
+/// retried, and the delay before the first retry, doubled for each next.
+const APPLY_RETRIES: u32 = 8;
+const APPLY_RETRY_DELAY: Duration = Duration::from_millis(1);
+
+/// Caches are never rebalanced below this fraction of their configured
+/// size.
+const MIN_CACHE_DIVISOR: usize = 4;
+
+/// Bytes of the caches whose memory can be moved between them, within a
+/// budget limited to `limit`: the buffer pool, the row cache and, for the
+/// LSM engine, both memtables.
+fn cache_bytes_within(options: &Options, limit: usize) -> usize {
+    let memtables = match options.engine {
+        Engine::BTree => 0,
+        Engine::Lsm => 2 * options.memtable_bytes_within(limit),
+    };
+    options.buffer_pool_bytes_within(limit) + options.row_cache_bytes_within(limit) + memtables
+}
+
+/// Bytes the buffer pool can grow to: its own share, plus the other
+/// caches' if memory is moved between them.
+fn max_pool_bytes(options: &Options) -> usize {
+    match options.cache_rebalance_interval {
+        Some(_) => cache_bytes_within(options, options.max_resident_bytes),
+        None => options.buffer_pool_bytes(),
+    }
+}
+
+/// Starts moving memory between the buffer pool, the row cache and the
+/// memtables if the options ask for it and there are at least two of them.
+fn start_rebalancer(
+    options: &Options,
+    pool: &Arc<BufferPool>,
+    row_cache: Option<&Arc<RowCache>>,
+    primary: &Primary,
+) -> Result<Option<Arc<Rebalancer>>> {
+    let Some(interval) = options.cache_rebalance_interval else {
+        return Ok(None);
+    };
+    let min_pool = (options.buffer_pool_bytes() / MIN_CACHE_DIVISOR)
+        .max(MIN_BTREE_POOL_FRAMES * crate::storage::PAGE_SIZE);
+    let mut caches: Vec<(Arc<dyn Rebalance>, usize)> = vec![(Arc::clone(pool) as _, min_pool)];
+    if let Some(row_cache) = row_cache {
+        caches.push((
+            Arc::clone(row_cache) as _,
+            options.row_cache_bytes() / MIN_CACHE_DIVISOR,
+        ));
+    }
+    if let Primary::Lsm(tree) = primary {
+        caches.push((
+            Arc::new(tree.memtable_limit()),
+            2 * options.memtable_bytes() / MIN_CACHE_DIVISOR,
+        ));
+    }
+    if caches.len() < 2 {
+        return Ok(None);
+    }
+    Rebalancer::start(caches, interval).map(Some)
+}
+
+/// Starts following the cgroup's memory limit and pressure if the options
+/// ask for it and the process has a cgroup v2 memory controller.
+fn start_monitor(
+    options: &Options,
+    budget: &Arc<MemoryBudget>,
+    pool: &Arc<BufferPool>,
+    row_cache: Option<&Arc<RowCache>>,
+    broker: &Arc<GrantBroker>,
+    primary: &Primary,
+    rebalancer: Option<&Arc<Rebalancer>>,
+) -> Result<Option<MemoryMonitor>> {
+    let Some(interval) = options.memory_monitor_interval else {
+        return Ok(None);
+    };
+    let cgroup = match &options.cgroup_dir {
+        Some(dir) => Cgroup::at(dir),
+        None => Cgroup::detect(),
+    };
+    let Some(cgroup) = cgroup else {
+        return Ok(None);
+    };
+    let options = options.clone();
+    let pool = Arc::clone(pool);
+    let row_cache = row_cache.cloned();
+    let broker = Arc::clone(broker);
+    let memtable = match primary {
+        Primary::BTree(_) => None,
+        Primary::Lsm(tree) => Some(tree.memtable_limit()),
+    };
+    let rebalancer = rebalancer.cloned();
+    let resize = move |limit: usize| {
+        if let Some(rebalancer) = &rebalancer {
+            // Scale the caches together, keeping the split learned so far.
+            rebalancer.set_total(cache_bytes_within(&options, limit));
+        } else {
+            let frames = options.buffer_pool_bytes_within(limit) / crate::storage::PAGE_SIZE;
+            pool.resize(frames.max(MIN_BTREE_POOL_FRAMES));
+            if let Some(row_cache) = &row_cache {
+                row_cache.resize(options.row_cache_bytes_within(limit));
+            }
+            if let Some(memtable) = &memtable {
+                memtable.set(options.memtable_bytes_within(limit));
+            }
+        }
+        broker.set_capacity(options.query_memory_bytes_within(limit));
+    };
+    MemoryMonitor::start(cgroup, budget, interval, resize).map(Some)
+}
+
+fn temp_dir(dir: &Path, options: &Options) -> PathBuf {
+    options
+        .temp_dir
+        .clone()
+        .unwrap_or_else(|| dir.join(TEMP_DIR))
+}
+
+#[derive(Debug)]
+enum Primary {
+    BTree(BTree),
+    Lsm(LsmTree),
+}
+
+impl Primary {
+    fn max_entry_size(&self) -> usize {
+        match self {
+            Primary::BTree(_) => crate::index::MAX_ENTRY_SIZE,
+            Primary::Lsm(_) => crate::lsm::sstable::MAX_ENTRY_SIZE,
+        }
+    }
+
+    /// Applies a logged change. `lsn` is the position of its log record.
+    fn apply(&self, record: &LogRecord, lsn: Lsn) -> Result<()> {
+        match (self, record) {
+            (Primary::BTree(tree), LogRecord::Put { key, value }) => tree.insert(key, value),
+            (Primary::BTree(tree), LogRecord::Delete { key }) => tree.remove(key).map(drop),
+            (Primary::Lsm(tree), LogRecord::Put { key, value }) => tree.put(key, value, lsn),
+            (Primary::Lsm(tree), LogRecord::Delete { key }) => tree.delete(key, lsn),
+        }
+    }
+}
+
+/// An open database rooted at a directory.
+#[derive(Debug)]
+pub struct Database {
+    dir: PathBuf,
+    options: Options,
+    budget: Arc<MemoryBudget>,
+    /// Grants working memory to sorts and joins.
+    broker: Arc<GrantBroker>,
+    /// Moves memory between the buffer pool and memtables, if enabled.
+    rebalancer: Option<Arc<Rebalancer>>,
+    /// Follows the cgroup's memory limit and pressure, if enabled.
+    monitor: Option<MemoryMonitor>,
+    pool: Arc<BufferPool>,
+    /// Decoded rows of hot keys, if enabled.
+    row_cache: Option<Arc<RowCache>>,
+    primary: Primary,
+    wal: Wal,
+    /// LSN of the last B+tree checkpoint.
+    last_checkpoint: AtomicU64,
+    /// Serialises logging and applying writes so the log order matches the
+    /// order in which changes reach the engine. Checkpoints hold it too.
+    /// Holds the error of a write that was logged but could not be applied,
+    /// after which no further write or checkpoint is accepted.
+    write_order: Mutex<Option<String>>,
+    mvcc: Mvcc,
+    commit_latency: Histogram,
+}
+
+impl Database {
+    /// Opens the database stored in `dir`, creating it if allowed by
+    /// `options`. The memory budget is fixed here for the handle's lifetime.
+    pub fn open(dir: impl AsRef<Path>, options: Options) -> Result<Self> {
+        let dir = dir.as_ref().to_path_buf();
+        if options.max_resident_bytes == 0 {
+            return Err(Error::InvalidArgument(
+                "max_resident_bytes must be non-zero".into(),
+            ));
+        }
+        if !dir.exists() {
+            if !options.create_if_missing {
+                return Err(Error::InvalidArgument(format!(
+                    "{} does not exist",
+                    dir.display()
+                )));
+            }
+            fs::create_dir_all(&dir)?;
+        }
+        if options.engine == Engine::BTree
+            && options.buffer_pool_bytes() / crate::storage::PAGE_SIZE < MIN_BTREE_POOL_FRAMES
+        {
+            return Err(Error::InvalidArgument(format!(
+                "the B+tree engine needs a buffer pool of at least {MIN_BTREE_POOL_FRAMES} pages"
+            )));
+        }
+        let budget = MemoryBudget::new(options.max_resident_bytes);
+        let disk = Arc::new(if options.direct_io {
+            DiskManager::open_direct(dir.join(DATA_FILE))?
+        } else {
+            DiskManager::open(dir.join(DATA_FILE))?
+        });
+        let page_store_lsn = match options.engine {
+            Engine::BTree => recovery::restore_page_store(&dir, &disk)?,
+            Engine::Lsm => 0,
+        };
+        let fresh = disk.num_pages() == 0;
+        let pool = BufferPool::with_max_capacity(
+            disk,
+            &budget,
+            options.buffer_pool_bytes(),
+            max_pool_bytes(&options),
+        )?;
+        let primary = match options.engine {
+            Engine::BTree if fresh => Primary::BTree(BTree::create(Arc::clone(&pool))?),
+            Engine::BTree => {
+                Primary::BTree(BTree::open(Arc::clone(&pool), PRIMARY_INDEX_META_PAGE)?)
+            }
+            Engine::Lsm => Primary::Lsm(LsmTree::open(
+                &dir,
+                Arc::clone(&pool),
+                Arc::clone(&budget),
+                options.memtable_bytes(),
+                options.compression,
+            )?),
+        };
+        let checkpoint_lsn = match &primary {
+            Primary::BTree(_) => page_store_lsn,
+            Primary::Lsm(tree) => tree.checkpoint_lsn(),
+        };
+
+        let mut reader = WalReader::open(&dir, checkpoint_lsn, &budget)?;
+        while let Some((lsn, payload)) = reader.next_record()? {
+            primary.apply(&LogRecord::decode(&payload)?, lsn)?;
+            // Replayed pages are dirty and cannot be evicted; checkpoint
+            // before they fill the pool. The log is durable up to `lsn`.
+            if matches!(primary, Primary::BTree(_)) && pool.dirty_pages() * 2 >= pool.capacity() {
+                recovery::checkpoint_pages(&dir, &pool, lsn)?;
+            }
+        }
+        let end = reader.end_lsn();
+        drop(reader);
+
+        let wal = Wal::open(&dir, end, &budget, options.wal_options())?;
+        let mvcc = Mvcc::new(
+            &budget,
+            temp_dir(&dir, &options),
+            options.version_store_bytes,
+            end,
+        )?;
+        let broker = GrantBroker::new(&budget, options.query_memory_bytes, options.grant_wait);
+        let row_cache = match options.row_cache_bytes() {
+            0 => None,
+            bytes => Some(RowCache::new(&budget, bytes)?),
+        };
+        let rebalancer = start_rebalancer(&options, &pool, row_cache.as_ref(), &primary)?;
+        let monitor = start_monitor(
+            &options,
+            &budget,
+            &pool,
+            row_cache.as_ref(),
+            &broker,
+            &primary,
+            rebalancer.as_ref(),
+        )?;
+        let db = Database {
+            dir,
+            options,
+            budget,
+            broker,
+            rebalancer,
+            monitor,
+            pool,
+            row_cache,
+            primary,
+            wal,
+            last_checkpoint: AtomicU64::new(checkpoint_lsn),
+            write_order: Mutex::new(None),
+            mvcc,
+            commit_latency: Histogram::default(),
+        };
+        db.checkpoint()?;
+        Ok(db)
+    }
+
+    /// The directory holding this database's files.
+    pub fn path(&self) -> &Path {
+        &self.dir
+    }
+
+    /// The options the database was opened with.
+    pub fn options(&self) -> &Options {
+        &self.options
+    }
+
+    /// The memory budget every component of this database reserves from.
+    pub fn budget(&self) -> &Arc<MemoryBudget> {
+        &self.budget
+    }
+
+    /// The buffer pool caching pages of the data file.
+    pub fn buffer_pool(&self) -> &Arc<BufferPool> {
+        &self.pool
+    }
+
+    /// The write-ahead log protecting changes to the primary key space.
+    pub fn wal(&self) -> &Wal {
+        &self.wal
+    }
+
+    /// Directory where operators write their spill files.
+    pub fn temp_dir(&self) -> PathBuf {
+        temp_dir(&self.dir, &self.options)
+    }
+
+    /// The broker granting working memory to sorts and joins.
+    pub fn grant_broker(&self) -> &Arc<GrantBroker> {
+        &self.broker
+    }
+
+    /// Starts an external sort with a grant of up to `sort_memory_bytes`
+    /// from the query memory pool, spilling to [`Database::temp_dir`]. May
+    /// wait up to `grant_wait` while the pool is exhausted.
+    pub fn sorter(&self) -> Result<ExternalSorter> {
+        let grant = self.broker.acquire(
+            Consumer::Sort,
+            MIN_SORT_MEMORY,
+            self.options.sort_memory_bytes,
+        )?;
+        ExternalSorter::with_grant(grant, self.temp_dir())
+    }
+
+    /// Starts a hybrid hash join with a grant of up to `join_memory_bytes`
+    /// from the query memory pool, spilling to [`Database::temp_dir`]. May
+    /// wait up to `grant_wait` while the pool is exhausted.
+    pub fn hash_join(&self) -> Result<HashJoin> {
+        let grant = self.broker.acquire(
+            Consumer::HashJoin,
+            MIN_JOIN_MEMORY,
+            self.options.join_memory_bytes,
+        )?;
+        HashJoin::with_grant(grant, self.temp_dir())
+    }
+
+    /// Starts writing a column table called `name`, replacing any table of
+    /// that name once [`ColumnTableWriter::finish`] is called.
+    pub fn create_column_table(
+        &self,
+        name: &str,
+        columns: Vec<ColumnDef>,
+    ) -> Result<ColumnTableWriter> {
+        let path = self.column_table_path(name)?;
+        fs::create_dir_all(self.dir.join(COLUMNS_DIR))?;
+        ColumnTableWriter::create(path, columns, &self.temp_dir(), &self.budget)
+    }
+
+    /// Opens the column table called `name`, read through the buffer pool.
+    pub fn open_column_table(&self, name: &str) -> Result<ColumnTable> {
+        ColumnTable::open(self.column_table_path(name)?, &self.pool, &self.budget)
+    }
+
+    fn column_table_path(&self, name: &str) -> Result<PathBuf> {
+        let valid = |c: char| c.is_ascii_alphanumeric() || c == '_' || c == '-';
+        if name.is_empty() || !name.chars().all(valid) {
+            return Err(Error::InvalidArgument(format!(
+                "column table name {name:?} must be letters, digits, '_' or '-'"
+            )));
+        }
+        Ok(self.dir.join(COLUMNS_DIR).join(format!("{name}.col")))
+    }
+
+    /// Compression ratio and block decode cost of the primary key space,
+    /// the one table whose codec [`Options::compression`] selects. All zero
+    /// for the B+tree engine, whose pages are not compressed.
+    pub fn compression_stats(&self) -> CompressionStats {
+        match &self.primary {
+            Primary::BTree(_) => CompressionStats::default(),
+            Primary::Lsm(tree) => tree.compression_stats(),
+        }
+    }
+
+    /// Size of the run filters of the primary key space and the lookups
+    /// they answered. All zero for the B+tree engine.
+    pub fn filter_stats(&self) -> FilterStats {
+        match &self.primary {
+            Primary::BTree(_) => FilterStats::default(),
+            Primary::Lsm(tree) => tree.filter_stats(),
+        }
+    }
+
+    /// Memory use by consumer, cache behaviour, log activity and latency
+    /// histograms. Its `Display` form is a flat text dump for scraping.
+    pub fn stats(&self) -> DatabaseStats {
+        DatabaseStats {
+            memory: MemoryStats::of(&self.budget),
+            buffer_pool: self.pool.stats(),
+            row_cache: self
+                .row_cache
+                .as_ref()
+                .map_or_else(RowCacheStats::default, |cache| cache.stats()),
+            dirty_pages: self.pool.dirty_pages(),
+            wal: self.wal.stats(),
+            compression: self.compression_stats(),
+            filters: self.filter_stats(),
+            page_read_latency: self.pool.read_latency(),
+            fsync_latency: self.wal.fsync_latency(),
+            commit_latency: self.commit_latency.snapshot(),
+            version_store: self.mvcc.store().stats(),
+            grants: self.broker.stats(),
+            pressure: self
+                .monitor
+                .as_ref()
+                .map_or_else(PressureStats::default, MemoryMonitor::stats),
+            rebalance: self
+                .rebalancer
+                .as_ref()
+                .map_or_else(RebalanceStats::default, |r| r.stats()),
+            io_backend: aio::shared().backend(),
+            io: aio::shared().stats(),
+        }
+    }
+
+    /// Returns the value stored under `key`.
+    pub fn get(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        let Some(row_cache) = &self.row_cache else {
+            return self.get_uncached(key);
+        };
+        let ticket = match row_cache.probe(key) {
+            Probe::Hit(value) => return Ok(Some(value)),
+            Probe::Miss(ticket) => ticket,
+        };
+        let value = self.get_uncached(key)?;
+        if let Some(value) = &value {
+            row_cache.fill(ticket, key, value);
+        }
+        Ok(value)
+    }
+
+    /// Reads `key` from the engine, bypassing the row cache.
+    fn get_uncached(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        match &self.primary {
+            Primary::BTree(tree) => tree.get(key),
+            Primary::Lsm(tree) => tree.get(key),
+        }
+    }
+
+    /// Drops any cached row under `key` after a write to it was applied.
+    /// Called before the write is published to new read views.
+    fn invalidate_row(&self, key: &[u8]) {
+        if let Some(row_cache) = &self.row_cache {
+            row_cache.invalidate(key);
+        }
+    }
+
+    /// Stores `value` under `key`, replacing any previous value. Returns
+    /// once the change is durable in the write-ahead log.
+    pub fn put(&self, key: &[u8], value: &[u8]) -> Result<()> {
+        // Reject what the engine would refuse before it reaches the log.
+        let max = self.primary.max_entry_size();
+        if key.len() + value.len() > max {
+            return Err(Error::InvalidArgument(format!(
+                "entry of {} bytes exceeds the {max} byte limit",
+                key.len() + value.len()
+            )));
+        }
+        self.write(key, Some(value))
+    }
+
+    /// Removes `key` if present. Returns once the change is durable in the
+    /// write-ahead log.
+    pub fn delete(&self, key: &[u8]) -> Result<()> {
+        let max = self.primary.max_entry_size();
+        if key.len() > max {
+            return Err(Error::InvalidArgument(format!(
+                "key of {} bytes exceeds the {max} byte limit",
+                key.len()
+            )));
+        }
+        self.write(key, None)
+    }
+
+    /// Logs and applies a put of `value`, or a delete for `None`.
+    ///
+    /// What applying it needs is taken before it is logged: a checkpoint if
+    /// dirty pages crowd the pool, room in the memtable and memory for the
+    /// version open read views need. Once logged, a write that still fails
+    /// for want of frames or memory other threads hold is retried.
+    fn write(&self, key: &[u8], value: Option<&[u8]>) -> Result<()> {
+        let started = Instant::now();
+        let lsn = {
+            let mut order = self.lock_writes()?;
+            self.maybe_checkpoint()?;
+            if let Primary::Lsm(tree) = &self.primary {
+                tree.reserve(key, value)?;
+            }
+            let record = match value {
+                Some(value) => LogRecord::encode_put(key, value),
+                None => LogRecord::encode_delete(key),
+            };
+            self.mvcc.write(
+                key,
+                || self.get_uncached(key),
+                || self.wal.append(&record),
+                |lsn| {
+                    let applied = Self::retry_transient(|| {
+                        match (&self.primary, value) {
+                            (Primary::BTree(tree), Some(value)) => tree.insert(key, value),
+                            (Primary::BTree(tree), None) => tree.remove(key).map(drop),
+                            (Primary::Lsm(tree), Some(value)) => tree.put(key, value, lsn),
+                            (Primary::Lsm(tree), None) => tree.delete(key, lsn),
+                        }?;
+                        self.invalidate_row(key);
+                        Ok(())
+                    });
+                    Self::check_applied(&mut order, applied)
+                },
+            )?
+        };
+        // Wait outside the ordering lock so concurrent writers share syncs.
+        self.wal.wait_durable(lsn)?;
+        self.commit_latency.record_since(started);
+        Ok(())
+    }
+
+    /// Runs `apply` again, backing off, while it fails for want of buffer
+    /// pool frames or memory, which readers and other consumers hold only
+    /// for a while.
+    fn retry_transient(mut apply: impl FnMut() -> Result<()>) -> Result<()> {
+        let mut delay = APPLY_RETRY_DELAY;
+        let mut result = apply();
+        for _ in 0..APPLY_RETRIES {
+            if !matches!(
+                result,
+                Err(Error::BufferPoolExhausted | Error::MemoryExhausted { .. })
+            ) {
+                break;
+            }
+            std::thread::sleep(delay);
+            delay *= 2;
+            result = apply();
+        }
+        result
+    }
+
+    /// Persists the primary key space up to the current end of the log and
+    /// deletes log segments that are no longer needed for recovery.
+    ///
+    /// The B+tree writes its dirty pages atomically; the LSM tree is already
+    /// durable up to its last memtable flush, so only the log is trimmed.
+    pub fn checkpoint(&self) -> Result<()> {
+        let _order = self.lock_writes()?;
+        self.checkpoint_locked()
+    }
+
+    /// Takes `write_order`, unless an earlier write was logged but not
+    /// applied.
+    fn lock_writes(&self) -> Result<MutexGuard<'_, Option<String>>> {
+        let order = self.write_order.lock().unwrap();
+        match &*order {
+            Some(err) => Err(Error::Background(err.clone())),
+            None => Ok(order),
+        }
+    }
+
+    /// Passes on `applied`, the outcome of applying a logged write, keeping
+    /// a failure in `order`. Memory and frames are taken before logging and
+    /// retried after, so this is an engine fault such as a failed read or
+    /// write of a page or run. The engine is then behind the log: a later
+    /// write would be logged after a record it never saw, and a checkpoint
+    /// could truncate that record, so both are refused. The record is
+    /// replayed when the database is next opened.
+    fn check_applied(order: &mut Option<String>, applied: Result<()>) -> Result<()> {
+        if let Err(err) = &applied {
+            *order = Some(format!("a logged write could not be applied: {err}"));
+        }
+        applied
+    }
+
+    fn checkpoint_locked(&self) -> Result<()> {
+        let lsn = match &self.primary {
+            Primary::BTree(_) => {
+                // Pages may only reach the data file after their log records.
+                let lsn = self.wal.sync()?;
+                recovery::checkpoint_pages(&self.dir, &self.pool, lsn)?;
+                self.last_checkpoint.store(lsn, Ordering::Relaxed);
+                lsn
+            }
+            Primary::Lsm(tree) => tree.checkpoint_lsn(),
+        };
+        self.wal.truncate_before(lsn)
+    }
+
+    /// Checkpoints when dirty pages crowd the pool or the log has grown too
+    /// far past the last checkpoint. Called with `write_order` held.
+    fn maybe_checkpoint(&self) -> Result<()> {
+        let due = match &self.primary {
+            Primary::BTree(_) => {
+                let since = self.wal.end_lsn() - self.last_checkpoint.load(Ordering::Relaxed);
+                self.pool.dirty_pages() * 2 >= self.pool.capacity()
+                    || since >= self.options.checkpoint_wal_bytes
+            }
+            Primary::Lsm(_) => self.wal.segment_count() > 1,
+        };
+        if due {
+            self.checkpoint_locked()?;
+        }
+        Ok(())
+    }
+
+    /// Opens a view of the database as of the last applied write. Reads
+    /// through it ignore later writes, and neither side blocks the other.
+    pub fn read_view(&self) -> ReadView<'_> {
+        ReadView::new(self, &self.mvcc)
+    }
+
+    /// Iterates over entries with keys at or above `start`, in key order.
+    pub fn scan_from(&self, start: &[u8]) -> Result<ScanIter<'_>> {
+        match &self.primary {
+            Primary::BTree(tree) => tree
+                .scan_from(start)
+                .map(|iter| ScanIter::BTree(Box::new(iter))),
+            Primary::Lsm(tree) => tree.scan_from(start).map(ScanIter::Lsm),
+        }
+    }
+}
+
+impl Drop for Database {
+    fn drop(&mut self) {
+        self.monitor = None;
+        self.rebalancer = None;
+        let _ = self.checkpoint();
+    }
+}
+
+/// Iterator returned by [`Database::scan_from`].
+pub enum ScanIter<'a> {
+    BTree(Box<BTreeIter<'a>>),
+    Lsm(LsmIter),
+}
+
+impl Iterator for ScanIter<'_> {
+    type Item = Result<(Vec<u8>, Vec<u8>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match self {
+            ScanIter::BTree(iter) => iter.next(),
+            ScanIter::Lsm(iter) => iter.next(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn options(engine: Engine) -> Options {
+        Options {
+            engine,
+            memory_monitor_interval: None,
+            cache_rebalance_interval: None,
+            ..Options::default()
+        }
+    }
+
+    #[test]
+    fn writes_refused_for_memory_are_not_logged() {
+        for engine in [Engine::BTree, Engine::Lsm] {
+            let dir = TempDir::new("db-refused");
+            {
+                let db = Database::open(dir.path(), options(engine)).unwrap();
+                db.put(b"kept", b"before").unwrap();
+                let view = db.read_view();
+                // With the budget held elsewhere, a version for the view
+                // cannot be kept, and the write is refused before the log.
+                let held = db
+                    .budget()
+                    .try_reserve(Consumer::Sort, db.budget().available())
+                    .unwrap();
+                let err = db.put(b"refused", b"value").unwrap_err();
+                assert!(
+                    matches!(err, Error::MemoryExhausted { .. }),
+                    "{engine:?}: {err}"
+                );
+                drop(held);
+
+                db.put(b"kept", b"after").unwrap();
+                assert_eq!(view.get(b"kept").unwrap().as_deref(), Some(&b"before"[..]));
+                assert_eq!(db.get(b"refused").unwrap(), None);
+                drop(view);
+                std::mem::forget(db);
+            }
+            let db = Database::open(dir.path(), options(engine)).unwrap();
+            assert_eq!(db.get(b"kept").unwrap().as_deref(), Some(&b"after"[..]));
+            assert_eq!(db.get(b"refused").unwrap(), None, "{engine:?}");
+        }
+    }
+}
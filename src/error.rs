@@ -0,0 +1,60 @@
+//! Error type shared by every subsystem.
+
+use std::fmt;
+use std::io;
+
+/// Result alias used throughout the crate.
+pub type Result<T> = std::result::Result<T, Error>;
+
+/// Errors surfaced by the database.
+#[derive(Debug)]
+pub enum Error {
+    /// An underlying file-system operation failed.
+    Io(io::Error),
+    /// A memory reservation would exceed the configured budget. Callers are
+    /// expected to spill, shrink, or retry later rather than allocate anyway.
+    MemoryExhausted { requested: usize, available: usize },
+    /// Every buffer-pool frame is pinned, so no page can be brought in.
+    BufferPoolExhausted,
+    /// A log write, flush or compaction failed; the engine refuses further
+    /// writes until reopened.
+    Background(String),
+    /// On-disk data failed a structural check.
+    Corruption(String),
+    /// The caller supplied an argument that can never succeed.
+    InvalidArgument(String),
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::Io(err) => write!(f, "I/O error: {err}"),
+            Error::MemoryExhausted {
+                requested,
+                available,
+            } => write!(
+                f,
+                "memory budget exhausted: requested {requested} bytes, {available} available"
+            ),
+            Error::BufferPoolExhausted => write!(f, "all buffer pool frames are pinned"),
+            Error::Background(msg) => write!(f, "background work failed: {msg}"),
+            Error::Corruption(msg) => write!(f, "corruption: {msg}"),
+            Error::InvalidArgument(msg) => write!(f, "invalid argument: {msg}"),
+        }
+    }
+}
+
+impl std::error::Error for Error {
+    fn source(&self) -> Option<&(dyn std::error::Error + 'static)> {
+        match self {
+            Error::Io(err) => Some(err),
+            _ => None,
+        }
+    }
+}
+
+impl From<io::Error> for Error {
+    fn from(err: io::Error) -> Self {
+        Error::Io(err)
+    }
+}
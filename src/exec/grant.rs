@@ -0,0 +1,416 @@
+//! Admission control and adaptive memory grants for query operators.
+//!
+//! Sorts and hash joins take their working memory from a shared pool
+//! through a [`GrantBroker`]. A new operator is offered a fair share of the
+//! pool, `pool / (running + 1)` clamped to what it asks for. If that much
+//! is free it is admitted at once. Otherwise the broker lowers the targets
+//! of the running grants to the new fair share, and the operator queues,
+//! first come first served, for up to the configured wait. Running
+//! operators check their target at points where they can spill, and shrink
+//! by spilling. An operator still queued when the wait runs out is admitted
+//! with whatever is free, or with its minimum if less is free, since its
+//! memory is still bounded by the budget and spilling beats failing.
+//!
+//! Under a burst, new queries wait briefly for memory to come back instead
+//! of all starting at once with grants too small to avoid spilling.
+//! Granted memory is still reserved from the [`MemoryBudget`], so the
+//! pool is a cap on query memory, not a separate allowance.
+
+use std::collections::{HashMap, VecDeque};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+use crate::error::{Error, Result};
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+
+/// Counters describing a [`GrantBroker`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct GrantStats {
+    /// Grants currently held.
+    pub active: u64,
+    /// Operators queued for a grant.
+    pub waiting: u64,
+    /// Bytes currently granted.
+    pub granted_bytes: u64,
+    /// Grants handed out since the broker was created.
+    pub admitted: u64,
+    /// Of those, grants that had to queue first.
+    pub queued: u64,
+    /// Grants admitted below their fair share after the wait ran out.
+    pub timeouts: u64,
+    /// Of those, grants of an operator's minimum that took the pool past
+    /// its capacity.
+    pub overcommits: u64,
+    /// Times running grants were asked to shrink.
+    pub shrink_requests: u64,
+    /// Total time spent queued.
+    pub wait_nanos: u64,
+}
+
+#[derive(Debug)]
+struct Share {
+    size: usize,
+    /// Smallest size the operator can run in.
+    min: usize,
+    /// The size the broker wants the grant at; shared with the grant.
+    target: Arc<AtomicUsize>,
+}
+
+#[derive(Debug, Default)]
+struct State {
+    capacity: usize,
+    granted: usize,
+    shares: HashMap<u64, Share>,
+    queue: VecDeque<u64>,
+    next_id: u64,
+    stats: GrantStats,
+}
+
+impl State {
+    /// Lowers the target of every grant above `share`, or above its
+    /// minimum if that is larger.
+    fn ask_to_shrink(&mut self, share: usize) {
+        let mut asked = false;
+        for grant in self.shares.values() {
+            let target = share.max(grant.min).min(grant.size);
+            if grant.target.load(Ordering::Relaxed) > target {
+                grant.target.store(target, Ordering::Relaxed);
+                asked = true;
+            }
+        }
+        if asked {
+            self.stats.shrink_requests += 1;
+        }
+    }
+}
+
+/// Hands out memory grants from a fixed pool, queueing operators when it
+/// is exhausted and asking running ones to shrink.
+#[derive(Debug)]
+pub struct GrantBroker {
+    budget: Arc<MemoryBudget>,
+    wait: Duration,
+    state: Mutex<State>,
+    changed: Condvar,
+}
+
+impl GrantBroker {
+    /// Creates a broker granting at most `capacity` bytes at a time from
+    /// `budget`, queueing operators for at most `wait`.
+    pub fn new(budget: &Arc<MemoryBudget>, capacity: usize, wait: Duration) -> Arc<Self> {
+        Arc::new(GrantBroker {
+            budget: Arc::clone(budget),
+            wait,
+            state: Mutex::new(State {
+                capacity,
+                ..State::default()
+            }),
+            changed: Condvar::new(),
+        })
+    }
+
+    /// Bytes the broker can grant at a time.
+    pub fn capacity(&self) -> usize {
+        self.state.lock().unwrap().capacity
+    }
+
+    /// Changes the pool to `bytes`. If more than that is granted, running
+    /// grants are asked to shrink to an even share of the new pool.
+    pub fn set_capacity(&self, bytes: usize) {
+        let mut state = self.state.lock().unwrap();
+        state.capacity = bytes;
+        if state.granted > bytes {
+            let share = bytes / state.shares.len();
+            state.ask_to_shrink(share);
+        }
+        self.changed.notify_all();
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> GrantStats {
+        let state = self.state.lock().unwrap();
+        GrantStats {
+            active: state.shares.len() as u64,
+            waiting: state.queue.len() as u64,
+            granted_bytes: state.granted as u64,
+            ..state.stats
+        }
+    }
+
+    /// Admits an operator charged to `consumer` that needs at least `min`
+    /// and at most `max` bytes, queueing while the pool is exhausted.
+    pub fn acquire(self: &Arc<Self>, consumer: Consumer, min: usize, max: usize) -> Result<Grant> {
+        let mut state = self.state.lock().unwrap();
+        if min > state.capacity {
+            return Err(Error::InvalidArgument(format!(
+                "an operator needing {min} bytes does not fit the {} byte query memory pool",
+                state.capacity
+            )));
+        }
+        let max = max.max(min);
+        let started = Instant::now();
+        let deadline = started + self.wait;
+        let id = state.next_id;
+        state.next_id += 1;
+        state.queue.push_back(id);
+        let mut waited = false;
+        let bytes = loop {
+            let free = state.capacity.saturating_sub(state.granted);
+            let share = (state.capacity / (state.shares.len() + 1)).clamp(min, max);
+            if state.queue.front() == Some(&id) && free >= share {
+                break share;
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                state.stats.timeouts += 1;
+                if free < min {
+                    state.stats.overcommits += 1;
+                }
+                break free.clamp(min, max);
+            }
+            // Ask running grants to make room for the new fair share.
+            state.ask_to_shrink(share);
+            waited = true;
+            state = self.changed.wait_timeout(state, deadline - now).unwrap().0;
+        };
+        state.queue.retain(|&queued| queued != id);
+        let reservation = match self.budget.try_reserve(consumer, bytes) {
+            Ok(reservation) => reservation,
+            Err(err) => {
+                self.changed.notify_all();
+                return Err(err);
+            }
+        };
+        let target = Arc::new(AtomicUsize::new(bytes));
+        state.granted += bytes;
+        state.shares.insert(
+            id,
+            Share {
+                size: bytes,
+                min,
+                target: Arc::clone(&target),
+            },
+        );
+        state.stats.admitted += 1;
+        if waited {
+            state.stats.queued += 1;
+            state.stats.wait_nanos += started.elapsed().as_nanos() as u64;
+        }
+        // The next operator in line may fit too.
+        self.changed.notify_all();
+        Ok(Grant {
+            broker: Some((Arc::clone(self), id)),
+            size: bytes,
+            target,
+            reservation,
+        })
+    }
+
+    fn resized(&self, id: u64, size: usize) {
+        let mut state = self.state.lock().unwrap();
+        let share = state.shares.get_mut(&id).unwrap();
+        let freed = share.size - size;
+        share.size = size;
+        state.granted -= freed;
+        self.changed.notify_all();
+    }
+
+    fn released(&self, id: u64) {
+        let mut state = self.state.lock().unwrap();
+        let share = state.shares.remove(&id).unwrap();
+        state.granted -= share.size;
+        if state.queue.is_empty() && state.granted <= state.capacity {
+            // Nobody is waiting: let the others keep what they hold.
+            for share in state.shares.values() {
+                share.target.store(share.size, Ordering::Relaxed);
+            }
+        }
+        self.changed.notify_all();
+    }
+}
+
+/// Working memory granted to one operator, returned when dropped. The
+/// operator is expected to check [`Grant::target`] where it can spill and
+/// shrink to it.
+#[derive(Debug)]
+pub struct Grant {
+    broker: Option<(Arc<GrantBroker>, u64)>,
+    size: usize,
+    target: Arc<AtomicUsize>,
+    /// The granted bytes not currently lent out by [`Grant::split`].
+    reservation: Reservation,
+}
+
+impl Grant {
+    /// A grant of `bytes` reserved straight from `budget`, outside any
+    /// broker; it is never asked to shrink.
+    pub fn fixed(budget: &Arc<MemoryBudget>, consumer: Consumer, bytes: usize) -> Result<Grant> {
+        Ok(Grant {
+            broker: None,
+            size: bytes,
+            target: Arc::new(AtomicUsize::new(bytes)),
+            reservation: budget.try_reserve(consumer, bytes)?,
+        })
+    }
+
+    /// Bytes granted.
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    /// The size the broker wants the grant shrunk to; equal to
+    /// [`Grant::size`] unless other operators are waiting.
+    pub fn target(&self) -> usize {
+        self.target.load(Ordering::Relaxed).min(self.size)
+    }
+
+    /// Lends `bytes` of the grant out as a separate reservation, to be
+    /// given back with [`Grant::merge`].
+    pub fn split(&mut self, bytes: usize) -> Reservation {
+        self.reservation.split(bytes)
+    }
+
+    /// Takes back a reservation lent out by [`Grant::split`].
+    pub fn merge(&mut self, reservation: Reservation) {
+        self.reservation.merge(reservation);
+    }
+
+    /// Shrinks the grant to `bytes`, returning the rest to the budget and
+    /// the broker. Every reservation lent out must have been merged back.
+    pub fn shrink_to(&mut self, bytes: usize) {
+        debug_assert_eq!(self.reservation.size(), self.size);
+        if bytes >= self.size {
+            return;
+        }
+        self.reservation.shrink(self.size - bytes);
+        self.size = bytes;
+        if let Some((broker, id)) = &self.broker {
+            broker.resized(*id, bytes);
+        }
+    }
+}
+
+impl Drop for Grant {
+    fn drop(&mut self) {
+        // Give the memory back to the budget before waking waiters.
+        let held = self.reservation.size();
+        self.reservation.shrink(held);
+        if let Some((broker, id)) = &self.broker {
+            broker.released(*id);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::mpsc;
+    use std::thread;
+
+    use super::*;
+
+    const MIB: usize = 1 << 20;
+
+    fn broker(wait: Duration) -> (Arc<MemoryBudget>, Arc<GrantBroker>) {
+        let budget = MemoryBudget::new(64 * MIB);
+        let broker = GrantBroker::new(&budget, MIB, wait);
+        (budget, broker)
+    }
+
+    fn wait_until(what: &str, mut done: impl FnMut() -> bool) {
+        let deadline = Instant::now() + Duration::from_secs(10);
+        while !done() {
+            assert!(Instant::now() < deadline, "timed out waiting until {what}");
+            thread::sleep(Duration::from_millis(1));
+        }
+    }
+
+    #[test]
+    fn running_grants_shrink_for_a_newcomer() {
+        let (budget, broker) = broker(Duration::from_secs(10));
+        let mut first = broker.acquire(Consumer::Sort, MIB / 8, MIB).unwrap();
+        assert_eq!(first.size(), MIB);
+        thread::scope(|s| {
+            let second = s.spawn(|| broker.acquire(Consumer::HashJoin, MIB / 8, MIB).unwrap());
+            // The newcomer's fair share is half the pool.
+            wait_until("the first grant is asked to shrink", || {
+                first.target() == MIB / 2
+            });
+            assert_eq!(broker.stats().waiting, 1);
+            first.shrink_to(first.target());
+            let second = second.join().unwrap();
+            assert_eq!(second.size(), MIB / 2);
+            assert_eq!(budget.used(), MIB);
+        });
+        let stats = broker.stats();
+        assert_eq!((stats.admitted, stats.queued, stats.timeouts), (2, 1, 0));
+        assert!(stats.shrink_requests >= 1);
+        drop(first);
+        assert_eq!(broker.stats().active, 0);
+        assert_eq!(broker.stats().granted_bytes, 0);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn queued_operators_are_admitted_in_order() {
+        let (budget, broker) = broker(Duration::from_secs(10));
+        let mut holder = broker.acquire(Consumer::Sort, MIB, MIB).unwrap();
+        let (admitted, order) = mpsc::channel();
+        thread::scope(|s| {
+            let large = s.spawn(|| {
+                let grant = broker.acquire(Consumer::Sort, MIB, MIB).unwrap();
+                admitted.send("large").unwrap();
+                grant
+            });
+            wait_until("the large operator queues", || broker.stats().waiting == 1);
+            let small = s.spawn(|| {
+                let grant = broker.acquire(Consumer::Sort, MIB / 4, MIB / 4).unwrap();
+                admitted.send("small").unwrap();
+                grant
+            });
+            wait_until("the small operator queues", || broker.stats().waiting == 2);
+
+            // Room for the small operator alone does not let it jump the
+            // queue.
+            holder.shrink_to(MIB * 3 / 4);
+            thread::sleep(Duration::from_millis(50));
+            assert_eq!(broker.stats().waiting, 2);
+            drop(holder);
+            let large = large.join().unwrap();
+            assert_eq!(order.recv().unwrap(), "large");
+            assert_eq!(broker.stats().waiting, 1);
+            drop(large);
+            let small = small.join().unwrap();
+            assert_eq!(order.recv().unwrap(), "small");
+            assert_eq!(small.size(), MIB / 4);
+        });
+        let stats = broker.stats();
+        assert_eq!((stats.admitted, stats.queued), (3, 2));
+        assert_eq!((stats.active, stats.granted_bytes), (0, 0));
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn a_wait_that_runs_out_admits_the_minimum() {
+        let wait = Duration::from_millis(50);
+        let (budget, broker) = broker(wait);
+        let holder = broker.acquire(Consumer::Sort, MIB, MIB).unwrap();
+        let started = Instant::now();
+        let late = broker
+            .acquire(Consumer::HashJoin, MIB / 8, MIB / 2)
+            .unwrap();
+        assert!(started.elapsed() >= wait);
+        // Nothing was free, so it runs in its minimum beyond the pool.
+        assert_eq!(late.size(), MIB / 8);
+        let stats = broker.stats();
+        assert_eq!((stats.timeouts, stats.overcommits), (1, 1));
+        assert_eq!(stats.granted_bytes, (MIB + MIB / 8) as u64);
+        drop((holder, late));
+        assert_eq!(budget.used(), 0);
+
+        assert!(matches!(
+            broker.acquire(Consumer::Sort, 2 * MIB, 2 * MIB),
+            Err(Error::InvalidArgument(_))
+        ));
+    }
+}
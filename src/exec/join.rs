@@ -0,0 +1,582 @@
+//! Hybrid hash join.
+//!
+//! Build rows are hashed into a fixed number of partitions, each held in
+//! an in-memory hash table. When the tables outgrow the memory grant, the
+//! largest resident partition is written to a run file and later build rows
+//! for it follow straight to disk. Probe rows that hash to a resident
+//! partition are joined immediately; those for a spilled partition are
+//! first checked against a Bloom filter of every spilled build key, and
+//! only possible matches are written to the partition's probe run.
+//!
+//! Once the probe input ends, spilled partitions are joined pairwise. A
+//! build partition that still does not fit the grant is split again with a
+//! different hash seed; when splitting stops helping (a single heavily
+//! repeated key), its build side is loaded one grant-sized chunk at a time
+//! and the probe run is scanned once per chunk. The join therefore always
+//! completes within its grant, only slower as memory gets tighter.
+//!
+//! If the grant's broker asks it to shrink, the join gives the memory back
+//! at the next build row, spilling partitions until the rest fits, or
+//! before it loads the next spilled partition pair.
+//!
+//! This is an inner equi-join on the entry key. Each output row carries the
+//! key, the build value and the probe value.
+
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use crate::bloom::BloomFilter;
+use crate::error::{Error, Result};
+use crate::exec::grant::Grant;
+use crate::exec::run::{Entry, Run, RunWriter};
+use crate::hash::hash64;
+use crate::memory::{Consumer, MemoryBudget};
+
+/// Output buffer of each spilled partition.
+const PARTITION_BLOCK_BYTES: usize = 32 << 10;
+/// Read buffer for run files.
+const READ_BLOCK_BYTES: usize = 64 << 10;
+const MAX_FANOUT: usize = 32;
+/// Smallest grant accepted.
+pub const MIN_JOIN_MEMORY: usize = 8 * PARTITION_BLOCK_BYTES;
+/// Repartitioning deeper than this falls back to chunked nested loops.
+const MAX_DEPTH: u32 = 6;
+/// Estimated in-memory cost of a hash-table row beyond its key and value.
+const ROW_OVERHEAD: usize = 64;
+/// Share of the grant given to the Bloom filter once a partition spills.
+const BLOOM_FRACTION: usize = 16;
+const BLOOM_PROBES: u32 = 6;
+
+/// A joined row: the key, the build-side value and the probe-side value.
+pub type JoinRow = (Vec<u8>, Vec<u8>, Vec<u8>);
+
+/// Counters describing one join.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct JoinStats {
+    pub build_rows: u64,
+    pub probe_rows: u64,
+    /// Build partitions written to disk during the build phase.
+    pub spilled_partitions: u64,
+    /// Partitions split again because their build side did not fit.
+    pub repartitions: u64,
+    /// Build chunks joined by nested loops after repartitioning gave up.
+    pub nested_loop_chunks: u64,
+    /// Probe rows for spilled partitions discarded by the Bloom filter.
+    pub bloom_filtered: u64,
+    /// Total bytes written to run files.
+    pub spilled_bytes: u64,
+}
+
+fn row_cost(key: &[u8], value: &[u8]) -> usize {
+    key.len() + value.len() + ROW_OVERHEAD
+}
+
+#[derive(Debug, Default)]
+struct Table {
+    rows: HashMap<Vec<u8>, Vec<Vec<u8>>>,
+    bytes: usize,
+}
+
+impl Table {
+    fn insert(&mut self, key: Vec<u8>, value: Vec<u8>) {
+        self.bytes += row_cost(&key, &value);
+        self.rows.entry(key).or_default().push(value);
+    }
+}
+
+#[derive(Debug)]
+enum Partition {
+    Resident(Table),
+    Spilled(RunWriter),
+}
+
+/// The build side of a hybrid hash join.
+#[derive(Debug)]
+pub struct HashJoin {
+    temp_dir: PathBuf,
+    grant: Grant,
+    fanout: usize,
+    partitions: Vec<Partition>,
+    resident_bytes: usize,
+    bloom: Option<BloomFilter>,
+    stats: JoinStats,
+}
+
+impl HashJoin {
+    /// Creates a join that reserves `memory_bytes` from `budget` for its
+    /// whole life and spills to files in `temp_dir`.
+    pub fn new(
+        budget: &Arc<MemoryBudget>,
+        temp_dir: impl AsRef<Path>,
+        memory_bytes: usize,
+    ) -> Result<Self> {
+        if memory_bytes < MIN_JOIN_MEMORY {
+            return Err(Error::InvalidArgument(format!(
+                "a hash join needs at least {MIN_JOIN_MEMORY} bytes of memory"
+            )));
+        }
+        let grant = Grant::fixed(budget, Consumer::HashJoin, memory_bytes)?;
+        Self::with_grant(grant, temp_dir)
+    }
+
+    /// Creates a join working in `grant`, shrinking with it, and spilling
+    /// to files in `temp_dir`.
+    pub fn with_grant(grant: Grant, temp_dir: impl AsRef<Path>) -> Result<Self> {
+        if grant.size() < MIN_JOIN_MEMORY {
+            return Err(Error::InvalidArgument(format!(
+                "a hash join needs at least {MIN_JOIN_MEMORY} bytes of memory"
+            )));
+        }
+        // Spilled partitions' buffers may take at most half the grant.
+        let fanout = (grant.size() / 2 / PARTITION_BLOCK_BYTES).clamp(2, MAX_FANOUT);
+        Ok(HashJoin {
+            temp_dir: temp_dir.as_ref().to_path_buf(),
+            grant,
+            fanout,
+            partitions: (0..fanout)
+                .map(|_| Partition::Resident(Table::default()))
+                .collect(),
+            resident_bytes: 0,
+            bloom: None,
+            stats: JoinStats::default(),
+        })
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> JoinStats {
+        self.stats
+    }
+
+    /// Bytes of the grant left for resident hash tables.
+    fn table_capacity(&self) -> usize {
+        let spilled = self
+            .partitions
+            .iter()
+            .filter(|p| matches!(p, Partition::Spilled(_)))
+            .count();
+        let bloom = self.bloom.as_ref().map_or(0, BloomFilter::memory_bytes);
+        self.grant
+            .size()
+            .saturating_sub(bloom + spilled * PARTITION_BLOCK_BYTES)
+    }
+
+    /// Adds a build-side row.
+    pub fn push_build(&mut self, key: Vec<u8>, value: Vec<u8>) -> Result<()> {
+        // The fanout was chosen for the initial grant; keep enough for the
+        // buffers and the Bloom filter of every partition spilling.
+        let bloom = self.bloom.as_ref().map_or(
+            self.grant.size() / BLOOM_FRACTION,
+            BloomFilter::memory_bytes,
+        );
+        let floor = MIN_JOIN_MEMORY.max(self.fanout * PARTITION_BLOCK_BYTES + bloom);
+        self.grant.shrink_to(self.grant.target().max(floor));
+        self.stats.build_rows += 1;
+        let index = partition_of(&key, 0, self.fanout);
+        match &mut self.partitions[index] {
+            Partition::Spilled(writer) => {
+                writer.push(&key, &value)?;
+                self.bloom.as_mut().unwrap().insert(&key);
+                return Ok(());
+            }
+            Partition::Resident(table) => {
+                self.resident_bytes += row_cost(&key, &value);
+                table.insert(key, value);
+            }
+        }
+        while self.resident_bytes > self.table_capacity() {
+            self.spill_largest()?;
+        }
+        Ok(())
+    }
+
+    fn spill_largest(&mut self) -> Result<()> {
+        let Some(index) = (0..self.fanout)
+            .filter(|&i| matches!(&self.partitions[i], Partition::Resident(t) if t.bytes > 0))
+            .max_by_key(|&i| match &self.partitions[i] {
+                Partition::Resident(table) => table.bytes,
+                Partition::Spilled(_) => 0,
+            })
+        else {
+            return Err(Error::InvalidArgument(
+                "the hash join's memory grant cannot hold a single row".into(),
+            ));
+        };
+        let bloom_bytes = self.grant.size() / BLOOM_FRACTION;
+        let bloom = self
+            .bloom
+            .get_or_insert_with(|| BloomFilter::new(bloom_bytes, BLOOM_PROBES));
+        let mut writer = RunWriter::create(&self.temp_dir, PARTITION_BLOCK_BYTES)?;
+        let Partition::Resident(table) = std::mem::replace(
+            &mut self.partitions[index],
+            Partition::Resident(Table::default()),
+        ) else {
+            unreachable!();
+        };
+        for (key, values) in table.rows {
+            bloom.insert(&key);
+            for value in values {
+                writer.push(&key, &value)?;
+            }
+        }
+        self.resident_bytes -= table.bytes;
+        self.partitions[index] = Partition::Spilled(writer);
+        self.stats.spilled_partitions += 1;
+        Ok(())
+    }
+
+    /// Ends the build input and joins it with `probe`, yielding matches as
+    /// they are found.
+    pub fn probe<'a, I>(self, probe: I) -> Result<JoinIter<'a>>
+    where
+        I: Iterator<Item = Result<Entry>> + 'a,
+    {
+        let mut tables = Vec::with_capacity(self.fanout);
+        let mut pending = Vec::with_capacity(self.fanout);
+        let mut stats = self.stats;
+        for partition in self.partitions {
+            match partition {
+                Partition::Resident(table) => {
+                    tables.push(table);
+                    pending.push(None);
+                }
+                Partition::Spilled(writer) => {
+                    let build = writer.finish()?;
+                    stats.spilled_bytes += build.bytes();
+                    let probe = RunWriter::create(&self.temp_dir, PARTITION_BLOCK_BYTES)?;
+                    tables.push(Table::default());
+                    pending.push(Some((build, probe)));
+                }
+            }
+        }
+        Ok(JoinIter {
+            temp_dir: self.temp_dir,
+            grant: self.grant,
+            fanout: self.fanout,
+            tables,
+            probe: Box::new(probe),
+            current: None,
+            routing: Some(Routing {
+                pending,
+                bloom: self.bloom,
+            }),
+            tasks: Vec::new(),
+            stats,
+        })
+    }
+}
+
+fn partition_of(key: &[u8], depth: u32, fanout: usize) -> usize {
+    (hash64(key, depth as u64) % fanout as u64) as usize
+}
+
+/// Where probe rows of spilled partitions go during the first probe pass.
+struct Routing {
+    pending: Vec<Option<(Run, RunWriter)>>,
+    bloom: Option<BloomFilter>,
+}
+
+/// A spilled partition pair still to be joined.
+struct Task {
+    build: Arc<Run>,
+    probe: Arc<Run>,
+    depth: u32,
+    /// Where the next nested-loop chunk of the build run starts.
+    build_from: u64,
+}
+
+/// A probe row, the table holding its matches and the index of the next
+/// build value it matches.
+struct Matching {
+    table: usize,
+    key: Vec<u8>,
+    value: Vec<u8>,
+    next: usize,
+}
+
+/// Rows produced by a [`HashJoin`]. Holds the join's memory grant until
+/// dropped.
+pub struct JoinIter<'a> {
+    temp_dir: PathBuf,
+    grant: Grant,
+    fanout: usize,
+    /// One table per partition during the first pass, then the single
+    /// table of the partition pair being joined.
+    tables: Vec<Table>,
+    probe: Box<dyn Iterator<Item = Result<Entry>> + 'a>,
+    current: Option<Matching>,
+    routing: Option<Routing>,
+    tasks: Vec<Task>,
+    stats: JoinStats,
+}
+
+impl JoinIter<'_> {
+    /// Counters for the join so far.
+    pub fn stats(&self) -> JoinStats {
+        self.stats
+    }
+
+    /// Largest build run joined with an in-memory table.
+    fn load_limit(&self) -> usize {
+        self.grant.size() - 2 * READ_BLOCK_BYTES
+    }
+
+    fn next_match(&mut self) -> Option<JoinRow> {
+        let matching = self.current.as_mut()?;
+        let values = &self.tables[matching.table].rows[&matching.key];
+        let row = (
+            matching.key.clone(),
+            values[matching.next].clone(),
+            matching.value.clone(),
+        );
+        matching.next += 1;
+        if matching.next == values.len() {
+            self.current = None;
+        }
+        Some(row)
+    }
+
+    /// Handles one probe row: joins it against the current table or, in the
+    /// first pass, routes it to its spilled partition.
+    fn accept(&mut self, key: Vec<u8>, value: Vec<u8>) -> Result<()> {
+        let mut table = 0;
+        if let Some(routing) = &mut self.routing {
+            self.stats.probe_rows += 1;
+            table = partition_of(&key, 0, self.fanout);
+            if let Some((_, writer)) = &mut routing.pending[table] {
+                if routing.bloom.as_ref().unwrap().may_contain(&key) {
+                    writer.push(&key, &value)?;
+                } else {
+                    self.stats.bloom_filtered += 1;
+                }
+                return Ok(());
+            }
+        }
+        if self.tables[table].rows.contains_key(&key) {
+            self.current = Some(Matching {
+                table,
+                key,
+                value,
+                next: 0,
+            });
+        }
+        Ok(())
+    }
+
+    /// Moves to the next partition pair once a probe input is exhausted.
+    /// Returns `false` when the join is complete.
+    fn advance(&mut self) -> Result<bool> {
+        self.tables = vec![Table::default()];
+        if let Some(routing) = self.routing.take() {
+            for (build, writer) in routing.pending.into_iter().flatten() {
+                let probe = writer.finish()?;
+                self.stats.spilled_bytes += probe.bytes();
+                if probe.entries() > 0 {
+                    self.tasks.push(Task {
+                        build: Arc::new(build),
+                        probe: Arc::new(probe),
+                        depth: 0,
+                        build_from: 0,
+                    });
+                }
+            }
+        }
+        // Nothing is held between partition pairs: shrink if asked to.
+        self.grant
+            .shrink_to(self.grant.target().max(MIN_JOIN_MEMORY));
+        while let Some(task) = self.tasks.pop() {
+            let limit = self.load_limit();
+            let cost = task.build.bytes() as usize + task.build.entries() as usize * ROW_OVERHEAD;
+            if task.build_from == 0 && cost <= limit {
+                let mut reader = task.build.reader(READ_BLOCK_BYTES)?;
+                for entry in reader.by_ref() {
+                    let (key, value) = entry?;
+                    self.tables[0].insert(key, value);
+                }
+                self.probe = Box::new(task.probe.reader(READ_BLOCK_BYTES)?);
+                return Ok(true);
+            }
+            if task.depth < MAX_DEPTH && task.build_from == 0 {
+                self.repartition(task)?;
+                continue;
+            }
+            self.load_chunk(task)?;
+            return Ok(true);
+        }
+        Ok(false)
+    }
+
+    /// Splits both sides of `task` with the next hash seed.
+    fn repartition(&mut self, task: Task) -> Result<()> {
+        self.stats.repartitions += 1;
+        let depth = task.depth + 1;
+        let builds = self.split(&task.build, depth)?;
+        let probes = self.split(&task.probe, depth)?;
+        for (build, probe) in builds.into_iter().zip(probes) {
+            if build.entries() > 0 && probe.entries() > 0 {
+                // A split that made no progress will not make any with
+                // more seeds either: every row shares one key.
+                let depth = if build.entries() == task.build.entries() {
+                    MAX_DEPTH
+                } else {
+                    depth
+                };
+                self.tasks.push(Task {
+                    build: Arc::new(build),
+                    probe: Arc::new(probe),
+                    depth,
+                    build_from: 0,
+                });
+            }
+        }
+        Ok(())
+    }
+
+    fn split(&mut self, run: &Run, depth: u32) -> Result<Vec<Run>> {
+        let mut writers = (0..self.fanout)
+            .map(|_| RunWriter::create(&self.temp_dir, PARTITION_BLOCK_BYTES))
+            .collect::<Result<Vec<_>>>()?;
+        for entry in run.reader(READ_BLOCK_BYTES)? {
+            let (key, value) = entry?;
+            writers[partition_of(&key, depth, self.fanout)].push(&key, &value)?;
+        }
+        let runs = writers
+            .into_iter()
+            .map(RunWriter::finish)
+            .collect::<Result<Vec<_>>>()?;
+        self.stats.spilled_bytes += runs.iter().map(Run::bytes).sum::<u64>();
+        Ok(runs)
+    }
+
+    /// Loads the next chunk of an unsplittable build run that fits the
+    /// grant and rescans the whole probe run against it.
+    fn load_chunk(&mut self, task: Task) -> Result<()> {
+        self.stats.nested_loop_chunks += 1;
+        let limit = self.load_limit();
+        let mut reader = task.build.reader_at(task.build_from, READ_BLOCK_BYTES)?;
+        self.probe = Box::new(task.probe.reader(READ_BLOCK_BYTES)?);
+        loop {
+            let position = reader.position();
+            let Some(entry) = reader.next() else {
+                break;
+            };
+            let (key, value) = entry?;
+            let table = &mut self.tables[0];
+            if table.bytes > 0 && table.bytes + row_cost(&key, &value) > limit {
+                self.tasks.push(Task {
+                    build_from: position,
+                    ..task
+                });
+                break;
+            }
+            table.insert(key, value);
+        }
+        Ok(())
+    }
+}
+
+impl Iterator for JoinIter<'_> {
+    type Item = Result<JoinRow>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            if let Some(row) = self.next_match() {
+                return Some(Ok(row));
+            }
+            let result = match self.probe.next() {
+                Some(Ok((key, value))) => self.accept(key, value),
+                Some(Err(err)) => Err(err),
+                None => match self.advance() {
+                    Ok(true) => Ok(()),
+                    Ok(false) => return None,
+                    Err(err) => Err(err),
+                },
+            };
+            if let Err(err) = result {
+                return Some(Err(err));
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn entry(key: u32, value: u32) -> Entry {
+        let mut value = value.to_le_bytes().to_vec();
+        value.resize(200, 0);
+        (format!("key{key:08}").into_bytes(), value)
+    }
+
+    /// Joins `build` and `probe` in a grant of `memory` bytes and checks the
+    /// rows against a nested-loop join of the same inputs.
+    fn join(dir: &TempDir, memory: usize, build: &[Entry], probe: &[Entry]) -> JoinStats {
+        let budget = MemoryBudget::new(64 << 20);
+        let mut join = HashJoin::new(&budget, dir.path(), memory).unwrap();
+        for (key, value) in build {
+            join.push_build(key.clone(), value.clone()).unwrap();
+        }
+        let mut iter = join.probe(probe.iter().cloned().map(Ok)).unwrap();
+        let mut rows: Vec<JoinRow> = iter.by_ref().collect::<Result<_>>().unwrap();
+        let stats = iter.stats();
+        drop(iter);
+        assert_eq!(budget.used(), 0);
+        assert_eq!(fs::read_dir(dir.path()).unwrap().count(), 0);
+
+        let mut expected = Vec::new();
+        for (probe_key, probe_value) in probe {
+            for (build_key, build_value) in build {
+                if build_key == probe_key {
+                    expected.push((build_key.clone(), build_value.clone(), probe_value.clone()));
+                }
+            }
+        }
+        assert_eq!(rows.len(), expected.len());
+        rows.sort();
+        expected.sort();
+        assert!(rows == expected);
+        assert_eq!(stats.build_rows, build.len() as u64);
+        stats
+    }
+
+    #[test]
+    fn a_build_within_its_grant_joins_in_memory() {
+        let dir = TempDir::new("join-memory");
+        // Keys 0..300 twice on the build side; every third probe key misses.
+        let build: Vec<Entry> = (0..600).map(|i| entry(i % 300, i)).collect();
+        let probe: Vec<Entry> = (0..450).map(|i| entry(i, i)).collect();
+        let stats = join(&dir, 4 << 20, &build, &probe);
+        assert_eq!(stats.spilled_partitions, 0);
+        assert_eq!(stats.spilled_bytes, 0);
+        assert_eq!(stats.probe_rows, 450);
+    }
+
+    #[test]
+    fn spilled_partitions_are_joined_afterwards() {
+        let dir = TempDir::new("join-spill");
+        // About 2 MiB of build rows against the smallest grant.
+        let build: Vec<Entry> = (0..8000).map(|i| entry(i * 7919 % 4000, i)).collect();
+        let probe: Vec<Entry> = (0..8000).map(|i| entry(i * 31 % 12_000, i)).collect();
+        let stats = join(&dir, MIN_JOIN_MEMORY, &build, &probe);
+        assert!(stats.spilled_partitions > 0, "{stats:?}");
+        // Most probe rows without a match never reach a probe run.
+        assert!(stats.bloom_filtered > 2000, "{stats:?}");
+    }
+
+    #[test]
+    fn a_repeated_key_falls_back_to_nested_loops() {
+        let dir = TempDir::new("join-skew");
+        // One key carries 1 MiB of build rows, far more than the grant can
+        // load at once, so splitting it cannot help.
+        let mut build: Vec<Entry> = (0..4000).map(|i| entry(7, i)).collect();
+        build.extend((0..2000).map(|i| entry(i, i)));
+        let probe: Vec<Entry> = (0..3).map(|i| entry(7, i)).chain([entry(8, 0)]).collect();
+        let stats = join(&dir, MIN_JOIN_MEMORY, &build, &probe);
+        assert!(stats.repartitions > 0, "{stats:?}");
+        assert!(stats.nested_loop_chunks > 1, "{stats:?}");
+    }
+}
@@ -0,0 +1,150 @@
+//! K-way merge by tournament (loser) tree.
+//!
+//! Internal node `i` remembers the loser of the match played there and node
+//! 0 holds the overall winner. Replacing the winner's entry replays only the
+//! matches on its leaf-to-root path, so each output entry costs `log2(k)`
+//! key comparisons, about half of what a binary heap needs.
+
+use std::cmp::Ordering;
+
+use crate::error::Result;
+use crate::exec::run::Entry;
+
+/// Merges sorted entry sources. Equal keys are yielded in source order.
+pub struct LoserTree<S> {
+    sources: Vec<S>,
+    heads: Vec<Option<Entry>>,
+    tree: Vec<usize>,
+}
+
+impl<S: Iterator<Item = Result<Entry>>> LoserTree<S> {
+    /// Builds the tree, reading the first entry of every source.
+    pub fn new(mut sources: Vec<S>) -> Result<Self> {
+        let heads = sources
+            .iter_mut()
+            .map(|source| source.next().transpose())
+            .collect::<Result<_>>()?;
+        let k = sources.len();
+        // Every node starts out holding the sentinel `k`, which beats any
+        // real source; playing each leaf in turn pushes all sentinels out.
+        let mut tree = LoserTree {
+            sources,
+            heads,
+            tree: vec![k; k],
+        };
+        for source in (0..k).rev() {
+            tree.replay(source);
+        }
+        Ok(tree)
+    }
+
+    /// Whether source `a` wins against source `b`.
+    fn beats(&self, a: usize, b: usize) -> bool {
+        let k = self.sources.len();
+        if a == k || b == k {
+            return a == k;
+        }
+        match (&self.heads[a], &self.heads[b]) {
+            (None, _) => false,
+            (Some(_), None) => true,
+            (Some(x), Some(y)) => match x.0.cmp(&y.0) {
+                Ordering::Less => true,
+                Ordering::Greater => false,
+                Ordering::Equal => a < b,
+            },
+        }
+    }
+
+    fn replay(&mut self, source: usize) {
+        let mut winner = source;
+        let mut node = (source + self.sources.len()) / 2;
+        while node > 0 {
+            if self.beats(self.tree[node], winner) {
+                std::mem::swap(&mut self.tree[node], &mut winner);
+            }
+            node /= 2;
+        }
+        self.tree[0] = winner;
+    }
+}
+
+impl<S: Iterator<Item = Result<Entry>>> Iterator for LoserTree<S> {
+    type Item = Result<Entry>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let winner = *self.tree.first()?;
+        let entry = self.heads[winner].take()?;
+        match self.sources[winner].next().transpose() {
+            Ok(head) => self.heads[winner] = head,
+            Err(err) => return Some(Err(err)),
+        }
+        self.replay(winner);
+        Some(Ok(entry))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::error::Error;
+
+    fn source(keys: &[&str], tag: u8) -> std::vec::IntoIter<Result<Entry>> {
+        keys.iter()
+            .map(|key| Ok((key.as_bytes().to_vec(), vec![tag])))
+            .collect::<Vec<_>>()
+            .into_iter()
+    }
+
+    fn merge(sources: Vec<std::vec::IntoIter<Result<Entry>>>) -> Vec<Entry> {
+        LoserTree::new(sources)
+            .unwrap()
+            .collect::<Result<_>>()
+            .unwrap()
+    }
+
+    #[test]
+    fn merges_any_number_of_sources() {
+        assert!(merge(Vec::new()).is_empty());
+        assert!(merge(vec![source(&[], 0)]).is_empty());
+        let single = merge(vec![source(&["a", "b", "c"], 0)]);
+        assert_eq!(single.len(), 3);
+
+        // Seven sources, so the tree is not a full binary tree, two of them
+        // empty and some keys shared between sources.
+        let merged = merge(vec![
+            source(&["b", "e", "h"], 0),
+            source(&[], 1),
+            source(&["a", "e"], 2),
+            source(&["c", "d", "f", "g", "i"], 3),
+            source(&[], 4),
+            source(&["e"], 5),
+            source(&["a", "z"], 6),
+        ]);
+        let keys: Vec<&[u8]> = merged.iter().map(|(key, _)| key.as_slice()).collect();
+        assert_eq!(
+            keys,
+            [b"a", b"a", b"b", b"c", b"d", b"e", b"e", b"e", b"f", b"g", b"h", b"i", b"z"]
+        );
+        // Equal keys come out in source order.
+        let tags = |key: &[u8]| -> Vec<u8> {
+            merged
+                .iter()
+                .filter(|(k, _)| k == key)
+                .map(|(_, value)| value[0])
+                .collect()
+        };
+        assert_eq!(tags(b"a"), [2, 6]);
+        assert_eq!(tags(b"e"), [0, 2, 5]);
+    }
+
+    #[test]
+    fn passes_on_source_errors() {
+        let failing = vec![
+            Ok((b"a".to_vec(), Vec::new())),
+            Err(Error::Corruption("bad run".into())),
+        ];
+        let tree = LoserTree::new(vec![source(&["b"], 0), failing.into_iter()]).unwrap();
+        let out: Vec<Result<Entry>> = tree.collect();
+        assert!(matches!(out.first(), Some(Err(Error::Corruption(_)))));
+    }
+}
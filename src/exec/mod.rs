@@ -0,0 +1,20 @@
+//! Query-execution operators that work inside a memory grant.
+//!
+//! Operators take a grant from the [`MemoryBudget`] when they start and
+//! spill to temporary run files whenever their working set would exceed
+//! it, so they handle inputs far larger than memory. Grants handed out by
+//! a [`GrantBroker`] can shrink while the operator runs; operators check
+//! for that where they can spill.
+//!
+//! [`MemoryBudget`]: crate::MemoryBudget
+
+pub mod grant;
+pub mod join;
+mod loser_tree;
+pub mod run;
+pub mod sort;
+
+pub use grant::{Grant, GrantBroker, GrantStats};
+pub use join::{HashJoin, JoinIter, JoinRow, JoinStats, MIN_JOIN_MEMORY};
+pub use run::{Run, RunReader, RunWriter};
+pub use sort::{ExternalSorter, SortStats, SortedIter, MIN_SORT_MEMORY};
@@ -0,0 +1,319 @@
+//! Temporary spill files of key/value entries.
+//!
+//! A run is written once, front to back, and read back once in the same
+//! order, so both directions use large sequential transfers:
+//!
+//! ```text
+//! { [key_len u32][value_len u32][key][value] } ...
+//! ```
+//!
+//! The file is unlinked as soon as it is created and lives only as long as
+//! its handle, so runs never outlive the operator, even after a crash.
+//! Both sides split their buffer in two halves and keep one transfer in
+//! flight through [`crate::aio`]: the writer fills one half while the other
+//! is written, and the reader consumes one half while the next block is read
+//! into the other.
+
+use std::fs::{self, File, OpenOptions};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use crate::aio::{self, Pending};
+use crate::error::{Error, Result};
+use crate::sys;
+
+/// A key and its value.
+pub type Entry = (Vec<u8>, Vec<u8>);
+
+const ENTRY_HEADER: usize = 8;
+
+static NEXT_RUN: AtomicU64 = AtomicU64::new(0);
+
+/// Creates a file in `dir` that is unlinked at once and disappears with its
+/// handle.
+pub(crate) fn temp_file(dir: &Path) -> Result<File> {
+    fs::create_dir_all(dir)?;
+    let path = dir.join(format!(
+        "run-{}-{}.tmp",
+        std::process::id(),
+        NEXT_RUN.fetch_add(1, Ordering::Relaxed)
+    ));
+    let file = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create_new(true)
+        .open(&path)?;
+    fs::remove_file(&path)?;
+    Ok(file)
+}
+
+/// Sequential writer of a new run.
+#[derive(Debug)]
+pub struct RunWriter {
+    file: Arc<File>,
+    /// Output not yet handed to the kernel.
+    buf: Vec<u8>,
+    /// Size at which `buf` is written out.
+    half: usize,
+    /// The previous half, still being written.
+    writing: Option<Pending<'static>>,
+    bytes: u64,
+    entries: u64,
+}
+
+impl RunWriter {
+    /// Creates an anonymous run file in `dir`, buffering `buffer_bytes` of
+    /// output: half is filled while the other half is being written.
+    pub fn create(dir: &Path, buffer_bytes: usize) -> Result<Self> {
+        let file = temp_file(dir)?;
+        let half = (buffer_bytes / 2).max(ENTRY_HEADER);
+        Ok(RunWriter {
+            file: Arc::new(file),
+            buf: Vec::with_capacity(half),
+            half,
+            writing: None,
+            bytes: 0,
+            entries: 0,
+        })
+    }
+
+    /// Appends one entry.
+    pub fn push(&mut self, key: &[u8], value: &[u8]) -> Result<()> {
+        let mut header = [0u8; ENTRY_HEADER];
+        header[..4].copy_from_slice(&(key.len() as u32).to_le_bytes());
+        header[4..].copy_from_slice(&(value.len() as u32).to_le_bytes());
+        self.buf.extend_from_slice(&header);
+        self.buf.extend_from_slice(key);
+        self.buf.extend_from_slice(value);
+        self.bytes += (ENTRY_HEADER + key.len() + value.len()) as u64;
+        self.entries += 1;
+        if self.buf.len() >= self.half {
+            self.write_out()?;
+        }
+        Ok(())
+    }
+
+    /// Starts writing the buffered output once the previous write is done,
+    /// taking over its buffer for the next half.
+    fn write_out(&mut self) -> Result<()> {
+        let mut spare = match self.writing.take() {
+            Some(pending) => pending.wait()?.0,
+            None => Vec::with_capacity(self.half),
+        };
+        spare.clear();
+        // An oversized entry may have grown the buffer past its half.
+        spare.shrink_to(self.half);
+        let out = std::mem::replace(&mut self.buf, spare);
+        let offset = self.bytes - out.len() as u64;
+        self.writing = Some(aio::shared().write(Arc::clone(&self.file), offset, out));
+        Ok(())
+    }
+
+    /// Bytes written so far.
+    pub fn bytes(&self) -> u64 {
+        self.bytes
+    }
+
+    /// Flushes the remaining output and returns the finished run. Runs are
+    /// not synced: they are worthless after a crash.
+    pub fn finish(mut self) -> Result<Run> {
+        if !self.buf.is_empty() {
+            self.write_out()?;
+        }
+        if let Some(pending) = self.writing.take() {
+            pending.wait()?;
+        }
+        Ok(Run {
+            file: self.file,
+            bytes: self.bytes,
+            entries: self.entries,
+        })
+    }
+}
+
+/// A finished, immutable run.
+#[derive(Debug)]
+pub struct Run {
+    file: Arc<File>,
+    bytes: u64,
+    entries: u64,
+}
+
+impl Run {
+    /// Size of the run file.
+    pub fn bytes(&self) -> u64 {
+        self.bytes
+    }
+
+    /// Number of entries in the run.
+    pub fn entries(&self) -> u64 {
+        self.entries
+    }
+
+    /// Reads the run from the start through a `block_bytes` buffer, half of
+    /// it read ahead. A run can be read any number of times.
+    pub fn reader(&self, block_bytes: usize) -> Result<RunReader> {
+        self.reader_at(0, block_bytes)
+    }
+
+    /// Reads the run from byte `offset`, which must be an entry boundary
+    /// obtained from [`RunReader::position`].
+    pub fn reader_at(&self, offset: u64, block_bytes: usize) -> Result<RunReader> {
+        let file = Arc::new(self.file.try_clone()?);
+        sys::advise_sequential(&file);
+        let mut reader = RunReader {
+            file,
+            len: self.bytes,
+            half: (block_bytes / 2).max(ENTRY_HEADER),
+            block: Vec::new(),
+            pos: 0,
+            filled: 0,
+            offset,
+            ahead: None,
+        };
+        reader.read_ahead(Vec::new());
+        Ok(reader)
+    }
+}
+
+/// Block-at-a-time sequential reader over a [`Run`].
+#[derive(Debug)]
+pub struct RunReader {
+    file: Arc<File>,
+    len: u64,
+    /// Size of each of the two block buffers.
+    half: usize,
+    block: Vec<u8>,
+    pos: usize,
+    filled: usize,
+    /// File offset of the next block.
+    offset: u64,
+    /// The next block, being read.
+    ahead: Option<Pending<'static>>,
+}
+
+impl RunReader {
+    /// Offset of the next entry in the run.
+    pub fn position(&self) -> u64 {
+        self.offset - (self.filled - self.pos) as u64
+    }
+
+    /// Starts reading the block at `offset` into `buf`, unless the run is
+    /// exhausted.
+    fn read_ahead(&mut self, mut buf: Vec<u8>) {
+        let n = (self.half as u64).min(self.len - self.offset) as usize;
+        if n > 0 {
+            buf.resize(n, 0);
+            let file = Arc::clone(&self.file);
+            self.ahead = Some(aio::shared().read(file, self.offset, buf));
+        }
+    }
+
+    fn refill(&mut self) -> Result<()> {
+        if self.filled > 0 {
+            sys::discard_cached(
+                &self.file,
+                self.offset - self.filled as u64,
+                self.filled as u64,
+            );
+        }
+        let Some(pending) = self.ahead.take() else {
+            return Err(Error::Corruption("spill run ends mid-entry".into()));
+        };
+        let (block, n) = pending.wait()?;
+        if n < block.len() {
+            return Err(Error::Corruption(
+                "spill run is shorter than written".into(),
+            ));
+        }
+        let spare = std::mem::replace(&mut self.block, block);
+        self.offset += n as u64;
+        self.pos = 0;
+        self.filled = n;
+        self.read_ahead(spare);
+        Ok(())
+    }
+
+    fn read_into(&mut self, out: &mut [u8]) -> Result<()> {
+        let mut done = 0;
+        while done < out.len() {
+            if self.pos == self.filled {
+                self.refill()?;
+            }
+            let n = (out.len() - done).min(self.filled - self.pos);
+            out[done..done + n].copy_from_slice(&self.block[self.pos..self.pos + n]);
+            self.pos += n;
+            done += n;
+        }
+        Ok(())
+    }
+
+    fn read_entry(&mut self) -> Result<Entry> {
+        let mut header = [0u8; ENTRY_HEADER];
+        self.read_into(&mut header)?;
+        let key_len = u32::from_le_bytes(header[..4].try_into().unwrap()) as usize;
+        let value_len = u32::from_le_bytes(header[4..].try_into().unwrap()) as usize;
+        let mut key = vec![0u8; key_len];
+        self.read_into(&mut key)?;
+        let mut value = vec![0u8; value_len];
+        self.read_into(&mut value)?;
+        Ok((key, value))
+    }
+}
+
+impl Iterator for RunReader {
+    type Item = Result<Entry>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.pos == self.filled && self.offset == self.len {
+            return None;
+        }
+        Some(self.read_entry())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn entry(i: usize) -> Entry {
+        (format!("key{i:05}").into_bytes(), vec![i as u8; i % 300])
+    }
+
+    #[test]
+    fn a_run_reads_back_what_was_written() {
+        let dir = TempDir::new("run-round-trip");
+        // Buffers far smaller than the run, and one entry larger than both.
+        let mut writer = RunWriter::create(dir.path(), 256).unwrap();
+        let mut entries: Vec<Entry> = (0..2000).map(entry).collect();
+        entries[1000].1 = vec![7; 5000];
+        for (key, value) in &entries {
+            writer.push(key, value).unwrap();
+        }
+        let run = writer.finish().unwrap();
+        assert_eq!(run.entries(), 2000);
+        // The file was unlinked when it was created.
+        assert_eq!(fs::read_dir(dir.path()).unwrap().count(), 0);
+
+        let mut reader = run.reader(512).unwrap();
+        let mut middle = 0;
+        for (i, expected) in entries.iter().enumerate() {
+            if i == 1500 {
+                middle = reader.position();
+            }
+            assert_eq!(&reader.next().unwrap().unwrap(), expected, "entry {i}");
+        }
+        assert!(reader.next().is_none());
+        assert_eq!(reader.position(), run.bytes());
+
+        // A second reader may start at any entry boundary.
+        let tail: Vec<Entry> = run
+            .reader_at(middle, 4096)
+            .unwrap()
+            .collect::<Result<_>>()
+            .unwrap();
+        assert_eq!(tail, entries[1500..]);
+    }
+}
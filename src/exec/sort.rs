@@ -0,0 +1,349 @@
+//! External merge sort.
+//!
+//! Entries are buffered until the memory grant is full, sorted in place and
+//! written out as a run. Buffered keys and values are copied into an
+//! [`Arena`] carved out of the grant and freed in one step at each spill,
+//! so buffering makes no heap allocation per entry. When the input ends, the runs are merged with a
+//! loser tree, each read through its own block buffer carved out of the
+//! same grant. If there are more runs than the grant has blocks for, groups
+//! of runs are first merged into longer ones, so any input size sorts in a
+//! fixed amount of memory. Inputs that fit in the grant never touch disk.
+//!
+//! If the grant's broker asks it to shrink, the sorter spills what it has
+//! buffered at the next push, or before the merge, and continues in the
+//! smaller grant.
+//!
+//! Entries are ordered by key bytes; the order of entries with equal keys
+//! is unspecified.
+
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use crate::arena::{Arena, Span};
+use crate::error::{Error, Result};
+use crate::exec::grant::Grant;
+use crate::exec::loser_tree::LoserTree;
+use crate::exec::run::{Entry, Run, RunReader, RunWriter};
+use crate::memory::{Consumer, MemoryBudget};
+
+/// Smallest read or write buffer used for a run.
+const MIN_BLOCK_BYTES: usize = 64 << 10;
+/// Largest read or write buffer used for a run; more buys little once the
+/// next block is read ahead.
+const MAX_BLOCK_BYTES: usize = 1 << 20;
+/// Smallest grant accepted: a few blocks, so merges have fan-in.
+pub const MIN_SORT_MEMORY: usize = 4 * MIN_BLOCK_BYTES;
+
+/// A buffered entry: its key and value bytes, back to back in the arena,
+/// and the length of the key.
+type Buffered = (Span, u32);
+
+/// In-memory cost of a buffered entry beyond its key and value bytes.
+const ENTRY_OVERHEAD: usize = std::mem::size_of::<Buffered>();
+
+/// Counters describing one sort.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct SortStats {
+    pub entries: u64,
+    /// Runs written while consuming the input.
+    pub runs: u64,
+    /// Intermediate merges of run groups before the final merge.
+    pub merge_passes: u64,
+    /// Total bytes written to run files, intermediate merges included.
+    pub spilled_bytes: u64,
+}
+
+fn block_size(bytes: usize) -> usize {
+    bytes.clamp(MIN_BLOCK_BYTES, MAX_BLOCK_BYTES)
+}
+
+/// Sorts an arbitrarily large stream of entries within a fixed grant.
+#[derive(Debug)]
+pub struct ExternalSorter {
+    temp_dir: PathBuf,
+    /// The grant; the share for buffered entries is lent to `arena`.
+    grant: Grant,
+    arena: Arena,
+    buffer: Vec<Buffered>,
+    runs: Vec<Run>,
+    stats: SortStats,
+}
+
+impl ExternalSorter {
+    /// Creates a sorter that reserves `memory_bytes` from `budget` for its
+    /// whole life and spills to files in `temp_dir`.
+    pub fn new(
+        budget: &Arc<MemoryBudget>,
+        temp_dir: impl AsRef<Path>,
+        memory_bytes: usize,
+    ) -> Result<Self> {
+        if memory_bytes < MIN_SORT_MEMORY {
+            return Err(Error::InvalidArgument(format!(
+                "a sort needs at least {MIN_SORT_MEMORY} bytes of memory"
+            )));
+        }
+        let grant = Grant::fixed(budget, Consumer::Sort, memory_bytes)?;
+        Self::with_grant(grant, temp_dir)
+    }
+
+    /// Creates a sorter working in `grant`, shrinking with it, and spilling
+    /// to files in `temp_dir`.
+    pub fn with_grant(mut grant: Grant, temp_dir: impl AsRef<Path>) -> Result<Self> {
+        if grant.size() < MIN_SORT_MEMORY {
+            return Err(Error::InvalidArgument(format!(
+                "a sort needs at least {MIN_SORT_MEMORY} bytes of memory"
+            )));
+        }
+        let arena = lend_arena(&mut grant);
+        Ok(ExternalSorter {
+            temp_dir: temp_dir.as_ref().to_path_buf(),
+            grant,
+            arena,
+            buffer: Vec::new(),
+            runs: Vec::new(),
+            stats: SortStats::default(),
+        })
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> SortStats {
+        self.stats
+    }
+
+    /// Bytes of the grant available to buffered entries; the rest is kept
+    /// for the write buffer used when they are spilled.
+    fn buffer_capacity(&self) -> usize {
+        buffer_capacity(self.grant.size())
+    }
+
+    /// Shrinks to the grant's target if the broker lowered it, spilling the
+    /// buffered entries first.
+    fn adapt(&mut self) -> Result<()> {
+        let target = self.grant.target().max(MIN_SORT_MEMORY);
+        if target >= self.grant.size() {
+            return Ok(());
+        }
+        if !self.buffer.is_empty() {
+            self.spill()?;
+        }
+        self.buffer = Vec::new();
+        let arena = std::mem::replace(&mut self.arena, Arena::new(self.grant.split(0), 0));
+        self.grant.merge(arena.into_reservation());
+        self.grant.shrink_to(target);
+        self.arena = lend_arena(&mut self.grant);
+        Ok(())
+    }
+
+    /// Adds an entry to the sort.
+    pub fn push(&mut self, key: Vec<u8>, value: Vec<u8>) -> Result<()> {
+        self.adapt()?;
+        let size = key.len() + value.len();
+        // A full vector doubles on push; count the slots it would have.
+        let slots = if self.buffer.len() == self.buffer.capacity() {
+            (2 * self.buffer.capacity()).max(64)
+        } else {
+            self.buffer.capacity()
+        };
+        if self.arena.held_after(size) + slots * ENTRY_OVERHEAD > self.buffer_capacity() {
+            if self.buffer.is_empty() {
+                return Err(Error::InvalidArgument(format!(
+                    "entry of {size} bytes does not fit the sort's memory grant"
+                )));
+            }
+            self.spill()?;
+            return self.push(key, value);
+        }
+        let span = self.arena.alloc(size)?;
+        let data = self.arena.get_mut(span);
+        data[..key.len()].copy_from_slice(&key);
+        data[key.len()..].copy_from_slice(&value);
+        self.buffer.push((span, key.len() as u32));
+        self.stats.entries += 1;
+        Ok(())
+    }
+
+    /// Sorts the buffered entries and writes them out as a new run.
+    fn spill(&mut self) -> Result<()> {
+        sort_buffer(&mut self.buffer, &self.arena);
+        let mut writer = RunWriter::create(&self.temp_dir, write_block(self.grant.size()))?;
+        for &(span, key_len) in &self.buffer {
+            let (key, value) = self.arena.get(span).split_at(key_len as usize);
+            writer.push(key, value)?;
+        }
+        self.buffer.clear();
+        self.arena.reset();
+        let run = writer.finish()?;
+        self.stats.runs += 1;
+        self.stats.spilled_bytes += run.bytes();
+        self.runs.push(run);
+        Ok(())
+    }
+
+    /// Ends the input and returns the entries in key order.
+    pub fn finish(mut self) -> Result<SortedIter> {
+        if !self.runs.is_empty() {
+            self.adapt()?;
+        }
+        if self.runs.is_empty() {
+            sort_buffer(&mut self.buffer, &self.arena);
+            return Ok(SortedIter {
+                inner: Inner::Memory {
+                    entries: std::mem::take(&mut self.buffer).into_iter(),
+                    arena: self.arena,
+                },
+                stats: self.stats,
+                _grant: self.grant,
+            });
+        }
+        if !self.buffer.is_empty() {
+            self.spill()?;
+        }
+        self.buffer = Vec::new();
+        // The merge spends the whole grant on run buffers.
+        self.grant.merge(self.arena.into_reservation());
+
+        // One block per input run plus one for the output of a pass.
+        let fan_in = (self.grant.size() / MIN_BLOCK_BYTES - 1).max(2);
+        while self.runs.len() > fan_in {
+            let group: Vec<Run> = self.runs.drain(..fan_in).collect();
+            let block = block_size(self.grant.size() / (fan_in + 1));
+            let mut writer = RunWriter::create(&self.temp_dir, block)?;
+            for entry in LoserTree::new(readers(group, block)?)? {
+                let (key, value) = entry?;
+                writer.push(&key, &value)?;
+            }
+            let run = writer.finish()?;
+            self.stats.merge_passes += 1;
+            self.stats.spilled_bytes += run.bytes();
+            self.runs.push(run);
+        }
+
+        let block = block_size(self.grant.size() / self.runs.len());
+        let runs = std::mem::take(&mut self.runs);
+        Ok(SortedIter {
+            inner: Inner::Merge(LoserTree::new(readers(runs, block)?)?),
+            stats: self.stats,
+            _grant: self.grant,
+        })
+    }
+}
+
+fn write_block(memory_bytes: usize) -> usize {
+    block_size(memory_bytes / 8)
+}
+
+fn buffer_capacity(memory_bytes: usize) -> usize {
+    memory_bytes - write_block(memory_bytes)
+}
+
+/// Lends the share of `grant` kept for buffered entries to a new arena.
+fn lend_arena(grant: &mut Grant) -> Arena {
+    let capacity = buffer_capacity(grant.size());
+    Arena::new(grant.split(capacity), capacity)
+}
+
+fn sort_buffer(buffer: &mut [Buffered], arena: &Arena) {
+    let key = |&(span, key_len): &Buffered| &arena.get(span)[..key_len as usize];
+    buffer.sort_unstable_by(|a, b| key(a).cmp(key(b)));
+}
+
+fn readers(runs: Vec<Run>, block: usize) -> Result<Vec<RunReader>> {
+    runs.iter().map(|run| run.reader(block)).collect()
+}
+
+enum Inner {
+    Memory {
+        entries: std::vec::IntoIter<Buffered>,
+        arena: Arena,
+    },
+    Merge(LoserTree<RunReader>),
+}
+
+/// The output of an [`ExternalSorter`]. Holds the sort's memory grant until
+/// dropped.
+pub struct SortedIter {
+    inner: Inner,
+    stats: SortStats,
+    _grant: Grant,
+}
+
+impl SortedIter {
+    /// Counters for the sort that produced this output.
+    pub fn stats(&self) -> SortStats {
+        self.stats
+    }
+}
+
+impl Iterator for SortedIter {
+    type Item = Result<Entry>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match &mut self.inner {
+            Inner::Memory { entries, arena } => entries.next().map(|(span, key_len)| {
+                let (key, value) = arena.get(span).split_at(key_len as usize);
+                Ok((key.to_vec(), value.to_vec()))
+            }),
+            Inner::Merge(tree) => tree.next(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    /// Sorts `count` entries with keys in scrambled order, 4 entries per
+    /// key, and checks the output is ordered and holds every input once.
+    fn sort(dir: &TempDir, budget: &Arc<MemoryBudget>, count: u32, memory: usize) -> SortStats {
+        let mut sorter = ExternalSorter::new(budget, dir.path(), memory).unwrap();
+        for i in 0..count {
+            let key = format!("key{:08}", i * 7919 % (count / 4));
+            let mut value = i.to_le_bytes().to_vec();
+            value.resize(64, 0);
+            sorter.push(key.into_bytes(), value).unwrap();
+        }
+        let output = sorter.finish().unwrap();
+        let stats = output.stats();
+        let mut last = Vec::new();
+        let mut seen = vec![false; count as usize];
+        for entry in output {
+            let (key, value) = entry.unwrap();
+            assert!(key >= last);
+            let i = u32::from_le_bytes(value[..4].try_into().unwrap());
+            assert_eq!(key, format!("key{:08}", i * 7919 % (count / 4)).as_bytes());
+            assert!(!std::mem::replace(&mut seen[i as usize], true));
+            last = key;
+        }
+        assert!(seen.iter().all(|&seen| seen));
+        assert_eq!(stats.entries, count as u64);
+        stats
+    }
+
+    #[test]
+    fn a_sort_within_its_grant_stays_in_memory() {
+        let dir = TempDir::new("sort-memory");
+        let budget = MemoryBudget::new(64 << 20);
+        let stats = sort(&dir, &budget, 1000, 4 << 20);
+        assert_eq!(stats.runs, 0);
+        assert_eq!(stats.spilled_bytes, 0);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn a_sort_larger_than_its_grant_merges_in_passes() {
+        let dir = TempDir::new("sort-spill");
+        let budget = MemoryBudget::new(64 << 20);
+        // About 1.6 MiB of entries in the smallest grant, whose merge has a
+        // fan-in of 3.
+        let stats = sort(&dir, &budget, 20_000, MIN_SORT_MEMORY);
+        assert!(stats.runs > 3, "{stats:?}");
+        assert!(stats.merge_passes >= 2, "{stats:?}");
+        assert!(budget.peak_usage(Consumer::Sort) <= MIN_SORT_MEMORY);
+        // The grant went back with the output and no run file is left.
+        assert_eq!(budget.used(), 0);
+        assert_eq!(fs::read_dir(dir.path()).unwrap().count(), 0);
+    }
+}
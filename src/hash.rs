@@ -0,0 +1,41 @@
+//! Fast seeded 64-bit hashing of byte strings for partitioning and filters.
+//!
+//! Not cryptographic. Different seeds give independent-looking hashes of
+//! the same key, which recursive partitioning relies on.
+
+const K0: u64 = 0x9e37_79b9_7f4a_7c15;
+const K1: u64 = 0xbf58_476d_1ce4_e5b9;
+
+fn mix(h: u64) -> u64 {
+    h.wrapping_mul(K0).rotate_left(31).wrapping_mul(K1)
+}
+
+/// The MurmurHash3 finaliser: every input bit affects every output bit.
+fn finish(mut h: u64) -> u64 {
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xff51_afd7_ed55_8ccd);
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xc4ce_b9fe_1a85_ec53);
+    h ^ (h >> 33)
+}
+
+/// Hashes `data` under `seed`.
+pub fn hash64(data: &[u8], seed: u64) -> u64 {
+    let mut h = seed ^ (data.len() as u64).wrapping_mul(K0);
+    let mut chunks = data.chunks_exact(8);
+    for chunk in &mut chunks {
+        h = mix(h ^ u64::from_le_bytes(chunk.try_into().unwrap()));
+    }
+    let rest = chunks.remainder();
+    if !rest.is_empty() {
+        let mut tail = [0u8; 8];
+        tail[..rest.len()].copy_from_slice(rest);
+        h = mix(h ^ u64::from_le_bytes(tail));
+    }
+    finish(h)
+}
+
+/// Hashes a single word under `seed`, more cheaply than [`hash64`].
+pub fn hash_u64(value: u64, seed: u64) -> u64 {
+    finish(mix(seed ^ value))
+}
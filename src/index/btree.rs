@@ -0,0 +1,693 @@
+//! A B+tree whose nodes are buffer-pool pages.
+//!
+//! No node is ever materialised on the heap: lookups pin one page per level
+//! and release it before descending, so resident memory is bounded by the
+//! buffer pool regardless of how many keys the tree holds. Leaves are chained
+//! through right-sibling links for range scans. Nodes are not merged on
+//! delete; space freed by removals is reclaimed when a node is next rebuilt.
+//!
+//! There is no tree-wide latch. Following the B-link protocol, readers
+//! and writers latch one node at a time and move right when a node split
+//! after its parent was read. Writes that fit their leaf hold only the
+//! leaf's latch; splits are ordered by a structure lock that readers never
+//! take. Because nodes are never merged or freed, a reader holding a stale
+//! page id always lands on a live node, so no deferred reclamation is
+//! needed.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::error::{Error, Result};
+use crate::index::node::{self, NodeKind, MAX_ENTRY_SIZE};
+use crate::storage::{
+    BufferPool, PageGuard, PageId, PageScan, INVALID_PAGE_ID, MAIN_FILE, PAGE_SIZE,
+};
+
+pub(crate) const META_MAGIC: &[u8; 8] = b"DIGBLINK";
+const META_ROOT_OFFSET: usize = 8;
+
+/// A disk-resident ordered map from byte keys to byte values.
+#[derive(Debug)]
+pub struct BTree {
+    pool: Arc<BufferPool>,
+    meta_page: PageId,
+    /// The root page id, as last written to the meta page.
+    root: AtomicU64,
+    /// Held while a split propagates, so structure changes do not
+    /// interleave.
+    smo: Mutex<()>,
+}
+
+impl BTree {
+    /// Creates an empty tree, allocating its meta page and root leaf.
+    pub fn create(pool: Arc<BufferPool>) -> Result<Self> {
+        let meta = pool.new_page()?;
+        let root = pool.new_page()?;
+        node::init(&mut root.write(), NodeKind::Leaf, 0, INVALID_PAGE_ID);
+        {
+            let mut data = meta.write();
+            data[..8].copy_from_slice(META_MAGIC);
+            data[META_ROOT_OFFSET..META_ROOT_OFFSET + 8]
+                .copy_from_slice(&root.page_id().to_le_bytes());
+        }
+        Ok(BTree {
+            pool,
+            meta_page: meta.page_id(),
+            root: AtomicU64::new(root.page_id()),
+            smo: Mutex::new(()),
+        })
+    }
+
+    /// Opens the tree whose meta page is `meta_page`.
+    pub fn open(pool: Arc<BufferPool>, meta_page: PageId) -> Result<Self> {
+        let meta = pool.fetch_page(meta_page)?;
+        let data = meta.read();
+        if &data[..8] != META_MAGIC {
+            return Err(Error::Corruption(format!(
+                "page {meta_page} is not a B+tree meta page"
+            )));
+        }
+        let root = u64::from_le_bytes(
+            data[META_ROOT_OFFSET..META_ROOT_OFFSET + 8]
+                .try_into()
+                .unwrap(),
+        );
+        drop(data);
+        Ok(BTree {
+            pool,
+            meta_page,
+            root: AtomicU64::new(root),
+            smo: Mutex::new(()),
+        })
+    }
+
+    /// The page holding this tree's root pointer.
+    pub fn meta_page(&self) -> PageId {
+        self.meta_page
+    }
+
+    /// The root page id. A root that has just been replaced is still a
+    /// valid starting point: it covers its part of the key space and links
+    /// right to the rest.
+    fn root(&self) -> PageId {
+        self.root.load(Ordering::Acquire)
+    }
+
+    fn set_root(&self, root: PageId) -> Result<()> {
+        let meta = self.pool.fetch_page(self.meta_page)?;
+        meta.write()[META_ROOT_OFFSET..META_ROOT_OFFSET + 8].copy_from_slice(&root.to_le_bytes());
+        self.root.store(root, Ordering::Release);
+        Ok(())
+    }
+
+    /// Walks down from the root to the node at `level` that covers `key`,
+    /// moving right past nodes that split after their parent was read, and
+    /// returns it pinned but not latched: it may split again before the
+    /// caller latches it. Every internal node passed on the way is pushed to
+    /// `path`, top first. At most one page latch is held at a time.
+    fn descend(&self, key: &[u8], level: u8, path: &mut Vec<PageId>) -> Result<PageGuard> {
+        let mut page = self.pool.fetch_page(self.root())?;
+        loop {
+            let next = {
+                let data = page.read();
+                if !node::covers(&data, key) {
+                    node::right(&data)
+                } else if node::level(&data) == level {
+                    break;
+                } else {
+                    path.push(page.page_id());
+                    node::child_for(&data, key)
+                }
+            };
+            page = self.pool.fetch_page(next)?;
+        }
+        Ok(page)
+    }
+
+    /// Latches the node covering `key` exclusively, starting the search at
+    /// `page` and moving right, and calls `f` on it.
+    fn modify<T>(
+        &self,
+        mut page: PageGuard,
+        key: &[u8],
+        f: impl FnOnce(&mut [u8]) -> Result<T>,
+    ) -> Result<T> {
+        loop {
+            // Check under the shared latch first so moving right does not
+            // mark pages dirty.
+            let right = {
+                let data = page.read();
+                (!node::covers(&data, key)).then(|| node::right(&data))
+            };
+            let right = match right {
+                Some(right) => right,
+                None => {
+                    let mut data = page.write();
+                    if node::covers(&data, key) {
+                        return f(&mut data);
+                    }
+                    // Split between the two latches.
+                    node::right(&data)
+                }
+            };
+            page = self.pool.fetch_page(right)?;
+        }
+    }
+
+    /// Returns the value stored under `key`.
+    pub fn get(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        let mut page = self.descend(key, 0, &mut Vec::new())?;
+        loop {
+            let right = {
+                let data = page.read();
+                if node::covers(&data, key) {
+                    return Ok(node::search(&data, key)
+                        .ok()
+                        .map(|i| node::value(&data, i).to_vec()));
+                }
+                node::right(&data)
+            };
+            page = self.pool.fetch_page(right)?;
+        }
+    }
+
+    /// Inserts or replaces the value stored under `key`.
+    ///
+    /// When the leaf has room the change is made under the leaf's latch
+    /// alone. Otherwise the insert is retried under the structure lock,
+    /// which orders splits, and the split propagates upwards one latched
+    /// node at a time.
+    pub fn insert(&self, key: &[u8], value: &[u8]) -> Result<()> {
+        if key.len() + value.len() > MAX_ENTRY_SIZE {
+            return Err(Error::InvalidArgument(format!(
+                "entry of {} bytes exceeds the {MAX_ENTRY_SIZE} byte limit",
+                key.len() + value.len()
+            )));
+        }
+        let leaf = self.descend(key, 0, &mut Vec::new())?;
+        let done = self.modify(leaf, key, |data| {
+            let found = node::search(data, key);
+            if !node::has_room(data, key, value, found.is_ok()) {
+                return Ok(false);
+            }
+            let pos = match found {
+                Ok(i) => {
+                    node::remove_at(data, i);
+                    i
+                }
+                Err(i) => i,
+            };
+            let inserted = node::insert_at(data, pos, key, value);
+            debug_assert!(inserted);
+            Ok(true)
+        })?;
+        if done {
+            return Ok(());
+        }
+
+        // No other split can run while the structure lock is held, so the
+        // path read now stays accurate.
+        let _smo = self.smo.lock().unwrap();
+        let mut path = Vec::new();
+        let leaf = self.descend(key, 0, &mut path)?;
+        let split = self.modify(leaf, key, |data| {
+            let (pos, replaced) = match node::search(data, key) {
+                Ok(i) => {
+                    let old = node::value(data, i).to_vec();
+                    node::remove_at(data, i);
+                    (i, Some(old))
+                }
+                Err(i) => (i, None),
+            };
+            if node::insert_at(data, pos, key, value) {
+                return Ok(None);
+            }
+            let mut entries = node::entries(data);
+            entries.insert(pos, (key.to_vec(), value.to_vec()));
+            match self.rebuild_or_split(data, NodeKind::Leaf, entries) {
+                Ok(split) => Ok(split),
+                Err(err) => {
+                    // Splitting allocates before touching the leaf, so only
+                    // the removed old value needs putting back.
+                    if let Some(old) = replaced {
+                        let mut entries = node::entries(data);
+                        entries.insert(pos, (key.to_vec(), old));
+                        node::rebuild(data, NodeKind::Leaf, INVALID_PAGE_ID, &entries);
+                    }
+                    Err(err)
+                }
+            }
+        })?;
+
+        let Some(mut pending) = split else {
+            return Ok(());
+        };
+        while let Some(parent_id) = path.pop() {
+            let (separator, right) = pending;
+            let next = self.modify(self.pool.fetch_page(parent_id)?, &separator, |data| {
+                let child = right.to_le_bytes();
+                let pos = node::search(data, &separator).unwrap_err();
+                if node::insert_at(data, pos, &separator, &child) {
+                    return Ok(None);
+                }
+                let mut entries = node::entries(data);
+                entries.insert(pos, (separator.clone(), child.to_vec()));
+                self.rebuild_or_split(data, NodeKind::Internal, entries)
+            })?;
+            match next {
+                Some(next) => pending = next,
+                None => return Ok(()),
+            }
+        }
+
+        // The root itself split: grow the tree by one level.
+        let (separator, right) = pending;
+        let old_root = self.root();
+        let level = node::level(&self.pool.fetch_page(old_root)?.read()) + 1;
+        let root = self.pool.new_page()?;
+        {
+            let mut data = root.write();
+            node::init(&mut data, NodeKind::Internal, level, old_root);
+            node::rebuild(
+                &mut data,
+                NodeKind::Internal,
+                old_root,
+                &[(separator, right.to_le_bytes().to_vec())],
+            );
+        }
+        self.set_root(root.page_id())
+    }
+
+    /// Rewrites `data` to hold `entries`, splitting into a new right sibling
+    /// when they do not fit. Returns the separator and page id to insert
+    /// into the parent after a split.
+    ///
+    /// The new sibling is complete before `data` links to it, and the caller
+    /// holds the latch on `data`, so readers see either the old node or both
+    /// halves joined by the right link.
+    fn rebuild_or_split(
+        &self,
+        data: &mut [u8],
+        kind: NodeKind,
+        mut entries: Vec<(Vec<u8>, Vec<u8>)>,
+    ) -> Result<Option<(Vec<u8>, PageId)>> {
+        let link = node::link(data);
+        let fence = node::fence(data);
+        let high_key_len = fence.high_key.as_ref().map_or(0, Vec::len);
+        if node::encoded_size(kind, &entries, high_key_len) <= data.len() {
+            node::rebuild(data, kind, link, &entries);
+            return Ok(None);
+        }
+
+        let mid = split_point(kind, &entries, high_key_len);
+        let mut right_entries = entries.split_off(mid);
+        let separator = separator(kind, &entries, &right_entries);
+        let right_link = match kind {
+            NodeKind::Leaf => INVALID_PAGE_ID,
+            NodeKind::Internal => {
+                let (_, child) = right_entries.remove(0);
+                u64::from_le_bytes(child.as_slice().try_into().unwrap())
+            }
+        };
+        let right = self.pool.new_page()?;
+        {
+            let mut right_data = right.write();
+            node::init(&mut right_data, kind, node::level(data), right_link);
+            node::rebuild_fenced(&mut right_data, kind, right_link, &fence, &right_entries);
+        }
+        let left_fence = node::Fence {
+            right: right.page_id(),
+            high_key: Some(separator.clone()),
+        };
+        node::rebuild_fenced(data, kind, link, &left_fence, &entries);
+        Ok(Some((separator, right.page_id())))
+    }
+
+    /// Removes `key`, returning whether it was present.
+    pub fn remove(&self, key: &[u8]) -> Result<bool> {
+        let leaf = self.descend(key, 0, &mut Vec::new())?;
+        self.modify(leaf, key, |data| match node::search(data, key) {
+            Ok(i) => {
+                node::remove_at(data, i);
+                Ok(true)
+            }
+            Err(_) => Ok(false),
+        })
+    }
+
+    /// Iterates over entries with keys at or above `start`, in key order.
+    pub fn scan_from(&self, start: &[u8]) -> Result<BTreeIter<'_>> {
+        Ok(BTreeIter {
+            tree: self,
+            leaf: None,
+            leaf_version: 0,
+            right: INVALID_PAGE_ID,
+            private: false,
+            scan: self.pool.page_scan(MAIN_FILE, INVALID_PAGE_ID),
+            lower: start.to_vec(),
+            inclusive: true,
+            batch: Vec::new(),
+        })
+    }
+}
+
+/// The key separating the two halves of a split node. For leaves this is
+/// the shortest prefix of the right half's first key that still sorts
+/// after the left half's last key (suffix truncation); internal nodes move
+/// the right half's first key up.
+fn separator(kind: NodeKind, left: &[(Vec<u8>, Vec<u8>)], right: &[(Vec<u8>, Vec<u8>)]) -> Vec<u8> {
+    let first = &right[0].0;
+    match kind {
+        NodeKind::Leaf => {
+            let last = &left.last().unwrap().0;
+            let shared = last.iter().zip(first).take_while(|(a, b)| a == b).count();
+            first[..(shared + 1).min(first.len())].to_vec()
+        }
+        NodeKind::Internal => first.clone(),
+    }
+}
+
+/// Where to split `entries` so both halves fit a page along with their
+/// high keys: the left gets the separator, the right keeps the node's
+/// current high key of `high_key_len` bytes. Prefers an even split by
+/// bytes.
+fn split_point(kind: NodeKind, entries: &[(Vec<u8>, Vec<u8>)], high_key_len: usize) -> usize {
+    let fits = |mid: usize| {
+        let (left, right) = entries.split_at(mid);
+        let separator = separator(kind, left, right);
+        let right = match kind {
+            NodeKind::Leaf => right,
+            NodeKind::Internal => &right[1..],
+        };
+        node::encoded_size(kind, left, separator.len()) <= PAGE_SIZE
+            && node::encoded_size(kind, right, high_key_len) <= PAGE_SIZE
+    };
+    let total: usize = entries.iter().map(|(k, v)| k.len() + v.len()).sum();
+    let mut acc = 0;
+    let mut mid = 1;
+    for (i, (k, v)) in entries.iter().enumerate() {
+        acc += k.len() + v.len();
+        if acc * 2 >= total {
+            mid = (i + 1).clamp(1, entries.len() - 1);
+            break;
+        }
+    }
+    if fits(mid) {
+        return mid;
+    }
+    // Long keys can leave the even split without room for a high key.
+    (1..entries.len()).find(|&i| fits(i)).unwrap_or(mid)
+}
+
+/// Iterator over a key range of a [`BTree`].
+///
+/// The iterator copies one leaf at a time and holds no latch between leaves,
+/// so writers are never blocked by a slow consumer. A leaf that splits while
+/// the iterator is parked moves keys already returned into its new sibling;
+/// those are skipped by resuming strictly after the last key yielded.
+/// When the leaf's version is unchanged since it was copied, its right link
+/// is followed without latching it again.
+///
+/// Leaves are read through a [`PageScan`]: once the scan has read more
+/// leaves than the pool's scan-ring threshold, leaves that are not
+/// resident go through a scan ring, so a long scan does not flush the
+/// pool, and leaves laid out in file order are read ahead.
+#[derive(Debug)]
+pub struct BTreeIter<'a> {
+    tree: &'a BTree,
+    leaf: Option<PageId>,
+    /// Version of `leaf`'s frame when it was copied.
+    leaf_version: u64,
+    /// `leaf`'s right link when it was copied.
+    right: PageId,
+    /// Whether `leaf` was read into the scan ring rather than the pool.
+    private: bool,
+    scan: PageScan,
+    lower: Vec<u8>,
+    inclusive: bool,
+    batch: Vec<(Vec<u8>, Vec<u8>)>,
+}
+
+impl BTreeIter<'_> {
+    fn fill(&mut self) -> Result<bool> {
+        let leaf_id = match self.leaf {
+            None => self
+                .tree
+                .descend(&self.lower, 0, &mut Vec::new())?
+                .page_id(),
+            Some(prev) => {
+                // Re-read the sibling link if the previous leaf changed since
+                // it was copied, so entries moved right by a split in between
+                // are still visited. A private copy is not re-read: that
+                // would cost another disk read, and its link still leads past
+                // every key the leaf held when it was copied.
+                let next = if self.private {
+                    self.right
+                } else {
+                    let page = self.tree.pool.fetch_page(prev)?;
+                    if page.version() == self.leaf_version {
+                        self.right
+                    } else {
+                        node::right(&page.read())
+                    }
+                };
+                if next == INVALID_PAGE_ID {
+                    return Ok(false);
+                }
+                next
+            }
+        };
+        self.leaf = Some(leaf_id);
+        let page = self.scan.fetch(leaf_id)?;
+        let data = page.read();
+        self.leaf_version = page.version();
+        self.private = page.is_private();
+        self.right = node::right(&data);
+        let start = match node::search(&data, &self.lower) {
+            Ok(i) if !self.inclusive => i + 1,
+            Ok(i) | Err(i) => i,
+        };
+        self.batch = (start..node::count(&data))
+            .rev()
+            .map(|i| (node::key(&data, i), node::value(&data, i).to_vec()))
+            .collect();
+        Ok(true)
+    }
+}
+
+impl Iterator for BTreeIter<'_> {
+    type Item = Result<(Vec<u8>, Vec<u8>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            if let Some((key, value)) = self.batch.pop() {
+                self.lower.clone_from(&key);
+                self.inclusive = false;
+                return Some(Ok((key, value)));
+            }
+            match self.fill() {
+                Ok(true) => continue,
+                Ok(false) => return None,
+                Err(err) => return Some(Err(err)),
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeSet;
+    use std::sync::atomic::AtomicBool;
+    use std::thread;
+
+    use super::*;
+    use crate::memory::MemoryBudget;
+    use crate::storage::DiskManager;
+    use crate::test_util::TempDir;
+
+    const POOL_BYTES: usize = 16 << 20;
+
+    fn tree(dir: &TempDir) -> BTree {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        let budget = MemoryBudget::new(2 * POOL_BYTES);
+        BTree::create(BufferPool::new(disk, &budget, POOL_BYTES).unwrap()).unwrap()
+    }
+
+    fn key(i: u64) -> Vec<u8> {
+        format!("key{i:08}").into_bytes()
+    }
+
+    fn value(i: u64) -> Vec<u8> {
+        let mut value = i.to_le_bytes().to_vec();
+        value.resize(120, b'v');
+        value
+    }
+
+    fn height(tree: &BTree) -> u8 {
+        node::level(&tree.pool.fetch_page(tree.root()).unwrap().read())
+    }
+
+    #[test]
+    fn separators_are_the_shortest_key_between_the_halves() {
+        let entries = |keys: &[&[u8]]| -> Vec<(Vec<u8>, Vec<u8>)> {
+            keys.iter().map(|k| (k.to_vec(), Vec::new())).collect()
+        };
+        let cases: [(&[u8], &[u8], &[u8]); 4] = [
+            (b"apple", b"banana", b"b"),
+            (b"tenant/alpha/row/9", b"tenant/beta/row/0", b"tenant/b"),
+            (b"abc", b"abcd", b"abcd"),
+            (b"abc", b"abd", b"abd"),
+        ];
+        for (last, first, expected) in cases {
+            let sep = separator(NodeKind::Leaf, &entries(&[last]), &entries(&[first]));
+            assert_eq!(sep, expected);
+            assert!(&sep[..] > last && &sep[..] <= first);
+        }
+        let sep = separator(NodeKind::Internal, &entries(&[b"abc"]), &entries(&[b"abd"]));
+        assert_eq!(sep, b"abd");
+    }
+
+    #[test]
+    fn long_shared_prefixes_split_into_fitting_halves() {
+        let prefix = vec![b'p'; MAX_ENTRY_SIZE / 2];
+        let entries: Vec<(Vec<u8>, Vec<u8>)> = (0..12u32)
+            .map(|i| {
+                let mut key = prefix.clone();
+                key.extend_from_slice(format!("{i:04}").as_bytes());
+                (key, vec![b'v'; 200])
+            })
+            .collect();
+        let mid = split_point(NodeKind::Leaf, &entries, 0);
+        let (left, right) = entries.split_at(mid);
+        let sep = separator(NodeKind::Leaf, left, right);
+        assert_eq!(sep.len(), prefix.len() + 4);
+        assert!(node::encoded_size(NodeKind::Leaf, left, sep.len()) <= PAGE_SIZE);
+        assert!(node::encoded_size(NodeKind::Leaf, right, 0) <= PAGE_SIZE);
+    }
+
+    #[test]
+    fn modify_moves_right_past_a_split_leaf() {
+        let dir = TempDir::new("blink-move-right");
+        let tree = tree(&dir);
+        for i in (0..20).map(|i| i * 100) {
+            tree.insert(&key(i), &value(i)).unwrap();
+        }
+        // Pin the leaf covering a high key, then split it under the pin.
+        let stale = tree.descend(&key(1900), 0, &mut Vec::new()).unwrap();
+        let leaf = stale.page_id();
+        for i in 0..60 {
+            tree.insert(&key(i), &value(i)).unwrap();
+        }
+        assert!(!node::covers(&stale.read(), &key(1900)));
+        let found = tree
+            .modify(stale, &key(1900), |data| {
+                Ok(node::search(data, &key(1900)).is_ok())
+            })
+            .unwrap();
+        assert!(found);
+        assert_ne!(
+            tree.descend(&key(1900), 0, &mut Vec::new())
+                .unwrap()
+                .page_id(),
+            leaf
+        );
+        assert_eq!(tree.get(&key(1900)).unwrap(), Some(value(1900)));
+    }
+
+    #[test]
+    fn root_splits_are_seen_through_the_cached_root() {
+        let dir = TempDir::new("blink-root");
+        let tree = tree(&dir);
+        let before = tree.root();
+        for i in 0..5000 {
+            tree.insert(&key(i), &value(i)).unwrap();
+        }
+        assert_ne!(tree.root(), before);
+        assert!(height(&tree) >= 2);
+        let reopened = BTree::open(Arc::clone(&tree.pool), tree.meta_page()).unwrap();
+        assert_eq!(reopened.root(), tree.root());
+        for i in (0..5000).step_by(7) {
+            assert_eq!(reopened.get(&key(i)).unwrap(), Some(value(i)));
+        }
+    }
+
+    #[test]
+    fn concurrent_writers_and_readers() {
+        const WRITERS: u64 = 4;
+        const PER_WRITER: u64 = 2500;
+        let dir = TempDir::new("blink-concurrent");
+        let tree = tree(&dir);
+        // Writer `w` inserts keys `w, w + WRITERS, ...` and publishes how
+        // many it has inserted, so readers know which keys must be found.
+        let inserted: Vec<AtomicU64> = (0..WRITERS).map(|_| AtomicU64::new(0)).collect();
+        let done = AtomicBool::new(false);
+        let published = |inserted: &[AtomicU64]| -> Vec<u64> {
+            (0..WRITERS)
+                .flat_map(|w| {
+                    let n = inserted[w as usize].load(Ordering::Acquire);
+                    (0..n).map(move |j| j * WRITERS + w)
+                })
+                .collect()
+        };
+        thread::scope(|scope| {
+            let writers: Vec<_> = (0..WRITERS)
+                .map(|w| {
+                    let (tree, inserted) = (&tree, &inserted);
+                    scope.spawn(move || {
+                        for j in 0..PER_WRITER {
+                            let i = j * WRITERS + w;
+                            tree.insert(&key(i), &value(i)).unwrap();
+                            inserted[w as usize].store(j + 1, Ordering::Release);
+                        }
+                    })
+                })
+                .collect();
+            let getter = scope.spawn(|| {
+                let mut gets = 0;
+                while !done.load(Ordering::Acquire) {
+                    for i in published(&inserted).into_iter().step_by(13) {
+                        assert_eq!(tree.get(&key(i)).unwrap(), Some(value(i)), "key {i}");
+                        gets += 1;
+                    }
+                }
+                gets
+            });
+            let scanner = scope.spawn(|| {
+                let mut scans = 0;
+                while !done.load(Ordering::Acquire) {
+                    let expected = published(&inserted);
+                    let mut seen = BTreeSet::new();
+                    let mut last: Option<Vec<u8>> = None;
+                    for entry in tree.scan_from(b"").unwrap() {
+                        let (k, v) = entry.unwrap();
+                        assert!(
+                            last.as_ref().is_none_or(|last| *last < k),
+                            "scan out of order"
+                        );
+                        let i: u64 = std::str::from_utf8(&k[3..]).unwrap().parse().unwrap();
+                        assert_eq!(v, value(i));
+                        seen.insert(k.clone());
+                        last = Some(k);
+                    }
+                    for i in expected {
+                        assert!(seen.contains(&key(i)), "scan missed key {i}");
+                    }
+                    scans += 1;
+                }
+                scans
+            });
+            for writer in writers {
+                writer.join().unwrap();
+            }
+            done.store(true, Ordering::Release);
+            assert!(getter.join().unwrap() > 0);
+            assert!(scanner.join().unwrap() > 0);
+        });
+        assert!(height(&tree) >= 2);
+        let all: Vec<_> = tree.scan_from(b"").unwrap().map(Result::unwrap).collect();
+        assert_eq!(all.len() as u64, WRITERS * PER_WRITER);
+        for (i, (k, v)) in all.into_iter().enumerate() {
+            assert_eq!((k, v), (key(i as u64), value(i as u64)));
+        }
+    }
+}
@@ -0,0 +1,150 @@
+//! Read-only access to a B+tree through a memory mapping of its file.
+//!
+//! Nodes are read in place in the operating system's page cache: a lookup
+//! copies nothing and pins nothing, and residency is left to the kernel.
+//! The mapping covers the file as it was when last mapped and is replaced
+//! when the tree refers to a page beyond it. The caller must keep the
+//! writer from overwriting pages while a call runs; see
+//! [`CheckpointLock`](crate::recovery::CheckpointLock).
+
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, RwLock};
+
+use crate::error::{Error, Result};
+use crate::index::btree::META_MAGIC;
+use crate::index::node;
+use crate::storage::{MappedFile, PageId, INVALID_PAGE_ID};
+
+const META_ROOT_OFFSET: usize = 8;
+
+/// A B+tree read through a shared, read-only mapping.
+#[derive(Debug)]
+pub struct MappedBTree {
+    path: PathBuf,
+    meta_page: PageId,
+    map: RwLock<Arc<MappedFile>>,
+}
+
+impl MappedBTree {
+    /// Maps the data file at `path` and checks that `meta_page` holds a
+    /// tree.
+    pub fn open(path: impl AsRef<Path>, meta_page: PageId) -> Result<Self> {
+        let path = path.as_ref().to_path_buf();
+        let tree = MappedBTree {
+            map: RwLock::new(Arc::new(MappedFile::open(&path)?)),
+            path,
+            meta_page,
+        };
+        let mut map = tree.mapping();
+        tree.cover(&mut map, meta_page)?;
+        if &map.page(meta_page)?[..8] != META_MAGIC {
+            return Err(Error::Corruption(format!(
+                "page {meta_page} is not a B+tree meta page"
+            )));
+        }
+        Ok(tree)
+    }
+
+    fn mapping(&self) -> Arc<MappedFile> {
+        Arc::clone(&self.map.read().unwrap())
+    }
+
+    /// Makes sure `map` covers `page_id`, remapping the grown file if not.
+    fn cover(&self, map: &mut Arc<MappedFile>, page_id: PageId) -> Result<()> {
+        if page_id < map.num_pages() {
+            return Ok(());
+        }
+        let mut shared = self.map.write().unwrap();
+        if shared.num_pages() <= page_id {
+            *shared = Arc::new(MappedFile::open(&self.path)?);
+        }
+        *map = Arc::clone(&shared);
+        if page_id >= map.num_pages() {
+            return Err(Error::Corruption(format!(
+                "B+tree page {page_id} is beyond the end of the data file"
+            )));
+        }
+        Ok(())
+    }
+
+    fn node<'m>(&self, map: &'m mut Arc<MappedFile>, page_id: PageId) -> Result<&'m [u8]> {
+        self.cover(map, page_id)?;
+        let data = map.page(page_id)?;
+        if node::try_kind(data).is_none() {
+            return Err(Error::Corruption(format!(
+                "page {page_id} is not a B+tree node"
+            )));
+        }
+        Ok(data)
+    }
+
+    /// The leaf that covers `key`.
+    fn find_leaf(&self, map: &mut Arc<MappedFile>, key: &[u8]) -> Result<PageId> {
+        let meta = map.page(self.meta_page)?;
+        let mut page_id = u64::from_le_bytes(
+            meta[META_ROOT_OFFSET..META_ROOT_OFFSET + 8]
+                .try_into()
+                .unwrap(),
+        );
+        loop {
+            let data = self.node(map, page_id)?;
+            if !node::covers(data, key) {
+                page_id = node::right(data);
+            } else if node::level(data) > 0 {
+                page_id = node::child_for(data, key);
+            } else {
+                return Ok(page_id);
+            }
+        }
+    }
+
+    /// Calls `f` with the value stored under `key`, read in place.
+    pub fn get_with<T>(&self, key: &[u8], f: impl FnOnce(&[u8]) -> T) -> Result<Option<T>> {
+        let mut map = self.mapping();
+        let leaf = self.find_leaf(&mut map, key)?;
+        let data = self.node(&mut map, leaf)?;
+        Ok(node::search(data, key)
+            .ok()
+            .map(|i| f(node::value(data, i))))
+    }
+
+    /// Calls `f` with the entries of one leaf, in place and in key order,
+    /// starting at `start` (or just above it if `exclusive`). Empty leaves
+    /// are skipped. Returns the last key visited if `f` asked for more and
+    /// further leaves follow, so the caller can resume there, possibly
+    /// after releasing its lock.
+    pub fn visit_leaf(
+        &self,
+        start: &[u8],
+        exclusive: bool,
+        f: &mut impl FnMut(&[u8], &[u8]) -> bool,
+    ) -> Result<Option<Vec<u8>>> {
+        let mut map = self.mapping();
+        let mut page_id = self.find_leaf(&mut map, start)?;
+        let mut pos = match node::search(self.node(&mut map, page_id)?, start) {
+            Ok(i) if exclusive => i + 1,
+            Ok(i) | Err(i) => i,
+        };
+        let mut key = Vec::new();
+        loop {
+            let data = self.node(&mut map, page_id)?;
+            let count = node::count(data);
+            if pos < count {
+                for i in pos..count {
+                    key.clear();
+                    key.extend_from_slice(node::prefix(data));
+                    key.extend_from_slice(node::suffix(data, i));
+                    if !f(&key, node::value(data, i)) {
+                        return Ok(None);
+                    }
+                }
+                return Ok((node::right(data) != INVALID_PAGE_ID).then_some(key));
+            }
+            page_id = node::right(data);
+            if page_id == INVALID_PAGE_ID {
+                return Ok(None);
+            }
+            pos = 0;
+        }
+    }
+}
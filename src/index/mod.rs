@@ -0,0 +1,10 @@
+//! Ordered indexes stored in buffer-pool pages, with a read-only variant
+//! over a memory mapping.
+
+pub mod btree;
+pub mod mapped;
+mod node;
+
+pub use btree::{BTree, BTreeIter};
+pub use mapped::MappedBTree;
+pub use node::MAX_ENTRY_SIZE;
@@ -0,0 +1,556 @@
+//! Slotted-page layout of B+tree nodes.
+//!
+//! Nodes follow the B-link design: besides its entries, every node stores
+//! a high key, the exclusive upper bound of the keys it covers, and a link
+//! to its right sibling on the same level. A reader that reaches a node
+//! after it split finds its key at or above the high key and moves right,
+//! so it never needs the parent to be consistent with the child.
+//!
+//! ```text
+//! +--------+--------+-------------------+---------+ ... +-----------------+
+//! | header | prefix | slots[0..count]   |  free space   | cells (heap)    |
+//! +--------+--------+-------------------+---------+ ... +-----------------+
+//! ```
+//!
+//! Every key in a node shares the node's prefix, which is stored once. The
+//! slot array is contiguous and sorted; each slot carries the first four
+//! bytes of the key suffix (the "head") so that binary search mostly compares
+//! integers within a couple of cache lines and only dereferences a cell on a
+//! head tie. Cells grow down from the end of the page and hold the rest of
+//! the suffix followed by the payload: a length-prefixed value in leaves or a
+//! child page id in internal nodes. The high key, if any, is a cell of its
+//! own, stored whole.
+
+use std::cmp::Ordering;
+
+use crate::storage::{PageId, INVALID_PAGE_ID, PAGE_SIZE};
+
+const KIND_OFFSET: usize = 0;
+const LEVEL_OFFSET: usize = 1;
+const COUNT_OFFSET: usize = 2;
+const PREFIX_LEN_OFFSET: usize = 4;
+const HEAP_START_OFFSET: usize = 6;
+const LINK_OFFSET: usize = 8;
+const RIGHT_OFFSET: usize = 16;
+/// Heap offset of the high key cell; zero when the node has none.
+const HIGH_KEY_OFFSET: usize = 24;
+const HIGH_KEY_LEN_OFFSET: usize = 26;
+const HEADER_SIZE: usize = 32;
+const SLOT_SIZE: usize = 8;
+
+/// Largest key plus value accepted, so a split always leaves both halves
+/// with room for at least two entries.
+pub const MAX_ENTRY_SIZE: usize = PAGE_SIZE / 4 - 32;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum NodeKind {
+    Leaf = 1,
+    Internal = 2,
+}
+
+fn read_u16(page: &[u8], off: usize) -> usize {
+    u16::from_le_bytes([page[off], page[off + 1]]) as usize
+}
+
+fn write_u16(page: &mut [u8], off: usize, v: usize) {
+    page[off..off + 2].copy_from_slice(&(v as u16).to_le_bytes());
+}
+
+fn read_u64(page: &[u8], off: usize) -> u64 {
+    u64::from_le_bytes(page[off..off + 8].try_into().unwrap())
+}
+
+fn head_of(suffix: &[u8]) -> u32 {
+    let mut buf = [0u8; 4];
+    let n = suffix.len().min(4);
+    buf[..n].copy_from_slice(&suffix[..n]);
+    u32::from_be_bytes(buf)
+}
+
+/// Size of the cell payload for an entry in a node of `kind`.
+fn payload_size(kind: NodeKind, payload: &[u8]) -> usize {
+    match kind {
+        NodeKind::Leaf => 2 + payload.len(),
+        NodeKind::Internal => 8,
+    }
+}
+
+/// Makes `page` an empty node of `kind` at `level` (leaves are level 0)
+/// with no right sibling and no high key.
+pub(crate) fn init(page: &mut [u8], kind: NodeKind, level: u8, link: PageId) {
+    page[..HEADER_SIZE].fill(0);
+    page[KIND_OFFSET] = kind as u8;
+    page[LEVEL_OFFSET] = level;
+    write_u16(page, HEAP_START_OFFSET, PAGE_SIZE);
+    set_link(page, link);
+    set_right(page, INVALID_PAGE_ID);
+}
+
+pub(crate) fn kind(page: &[u8]) -> NodeKind {
+    try_kind(page).unwrap_or_else(|| panic!("corrupt B+tree node kind {}", page[KIND_OFFSET]))
+}
+
+/// The node kind, or `None` if the page is not a node.
+pub(crate) fn try_kind(page: &[u8]) -> Option<NodeKind> {
+    match page[KIND_OFFSET] {
+        1 => Some(NodeKind::Leaf),
+        2 => Some(NodeKind::Internal),
+        _ => None,
+    }
+}
+
+/// Height above the leaves.
+pub(crate) fn level(page: &[u8]) -> u8 {
+    page[LEVEL_OFFSET]
+}
+
+pub(crate) fn count(page: &[u8]) -> usize {
+    read_u16(page, COUNT_OFFSET)
+}
+
+/// Leftmost child of an internal node.
+pub(crate) fn link(page: &[u8]) -> PageId {
+    read_u64(page, LINK_OFFSET)
+}
+
+pub(crate) fn set_link(page: &mut [u8], link: PageId) {
+    page[LINK_OFFSET..LINK_OFFSET + 8].copy_from_slice(&link.to_le_bytes());
+}
+
+/// Next node to the right on the same level.
+pub(crate) fn right(page: &[u8]) -> PageId {
+    read_u64(page, RIGHT_OFFSET)
+}
+
+fn set_right(page: &mut [u8], right: PageId) {
+    page[RIGHT_OFFSET..RIGHT_OFFSET + 8].copy_from_slice(&right.to_le_bytes());
+}
+
+/// Exclusive upper bound of the node's keys; `None` for the rightmost node
+/// of a level.
+pub(crate) fn high_key(page: &[u8]) -> Option<&[u8]> {
+    let off = read_u16(page, HIGH_KEY_OFFSET);
+    (off != 0).then(|| &page[off..off + read_u16(page, HIGH_KEY_LEN_OFFSET)])
+}
+
+/// Whether `key` belongs in this node rather than to its right.
+pub(crate) fn covers(page: &[u8], key: &[u8]) -> bool {
+    high_key(page).is_none_or(|high| key < high)
+}
+
+/// The right sibling and high key a node keeps across rebuilds.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub(crate) struct Fence {
+    pub right: PageId,
+    pub high_key: Option<Vec<u8>>,
+}
+
+pub(crate) fn fence(page: &[u8]) -> Fence {
+    Fence {
+        right: right(page),
+        high_key: high_key(page).map(<[u8]>::to_vec),
+    }
+}
+
+pub(crate) fn prefix(page: &[u8]) -> &[u8] {
+    &page[HEADER_SIZE..HEADER_SIZE + read_u16(page, PREFIX_LEN_OFFSET)]
+}
+
+fn slots_start(page: &[u8]) -> usize {
+    HEADER_SIZE + read_u16(page, PREFIX_LEN_OFFSET)
+}
+
+fn slot(page: &[u8], i: usize) -> (usize, usize, u32) {
+    let off = slots_start(page) + i * SLOT_SIZE;
+    (
+        read_u16(page, off),
+        read_u16(page, off + 2),
+        u32::from_le_bytes(page[off + 4..off + 8].try_into().unwrap()),
+    )
+}
+
+fn free_space(page: &[u8]) -> usize {
+    read_u16(page, HEAP_START_OFFSET) - (slots_start(page) + count(page) * SLOT_SIZE)
+}
+
+pub(crate) fn suffix(page: &[u8], i: usize) -> &[u8] {
+    let (off, len, _) = slot(page, i);
+    &page[off..off + len]
+}
+
+/// The full key of entry `i`.
+pub(crate) fn key(page: &[u8], i: usize) -> Vec<u8> {
+    let mut key = prefix(page).to_vec();
+    key.extend_from_slice(suffix(page, i));
+    key
+}
+
+/// The value of leaf entry `i`.
+pub(crate) fn value(page: &[u8], i: usize) -> &[u8] {
+    let (off, len, _) = slot(page, i);
+    let at = off + len;
+    let value_len = read_u16(page, at);
+    &page[at + 2..at + 2 + value_len]
+}
+
+/// The child of internal entry `i`, covering keys at or above `key(i)`.
+pub(crate) fn child(page: &[u8], i: usize) -> PageId {
+    let (off, len, _) = slot(page, i);
+    read_u64(page, off + len)
+}
+
+/// Binary search for `key`: `Ok(i)` on an exact match, otherwise `Err(i)`
+/// with the position it would be inserted at.
+pub(crate) fn search(page: &[u8], key: &[u8]) -> Result<usize, usize> {
+    let prefix = prefix(page);
+    let n = count(page);
+    if !key.starts_with(prefix) {
+        return match key.cmp(prefix) {
+            Ordering::Less => Err(0),
+            _ => Err(n),
+        };
+    }
+    let rest = &key[prefix.len()..];
+    let head = head_of(rest);
+    let (mut lo, mut hi) = (0, n);
+    while lo < hi {
+        let mid = lo + (hi - lo) / 2;
+        let (_, _, mid_head) = slot(page, mid);
+        let ord = match mid_head.cmp(&head) {
+            Ordering::Equal => suffix(page, mid).cmp(rest),
+            ord => ord,
+        };
+        match ord {
+            Ordering::Less => lo = mid + 1,
+            Ordering::Greater => hi = mid,
+            Ordering::Equal => return Ok(mid),
+        }
+    }
+    Err(lo)
+}
+
+/// Index of the child of an internal node that covers `key`.
+pub(crate) fn child_for(page: &[u8], key: &[u8]) -> PageId {
+    match search(page, key) {
+        Ok(i) => child(page, i),
+        Err(0) => link(page),
+        Err(i) => child(page, i - 1),
+    }
+}
+
+/// Whether an entry can be inserted in place, with room for its slot
+/// unless it replaces an existing entry's.
+pub(crate) fn has_room(page: &[u8], key: &[u8], payload: &[u8], replacing: bool) -> bool {
+    let prefix = prefix(page);
+    if !key.starts_with(prefix) {
+        return false;
+    }
+    let cell_size = key.len() - prefix.len() + payload_size(kind(page), payload);
+    let slot = if replacing { 0 } else { SLOT_SIZE };
+    free_space(page) >= cell_size + slot
+}
+
+/// Inserts an entry at slot `i` in place. Returns `false` when the key does
+/// not share the node prefix or there is not enough contiguous free space;
+/// the caller then rebuilds or splits the node.
+pub(crate) fn insert_at(page: &mut [u8], i: usize, key: &[u8], payload: &[u8]) -> bool {
+    if !has_room(page, key, payload, false) {
+        return false;
+    }
+    let kind = kind(page);
+    let prefix_len = read_u16(page, PREFIX_LEN_OFFSET);
+    let rest = &key[prefix_len..];
+    let cell_size = rest.len() + payload_size(kind, payload);
+    let n = count(page);
+    let heap_start = read_u16(page, HEAP_START_OFFSET) - cell_size;
+    page[heap_start..heap_start + rest.len()].copy_from_slice(rest);
+    let at = heap_start + rest.len();
+    match kind {
+        NodeKind::Leaf => {
+            write_u16(page, at, payload.len());
+            page[at + 2..at + 2 + payload.len()].copy_from_slice(payload);
+        }
+        NodeKind::Internal => page[at..at + 8].copy_from_slice(payload),
+    }
+    let slots = slots_start(page);
+    let slot_off = slots + i * SLOT_SIZE;
+    page.copy_within(slot_off..slots + n * SLOT_SIZE, slot_off + SLOT_SIZE);
+    write_u16(page, slot_off, heap_start);
+    write_u16(page, slot_off + 2, rest.len());
+    page[slot_off + 4..slot_off + 8].copy_from_slice(&head_of(rest).to_le_bytes());
+    write_u16(page, HEAP_START_OFFSET, heap_start);
+    write_u16(page, COUNT_OFFSET, n + 1);
+    true
+}
+
+/// Removes slot `i`. The cell's heap space is reclaimed at the next rebuild.
+pub(crate) fn remove_at(page: &mut [u8], i: usize) {
+    let n = count(page);
+    let slots = slots_start(page);
+    let slot_off = slots + i * SLOT_SIZE;
+    page.copy_within(slot_off + SLOT_SIZE..slots + n * SLOT_SIZE, slot_off);
+    write_u16(page, COUNT_OFFSET, n - 1);
+}
+
+/// Entries of a node as `(key, payload)`, where the payload is the value for
+/// leaves and the little-endian child id for internal nodes.
+pub(crate) fn entries(page: &[u8]) -> Vec<(Vec<u8>, Vec<u8>)> {
+    let kind = kind(page);
+    (0..count(page))
+        .map(|i| {
+            let payload = match kind {
+                NodeKind::Leaf => value(page, i).to_vec(),
+                NodeKind::Internal => child(page, i).to_le_bytes().to_vec(),
+            };
+            (key(page, i), payload)
+        })
+        .collect()
+}
+
+fn common_prefix_len(a: &[u8], b: &[u8]) -> usize {
+    a.iter().zip(b).take_while(|(x, y)| x == y).count()
+}
+
+/// Bytes a node of `kind` needs to hold `entries` (sorted by key) below a
+/// high key of `high_key_len` bytes.
+pub(crate) fn encoded_size(
+    kind: NodeKind,
+    entries: &[(Vec<u8>, Vec<u8>)],
+    high_key_len: usize,
+) -> usize {
+    let prefix_len = match (entries.first(), entries.last()) {
+        (Some(first), Some(last)) => common_prefix_len(&first.0, &last.0),
+        _ => 0,
+    };
+    HEADER_SIZE
+        + high_key_len
+        + prefix_len
+        + entries
+            .iter()
+            .map(|(k, p)| SLOT_SIZE + k.len() - prefix_len + payload_size(kind, p))
+            .sum::<usize>()
+}
+
+/// Rewrites the page to hold exactly `entries` (sorted by key), recomputing
+/// the shared prefix and compacting the heap. The level and fence are kept.
+pub(crate) fn rebuild(
+    page: &mut [u8],
+    kind: NodeKind,
+    link: PageId,
+    entries: &[(Vec<u8>, Vec<u8>)],
+) {
+    let fence = fence(page);
+    rebuild_fenced(page, kind, link, &fence, entries);
+}
+
+/// Like [`rebuild`], but also replaces the node's fence.
+pub(crate) fn rebuild_fenced(
+    page: &mut [u8],
+    kind: NodeKind,
+    link: PageId,
+    fence: &Fence,
+    entries: &[(Vec<u8>, Vec<u8>)],
+) {
+    let high_key_len = fence.high_key.as_ref().map_or(0, Vec::len);
+    debug_assert!(encoded_size(kind, entries, high_key_len) <= PAGE_SIZE);
+    init(page, kind, level(page), link);
+    set_right(page, fence.right);
+    if let Some(high) = &fence.high_key {
+        let off = PAGE_SIZE - high.len();
+        page[off..].copy_from_slice(high);
+        write_u16(page, HIGH_KEY_OFFSET, off);
+        write_u16(page, HIGH_KEY_LEN_OFFSET, high.len());
+        write_u16(page, HEAP_START_OFFSET, off);
+    }
+    let prefix_len = match (entries.first(), entries.last()) {
+        (Some(first), Some(last)) => common_prefix_len(&first.0, &last.0),
+        _ => 0,
+    };
+    if let Some((first, _)) = entries.first() {
+        page[HEADER_SIZE..HEADER_SIZE + prefix_len].copy_from_slice(&first[..prefix_len]);
+    }
+    write_u16(page, PREFIX_LEN_OFFSET, prefix_len);
+    for (i, (key, payload)) in entries.iter().enumerate() {
+        let inserted = insert_at(page, i, key, payload);
+        debug_assert!(inserted);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn leaf(entries: &[(Vec<u8>, Vec<u8>)]) -> Vec<u8> {
+        let mut page = vec![0; PAGE_SIZE];
+        init(&mut page, NodeKind::Leaf, 0, INVALID_PAGE_ID);
+        rebuild(&mut page, NodeKind::Leaf, INVALID_PAGE_ID, entries);
+        page
+    }
+
+    fn entries_of(keys: &[&[u8]]) -> Vec<(Vec<u8>, Vec<u8>)> {
+        keys.iter().map(|k| (k.to_vec(), k.to_vec())).collect()
+    }
+
+    fn assert_holds(page: &[u8], entries: &[(Vec<u8>, Vec<u8>)]) {
+        assert_eq!(self::entries(page), entries);
+        for (i, (key, value)) in entries.iter().enumerate() {
+            assert_eq!(search(page, key), Ok(i), "key {key:?}");
+            assert_eq!(self::value(page, i), &value[..]);
+        }
+    }
+
+    #[test]
+    fn a_single_key_is_all_prefix() {
+        let entries = entries_of(&[b"account"]);
+        let page = leaf(&entries);
+        assert_eq!(prefix(&page), b"account");
+        assert_eq!(suffix(&page, 0), b"");
+        assert_holds(&page, &entries);
+        assert_eq!(search(&page, b"acc"), Err(0));
+        assert_eq!(search(&page, b"a"), Err(0));
+        assert_eq!(search(&page, b"accounts"), Err(1));
+        assert_eq!(search(&page, b"b"), Err(1));
+    }
+
+    #[test]
+    fn keys_that_prefix_each_other_tie_on_heads() {
+        // Empty and zero-byte suffixes share the head 0; the full suffix
+        // compare must still order them.
+        let entries = entries_of(&[
+            b"ab",
+            b"ab\0",
+            b"ab\0\0",
+            b"ab\0\0\0\0\0",
+            b"ab\0\x01",
+            b"ab\x01",
+            b"abcd",
+            b"abcde",
+        ]);
+        let page = leaf(&entries);
+        assert_eq!(prefix(&page), b"ab");
+        assert_holds(&page, &entries);
+        assert_eq!(search(&page, b"ab\0\0\0"), Err(3));
+        assert_eq!(search(&page, b"abc"), Err(6));
+        assert_eq!(search(&page, b"abcdef"), Err(8));
+    }
+
+    #[test]
+    fn an_insert_outside_the_prefix_forces_a_rebuild() {
+        let mut entries = entries_of(&[b"user:0001", b"user:0002", b"user:0003"]);
+        let mut page = leaf(&entries);
+        assert_eq!(prefix(&page), b"user:000");
+        for key in [&b"user:0010"[..], b"use", b"v"] {
+            let pos = search(&page, key).unwrap_err();
+            assert!(!insert_at(&mut page, pos, key, key), "{key:?}");
+            entries.insert(pos, (key.to_vec(), key.to_vec()));
+            rebuild(&mut page, NodeKind::Leaf, INVALID_PAGE_ID, &entries);
+            assert_holds(&page, &entries);
+        }
+        assert_eq!(prefix(&page), b"");
+        // A key inside the shorter prefix goes in place again.
+        let pos = search(&page, b"user:0004").unwrap_err();
+        assert!(insert_at(&mut page, pos, b"user:0004", b"4"));
+        assert_eq!(key(&page, pos), b"user:0004");
+    }
+
+    #[test]
+    fn split_halves_get_longer_prefixes_and_merge_back() {
+        let entries: Vec<(Vec<u8>, Vec<u8>)> = (0..80u32)
+            .map(|i| {
+                let key = format!(
+                    "tenant/{}/row/{i:05}",
+                    if i < 40 { "alpha" } else { "beta" }
+                );
+                (key.into_bytes(), vec![b'v'; 8])
+            })
+            .collect();
+        let page = leaf(&entries);
+        assert_eq!(prefix(&page), b"tenant/");
+
+        let (left_entries, right_entries) = entries.split_at(40);
+        let separator = b"tenant/b".to_vec();
+        let mut right = vec![0; PAGE_SIZE];
+        init(&mut right, NodeKind::Leaf, 0, INVALID_PAGE_ID);
+        rebuild_fenced(
+            &mut right,
+            NodeKind::Leaf,
+            INVALID_PAGE_ID,
+            &fence(&page),
+            right_entries,
+        );
+        let mut left = page.clone();
+        let left_fence = Fence {
+            right: 7,
+            high_key: Some(separator.clone()),
+        };
+        rebuild_fenced(
+            &mut left,
+            NodeKind::Leaf,
+            INVALID_PAGE_ID,
+            &left_fence,
+            left_entries,
+        );
+        assert_eq!(prefix(&left), b"tenant/alpha/row/000");
+        assert_eq!(prefix(&right), b"tenant/beta/row/000");
+        assert_holds(&left, left_entries);
+        assert_holds(&right, right_entries);
+        assert_eq!(fence(&left), left_fence);
+        assert!(covers(&left, b"tenant/alpha/zzz"));
+        assert!(!covers(&left, &separator));
+        assert!(covers(&right, b"zzz"));
+
+        // Merging the halves back recomputes the shorter shared prefix.
+        let mut merged = left.clone();
+        let mut all = self::entries(&left);
+        all.extend(self::entries(&right));
+        rebuild_fenced(
+            &mut merged,
+            NodeKind::Leaf,
+            INVALID_PAGE_ID,
+            &fence(&right),
+            &all,
+        );
+        assert_eq!(prefix(&merged), b"tenant/");
+        assert_holds(&merged, &entries);
+        assert_eq!(high_key(&merged), None);
+    }
+
+    #[test]
+    fn removals_keep_the_prefix_until_the_rebuild() {
+        let entries = entries_of(&[b"aa1", b"ab1", b"ab2", b"ab3", b"ac1"]);
+        let mut page = leaf(&entries);
+        assert_eq!(prefix(&page), b"a");
+        remove_at(&mut page, 4);
+        remove_at(&mut page, 0);
+        assert_eq!(prefix(&page), b"a");
+        assert_holds(&page, &entries[1..4]);
+        let rest = self::entries(&page);
+        rebuild(&mut page, NodeKind::Leaf, INVALID_PAGE_ID, &rest);
+        assert_eq!(prefix(&page), b"ab");
+        assert_holds(&page, &entries[1..4]);
+        assert!(!has_room(&page, b"ac2", b"x", false));
+        assert!(has_room(&page, b"ab4", b"x", false));
+    }
+
+    #[test]
+    fn internal_nodes_route_through_their_prefix() {
+        let mut page = vec![0; PAGE_SIZE];
+        init(&mut page, NodeKind::Internal, 1, 100);
+        let separators: Vec<(Vec<u8>, Vec<u8>)> =
+            [(&b"key10"[..], 101u64), (b"key20", 102), (b"key30", 103)]
+                .iter()
+                .map(|&(k, child)| (k.to_vec(), child.to_le_bytes().to_vec()))
+                .collect();
+        rebuild(&mut page, NodeKind::Internal, 100, &separators);
+        assert_eq!(prefix(&page), b"key");
+        assert_eq!(child_for(&page, b"a"), 100);
+        assert_eq!(child_for(&page, b"key"), 100);
+        assert_eq!(child_for(&page, b"key0"), 100);
+        assert_eq!(child_for(&page, b"key10"), 101);
+        assert_eq!(child_for(&page, b"key15"), 101);
+        assert_eq!(child_for(&page, b"key2"), 101);
+        assert_eq!(child_for(&page, b"key20"), 102);
+        assert_eq!(child_for(&page, b"key99"), 103);
+        assert_eq!(child_for(&page, b"kez"), 103);
+    }
+}
@@ -0,0 +1,41 @@
+//! An embedded storage engine built to run inside a hard memory budget.
+//!
+//! All resident memory is accounted through a single [`MemoryBudget`] fixed
+//! when the [`Database`] is opened; components that cannot get memory are
+//! told to spill or wait instead of growing past the cap.
+
+pub mod aio;
+pub mod arena;
+pub mod bloom;
+pub mod checksum;
+pub mod column;
+pub mod compress;
+pub mod db;
+pub mod error;
+pub mod exec;
+pub mod hash;
+pub mod index;
+pub mod lsm;
+pub mod memory;
+pub mod mvcc;
+pub mod options;
+pub mod pressure;
+pub mod rebalance;
+pub mod recovery;
+pub mod row_cache;
+pub mod snapshot;
+pub mod stats;
+pub mod storage;
+mod sys;
+#[cfg(test)]
+mod test_util;
+pub mod wal;
+
+pub use compress::Codec;
+pub use db::{Database, ScanIter};
+pub use error::{Error, Result};
+pub use memory::{Consumer, MemoryBudget, Reservation};
+pub use mvcc::ReadView;
+pub use options::{Engine, Options};
+pub use snapshot::Snapshot;
+pub use stats::DatabaseStats;
@@ -0,0 +1,378 @@
+//! The in-memory sorted write buffer of the LSM engine.
+//!
+//! A skiplist whose nodes live in a single vector and link to each other by
+//! index. Nodes are never removed, so an iterator can remember its position
+//! as a plain index and re-take the read lock for every step. Overwriting a
+//! key points its node at the new value; deletions are stored as tombstones
+//! so they shadow older sorted runs.
+//!
+//! Keys and values are copied into an [`Arena`] and the forward links of
+//! every node share one vector, so an insert makes no heap allocation of
+//! its own. All of it is freed at once when the flushed memtable is
+//! dropped. A replaced value stays in the arena until then.
+
+use std::sync::{Arc, RwLock};
+
+use crate::arena::{Arena, Span};
+use crate::error::Result;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+
+const MAX_HEIGHT: usize = 12;
+const NIL: u32 = u32::MAX;
+const HEAD: u32 = 0;
+
+#[derive(Debug)]
+struct Node {
+    key: Span,
+    value: Option<Span>,
+    /// Position of the node's forward links in `SkipList::links`.
+    links: u32,
+}
+
+/// Memory a node of `height` levels adds outside the arena.
+fn footprint(height: usize) -> usize {
+    std::mem::size_of::<Node>() + height * std::mem::size_of::<u32>()
+}
+
+#[derive(Debug)]
+struct SkipList {
+    nodes: Vec<Node>,
+    links: Vec<u32>,
+    arena: Arena,
+    height: usize,
+    rng: u64,
+    bytes: usize,
+    len: usize,
+    last_lsn: u64,
+}
+
+impl SkipList {
+    fn random_height(&mut self) -> usize {
+        // xorshift; a quarter of nodes are promoted to each next level.
+        let mut height = 1;
+        while height < MAX_HEIGHT {
+            self.rng ^= self.rng << 13;
+            self.rng ^= self.rng >> 7;
+            self.rng ^= self.rng << 17;
+            if self.rng & 3 != 0 {
+                break;
+            }
+            height += 1;
+        }
+        height
+    }
+
+    fn next(&self, node: u32, level: usize) -> u32 {
+        self.links[self.nodes[node as usize].links as usize + level]
+    }
+
+    fn set_next(&mut self, node: u32, level: usize, next: u32) {
+        let at = self.nodes[node as usize].links as usize + level;
+        self.links[at] = next;
+    }
+
+    fn key(&self, node: u32) -> &[u8] {
+        self.arena.get(self.nodes[node as usize].key)
+    }
+
+    fn value(&self, node: u32) -> Option<&[u8]> {
+        self.nodes[node as usize]
+            .value
+            .map(|span| self.arena.get(span))
+    }
+
+    /// Returns, for every level, the last node whose key is below `key`.
+    fn find_predecessors(&self, key: &[u8]) -> [u32; MAX_HEIGHT] {
+        let mut preds = [HEAD; MAX_HEIGHT];
+        let mut node = HEAD;
+        for level in (0..self.height).rev() {
+            loop {
+                let next = self.next(node, level);
+                if next != NIL && self.key(next) < key {
+                    node = next;
+                } else {
+                    break;
+                }
+            }
+            preds[level] = node;
+        }
+        preds
+    }
+
+    fn seek(&self, key: &[u8]) -> u32 {
+        let preds = self.find_predecessors(key);
+        self.next(preds[0], 0)
+    }
+}
+
+/// A sorted, size-accounted write buffer.
+#[derive(Debug)]
+pub struct Memtable {
+    list: RwLock<SkipList>,
+    reservation: RwLock<Reservation>,
+}
+
+/// Outcome of looking a key up in one layer of the LSM tree.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Lookup {
+    Found(Vec<u8>),
+    Deleted,
+    Absent,
+}
+
+impl Memtable {
+    /// Creates an empty memtable charging its growth to `budget`.
+    pub fn new(budget: &Arc<MemoryBudget>) -> Result<Arc<Self>> {
+        let head = Node {
+            key: Span::default(),
+            value: None,
+            links: 0,
+        };
+        let bytes = footprint(MAX_HEIGHT);
+        let reservation = budget.try_reserve(Consumer::Memtable, bytes)?;
+        let arena = Arena::new(budget.try_reserve(Consumer::Memtable, 0)?, usize::MAX);
+        Ok(Arc::new(Memtable {
+            list: RwLock::new(SkipList {
+                nodes: vec![head],
+                links: vec![NIL; MAX_HEIGHT],
+                arena,
+                height: 1,
+                rng: 0x9e37_79b9_7f4a_7c15,
+                bytes,
+                len: 0,
+                last_lsn: 0,
+            }),
+            reservation: RwLock::new(reservation),
+        }))
+    }
+
+    /// Approximate bytes held by the memtable.
+    pub fn approximate_bytes(&self) -> usize {
+        let list = self.list.read().unwrap();
+        list.bytes + list.arena.held_bytes()
+    }
+
+    /// Number of distinct keys, tombstones included.
+    pub fn len(&self) -> usize {
+        self.list.read().unwrap().len
+    }
+
+    /// Whether no key has been written.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Log position of the newest write applied to the memtable.
+    pub fn last_lsn(&self) -> u64 {
+        self.list.read().unwrap().last_lsn
+    }
+
+    /// Records `value` (or a tombstone for `None`) under `key`, written to
+    /// the log at `lsn`. Fails with
+    /// [`Error::MemoryExhausted`](crate::Error::MemoryExhausted), leaving
+    /// the memtable unchanged, when the budget cannot cover the growth.
+    pub fn insert(&self, key: &[u8], value: Option<&[u8]>, lsn: u64) -> Result<()> {
+        let mut list = self.list.write().unwrap();
+        let preds = list.find_predecessors(key);
+        let next = list.next(preds[0], 0);
+        if next != NIL && list.key(next) == key {
+            let value = match value {
+                Some(value) => Some(list.arena.push(value)?),
+                None => None,
+            };
+            list.nodes[next as usize].value = value;
+            list.last_lsn = list.last_lsn.max(lsn);
+            return Ok(());
+        }
+
+        let height = list.random_height();
+        let footprint = footprint(height);
+        // Memory taken by `reserve` may already cover the node.
+        let grown = {
+            let mut reservation = self.reservation.write().unwrap();
+            let grown = (list.bytes + footprint).saturating_sub(reservation.size());
+            reservation.try_grow(grown)?;
+            grown
+        };
+        let value_len = value.map_or(0, <[u8]>::len);
+        let entry = match list.arena.alloc(key.len() + value_len) {
+            Ok(entry) => entry,
+            Err(err) => {
+                self.reservation.write().unwrap().shrink(grown);
+                return Err(err);
+            }
+        };
+        let data = list.arena.get_mut(entry);
+        data[..key.len()].copy_from_slice(key);
+        data[key.len()..].copy_from_slice(value.unwrap_or_default());
+        let (key, value_span) = entry.split_at(key.len());
+        let index = list.nodes.len() as u32;
+        let links = list.links.len() as u32;
+        list.nodes.push(Node {
+            key,
+            value: value.map(|_| value_span),
+            links,
+        });
+        list.links.resize(links as usize + height, NIL);
+        for (level, &pred) in preds.iter().enumerate().take(height) {
+            // Levels above the current height start from the head node,
+            // which find_predecessors already reports for them.
+            let succ = list.next(pred, level);
+            list.set_next(index, level, succ);
+            list.set_next(pred, level, index);
+        }
+        list.height = list.height.max(height);
+        list.bytes += footprint;
+        list.len += 1;
+        list.last_lsn = list.last_lsn.max(lsn);
+        Ok(())
+    }
+
+    /// Takes from the budget ahead of time the memory an insert of `len`
+    /// key and value bytes needs, so that the insert cannot then fail with
+    /// [`Error::MemoryExhausted`](crate::Error::MemoryExhausted). What is
+    /// left over is used by later inserts.
+    pub fn reserve(&self, len: usize) -> Result<()> {
+        let mut list = self.list.write().unwrap();
+        {
+            let mut reservation = self.reservation.write().unwrap();
+            let short = (list.bytes + footprint(MAX_HEIGHT)).saturating_sub(reservation.size());
+            reservation.try_grow(short)?;
+        }
+        list.arena.reserve(len)
+    }
+
+    /// Looks `key` up.
+    pub fn get(&self, key: &[u8]) -> Lookup {
+        let list = self.list.read().unwrap();
+        let node = list.seek(key);
+        if node == NIL || list.key(node) != key {
+            return Lookup::Absent;
+        }
+        match list.value(node) {
+            Some(value) => Lookup::Found(value.to_vec()),
+            None => Lookup::Deleted,
+        }
+    }
+
+    /// Iterates over entries with keys at or above `start`. Tombstones are
+    /// yielded as `None` values.
+    pub fn iter_from(self: &Arc<Self>, start: &[u8]) -> MemtableIter {
+        let next = self.list.read().unwrap().seek(start);
+        MemtableIter {
+            memtable: Arc::clone(self),
+            next,
+        }
+    }
+}
+
+/// Iterator over a [`Memtable`].
+#[derive(Debug)]
+pub struct MemtableIter {
+    memtable: Arc<Memtable>,
+    next: u32,
+}
+
+impl Iterator for MemtableIter {
+    type Item = (Vec<u8>, Option<Vec<u8>>);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.next == NIL {
+            return None;
+        }
+        let list = self.memtable.list.read().unwrap();
+        let node = self.next;
+        self.next = list.next(node, 0);
+        Some((
+            list.key(node).to_vec(),
+            list.value(node).map(<[u8]>::to_vec),
+        ))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeMap;
+
+    use super::*;
+    use crate::arena::ARENA_CHUNK_BYTES;
+    use crate::error::Error;
+
+    fn key(i: u32) -> Vec<u8> {
+        format!("key{i:06}").into_bytes()
+    }
+
+    #[test]
+    fn a_memtable_matches_a_sorted_map() {
+        let budget = MemoryBudget::new(64 << 20);
+        let memtable = Memtable::new(&budget).unwrap();
+        let mut expected = BTreeMap::new();
+        let mut rng = 7u64;
+        for lsn in 1..=20_000u64 {
+            rng = rng
+                .wrapping_mul(6364136223846793005)
+                .wrapping_add(1442695040888963407);
+            let k = key((rng >> 33) as u32 % 5000);
+            let value = (lsn % 7 != 0).then(|| format!("value {lsn}").into_bytes());
+            memtable.insert(&k, value.as_deref(), lsn).unwrap();
+            expected.insert(k, value);
+        }
+
+        assert_eq!(memtable.len(), expected.len());
+        assert_eq!(memtable.last_lsn(), 20_000);
+        for (k, value) in &expected {
+            let lookup = match value {
+                Some(value) => Lookup::Found(value.clone()),
+                None => Lookup::Deleted,
+            };
+            assert_eq!(memtable.get(k), lookup);
+        }
+        assert_eq!(memtable.get(b"key999999"), Lookup::Absent);
+        let all: Vec<_> = memtable.iter_from(&[]).collect();
+        assert_eq!(all, expected.clone().into_iter().collect::<Vec<_>>());
+        let tail: Vec<_> = memtable.iter_from(&key(4990)).map(|(k, _)| k).collect();
+        let expected_tail: Vec<_> = expected
+            .range(key(4990)..)
+            .map(|(k, _)| k.clone())
+            .collect();
+        assert_eq!(tail, expected_tail);
+    }
+
+    #[test]
+    fn memory_is_charged_to_the_budget_and_returned_on_drop() {
+        let budget = MemoryBudget::new(64 << 20);
+        let memtable = Memtable::new(&budget).unwrap();
+        for i in 0..1000 {
+            memtable.insert(&key(i), Some(&[0; 100]), 1).unwrap();
+        }
+        let charged = budget.usage(Consumer::Memtable);
+        assert!(charged >= memtable.approximate_bytes(), "{charged}");
+        assert!(memtable.approximate_bytes() > 1000 * 110);
+        drop(memtable);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn an_insert_past_the_budget_changes_nothing() {
+        let budget = MemoryBudget::new(footprint(MAX_HEIGHT) + ARENA_CHUNK_BYTES + 4096);
+        let memtable = Memtable::new(&budget).unwrap();
+        let mut written = 0;
+        let err = loop {
+            match memtable.insert(&key(written), Some(&[1; 200]), 1) {
+                Ok(()) => written += 1,
+                Err(err) => break err,
+            }
+        };
+        assert!(matches!(err, Error::MemoryExhausted { .. }), "{err:?}");
+        assert_eq!(memtable.len(), written as usize);
+        assert_eq!(memtable.get(&key(written)), Lookup::Absent);
+        assert_eq!(memtable.iter_from(&[]).count(), written as usize);
+
+        // Memory reserved ahead of time makes the same insert succeed.
+        budget.set_limit(1 << 20);
+        memtable.reserve(key(written).len() + 200).unwrap();
+        budget.set_limit(budget.used());
+        memtable.insert(&key(written), Some(&[1; 200]), 2).unwrap();
+        assert_eq!(memtable.get(&key(written)), Lookup::Found(vec![1; 200]));
+    }
+}
@@ -0,0 +1,94 @@
+//! K-way merge of sorted entry streams.
+
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+
+use crate::error::Result;
+use crate::lsm::sstable::Entry;
+
+/// A boxed sorted entry stream.
+pub type EntryStream = Box<dyn Iterator<Item = Result<Entry>> + Send>;
+
+struct HeapItem {
+    entry: Entry,
+    source: usize,
+}
+
+impl PartialEq for HeapItem {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for HeapItem {}
+
+impl PartialOrd for HeapItem {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for HeapItem {
+    // BinaryHeap is a max-heap: invert so the smallest key, and for equal
+    // keys the lowest (newest) source, is popped first.
+    fn cmp(&self, other: &Self) -> Ordering {
+        other
+            .entry
+            .0
+            .cmp(&self.entry.0)
+            .then_with(|| other.source.cmp(&self.source))
+    }
+}
+
+/// Merges streams ordered newest first. For keys present in several streams
+/// only the newest entry is yielded.
+pub struct MergeIter {
+    sources: Vec<EntryStream>,
+    heap: BinaryHeap<HeapItem>,
+    primed: bool,
+}
+
+impl MergeIter {
+    /// Creates a merge over `sources`, where index 0 is the newest.
+    pub fn new(sources: Vec<EntryStream>) -> Self {
+        MergeIter {
+            heap: BinaryHeap::with_capacity(sources.len()),
+            sources,
+            primed: false,
+        }
+    }
+
+    fn advance(&mut self, source: usize) -> Result<()> {
+        if let Some(entry) = self.sources[source].next().transpose()? {
+            self.heap.push(HeapItem { entry, source });
+        }
+        Ok(())
+    }
+}
+
+impl Iterator for MergeIter {
+    type Item = Result<Entry>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if !self.primed {
+            self.primed = true;
+            for source in 0..self.sources.len() {
+                if let Err(err) = self.advance(source) {
+                    return Some(Err(err));
+                }
+            }
+        }
+        let HeapItem { entry, source } = self.heap.pop()?;
+        if let Err(err) = self.advance(source) {
+            return Some(Err(err));
+        }
+        // Drop older versions of the same key.
+        while self.heap.peek().is_some_and(|top| top.entry.0 == entry.0) {
+            let stale = self.heap.pop().unwrap();
+            if let Err(err) = self.advance(stale.source) {
+                return Some(Err(err));
+            }
+        }
+        Some(Ok(entry))
+    }
+}
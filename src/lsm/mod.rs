@@ -0,0 +1,13 @@
+//! Log-structured merge-tree engine for write-heavy workloads.
+
+pub mod memtable;
+mod merge;
+pub mod snapshot;
+pub mod sstable;
+pub mod tree;
+mod version;
+
+pub use memtable::Memtable;
+pub use snapshot::LsmSnapshot;
+pub use sstable::{CompressionStats, FilterStats, SsTable, SsTableBuilder};
+pub use tree::{LsmIter, LsmTree, MemtableLimit};
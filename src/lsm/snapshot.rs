@@ -0,0 +1,84 @@
+//! Read-only views of an LSM tree for processes other than its writer.
+//!
+//! A snapshot loads the manifest once and maps every run it lists. Runs
+//! are immutable and a run file deleted by a later compaction stays
+//! readable through its mapping, so the snapshot is an exact point-in-time
+//! view of the tree as of its last flush. Writes still in the writer's
+//! memtables are not visible.
+
+use std::path::Path;
+use std::sync::Arc;
+
+use crate::error::{Error, Result};
+use crate::lsm::sstable::SsTable;
+use crate::lsm::tree::LsmIter;
+use crate::lsm::version::{table_path, Manifest, Version};
+use crate::memory::MemoryBudget;
+
+/// Attempts at loading a manifest whose runs are being compacted away.
+const OPEN_ATTEMPTS: usize = 8;
+
+/// The runs of an LSM tree as of one manifest, read through mappings.
+#[derive(Debug)]
+pub struct LsmSnapshot {
+    version: Version,
+    log_lsn: u64,
+}
+
+impl LsmSnapshot {
+    /// Maps the runs listed in the manifest in `dir`, charging their
+    /// indexes to `budget`.
+    pub fn open(dir: impl AsRef<Path>, budget: &Arc<MemoryBudget>) -> Result<Self> {
+        let dir = dir.as_ref();
+        let mut attempt = 0;
+        loop {
+            match Self::load(dir, budget) {
+                // A compaction replaced a listed run between reading the
+                // manifest and opening it; the new manifest is in place.
+                Err(Error::Io(err))
+                    if err.kind() == std::io::ErrorKind::NotFound
+                        && attempt + 1 < OPEN_ATTEMPTS =>
+                {
+                    attempt += 1;
+                }
+                result => return result,
+            }
+        }
+    }
+
+    fn load(dir: &Path, budget: &Arc<MemoryBudget>) -> Result<Self> {
+        let manifest = Manifest::load(dir)?;
+        let mut version = Version::default();
+        for (level, numbers) in manifest.levels.iter().enumerate() {
+            for &number in numbers {
+                let table = SsTable::open_mapped(number, table_path(dir, number), budget)?;
+                version.levels[level].push(table);
+            }
+        }
+        Ok(LsmSnapshot {
+            version,
+            log_lsn: manifest.log_lsn,
+        })
+    }
+
+    /// Newest log position whose writes the snapshot contains.
+    pub fn lsn(&self) -> u64 {
+        self.log_lsn
+    }
+
+    /// Calls `f` with the value stored under `key`, read in place.
+    pub fn get_with<T>(&self, key: &[u8], f: impl FnOnce(&[u8]) -> T) -> Result<Option<T>> {
+        let mut f = Some(f);
+        let found = self
+            .version
+            .lookup_with(key, &mut |value| value.map(|v| (f.take().unwrap())(v)))?;
+        Ok(found.flatten())
+    }
+
+    /// Iterates over live entries with keys at or above `start`.
+    pub fn scan_from(&self, start: &[u8]) -> LsmIter {
+        let mut sources = Vec::new();
+        self.version.streams_from(start, &mut sources);
+        LsmIter::new(sources)
+    }
+}
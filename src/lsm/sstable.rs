@@ -0,0 +1,879 @@
+//! Immutable sorted runs ("SSTables") written by memtable flushes and
+//! compactions.
+//!
+//! ```text
+//! +---------+-----+---------+------------------+-----------------+--------+
+//! | block 0 | ... | block n | filter (f pages) | index (k pages) | footer |
+//! +---------+-----+---------+------------------+-----------------+--------+
+//! ```
+//!
+//! The file is read in [`PAGE_SIZE`] pages through the shared buffer pool
+//! like any other file. A block holds a count followed by sorted entries
+//! `[key_len u16][value_len u16][flags u8][key][value]` and is stored as
+//! `[codec u8][raw_len u32][payload]`. Uncompressed runs fill and pad one
+//! page per block, so a lookup touches a single page. Compressed runs pack
+//! larger blocks back to back; the pool then caches compressed pages and a
+//! block is decoded only while it is being read, which stretches the cache
+//! over more data. A block that does not shrink is stored raw.
+//!
+//! The index records the first key and location of every block and is kept
+//! in memory, charged to the budget, while the run is open.
+//!
+//! The filter is a blocked Bloom filter over every key in the run, one
+//! block per page. A point lookup reads the one filter page its key hashes
+//! to before touching a data block, so most lookups of absent keys never
+//! read the run's data. Filter pages go through the buffer pool like data
+//! pages: pages probed often stay resident and idle ones are evicted.
+//!
+//! A run can also be opened over a read-only mapping instead of the pool,
+//! for snapshot readers in other processes; blocks are then read straight
+//! from the operating system's page cache.
+
+use std::fs::{self, File};
+use std::io::{BufWriter, Write};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
+
+use crate::bloom;
+use crate::compress::Codec;
+use crate::error::{Error, Result};
+use crate::lsm::memtable::Lookup;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::storage::{BufferPool, FileId, MappedFile, PageId, PageScan, PAGE_SIZE};
+
+const MAGIC: &[u8; 8] = b"DIGSSTBL";
+const ENTRY_HEADER: usize = 5;
+const BLOCK_COUNT_HEADER: usize = 2;
+const STORED_HEADER: usize = 5;
+const FLAG_TOMBSTONE: u8 = 1;
+/// Uncompressed size of the blocks of compressed runs.
+const COMPRESSED_BLOCK_BYTES: usize = 16 << 10;
+
+/// Fixed part of the footer, which is followed by the largest key.
+const FOOTER_HEADER: usize = 59;
+
+/// Largest key plus value a sorted run can store. An entry must fit an
+/// uncompressed block, and a key must fit the footer.
+pub const MAX_ENTRY_SIZE: usize = PAGE_SIZE - 64;
+
+const _: () = assert!(MAX_ENTRY_SIZE + FOOTER_HEADER <= PAGE_SIZE);
+const _: () =
+    assert!(MAX_ENTRY_SIZE + STORED_HEADER + BLOCK_COUNT_HEADER + ENTRY_HEADER <= PAGE_SIZE);
+
+/// An entry as stored in a run; `None` marks a deletion.
+pub type Entry = (Vec<u8>, Option<Vec<u8>>);
+
+#[derive(Debug)]
+struct BlockHandle {
+    first_key: Vec<u8>,
+    offset: u64,
+    len: u32,
+}
+
+/// Streams sorted entries into a new run file.
+#[derive(Debug)]
+pub struct SsTableBuilder {
+    path: PathBuf,
+    out: BufWriter<File>,
+    codec: Codec,
+    block: Vec<u8>,
+    block_count: usize,
+    block_limit: usize,
+    stored: Vec<u8>,
+    index: Vec<BlockHandle>,
+    last_key: Vec<u8>,
+    /// Filter hash of every key added, for the filter written at the end.
+    hashes: Vec<u64>,
+    entries: u64,
+    offset: u64,
+    raw_bytes: u64,
+}
+
+impl SsTableBuilder {
+    /// Creates the run file at `path`, compressing blocks with `codec`.
+    pub fn create(path: impl AsRef<Path>, codec: Codec) -> Result<Self> {
+        let path = path.as_ref().to_path_buf();
+        let out = BufWriter::with_capacity(4 * PAGE_SIZE, File::create(&path)?);
+        let block_limit = match codec {
+            Codec::None => PAGE_SIZE - STORED_HEADER,
+            _ => COMPRESSED_BLOCK_BYTES,
+        };
+        Ok(SsTableBuilder {
+            path,
+            out,
+            codec,
+            block: vec![0; BLOCK_COUNT_HEADER],
+            block_count: 0,
+            block_limit,
+            stored: Vec::new(),
+            index: Vec::new(),
+            last_key: Vec::new(),
+            hashes: Vec::new(),
+            entries: 0,
+            offset: 0,
+            raw_bytes: 0,
+        })
+    }
+
+    /// Appends an entry. Keys must arrive in strictly increasing order.
+    pub fn add(&mut self, key: &[u8], value: Option<&[u8]>) -> Result<()> {
+        debug_assert!(self.entries == 0 || key > self.last_key.as_slice());
+        let value_len = value.map_or(0, <[u8]>::len);
+        let size = ENTRY_HEADER + key.len() + value_len;
+        if key.len() + value_len > MAX_ENTRY_SIZE {
+            return Err(Error::InvalidArgument(format!(
+                "entry of {} bytes exceeds the {MAX_ENTRY_SIZE} byte limit",
+                key.len() + value_len
+            )));
+        }
+        if self.block.len() + size > self.block_limit {
+            self.finish_block()?;
+        }
+        if self.block_count == 0 {
+            self.index.push(BlockHandle {
+                first_key: key.to_vec(),
+                offset: 0,
+                len: 0,
+            });
+        }
+        self.block
+            .extend_from_slice(&(key.len() as u16).to_le_bytes());
+        self.block
+            .extend_from_slice(&(value_len as u16).to_le_bytes());
+        self.block
+            .push(if value.is_some() { 0 } else { FLAG_TOMBSTONE });
+        self.block.extend_from_slice(key);
+        self.block.extend_from_slice(value.unwrap_or_default());
+        self.block_count += 1;
+        self.hashes.push(bloom::key_hash(key));
+        self.entries += 1;
+        self.last_key.clear();
+        self.last_key.extend_from_slice(key);
+        Ok(())
+    }
+
+    /// Bytes written so far, used to cut runs at a target size.
+    pub fn file_size(&self) -> u64 {
+        self.offset + PAGE_SIZE as u64
+    }
+
+    /// Number of entries added.
+    pub fn entries(&self) -> u64 {
+        self.entries
+    }
+
+    fn finish_block(&mut self) -> Result<()> {
+        self.block[..BLOCK_COUNT_HEADER].copy_from_slice(&(self.block_count as u16).to_le_bytes());
+        self.stored.clear();
+        self.stored.push(self.codec.id());
+        self.stored
+            .extend_from_slice(&(self.block.len() as u32).to_le_bytes());
+        self.codec.compress(&self.block, &mut self.stored);
+        if self.stored.len() >= STORED_HEADER + self.block.len() {
+            self.stored.truncate(STORED_HEADER);
+            self.stored[0] = Codec::None.id();
+            self.stored.extend_from_slice(&self.block);
+        }
+        let handle = self.index.last_mut().unwrap();
+        handle.offset = self.offset;
+        handle.len = self.stored.len() as u32;
+        if self.codec == Codec::None {
+            self.stored.resize(PAGE_SIZE, 0);
+        }
+        self.out.write_all(&self.stored)?;
+        self.offset += self.stored.len() as u64;
+        self.raw_bytes += self.block.len() as u64;
+        self.block.clear();
+        self.block.resize(BLOCK_COUNT_HEADER, 0);
+        self.block_count = 0;
+        Ok(())
+    }
+
+    /// Writes the filter, index and footer and syncs the file.
+    pub fn finish(mut self) -> Result<PathBuf> {
+        if self.block_count > 0 {
+            self.finish_block()?;
+        }
+        let data_bytes = self.offset;
+        let padding = data_bytes.next_multiple_of(PAGE_SIZE as u64) - data_bytes;
+        self.out.write_all(&vec![0u8; padding as usize])?;
+        let data_pages = (data_bytes + padding) / PAGE_SIZE as u64;
+
+        let filter_pages = bloom::blocked_blocks(self.hashes.len(), PAGE_SIZE);
+        self.out
+            .write_all(&bloom::build_blocked(&self.hashes, filter_pages, PAGE_SIZE))?;
+
+        let mut index = Vec::new();
+        for handle in &self.index {
+            index.extend_from_slice(&(handle.first_key.len() as u16).to_le_bytes());
+            index.extend_from_slice(&handle.first_key);
+            index.extend_from_slice(&handle.offset.to_le_bytes());
+            index.extend_from_slice(&handle.len.to_le_bytes());
+        }
+        let index_len = index.len() as u64;
+        index.resize(index.len().div_ceil(PAGE_SIZE) * PAGE_SIZE, 0);
+        self.out.write_all(&index)?;
+
+        let mut footer = Vec::with_capacity(PAGE_SIZE);
+        footer.extend_from_slice(MAGIC);
+        footer.extend_from_slice(&data_pages.to_le_bytes());
+        footer.extend_from_slice(&index_len.to_le_bytes());
+        footer.extend_from_slice(&self.entries.to_le_bytes());
+        footer.extend_from_slice(&self.raw_bytes.to_le_bytes());
+        footer.extend_from_slice(&data_bytes.to_le_bytes());
+        footer.extend_from_slice(&(filter_pages as u64).to_le_bytes());
+        footer.push(self.codec.id());
+        footer.extend_from_slice(&(self.last_key.len() as u16).to_le_bytes());
+        footer.extend_from_slice(&self.last_key);
+        footer.resize(PAGE_SIZE, 0);
+        self.out.write_all(&footer)?;
+        self.out.flush()?;
+        self.out.get_ref().sync_all()?;
+        Ok(self.path)
+    }
+}
+
+/// Compression figures of one or more runs.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CompressionStats {
+    /// Entry bytes before compression.
+    pub raw_bytes: u64,
+    /// Bytes the same blocks occupy on disk and in the buffer pool.
+    pub stored_bytes: u64,
+    /// Compressed blocks decoded by reads.
+    pub blocks_decoded: u64,
+    /// Time spent decoding them.
+    pub decode_nanos: u64,
+}
+
+impl CompressionStats {
+    /// Raw bytes per stored byte; 1.0 when nothing is stored.
+    pub fn ratio(&self) -> f64 {
+        if self.stored_bytes == 0 {
+            1.0
+        } else {
+            self.raw_bytes as f64 / self.stored_bytes as f64
+        }
+    }
+
+    /// Mean time to decode a compressed block.
+    pub fn mean_decode_nanos(&self) -> u64 {
+        self.decode_nanos / self.blocks_decoded.max(1)
+    }
+
+    /// Adds the figures of `other`.
+    pub fn add(&mut self, other: &CompressionStats) {
+        self.raw_bytes += other.raw_bytes;
+        self.stored_bytes += other.stored_bytes;
+        self.blocks_decoded += other.blocks_decoded;
+        self.decode_nanos += other.decode_nanos;
+    }
+}
+
+/// Filter size and effect of one or more runs.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct FilterStats {
+    /// Bytes of filter pages on disk.
+    pub bytes: u64,
+    /// Point lookups checked against a filter.
+    pub probes: u64,
+    /// Lookups the filter answered without reading a data block.
+    pub negatives: u64,
+}
+
+impl FilterStats {
+    /// Adds the figures of `other`.
+    pub fn add(&mut self, other: &FilterStats) {
+        self.bytes += other.bytes;
+        self.probes += other.probes;
+        self.negatives += other.negatives;
+    }
+}
+
+/// Where the pages of an open run come from.
+#[derive(Debug)]
+enum Pages {
+    Pool {
+        pool: Arc<BufferPool>,
+        file_id: FileId,
+    },
+    Mapped(MappedFile),
+}
+
+/// An open, immutable sorted run whose pages are served by the buffer pool
+/// or a read-only mapping.
+#[derive(Debug)]
+pub struct SsTable {
+    number: u64,
+    path: PathBuf,
+    pages: Pages,
+    index: Vec<BlockHandle>,
+    largest: Vec<u8>,
+    entries: u64,
+    file_size: u64,
+    /// The filter occupies the pages from `data_pages` on.
+    data_pages: u64,
+    filter_pages: u64,
+    codec: Codec,
+    raw_bytes: u64,
+    stored_bytes: u64,
+    blocks_decoded: AtomicU64,
+    decode_nanos: AtomicU64,
+    filter_probes: AtomicU64,
+    filter_negatives: AtomicU64,
+    obsolete: AtomicBool,
+    _reservation: Reservation,
+}
+
+impl SsTable {
+    /// Opens run `number` stored at `path`, charging its index to `budget`.
+    pub fn open(
+        number: u64,
+        path: impl AsRef<Path>,
+        pool: &Arc<BufferPool>,
+        budget: &Arc<MemoryBudget>,
+    ) -> Result<Arc<Self>> {
+        Self::open_with(number, path.as_ref(), budget, |path| {
+            let file_id = pool.open_file(path)?;
+            Ok(Pages::Pool {
+                pool: Arc::clone(pool),
+                file_id,
+            })
+        })
+    }
+
+    /// Opens run `number` stored at `path` over a read-only mapping,
+    /// bypassing the buffer pool. The run is never deleted by this handle.
+    pub fn open_mapped(
+        number: u64,
+        path: impl AsRef<Path>,
+        budget: &Arc<MemoryBudget>,
+    ) -> Result<Arc<Self>> {
+        Self::open_with(number, path.as_ref(), budget, |path| {
+            Ok(Pages::Mapped(MappedFile::open(path)?))
+        })
+    }
+
+    fn open_with(
+        number: u64,
+        path: &Path,
+        budget: &Arc<MemoryBudget>,
+        pages: impl FnOnce(&Path) -> Result<Pages>,
+    ) -> Result<Arc<Self>> {
+        let path = path.to_path_buf();
+        let file = File::open(&path)?;
+        let file_size = file.metadata()?.len();
+        let damaged = |what: &str| Error::Corruption(format!("{} {what}", path.display()));
+        if file_size < PAGE_SIZE as u64 || file_size % PAGE_SIZE as u64 != 0 {
+            return Err(damaged("is truncated"));
+        }
+        let mut footer = vec![0u8; PAGE_SIZE];
+        file.read_exact_at(&mut footer, file_size - PAGE_SIZE as u64)?;
+        if &footer[..8] != MAGIC {
+            return Err(damaged("is not a sorted run"));
+        }
+        let read_u64 = |at: usize| u64::from_le_bytes(footer[at..at + 8].try_into().unwrap());
+        let data_pages = read_u64(8);
+        let index_len = read_u64(16) as usize;
+        let entries = read_u64(24);
+        let raw_bytes = read_u64(32);
+        let stored_bytes = read_u64(40);
+        let filter_pages = read_u64(48);
+        let codec = Codec::from_id(footer[56])?;
+        let largest_len = u16::from_le_bytes([footer[57], footer[58]]) as usize;
+        if stored_bytes > data_pages * PAGE_SIZE as u64
+            || (data_pages + filter_pages + 1) * PAGE_SIZE as u64 + index_len as u64 > file_size
+            || FOOTER_HEADER + largest_len > PAGE_SIZE
+        {
+            return Err(damaged("has a damaged footer"));
+        }
+        let largest = footer[FOOTER_HEADER..FOOTER_HEADER + largest_len].to_vec();
+
+        let mut raw = vec![0u8; index_len];
+        file.read_exact_at(&mut raw, (data_pages + filter_pages) * PAGE_SIZE as u64)?;
+        let mut index = Vec::new();
+        let mut at = 0;
+        while at < raw.len() {
+            let len = u16::from_le_bytes([raw[at], raw[at + 1]]) as usize;
+            let key_end = at + 2 + len;
+            if key_end + 12 > raw.len() {
+                return Err(damaged("has a damaged index"));
+            }
+            index.push(BlockHandle {
+                first_key: raw[at + 2..key_end].to_vec(),
+                offset: u64::from_le_bytes(raw[key_end..key_end + 8].try_into().unwrap()),
+                len: u32::from_le_bytes(raw[key_end + 8..key_end + 12].try_into().unwrap()),
+            });
+            at = key_end + 12;
+        }
+        if index
+            .iter()
+            .any(|h| h.offset + h.len as u64 > stored_bytes || (h.len as usize) < STORED_HEADER)
+        {
+            return Err(damaged("has a damaged index"));
+        }
+        let index_bytes = index
+            .iter()
+            .map(|h| h.first_key.len() + std::mem::size_of::<BlockHandle>())
+            .sum::<usize>()
+            + largest.len();
+        let reservation = budget.try_reserve(Consumer::Index, index_bytes)?;
+        drop(file);
+
+        let pages = pages(&path)?;
+        Ok(Arc::new(SsTable {
+            number,
+            path,
+            pages,
+            index,
+            largest,
+            entries,
+            file_size,
+            data_pages,
+            filter_pages,
+            codec,
+            raw_bytes,
+            stored_bytes,
+            blocks_decoded: AtomicU64::new(0),
+            decode_nanos: AtomicU64::new(0),
+            filter_probes: AtomicU64::new(0),
+            filter_negatives: AtomicU64::new(0),
+            obsolete: AtomicBool::new(false),
+            _reservation: reservation,
+        }))
+    }
+
+    /// The run's file number.
+    pub fn number(&self) -> u64 {
+        self.number
+    }
+
+    /// Size of the run file in bytes.
+    pub fn file_size(&self) -> u64 {
+        self.file_size
+    }
+
+    /// Number of entries, tombstones included.
+    pub fn entries(&self) -> u64 {
+        self.entries
+    }
+
+    /// The codec the run was written with.
+    pub fn codec(&self) -> Codec {
+        self.codec
+    }
+
+    /// Compression ratio and decode cost of this run.
+    pub fn compression_stats(&self) -> CompressionStats {
+        CompressionStats {
+            raw_bytes: self.raw_bytes,
+            stored_bytes: self.stored_bytes,
+            blocks_decoded: self.blocks_decoded.load(Ordering::Relaxed),
+            decode_nanos: self.decode_nanos.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Filter size and lookups it answered for this run.
+    pub fn filter_stats(&self) -> FilterStats {
+        FilterStats {
+            bytes: self.filter_pages * PAGE_SIZE as u64,
+            probes: self.filter_probes.load(Ordering::Relaxed),
+            negatives: self.filter_negatives.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Smallest key in the run.
+    pub fn smallest(&self) -> &[u8] {
+        self.index.first().map_or(&[], |h| h.first_key.as_slice())
+    }
+
+    /// Largest key in the run.
+    pub fn largest(&self) -> &[u8] {
+        &self.largest
+    }
+
+    /// Whether the run's key range intersects `[smallest, largest]`.
+    pub fn overlaps(&self, smallest: &[u8], largest: &[u8]) -> bool {
+        !self.index.is_empty() && self.smallest() <= largest && self.largest() >= smallest
+    }
+
+    /// Deletes the file once the last reference to the run is dropped.
+    pub fn mark_obsolete(&self) {
+        self.obsolete.store(true, Ordering::Release);
+    }
+
+    fn block_for(&self, key: &[u8]) -> Option<usize> {
+        match self
+            .index
+            .partition_point(|h| h.first_key.as_slice() <= key)
+        {
+            0 => None,
+            n => Some(n - 1),
+        }
+    }
+
+    /// Calls `f` with the decoded contents of block `block`, reading its
+    /// pages through `scan` if given. A raw block within one page is read in
+    /// place; anything else is assembled from its pages and decoded into a
+    /// temporary buffer.
+    fn with_block<T>(
+        &self,
+        block: usize,
+        scan: Option<&mut PageScan>,
+        f: impl FnOnce(&[u8]) -> T,
+    ) -> Result<T> {
+        let handle = &self.index[block];
+        let (pool, file_id) = match &self.pages {
+            Pages::Pool { pool, file_id } => (pool, *file_id),
+            Pages::Mapped(map) => {
+                let start = handle.offset as usize;
+                let stored = &map.bytes()[start..start + handle.len as usize];
+                if stored[0] == Codec::None.id() {
+                    return Ok(f(&stored[STORED_HEADER..]));
+                }
+                return self.decode(stored).map(|block| f(&block));
+            }
+        };
+        let page_size = PAGE_SIZE as u64;
+        let first_page = handle.offset / page_size;
+        let end = handle.offset + handle.len as u64;
+        let last_page = (end - 1) / page_size;
+        if first_page == last_page {
+            let guard = match scan {
+                Some(scan) => scan.fetch(first_page)?,
+                None => pool.fetch_file_page(file_id, first_page)?,
+            };
+            let data = guard.read();
+            let at = (handle.offset % page_size) as usize;
+            let stored = &data[at..at + handle.len as usize];
+            if stored[0] == Codec::None.id() {
+                return Ok(f(&stored[STORED_HEADER..]));
+            }
+            return self.decode(stored).map(|block| f(&block));
+        }
+        let page_ids: Vec<PageId> = (first_page..=last_page).collect();
+        let guards = match scan {
+            Some(scan) => scan.fetch_pages(&page_ids)?,
+            None => pool.fetch_file_pages(file_id, &page_ids)?,
+        };
+        let mut stored = Vec::with_capacity(handle.len as usize);
+        for (page, guard) in (first_page..=last_page).zip(&guards) {
+            let data = guard.read();
+            let from = handle.offset.max(page * page_size) - page * page_size;
+            let to = end.min((page + 1) * page_size) - page * page_size;
+            stored.extend_from_slice(&data[from as usize..to as usize]);
+        }
+        self.decode(&stored).map(|block| f(&block))
+    }
+
+    fn decode(&self, stored: &[u8]) -> Result<Vec<u8>> {
+        let codec = Codec::from_id(stored[0])?;
+        let raw_len = u32::from_le_bytes(stored[1..STORED_HEADER].try_into().unwrap()) as usize;
+        let payload = &stored[STORED_HEADER..];
+        if codec == Codec::None {
+            return codec.decompress(payload, raw_len);
+        }
+        let started = Instant::now();
+        let block = codec.decompress(payload, raw_len)?;
+        self.blocks_decoded.fetch_add(1, Ordering::Relaxed);
+        self.decode_nanos
+            .fetch_add(started.elapsed().as_nanos() as u64, Ordering::Relaxed);
+        Ok(block)
+    }
+
+    /// Checks `key` against the filter, reading the one filter page it
+    /// hashes to. Runs without a filter may contain any key.
+    fn may_contain(&self, key: &[u8]) -> Result<bool> {
+        if self.filter_pages == 0 {
+            return Ok(true);
+        }
+        let hash = bloom::key_hash(key);
+        let page = self.data_pages + bloom::block_of(hash, self.filter_pages as usize) as u64;
+        let found = match &self.pages {
+            Pages::Pool { pool, file_id } => {
+                let guard = pool.fetch_file_page(*file_id, page)?;
+                let data = guard.read();
+                bloom::block_may_contain(&data, hash)
+            }
+            Pages::Mapped(map) => {
+                let start = page as usize * PAGE_SIZE;
+                bloom::block_may_contain(&map.bytes()[start..start + PAGE_SIZE], hash)
+            }
+        };
+        self.filter_probes.fetch_add(1, Ordering::Relaxed);
+        if !found {
+            self.filter_negatives.fetch_add(1, Ordering::Relaxed);
+        }
+        Ok(found)
+    }
+
+    fn read_block(&self, block: usize, scan: Option<&mut PageScan>) -> Result<Vec<Entry>> {
+        self.with_block(block, scan, decode_block)
+    }
+
+    /// Looks `key` up, decoding at most one block.
+    pub fn get(&self, key: &[u8]) -> Result<Lookup> {
+        let found = self.lookup_with(key, &mut |value| match value {
+            Some(value) => Lookup::Found(value.to_vec()),
+            None => Lookup::Deleted,
+        })?;
+        Ok(found.unwrap_or(Lookup::Absent))
+    }
+
+    /// Looks `key` up and, if the run has an entry for it, calls `f` with
+    /// the value in place, or `None` for a deletion.
+    pub fn lookup_with<T>(
+        &self,
+        key: &[u8],
+        f: &mut impl FnMut(Option<&[u8]>) -> T,
+    ) -> Result<Option<T>> {
+        if key > self.largest.as_slice() {
+            return Ok(None);
+        }
+        let Some(block) = self.block_for(key) else {
+            return Ok(None);
+        };
+        if !self.may_contain(key)? {
+            return Ok(None);
+        }
+        self.with_block(block, None, |data| {
+            let count = u16::from_le_bytes([data[0], data[1]]) as usize;
+            let mut at = BLOCK_COUNT_HEADER;
+            for _ in 0..count {
+                let (entry_key, value, next) = decode_entry(data, at);
+                match entry_key.cmp(key) {
+                    std::cmp::Ordering::Less => at = next,
+                    std::cmp::Ordering::Equal => return Some(f(value)),
+                    std::cmp::Ordering::Greater => break,
+                }
+            }
+            None
+        })
+    }
+
+    /// Iterates over entries with keys at or above `start`, holding at most
+    /// one decoded block in memory.
+    pub fn iter_from(self: &Arc<Self>, start: &[u8]) -> SsTableIter {
+        SsTableIter {
+            table: Arc::clone(self),
+            next_block: self.block_for(start).unwrap_or(0),
+            scan: match &self.pages {
+                Pages::Pool { pool, file_id } => Some(pool.page_scan(*file_id, self.data_pages)),
+                Pages::Mapped(_) => None,
+            },
+            start: start.to_vec(),
+            batch: Vec::new(),
+            error: false,
+        }
+    }
+}
+
+impl Drop for SsTable {
+    fn drop(&mut self) {
+        if let Pages::Pool { pool, file_id } = &self.pages {
+            pool.detach(*file_id);
+        }
+        if self.obsolete.load(Ordering::Acquire) {
+            let _ = fs::remove_file(&self.path);
+        }
+    }
+}
+
+fn decode_entry(data: &[u8], at: usize) -> (&[u8], Option<&[u8]>, usize) {
+    let key_len = u16::from_le_bytes([data[at], data[at + 1]]) as usize;
+    let value_len = u16::from_le_bytes([data[at + 2], data[at + 3]]) as usize;
+    let flags = data[at + 4];
+    let key_start = at + ENTRY_HEADER;
+    let value_start = key_start + key_len;
+    let key = &data[key_start..value_start];
+    let value = (flags & FLAG_TOMBSTONE == 0).then(|| &data[value_start..value_start + value_len]);
+    (key, value, value_start + value_len)
+}
+
+fn decode_block(data: &[u8]) -> Vec<Entry> {
+    let count = u16::from_le_bytes([data[0], data[1]]) as usize;
+    let mut entries = Vec::with_capacity(count);
+    let mut at = BLOCK_COUNT_HEADER;
+    for _ in 0..count {
+        let (key, value, next) = decode_entry(data, at);
+        entries.push((key.to_vec(), value.map(<[u8]>::to_vec)));
+        at = next;
+    }
+    entries
+}
+
+/// Iterator over a [`SsTable`].
+///
+/// Like a B+tree scan, it reads blocks through a [`PageScan`], which
+/// switches to a scan ring once the scan is long and reads the next blocks
+/// ahead.
+#[derive(Debug)]
+pub struct SsTableIter {
+    table: Arc<SsTable>,
+    next_block: usize,
+    /// `None` for a mapped run.
+    scan: Option<PageScan>,
+    start: Vec<u8>,
+    batch: Vec<Entry>,
+    error: bool,
+}
+
+impl Iterator for SsTableIter {
+    type Item = Result<Entry>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            if let Some(entry) = self.batch.pop() {
+                return Some(Ok(entry));
+            }
+            if self.error || self.next_block >= self.table.index.len() {
+                return None;
+            }
+            match self.table.read_block(self.next_block, self.scan.as_mut()) {
+                Ok(mut entries) => {
+                    self.next_block += 1;
+                    entries.retain(|(key, _)| key.as_slice() >= self.start.as_slice());
+                    entries.reverse();
+                    self.batch = entries;
+                }
+                Err(err) => {
+                    self.error = true;
+                    return Some(Err(err));
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::OpenOptions;
+
+    use super::*;
+    use crate::storage::DiskManager;
+    use crate::test_util::TempDir;
+
+    fn key(i: u32) -> Vec<u8> {
+        format!("key{i:06}").into_bytes()
+    }
+
+    /// Every tenth entry is a deletion; the rest compress well.
+    fn value(i: u32) -> Option<Vec<u8>> {
+        (!i.is_multiple_of(10)).then(|| {
+            format!("value {i} ")
+                .repeat(1 + i as usize % 20)
+                .into_bytes()
+        })
+    }
+
+    fn write_run(dir: &TempDir, codec: Codec, count: u32) -> PathBuf {
+        let mut builder = SsTableBuilder::create(dir.path().join("1.sst"), codec).unwrap();
+        for i in 0..count {
+            builder.add(&key(2 * i), value(i).as_deref()).unwrap();
+        }
+        builder.finish().unwrap()
+    }
+
+    fn pool(dir: &TempDir, budget: &Arc<MemoryBudget>) -> Arc<BufferPool> {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        BufferPool::new(disk, budget, 256 * PAGE_SIZE).unwrap()
+    }
+
+    fn check_contents(table: &Arc<SsTable>, count: u32) {
+        for i in 0..count {
+            let expected = match value(i) {
+                Some(value) => Lookup::Found(value),
+                None => Lookup::Deleted,
+            };
+            assert_eq!(table.get(&key(2 * i)).unwrap(), expected, "key {i}");
+            assert_eq!(table.get(&key(2 * i + 1)).unwrap(), Lookup::Absent);
+        }
+        let tail: Vec<Entry> = table
+            .iter_from(&key(2 * count - 101))
+            .collect::<Result<_>>()
+            .unwrap();
+        let expected: Vec<Entry> = (count - 50..count)
+            .map(|i| (key(2 * i), value(i)))
+            .collect();
+        assert_eq!(tail, expected);
+    }
+
+    #[test]
+    fn a_compressed_run_reads_back() {
+        const COUNT: u32 = 2000;
+        let dir = TempDir::new("sstable-lz4");
+        let budget = MemoryBudget::new(64 << 20);
+        let path = write_run(&dir, Codec::Lz4, COUNT);
+
+        let table = SsTable::open(1, &path, &pool(&dir, &budget), &budget).unwrap();
+        assert_eq!(table.codec(), Codec::Lz4);
+        assert_eq!(table.entries(), COUNT as u64);
+        check_contents(&table, COUNT);
+        let stats = table.compression_stats();
+        assert!(stats.ratio() > 2.0, "{stats:?}");
+        assert!(stats.blocks_decoded > 0);
+        drop(table);
+
+        let mapped = SsTable::open_mapped(1, &path, &budget).unwrap();
+        check_contents(&mapped, COUNT);
+    }
+
+    #[test]
+    fn the_filter_answers_most_lookups_of_absent_keys() {
+        const COUNT: u32 = 5000;
+        let dir = TempDir::new("sstable-filter");
+        let budget = MemoryBudget::new(64 << 20);
+        let path = write_run(&dir, Codec::None, COUNT);
+        let table = SsTable::open(1, &path, &pool(&dir, &budget), &budget).unwrap();
+        assert!(table.filter_stats().bytes > 0);
+        // Odd keys fall between stored ones, so only the filter rules them
+        // out; the last is past the largest key and never probes it.
+        for i in 0..COUNT {
+            assert_eq!(table.get(&key(2 * i + 1)).unwrap(), Lookup::Absent);
+        }
+        let stats = table.filter_stats();
+        assert_eq!(stats.probes, COUNT as u64 - 1);
+        assert!(stats.negatives > COUNT as u64 * 97 / 100, "{stats:?}");
+        for i in (0..COUNT).step_by(7) {
+            assert_ne!(table.get(&key(2 * i)).unwrap(), Lookup::Absent);
+        }
+    }
+
+    #[test]
+    fn an_empty_run_has_no_filter() {
+        let dir = TempDir::new("sstable-empty");
+        let budget = MemoryBudget::new(64 << 20);
+        let path = write_run(&dir, Codec::None, 0);
+        let table = SsTable::open(1, &path, &pool(&dir, &budget), &budget).unwrap();
+        assert_eq!(table.filter_stats().bytes, 0);
+        assert_eq!(table.get(b"key").unwrap(), Lookup::Absent);
+        assert_eq!(table.iter_from(b"").count(), 0);
+    }
+
+    #[test]
+    fn a_damaged_compressed_block_is_reported() {
+        let dir = TempDir::new("sstable-lz4-damaged");
+        let budget = MemoryBudget::new(64 << 20);
+        let path = write_run(&dir, Codec::Lz4, 1000);
+        // Claim the first block decodes to one byte more than it does.
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(&path)
+            .unwrap();
+        let mut raw_len = [0u8; 4];
+        file.read_exact_at(&mut raw_len, 1).unwrap();
+        let raw_len = u32::from_le_bytes(raw_len) + 1;
+        file.write_all_at(&raw_len.to_le_bytes(), 1).unwrap();
+        drop(file);
+
+        let table = SsTable::open(1, &path, &pool(&dir, &budget), &budget).unwrap();
+        assert!(matches!(table.get(&key(2)), Err(Error::Corruption(_))));
+        assert!(table
+            .iter_from(b"")
+            .any(|entry| matches!(entry, Err(Error::Corruption(_)))));
+    }
+}
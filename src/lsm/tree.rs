@@ -0,0 +1,715 @@
+//! The LSM-tree storage engine.
+//!
+//! Writes go to an in-memory [`Memtable`] whose size is capped from the
+//! memory budget. When it fills up it becomes immutable and a background
+//! worker flushes it to a level-0 sorted run while a fresh memtable takes new
+//! writes; a writer that fills the second memtable before the flush finishes
+//! stalls until it does. The same worker runs leveled compaction: level 0 is
+//! merged into level 1 once it holds [`L0_COMPACTION_TRIGGER`] runs, and each
+//! deeper level is merged downward one run at a time when it outgrows its
+//! target size, so on-disk writes are always large sequential appends.
+//!
+//! Every write carries the LSN of its log record. A flush records in the
+//! manifest the newest LSN it made durable, which is where crash recovery
+//! resumes replaying the log into a fresh memtable.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::thread::{self, JoinHandle};
+
+use crate::compress::Codec;
+use crate::error::{Error, Result};
+use crate::hash::hash64;
+use crate::lsm::memtable::{Lookup, Memtable};
+use crate::lsm::merge::{EntryStream, MergeIter};
+use crate::lsm::sstable::{
+    CompressionStats, Entry, FilterStats, SsTable, SsTableBuilder, MAX_ENTRY_SIZE,
+};
+use crate::lsm::version::{table_path, Manifest, Version, NUM_LEVELS};
+use crate::memory::MemoryBudget;
+use crate::rebalance::{sampled, MissCurve, Rebalance, WriteDistance};
+use crate::storage::BufferPool;
+
+/// Number of level-0 runs that triggers a level-0 compaction.
+pub const L0_COMPACTION_TRIGGER: usize = 4;
+const TARGET_FILE_BYTES: u64 = 2 << 20;
+const LEVEL1_MAX_BYTES: u64 = 10 << 20;
+const LEVEL_MULTIPLIER: u64 = 10;
+/// Seed of the key hashes that pick the writes and reads sampled for the
+/// memtable's miss curve.
+const REUSE_SEED: u64 = 0x6d65_6d74_6162_6c65;
+
+fn max_bytes_for_level(level: usize) -> u64 {
+    LEVEL1_MAX_BYTES * LEVEL_MULTIPLIER.pow(level as u32 - 1)
+}
+
+#[derive(Debug)]
+struct State {
+    active: Arc<Memtable>,
+    immutable: Option<Arc<Memtable>>,
+    version: Arc<Version>,
+    next_file: u64,
+    log_lsn: u64,
+    compact_pointer: [Vec<u8>; NUM_LEVELS],
+    shutdown: bool,
+    background_error: Option<String>,
+}
+
+#[derive(Debug)]
+struct Shared {
+    dir: PathBuf,
+    pool: Arc<BufferPool>,
+    budget: Arc<MemoryBudget>,
+    /// Cap on the active memtable; lowered under memory pressure.
+    memtable_bytes: AtomicUsize,
+    /// Key and value bytes written so far.
+    written: AtomicU64,
+    /// When sampled keys were last written, and how far back reads of
+    /// them reached.
+    reuse: Mutex<(WriteDistance, MissCurve)>,
+    codec: Codec,
+    state: Mutex<State>,
+    work: Condvar,
+    stall: Condvar,
+}
+
+struct Compaction {
+    level: usize,
+    inputs: Vec<Arc<SsTable>>,
+    next_inputs: Vec<Arc<SsTable>>,
+}
+
+/// A log-structured merge tree over sorted runs in a directory.
+#[derive(Debug)]
+pub struct LsmTree {
+    shared: Arc<Shared>,
+    worker: Option<JoinHandle<()>>,
+}
+
+impl LsmTree {
+    /// Opens the tree stored in `dir`. Each memtable is capped at
+    /// `memtable_bytes`; at most two exist at once. New runs are written
+    /// with `codec`; existing runs keep the codec they were written with.
+    pub fn open(
+        dir: impl AsRef<Path>,
+        pool: Arc<BufferPool>,
+        budget: Arc<MemoryBudget>,
+        memtable_bytes: usize,
+        codec: Codec,
+    ) -> Result<Self> {
+        let dir = dir.as_ref().to_path_buf();
+        let manifest = Manifest::load(&dir)?;
+        let mut version = Version::default();
+        for (level, numbers) in manifest.levels.iter().enumerate() {
+            for &number in numbers {
+                let table = SsTable::open(number, table_path(&dir, number), &pool, &budget)?;
+                version.levels[level].push(table);
+            }
+        }
+        remove_stray_runs(&dir, &manifest)?;
+
+        let shared = Arc::new(Shared {
+            state: Mutex::new(State {
+                active: Memtable::new(&budget)?,
+                immutable: None,
+                version: Arc::new(version),
+                next_file: manifest.next_file,
+                log_lsn: manifest.log_lsn,
+                compact_pointer: Default::default(),
+                shutdown: false,
+                background_error: None,
+            }),
+            dir,
+            pool,
+            budget,
+            memtable_bytes: AtomicUsize::new(memtable_bytes),
+            written: AtomicU64::new(0),
+            reuse: Mutex::default(),
+            codec,
+            work: Condvar::new(),
+            stall: Condvar::new(),
+        });
+        let worker = {
+            let shared = Arc::clone(&shared);
+            thread::Builder::new()
+                .name("lsm-worker".into())
+                .spawn(move || shared.run_worker())?
+        };
+        Ok(LsmTree {
+            shared,
+            worker: Some(worker),
+        })
+    }
+
+    /// Stores `value` under `key`, as logged at `lsn`.
+    pub fn put(&self, key: &[u8], value: &[u8], lsn: u64) -> Result<()> {
+        self.write(key, Some(value), lsn)
+    }
+
+    /// Records a deletion of `key`, as logged at `lsn`.
+    pub fn delete(&self, key: &[u8], lsn: u64) -> Result<()> {
+        self.write(key, None, lsn)
+    }
+
+    /// Log position up to which every write is persisted in sorted runs.
+    pub fn checkpoint_lsn(&self) -> u64 {
+        self.shared.state.lock().unwrap().log_lsn
+    }
+
+    /// Takes ahead of time the memory a write of `key` and `value` needs
+    /// in the active memtable, flushing or stalling as the write itself
+    /// would, so that the write then only fails if the tree has failed.
+    pub fn reserve(&self, key: &[u8], value: Option<&[u8]>) -> Result<()> {
+        let size = Self::check_size(key, value)?;
+        self.with_active(|active| active.reserve(size))
+    }
+
+    fn write(&self, key: &[u8], value: Option<&[u8]>, lsn: u64) -> Result<()> {
+        let size = Self::check_size(key, value)?;
+        let shared = &self.shared;
+        let position = shared.written.fetch_add(size as u64, Ordering::Relaxed) + size as u64;
+        let hash = hash64(key, REUSE_SEED);
+        if sampled(hash) {
+            shared.reuse.lock().unwrap().0.written(hash, position);
+        }
+        self.with_active(|active| active.insert(key, value, lsn))
+    }
+
+    fn check_size(key: &[u8], value: Option<&[u8]>) -> Result<usize> {
+        let size = key.len() + value.map_or(0, <[u8]>::len);
+        if size > MAX_ENTRY_SIZE {
+            return Err(Error::InvalidArgument(format!(
+                "entry of {size} bytes exceeds the {MAX_ENTRY_SIZE} byte limit"
+            )));
+        }
+        Ok(size)
+    }
+
+    /// Runs `op` on the active memtable once it is below its cap, rotating
+    /// it first when it is not, and stalling while the previous one is
+    /// still being flushed.
+    fn with_active(&self, mut op: impl FnMut(&Memtable) -> Result<()>) -> Result<()> {
+        let shared = &self.shared;
+        let mut state = shared.state.lock().unwrap();
+        loop {
+            if let Some(err) = &state.background_error {
+                return Err(Error::Background(err.clone()));
+            }
+            if state.active.approximate_bytes() < shared.memtable_bytes.load(Ordering::Relaxed) {
+                match op(&state.active) {
+                    Ok(()) => return Ok(()),
+                    // The budget is tight: make room by flushing rather than
+                    // failing, unless there is nothing to flush.
+                    Err(Error::MemoryExhausted { .. }) if !state.active.is_empty() => {}
+                    Err(err) => return Err(err),
+                }
+            }
+            if state.immutable.is_some() {
+                state = shared.stall.wait(state).unwrap();
+                continue;
+            }
+            shared.rotate(&mut state)?;
+        }
+    }
+
+    /// A handle that changes the memtable cap from another thread.
+    pub fn memtable_limit(&self) -> MemtableLimit {
+        MemtableLimit {
+            shared: Arc::clone(&self.shared),
+        }
+    }
+
+    /// Returns the value stored under `key`.
+    pub fn get(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        self.shared.sample_read(key);
+        let (active, immutable, version) = {
+            let state = self.shared.state.lock().unwrap();
+            (
+                Arc::clone(&state.active),
+                state.immutable.clone(),
+                Arc::clone(&state.version),
+            )
+        };
+        let resolve = |lookup| match lookup {
+            Lookup::Found(value) => Some(Some(value)),
+            Lookup::Deleted => Some(None),
+            Lookup::Absent => None,
+        };
+        if let Some(found) = resolve(active.get(key)) {
+            return Ok(found);
+        }
+        if let Some(found) = immutable.and_then(|m| resolve(m.get(key))) {
+            return Ok(found);
+        }
+        let found = version.lookup_with(key, &mut |value| value.map(<[u8]>::to_vec))?;
+        Ok(found.flatten())
+    }
+
+    /// Iterates over live entries with keys at or above `start`.
+    pub fn scan_from(&self, start: &[u8]) -> Result<LsmIter> {
+        let state = self.shared.state.lock().unwrap();
+        let mut sources: Vec<EntryStream> = Vec::new();
+        sources.push(Box::new(state.active.iter_from(start).map(Ok)));
+        if let Some(immutable) = &state.immutable {
+            sources.push(Box::new(immutable.iter_from(start).map(Ok)));
+        }
+        state.version.streams_from(start, &mut sources);
+        Ok(LsmIter::new(sources))
+    }
+
+    /// Compression ratio and decode cost over all live runs.
+    pub fn compression_stats(&self) -> CompressionStats {
+        let version = Arc::clone(&self.shared.state.lock().unwrap().version);
+        let mut stats = CompressionStats::default();
+        for table in version.levels.iter().flatten() {
+            stats.add(&table.compression_stats());
+        }
+        stats
+    }
+
+    /// Filter size and lookups answered by filters over all live runs.
+    pub fn filter_stats(&self) -> FilterStats {
+        let version = Arc::clone(&self.shared.state.lock().unwrap().version);
+        let mut stats = FilterStats::default();
+        for table in version.levels.iter().flatten() {
+            stats.add(&table.filter_stats());
+        }
+        stats
+    }
+
+    /// Number of runs at each level.
+    pub fn runs_per_level(&self) -> [usize; NUM_LEVELS] {
+        let state = self.shared.state.lock().unwrap();
+        std::array::from_fn(|level| state.version.levels[level].len())
+    }
+}
+
+impl Drop for LsmTree {
+    fn drop(&mut self) {
+        {
+            let mut state = self.shared.state.lock().unwrap();
+            state.shutdown = true;
+            self.shared.work.notify_all();
+        }
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+        // Persist whatever is still buffered so a clean close loses nothing.
+        let _ = self.shared.flush_active();
+    }
+}
+
+/// Changes the memtable cap of an [`LsmTree`], from
+/// [`LsmTree::memtable_limit`].
+#[derive(Debug, Clone)]
+pub struct MemtableLimit {
+    shared: Arc<Shared>,
+}
+
+impl MemtableLimit {
+    /// Caps memtables at `bytes` from now on. If the active memtable is
+    /// already past the new cap it is flushed straight away, unless a
+    /// flush is in progress.
+    pub fn set(&self, bytes: usize) {
+        let shared = &self.shared;
+        shared.memtable_bytes.store(bytes, Ordering::Relaxed);
+        let mut state = shared.state.lock().unwrap();
+        if !state.shutdown
+            && state.immutable.is_none()
+            && !state.active.is_empty()
+            && state.active.approximate_bytes() >= bytes
+        {
+            // If even a fresh memtable does not fit, the next write flushes.
+            let _ = shared.rotate(&mut state);
+        }
+    }
+}
+
+impl Rebalance for MemtableLimit {
+    fn name(&self) -> &'static str {
+        "memtable"
+    }
+
+    /// Both memtables at their cap.
+    fn size_bytes(&self) -> usize {
+        2 * self.shared.memtable_bytes.load(Ordering::Relaxed)
+    }
+
+    fn resize_bytes(&self, bytes: usize) -> usize {
+        self.set(bytes / 2);
+        self.size_bytes()
+    }
+
+    fn take_curve(&self) -> MissCurve {
+        self.shared.reuse.lock().unwrap().1.take()
+    }
+}
+
+fn remove_stray_runs(dir: &Path, manifest: &Manifest) -> Result<()> {
+    let live: std::collections::HashSet<u64> = manifest.levels.iter().flatten().copied().collect();
+    for entry in fs::read_dir(dir)? {
+        let name = entry?.file_name();
+        let Some(number) = name
+            .to_str()
+            .and_then(|n| n.strip_suffix(".sst"))
+            .and_then(|n| n.parse::<u64>().ok())
+        else {
+            continue;
+        };
+        if !live.contains(&number) {
+            fs::remove_file(table_path(dir, number))?;
+        }
+    }
+    Ok(())
+}
+
+impl Shared {
+    fn run_worker(&self) {
+        loop {
+            let mut state = self.state.lock().unwrap();
+            let compaction = loop {
+                if state.immutable.is_some() {
+                    break None;
+                }
+                if state.shutdown {
+                    return;
+                }
+                if let Some(compaction) = self.pick_compaction(&mut state) {
+                    break Some(compaction);
+                }
+                state = self.work.wait(state).unwrap();
+            };
+            drop(state);
+            let result = match compaction {
+                None => self.flush_immutable(),
+                Some(compaction) => self.compact(compaction),
+            };
+            if let Err(err) = result {
+                let mut state = self.state.lock().unwrap();
+                state.background_error = Some(err.to_string());
+                self.stall.notify_all();
+                return;
+            }
+        }
+    }
+
+    fn allocate_file_number(&self) -> u64 {
+        let mut state = self.state.lock().unwrap();
+        state.next_file += 1;
+        state.next_file - 1
+    }
+
+    /// Writes `entries` into runs of at most `TARGET_FILE_BYTES`, dropping
+    /// tombstones when `drop_tombstones` is set.
+    fn write_runs(
+        &self,
+        entries: impl Iterator<Item = Result<Entry>>,
+        drop_tombstones: bool,
+        split: bool,
+    ) -> Result<Vec<Arc<SsTable>>> {
+        let mut outputs = Vec::new();
+        let mut builder: Option<(u64, SsTableBuilder)> = None;
+        for entry in entries {
+            let (key, value) = entry?;
+            if value.is_none() && drop_tombstones {
+                continue;
+            }
+            if builder.is_none() {
+                let number = self.allocate_file_number();
+                builder = Some((
+                    number,
+                    SsTableBuilder::create(table_path(&self.dir, number), self.codec)?,
+                ));
+            }
+            let (_, current) = builder.as_mut().unwrap();
+            current.add(&key, value.as_deref())?;
+            if split && current.file_size() >= TARGET_FILE_BYTES {
+                let (number, finished) = builder.take().unwrap();
+                outputs.push(self.finish_run(number, finished)?);
+            }
+        }
+        if let Some((number, finished)) = builder {
+            outputs.push(self.finish_run(number, finished)?);
+        }
+        Ok(outputs)
+    }
+
+    fn finish_run(&self, number: u64, builder: SsTableBuilder) -> Result<Arc<SsTable>> {
+        let path = builder.finish()?;
+        SsTable::open(number, path, &self.pool, &self.budget)
+    }
+
+    fn install(&self, state: &mut MutexGuard<'_, State>, version: Version) -> Result<()> {
+        Manifest::of(&version, state.next_file, state.log_lsn).store(&self.dir)?;
+        state.version = Arc::new(version);
+        Ok(())
+    }
+
+    fn flush_immutable(&self) -> Result<()> {
+        let memtable = self.state.lock().unwrap().immutable.clone().unwrap();
+        let outputs = self.write_runs(memtable.iter_from(&[]).map(Ok), false, false)?;
+        let mut state = self.state.lock().unwrap();
+        let mut version = (*state.version).clone();
+        for table in outputs {
+            version.levels[0].insert(0, table);
+        }
+        state.log_lsn = state.log_lsn.max(memtable.last_lsn());
+        self.install(&mut state, version)?;
+        state.immutable = None;
+        self.stall.notify_all();
+        Ok(())
+    }
+
+    /// Feeds the miss curve if `key` is among the sampled keys. A key
+    /// written `d` bytes ago is certainly still in memory if memtables are
+    /// capped above `d`, and the two memtables together then hold twice
+    /// that, so the read is recorded at `2 * d` bytes of memtable memory.
+    fn sample_read(&self, key: &[u8]) {
+        let hash = hash64(key, REUSE_SEED);
+        if !sampled(hash) {
+            return;
+        }
+        let position = self.written.load(Ordering::Relaxed);
+        let mut reuse = self.reuse.lock().unwrap();
+        let distance = reuse.0.distance(hash, position);
+        reuse.1.record(distance.map(|bytes| 2 * bytes));
+    }
+
+    /// Makes the active memtable immutable for the worker to flush and
+    /// starts a fresh one. The caller has checked no flush is pending.
+    fn rotate(&self, state: &mut State) -> Result<()> {
+        let fresh = Memtable::new(&self.budget)?;
+        let full = std::mem::replace(&mut state.active, fresh);
+        state.immutable = Some(full);
+        self.work.notify_one();
+        Ok(())
+    }
+
+    fn flush_active(&self) -> Result<()> {
+        let memtable = Arc::clone(&self.state.lock().unwrap().active);
+        if memtable.is_empty() {
+            return Ok(());
+        }
+        let outputs = self.write_runs(memtable.iter_from(&[]).map(Ok), false, false)?;
+        let mut state = self.state.lock().unwrap();
+        let mut version = (*state.version).clone();
+        for table in outputs {
+            version.levels[0].insert(0, table);
+        }
+        state.log_lsn = state.log_lsn.max(memtable.last_lsn());
+        self.install(&mut state, version)?;
+        state.active = Memtable::new(&self.budget)?;
+        Ok(())
+    }
+
+    fn pick_compaction(&self, state: &mut State) -> Option<Compaction> {
+        let version = &state.version;
+        if version.levels[0].len() >= L0_COMPACTION_TRIGGER {
+            let inputs = version.levels[0].clone();
+            let smallest = inputs.iter().map(|t| t.smallest()).min().unwrap();
+            let largest = inputs.iter().map(|t| t.largest()).max().unwrap();
+            let next_inputs = version.overlapping(1, smallest, largest);
+            return Some(Compaction {
+                level: 0,
+                inputs,
+                next_inputs,
+            });
+        }
+        for level in 1..NUM_LEVELS - 1 {
+            if version.level_bytes(level) <= max_bytes_for_level(level) {
+                continue;
+            }
+            // Rotate through the level so every key range gets compacted.
+            let runs = &version.levels[level];
+            let pointer = &state.compact_pointer[level];
+            let input = runs
+                .iter()
+                .find(|t| t.smallest() > pointer.as_slice())
+                .unwrap_or(&runs[0])
+                .clone();
+            state.compact_pointer[level] = input.largest().to_vec();
+            let next_inputs = version.overlapping(level + 1, input.smallest(), input.largest());
+            return Some(Compaction {
+                level,
+                inputs: vec![input],
+                next_inputs,
+            });
+        }
+        None
+    }
+
+    fn compact(&self, compaction: Compaction) -> Result<()> {
+        let Compaction {
+            level,
+            inputs,
+            next_inputs,
+        } = compaction;
+        let target = level + 1;
+        let version = Arc::clone(&self.state.lock().unwrap().version);
+
+        let outputs = if level > 0 && next_inputs.is_empty() {
+            // Nothing to merge with: move the run down without rewriting it.
+            inputs.clone()
+        } else {
+            let sources: Vec<EntryStream> = inputs
+                .iter()
+                .chain(&next_inputs)
+                .map(|t| Box::new(t.iter_from(&[])) as EntryStream)
+                .collect();
+            let drop_tombstones = !version.has_data_below(target);
+            self.write_runs(MergeIter::new(sources), drop_tombstones, true)?
+        };
+
+        let mut state = self.state.lock().unwrap();
+        let mut next = (*state.version).clone();
+        let removed = |t: &Arc<SsTable>| {
+            inputs
+                .iter()
+                .chain(&next_inputs)
+                .any(|i| i.number() == t.number())
+        };
+        next.levels[level].retain(|t| !removed(t));
+        next.levels[target].retain(|t| !removed(t));
+        next.levels[target].extend(outputs.iter().cloned());
+        next.levels[target].sort_by(|a, b| a.smallest().cmp(b.smallest()));
+        self.install(&mut state, next)?;
+        drop(state);
+
+        for table in inputs.iter().chain(&next_inputs) {
+            if !outputs.iter().any(|o| o.number() == table.number()) {
+                table.mark_obsolete();
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Iterator over live entries of an [`LsmTree`], in key order.
+pub struct LsmIter {
+    merge: MergeIter,
+}
+
+impl LsmIter {
+    /// Merges `sources`, newest first, dropping deleted keys.
+    pub(crate) fn new(sources: Vec<EntryStream>) -> Self {
+        LsmIter {
+            merge: MergeIter::new(sources),
+        }
+    }
+}
+
+impl Iterator for LsmIter {
+    type Item = Result<(Vec<u8>, Vec<u8>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            match self.merge.next()? {
+                Ok((key, Some(value))) => return Some(Ok((key, value))),
+                Ok((_, None)) => continue,
+                Err(err) => return Some(Err(err)),
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeMap;
+    use std::time::{Duration, Instant};
+
+    use super::*;
+    use crate::storage::{DiskManager, PAGE_SIZE};
+    use crate::test_util::TempDir;
+
+    const MEMTABLE_BYTES: usize = 128 << 10;
+
+    fn open(dir: &TempDir, budget: &Arc<MemoryBudget>) -> LsmTree {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        let pool = BufferPool::new(disk, budget, 256 * PAGE_SIZE).unwrap();
+        LsmTree::open(
+            dir.path(),
+            pool,
+            Arc::clone(budget),
+            MEMTABLE_BYTES,
+            Codec::Lz4,
+        )
+        .unwrap()
+    }
+
+    fn wait_until(what: &str, mut done: impl FnMut() -> bool) {
+        let deadline = Instant::now() + Duration::from_secs(10);
+        while !done() {
+            assert!(Instant::now() < deadline, "timed out waiting until {what}");
+            thread::sleep(Duration::from_millis(1));
+        }
+    }
+
+    fn check(tree: &LsmTree, expected: &BTreeMap<Vec<u8>, Option<Vec<u8>>>) {
+        for (key, value) in expected {
+            assert_eq!(&tree.get(key).unwrap(), value, "{key:?}");
+        }
+        let live: Vec<_> = expected
+            .iter()
+            .filter_map(|(k, v)| Some((k.clone(), v.clone()?)))
+            .collect();
+        let scanned: Vec<_> = tree.scan_from(&[]).unwrap().collect::<Result<_>>().unwrap();
+        assert_eq!(scanned, live);
+    }
+
+    /// Overwrites and deletes keys at random, enough to fill many memtables.
+    fn write(tree: &LsmTree, expected: &mut BTreeMap<Vec<u8>, Option<Vec<u8>>>) -> u64 {
+        let mut rng = 11u64;
+        let mut lsn = 0;
+        for i in 0..16_000u64 {
+            rng = rng
+                .wrapping_mul(6364136223846793005)
+                .wrapping_add(1442695040888963407);
+            let key = format!("key{:06}", (rng >> 33) % 6000).into_bytes();
+            lsn += 1;
+            if i % 5 == 0 {
+                tree.delete(&key, lsn).unwrap();
+                expected.insert(key, None);
+            } else {
+                let value = format!("value {lsn} ").repeat(4).into_bytes();
+                tree.put(&key, &value, lsn).unwrap();
+                expected.insert(key, Some(value));
+            }
+        }
+        lsn
+    }
+
+    #[test]
+    fn flushes_and_compactions_keep_the_newest_writes() {
+        let dir = TempDir::new("lsm-compaction");
+        let budget = MemoryBudget::new(64 << 20);
+        let mut expected = BTreeMap::new();
+        let tree = open(&dir, &budget);
+        let last_lsn = write(&tree, &mut expected);
+
+        wait_until("level 0 is compacted into level 1", || {
+            let runs = tree.runs_per_level();
+            runs[0] < L0_COMPACTION_TRIGGER && runs[1] > 0
+        });
+        assert!(tree.checkpoint_lsn() > 0);
+        check(&tree, &expected);
+
+        // Closing flushes the memtables; nothing is left to replay.
+        drop(tree);
+        let tree = open(&dir, &budget);
+        assert_eq!(tree.checkpoint_lsn(), last_lsn);
+        check(&tree, &expected);
+    }
+
+    #[test]
+    fn an_oversized_entry_is_refused() {
+        let dir = TempDir::new("lsm-oversized");
+        let budget = MemoryBudget::new(64 << 20);
+        let tree = open(&dir, &budget);
+        let value = vec![0; MAX_ENTRY_SIZE];
+        let err = tree.put(b"key", &value, 1).unwrap_err();
+        assert!(matches!(err, Error::InvalidArgument(_)), "{err:?}");
+        assert_eq!(tree.get(b"key").unwrap(), None);
+    }
+}
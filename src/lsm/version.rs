@@ -0,0 +1,187 @@
+//! The set of live sorted runs and its on-disk manifest.
+
+use std::fs::{self, File};
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use crate::error::{Error, Result};
+use crate::lsm::merge::EntryStream;
+use crate::lsm::sstable::SsTable;
+
+/// Number of levels, including level 0.
+pub const NUM_LEVELS: usize = 7;
+
+const MANIFEST: &str = "MANIFEST";
+const MANIFEST_TMP: &str = "MANIFEST.tmp";
+
+/// An immutable snapshot of the LSM tree's runs. Level 0 runs may overlap
+/// and are ordered newest first; deeper levels are sorted by key and
+/// disjoint.
+#[derive(Debug, Clone, Default)]
+pub struct Version {
+    pub levels: [Vec<Arc<SsTable>>; NUM_LEVELS],
+}
+
+impl Version {
+    /// Total file bytes at `level`.
+    pub fn level_bytes(&self, level: usize) -> u64 {
+        self.levels[level].iter().map(|t| t.file_size()).sum()
+    }
+
+    /// Runs at `level` (1 or deeper) whose key range intersects
+    /// `[smallest, largest]`.
+    pub fn overlapping(&self, level: usize, smallest: &[u8], largest: &[u8]) -> Vec<Arc<SsTable>> {
+        self.levels[level]
+            .iter()
+            .filter(|t| t.overlaps(smallest, largest))
+            .cloned()
+            .collect()
+    }
+
+    /// Whether any level deeper than `level` holds data.
+    pub fn has_data_below(&self, level: usize) -> bool {
+        self.levels[level + 1..].iter().any(|runs| !runs.is_empty())
+    }
+
+    /// Finds the newest entry for `key` and calls `f` with its value in
+    /// place, or `None` for a deletion. Probes at most one run per level
+    /// below level 0.
+    pub fn lookup_with<T>(
+        &self,
+        key: &[u8],
+        f: &mut impl FnMut(Option<&[u8]>) -> T,
+    ) -> Result<Option<T>> {
+        for table in &self.levels[0] {
+            if let Some(found) = table.lookup_with(key, f)? {
+                return Ok(Some(found));
+            }
+        }
+        for runs in &self.levels[1..] {
+            let at = runs.partition_point(|t| t.largest() < key);
+            if let Some(table) = runs.get(at).filter(|t| t.smallest() <= key) {
+                if let Some(found) = table.lookup_with(key, f)? {
+                    return Ok(Some(found));
+                }
+            }
+        }
+        Ok(None)
+    }
+
+    /// Appends one stream per level-0 run and per deeper level, newest
+    /// first, covering keys at or above `start`.
+    pub fn streams_from(&self, start: &[u8], sources: &mut Vec<EntryStream>) {
+        for table in &self.levels[0] {
+            sources.push(Box::new(table.iter_from(start)));
+        }
+        for runs in &self.levels[1..] {
+            sources.push(level_stream(runs, start));
+        }
+    }
+}
+
+/// Concatenates the disjoint runs of one level, skipping runs entirely
+/// below `start`.
+fn level_stream(runs: &[Arc<SsTable>], start: &[u8]) -> EntryStream {
+    let first = runs.partition_point(|t| t.largest() < start);
+    let runs = runs[first..].to_vec();
+    let start = start.to_vec();
+    Box::new(runs.into_iter().flat_map(move |t| t.iter_from(&start)))
+}
+
+/// Path of run file `number` in `dir`.
+pub fn table_path(dir: &Path, number: u64) -> PathBuf {
+    dir.join(format!("{number:06}.sst"))
+}
+
+/// Persisted form of a [`Version`]: the file numbers at every level, plus
+/// the log position up to which all writes are stored in runs.
+#[derive(Debug, Default)]
+pub struct Manifest {
+    pub next_file: u64,
+    pub log_lsn: u64,
+    pub levels: [Vec<u64>; NUM_LEVELS],
+}
+
+impl Manifest {
+    /// Reads the manifest in `dir`, or an empty one for a new tree.
+    pub fn load(dir: &Path) -> Result<Self> {
+        let text = match fs::read_to_string(dir.join(MANIFEST)) {
+            Ok(text) => text,
+            Err(err) if err.kind() == std::io::ErrorKind::NotFound => {
+                return Ok(Manifest {
+                    next_file: 1,
+                    ..Default::default()
+                })
+            }
+            Err(err) => return Err(err.into()),
+        };
+        let corrupt = || Error::Corruption("malformed LSM manifest".into());
+        let mut manifest = Manifest::default();
+        for line in text.lines() {
+            let mut fields = line.split_whitespace();
+            match fields.next() {
+                Some("next_file") => {
+                    manifest.next_file = fields
+                        .next()
+                        .and_then(|v| v.parse().ok())
+                        .ok_or_else(corrupt)?;
+                }
+                Some("log_lsn") => {
+                    manifest.log_lsn = fields
+                        .next()
+                        .and_then(|v| v.parse().ok())
+                        .ok_or_else(corrupt)?;
+                }
+                Some("run") => {
+                    let level: usize = fields
+                        .next()
+                        .and_then(|v| v.parse().ok())
+                        .ok_or_else(corrupt)?;
+                    let number: u64 = fields
+                        .next()
+                        .and_then(|v| v.parse().ok())
+                        .ok_or_else(corrupt)?;
+                    manifest
+                        .levels
+                        .get_mut(level)
+                        .ok_or_else(corrupt)?
+                        .push(number);
+                }
+                None => {}
+                Some(_) => return Err(corrupt()),
+            }
+        }
+        Ok(manifest)
+    }
+
+    /// Captures the run layout of `version`.
+    pub fn of(version: &Version, next_file: u64, log_lsn: u64) -> Self {
+        let mut manifest = Manifest {
+            next_file,
+            log_lsn,
+            ..Default::default()
+        };
+        for (level, runs) in version.levels.iter().enumerate() {
+            manifest.levels[level] = runs.iter().map(|t| t.number()).collect();
+        }
+        manifest
+    }
+
+    /// Atomically replaces the manifest in `dir`.
+    pub fn store(&self, dir: &Path) -> Result<()> {
+        let mut text = format!("next_file {}\nlog_lsn {}\n", self.next_file, self.log_lsn);
+        for (level, runs) in self.levels.iter().enumerate() {
+            for number in runs {
+                text.push_str(&format!("run {level} {number}\n"));
+            }
+        }
+        let tmp = dir.join(MANIFEST_TMP);
+        let mut file = File::create(&tmp)?;
+        file.write_all(text.as_bytes())?;
+        file.sync_all()?;
+        fs::rename(&tmp, dir.join(MANIFEST))?;
+        File::open(dir)?.sync_all()?;
+        Ok(())
+    }
+}
@@ -0,0 +1,406 @@
+//! Central memory accounting.
+//!
+//! Every component that holds a non-trivial amount of memory (caches,
+//! buffers, indexes, query operators) reserves it from a single
+//! [`MemoryBudget`] before allocating. The budget never lets the sum of live
+//! reservations exceed `max_resident_bytes`; a reservation that does not fit
+//! either fails immediately with [`Error::MemoryExhausted`] so the caller can
+//! spill, or waits for other consumers to release memory (back pressure).
+//!
+//! The limit can be lowered while the database runs, for instance when the
+//! host shrinks the container. Live reservations are not revoked; new ones
+//! fail until enough memory is released to get back under the limit.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+use crate::error::{Error, Result};
+
+/// The subsystem a reservation is charged to.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Consumer {
+    BufferPool,
+    Index,
+    Memtable,
+    WalBuffer,
+    Sort,
+    HashJoin,
+    VersionStore,
+    RowCache,
+    Other,
+}
+
+impl Consumer {
+    /// Every consumer, in reporting order.
+    pub const ALL: [Consumer; 9] = [
+        Consumer::BufferPool,
+        Consumer::Index,
+        Consumer::Memtable,
+        Consumer::WalBuffer,
+        Consumer::Sort,
+        Consumer::HashJoin,
+        Consumer::VersionStore,
+        Consumer::RowCache,
+        Consumer::Other,
+    ];
+
+    /// Stable lower-case name used in reports.
+    pub fn name(self) -> &'static str {
+        match self {
+            Consumer::BufferPool => "buffer_pool",
+            Consumer::Index => "index",
+            Consumer::Memtable => "memtable",
+            Consumer::WalBuffer => "wal_buffer",
+            Consumer::Sort => "sort",
+            Consumer::HashJoin => "hash_join",
+            Consumer::VersionStore => "version_store",
+            Consumer::RowCache => "row_cache",
+            Consumer::Other => "other",
+        }
+    }
+
+    fn index(self) -> usize {
+        self as usize
+    }
+}
+
+/// A hard cap on resident memory shared by the whole database.
+#[derive(Debug)]
+pub struct MemoryBudget {
+    limit: AtomicUsize,
+    used: AtomicUsize,
+    peak: AtomicUsize,
+    per_consumer: [AtomicUsize; Consumer::ALL.len()],
+    per_consumer_peak: [AtomicUsize; Consumer::ALL.len()],
+    waiters: AtomicUsize,
+    lock: Mutex<()>,
+    released: Condvar,
+}
+
+impl MemoryBudget {
+    /// Creates a budget that admits at most `max_resident_bytes` of live
+    /// reservations.
+    pub fn new(max_resident_bytes: usize) -> Arc<Self> {
+        Arc::new(MemoryBudget {
+            limit: AtomicUsize::new(max_resident_bytes),
+            used: AtomicUsize::new(0),
+            peak: AtomicUsize::new(0),
+            per_consumer: Default::default(),
+            per_consumer_peak: Default::default(),
+            waiters: AtomicUsize::new(0),
+            lock: Mutex::new(()),
+            released: Condvar::new(),
+        })
+    }
+
+    /// The current cap in bytes.
+    pub fn limit(&self) -> usize {
+        self.limit.load(Ordering::Acquire)
+    }
+
+    /// Changes the cap to `bytes`. Reservations already made are kept even
+    /// if they exceed it; waiters are woken if it was raised.
+    pub fn set_limit(&self, bytes: usize) {
+        let old = self.limit.swap(bytes, Ordering::SeqCst);
+        if bytes > old && self.waiters.load(Ordering::SeqCst) > 0 {
+            let _guard = self.lock.lock().unwrap();
+            self.released.notify_all();
+        }
+    }
+
+    /// Bytes currently reserved across all consumers.
+    pub fn used(&self) -> usize {
+        self.used.load(Ordering::Acquire)
+    }
+
+    /// Bytes that can still be reserved.
+    pub fn available(&self) -> usize {
+        self.limit().saturating_sub(self.used())
+    }
+
+    /// Highest value `used()` has reached since the budget was created, or
+    /// since [`MemoryBudget::reset_peak`].
+    pub fn peak(&self) -> usize {
+        self.peak.load(Ordering::Relaxed)
+    }
+
+    /// Restarts [`MemoryBudget::peak`] and every consumer's
+    /// [`MemoryBudget::peak_usage`] from what is reserved now, so later
+    /// readings cover only what follows.
+    pub fn reset_peak(&self) {
+        self.peak.store(self.used(), Ordering::Relaxed);
+        for (peak, held) in self.per_consumer_peak.iter().zip(&self.per_consumer) {
+            peak.store(held.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+    }
+
+    /// Bytes currently reserved by `consumer`.
+    pub fn usage(&self, consumer: Consumer) -> usize {
+        self.per_consumer[consumer.index()].load(Ordering::Relaxed)
+    }
+
+    /// Most `consumer` has held at once since the budget was created, or
+    /// since [`MemoryBudget::reset_peak`].
+    pub fn peak_usage(&self, consumer: Consumer) -> usize {
+        self.per_consumer_peak[consumer.index()].load(Ordering::Relaxed)
+    }
+
+    /// Reserves `bytes` for `consumer`, failing immediately with
+    /// [`Error::MemoryExhausted`] if that would exceed the limit.
+    pub fn try_reserve(self: &Arc<Self>, consumer: Consumer, bytes: usize) -> Result<Reservation> {
+        self.try_acquire(consumer, bytes)?;
+        Ok(Reservation {
+            budget: Arc::clone(self),
+            consumer,
+            bytes,
+        })
+    }
+
+    /// Reserves `bytes` for `consumer`, blocking for up to `timeout` while
+    /// other reservations are released. Requests larger than the whole
+    /// budget fail straight away since waiting cannot help them.
+    pub fn reserve(
+        self: &Arc<Self>,
+        consumer: Consumer,
+        bytes: usize,
+        timeout: Duration,
+    ) -> Result<Reservation> {
+        if bytes > self.limit() {
+            return Err(Error::MemoryExhausted {
+                requested: bytes,
+                available: self.available(),
+            });
+        }
+        let deadline = Instant::now() + timeout;
+        let mut guard = self.lock.lock().unwrap();
+        // Registering as a waiter before retrying guarantees that a release
+        // racing with the retry either frees enough memory for it or sees
+        // the waiter and signals.
+        self.waiters.fetch_add(1, Ordering::SeqCst);
+        let result = loop {
+            match self.try_acquire(consumer, bytes) {
+                Ok(()) => break Ok(()),
+                Err(err) => {
+                    let now = Instant::now();
+                    if now >= deadline {
+                        break Err(err);
+                    }
+                    guard = self.released.wait_timeout(guard, deadline - now).unwrap().0;
+                }
+            }
+        };
+        self.waiters.fetch_sub(1, Ordering::SeqCst);
+        drop(guard);
+        result.map(|()| Reservation {
+            budget: Arc::clone(self),
+            consumer,
+            bytes,
+        })
+    }
+
+    fn try_acquire(&self, consumer: Consumer, bytes: usize) -> Result<()> {
+        let limit = self.limit();
+        let mut used = self.used.load(Ordering::Relaxed);
+        loop {
+            let next = match used.checked_add(bytes) {
+                Some(next) if next <= limit => next,
+                _ => {
+                    return Err(Error::MemoryExhausted {
+                        requested: bytes,
+                        available: limit.saturating_sub(used),
+                    })
+                }
+            };
+            match self
+                .used
+                .compare_exchange_weak(used, next, Ordering::SeqCst, Ordering::Relaxed)
+            {
+                Ok(_) => {
+                    let held = self.per_consumer[consumer.index()]
+                        .fetch_add(bytes, Ordering::Relaxed)
+                        + bytes;
+                    self.per_consumer_peak[consumer.index()].fetch_max(held, Ordering::Relaxed);
+                    self.peak.fetch_max(next, Ordering::Relaxed);
+                    return Ok(());
+                }
+                Err(actual) => used = actual,
+            }
+        }
+    }
+
+    fn release(&self, consumer: Consumer, bytes: usize) {
+        if bytes == 0 {
+            return;
+        }
+        self.per_consumer[consumer.index()].fetch_sub(bytes, Ordering::Relaxed);
+        self.used.fetch_sub(bytes, Ordering::SeqCst);
+        if self.waiters.load(Ordering::SeqCst) > 0 {
+            let _guard = self.lock.lock().unwrap();
+            self.released.notify_all();
+        }
+    }
+}
+
+/// A live charge against a [`MemoryBudget`], released when dropped.
+#[derive(Debug)]
+pub struct Reservation {
+    budget: Arc<MemoryBudget>,
+    consumer: Consumer,
+    bytes: usize,
+}
+
+impl Reservation {
+    /// Bytes held by this reservation.
+    pub fn size(&self) -> usize {
+        self.bytes
+    }
+
+    /// The consumer this reservation is charged to.
+    pub fn consumer(&self) -> Consumer {
+        self.consumer
+    }
+
+    /// The budget this reservation draws from.
+    pub fn budget(&self) -> &Arc<MemoryBudget> {
+        &self.budget
+    }
+
+    /// Extends the reservation by `bytes` without blocking.
+    pub fn try_grow(&mut self, bytes: usize) -> Result<()> {
+        self.budget.try_acquire(self.consumer, bytes)?;
+        self.bytes += bytes;
+        Ok(())
+    }
+
+    /// Returns `bytes` of the reservation to the budget.
+    pub fn shrink(&mut self, bytes: usize) {
+        let bytes = bytes.min(self.bytes);
+        self.bytes -= bytes;
+        self.budget.release(self.consumer, bytes);
+    }
+
+    /// Moves `bytes` out of this reservation into a new one with the same
+    /// consumer, without touching the budget's totals.
+    pub fn split(&mut self, bytes: usize) -> Reservation {
+        let bytes = bytes.min(self.bytes);
+        self.bytes -= bytes;
+        Reservation {
+            budget: Arc::clone(&self.budget),
+            consumer: self.consumer,
+            bytes,
+        }
+    }
+
+    /// Takes over `other`, which must be charged to the same budget and
+    /// consumer, without touching the budget's totals. Undoes a
+    /// [`Reservation::split`].
+    pub fn merge(&mut self, mut other: Reservation) {
+        debug_assert!(Arc::ptr_eq(&self.budget, &other.budget) && self.consumer == other.consumer);
+        self.bytes += std::mem::take(&mut other.bytes);
+    }
+}
+
+impl Drop for Reservation {
+    fn drop(&mut self) {
+        self.budget.release(self.consumer, self.bytes);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    const LONG: Duration = Duration::from_secs(10);
+
+    #[test]
+    fn reservations_are_accounted_per_consumer() {
+        let budget = MemoryBudget::new(1000);
+        let mut sort = budget.try_reserve(Consumer::Sort, 600).unwrap();
+        let index = budget.try_reserve(Consumer::Index, 300).unwrap();
+        assert_eq!((budget.used(), budget.available()), (900, 100));
+        assert!(matches!(
+            budget.try_reserve(Consumer::Sort, 101),
+            Err(Error::MemoryExhausted {
+                requested: 101,
+                available: 100
+            })
+        ));
+        assert!(sort.try_grow(101).is_err());
+        sort.try_grow(100).unwrap();
+        assert_eq!(budget.usage(Consumer::Sort), 700);
+
+        // Splitting and merging move bytes between reservations only.
+        let lent = sort.split(200);
+        assert_eq!((sort.size(), lent.size()), (500, 200));
+        assert_eq!(budget.used(), 1000);
+        sort.merge(lent);
+        assert_eq!(sort.size(), 700);
+        assert_eq!(budget.used(), 1000);
+
+        sort.shrink(500);
+        drop(index);
+        assert_eq!(budget.usage(Consumer::Sort), 200);
+        assert_eq!(budget.usage(Consumer::Index), 0);
+        assert_eq!(budget.peak(), 1000);
+        assert_eq!(budget.peak_usage(Consumer::Sort), 700);
+        budget.reset_peak();
+        assert_eq!(budget.peak(), 200);
+        drop(sort);
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn a_waiter_is_woken_by_a_release() {
+        let budget = MemoryBudget::new(1000);
+        let held = budget.try_reserve(Consumer::Memtable, 800).unwrap();
+        thread::scope(|s| {
+            let waiter = s.spawn(|| budget.reserve(Consumer::WalBuffer, 500, LONG));
+            while budget.waiters.load(Ordering::SeqCst) == 0 {
+                thread::yield_now();
+            }
+            let started = Instant::now();
+            drop(held);
+            let reservation = waiter.join().unwrap().unwrap();
+            assert!(started.elapsed() < LONG);
+            assert_eq!(reservation.size(), 500);
+        });
+        assert_eq!(budget.used(), 0);
+    }
+
+    #[test]
+    fn a_waiter_is_woken_by_a_higher_limit() {
+        let budget = MemoryBudget::new(1000);
+        let _held = budget.try_reserve(Consumer::Memtable, 800).unwrap();
+        thread::scope(|s| {
+            let waiter = s.spawn(|| budget.reserve(Consumer::WalBuffer, 500, LONG));
+            while budget.waiters.load(Ordering::SeqCst) == 0 {
+                thread::yield_now();
+            }
+            budget.set_limit(2000);
+            let reservation = waiter.join().unwrap().unwrap();
+            assert_eq!(budget.used(), 1300);
+            drop(reservation);
+        });
+    }
+
+    #[test]
+    fn a_wait_times_out_and_oversized_requests_fail_at_once() {
+        let budget = MemoryBudget::new(1000);
+        let _held = budget.try_reserve(Consumer::Memtable, 800).unwrap();
+        let timeout = Duration::from_millis(50);
+        let started = Instant::now();
+        assert!(matches!(
+            budget.reserve(Consumer::WalBuffer, 500, timeout),
+            Err(Error::MemoryExhausted { .. })
+        ));
+        assert!(started.elapsed() >= timeout);
+        assert_eq!(budget.waiters.load(Ordering::SeqCst), 0);
+
+        let started = Instant::now();
+        assert!(budget.reserve(Consumer::WalBuffer, 1001, LONG).is_err());
+        assert!(started.elapsed() < LONG);
+    }
+}
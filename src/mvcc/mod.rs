@@ -0,0 +1,299 @@
+//! Snapshot reads over the live primary key space.
+//!
+//! A [`ReadView`] sees the database as of the write that had last been
+//! applied when it was opened, while writers keep going. Writers never wait
+//! for readers: each write made while a view is open records the value it
+//! replaces in the [`VersionStore`], and a view that finds a version newer
+//! than itself reads that before-image instead of the current value.
+//!
+//! Nothing is recorded while no view is open, and versions are discarded as
+//! soon as the oldest open view no longer needs them. Views live in memory
+//! only; they do not survive a restart.
+
+pub mod version_store;
+
+use std::collections::BTreeMap;
+use std::ops::Bound;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::db::{Database, ScanIter};
+use crate::error::Result;
+use crate::memory::MemoryBudget;
+use crate::wal::Lsn;
+
+use version_store::RunCursor;
+pub use version_store::{BeforeImage, VersionStore, VersionStoreStats};
+
+/// Tracks open views and keeps the versions they need.
+#[derive(Debug)]
+pub(crate) struct Mvcc {
+    /// Number of open views by their LSN. Writes are applied with this
+    /// lock held, so a view never opens halfway through one.
+    views: Mutex<BTreeMap<Lsn, usize>>,
+    /// LSN of the last write applied to the engine.
+    applied: AtomicU64,
+    store: VersionStore,
+}
+
+impl Mvcc {
+    pub(crate) fn new(
+        budget: &Arc<MemoryBudget>,
+        temp_dir: std::path::PathBuf,
+        quota: usize,
+        applied: Lsn,
+    ) -> Result<Self> {
+        Ok(Mvcc {
+            views: Mutex::new(BTreeMap::new()),
+            applied: AtomicU64::new(applied),
+            store: VersionStore::new(budget, temp_dir, quota)?,
+        })
+    }
+
+    pub(crate) fn store(&self) -> &VersionStore {
+        &self.store
+    }
+
+    /// Logs a write to `key` with `log` and applies it at the LSN that
+    /// returns with `apply`. While any view is open, the current value is
+    /// read with `current` and the memory to keep it is taken before the
+    /// write is logged, so that nothing after the log fails for want of
+    /// memory; the before-image is recorded once the LSN is known.
+    pub(crate) fn write(
+        &self,
+        key: &[u8],
+        current: impl FnOnce() -> Result<BeforeImage>,
+        log: impl FnOnce() -> Result<Lsn>,
+        apply: impl FnOnce(Lsn) -> Result<()>,
+    ) -> Result<Lsn> {
+        let views = self.views.lock().unwrap();
+        let version = match views.is_empty() {
+            true => None,
+            false => Some(self.store.prepare(key, current()?)?),
+        };
+        let lsn = log()?;
+        if let Some(version) = version {
+            version.commit(lsn);
+        }
+        apply(lsn)?;
+        self.applied.store(lsn, Ordering::Release);
+        Ok(lsn)
+    }
+
+    fn open_view(&self) -> Lsn {
+        let mut views = self.views.lock().unwrap();
+        let lsn = self.applied.load(Ordering::Acquire);
+        *views.entry(lsn).or_default() += 1;
+        lsn
+    }
+
+    fn close_view(&self, lsn: Lsn) {
+        let oldest = {
+            let mut views = self.views.lock().unwrap();
+            if let Some(count) = views.get_mut(&lsn) {
+                *count -= 1;
+                if *count == 0 {
+                    views.remove(&lsn);
+                }
+            }
+            views.keys().next().copied()
+        };
+        self.store.collect(oldest);
+    }
+}
+
+/// A consistent, read-only view of a [`Database`] at one point in its log.
+///
+/// Returned by [`Database::read_view`]. The versions it needs are kept,
+/// spilling to disk past `version_store_bytes`, until it is dropped.
+#[derive(Debug)]
+pub struct ReadView<'a> {
+    db: &'a Database,
+    mvcc: &'a Mvcc,
+    lsn: Lsn,
+}
+
+impl<'a> ReadView<'a> {
+    pub(crate) fn new(db: &'a Database, mvcc: &'a Mvcc) -> Self {
+        ReadView {
+            db,
+            mvcc,
+            lsn: mvcc.open_view(),
+        }
+    }
+
+    /// LSN of the last write this view sees.
+    pub fn lsn(&self) -> Lsn {
+        self.lsn
+    }
+
+    /// Returns the value stored under `key` when the view was opened.
+    pub fn get(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        // Read the engine first: a write that lands after this read records
+        // its before-image before it is applied, so the lookup below finds it.
+        let current = self.db.get(key)?;
+        Ok(match self.mvcc.store.lookup(key, self.lsn)? {
+            Some(before) => before,
+            None => current,
+        })
+    }
+
+    /// Iterates over entries with keys at or above `start` as they were
+    /// when the view was opened, in key order.
+    pub fn scan_from(&self, start: &[u8]) -> Result<ViewIter<'_>> {
+        Ok(ViewIter {
+            view: self,
+            live: self.db.scan_from(start)?,
+            live_head: None,
+            start: start.to_vec(),
+            last: None,
+            cursors: Vec::new(),
+        })
+    }
+}
+
+impl Drop for ReadView<'_> {
+    fn drop(&mut self) {
+        self.mvcc.close_view(self.lsn);
+    }
+}
+
+/// Iterator returned by [`ReadView::scan_from`].
+///
+/// Merges a scan of the live engine with the keys that have versions newer
+/// than the view, so keys deleted since the view was opened reappear and
+/// keys inserted since are skipped.
+pub struct ViewIter<'a> {
+    view: &'a ReadView<'a>,
+    live: ScanIter<'a>,
+    live_head: Option<(Vec<u8>, Vec<u8>)>,
+    start: Vec<u8>,
+    /// Last key returned.
+    last: Option<Vec<u8>>,
+    cursors: Vec<RunCursor>,
+}
+
+impl ViewIter<'_> {
+    fn step(&mut self) -> Result<Option<(Vec<u8>, Vec<u8>)>> {
+        loop {
+            if self.live_head.is_none() {
+                self.live_head = self.live.next().transpose()?;
+            }
+            let lower = match &self.last {
+                Some(last) => Bound::Excluded(last.as_slice()),
+                None => Bound::Included(self.start.as_slice()),
+            };
+            let versioned =
+                self.view
+                    .mvcc
+                    .store
+                    .next_from(lower, self.view.lsn, &mut self.cursors)?;
+            let (key, value) = match (versioned, &self.live_head) {
+                (Some((key, before)), Some((live, _))) if key.as_slice() <= live.as_slice() => {
+                    if key == *live {
+                        self.live_head = None;
+                    }
+                    (key, before)
+                }
+                (_, Some(_)) => {
+                    let (key, value) = self.live_head.take().unwrap();
+                    let value = match self.view.mvcc.store.lookup(&key, self.view.lsn)? {
+                        Some(before) => before,
+                        None => Some(value),
+                    };
+                    (key, value)
+                }
+                (Some((key, before)), None) => (key, before),
+                (None, None) => return Ok(None),
+            };
+            self.last = Some(key.clone());
+            if let Some(value) = value {
+                return Ok(Some((key, value)));
+            }
+        }
+    }
+}
+
+impl Iterator for ViewIter<'_> {
+    type Item = Result<(Vec<u8>, Vec<u8>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.step().transpose()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeMap;
+
+    use super::version_store::MIN_VERSION_STORE_BYTES;
+    use crate::options::{Engine, Options};
+    use crate::test_util::TempDir;
+    use crate::Database;
+
+    fn key(i: u64) -> Vec<u8> {
+        format!("key{i:05}").into_bytes()
+    }
+
+    #[test]
+    fn views_read_their_state_across_spills() {
+        for engine in [Engine::BTree, Engine::Lsm] {
+            let dir = TempDir::new("mvcc-spill");
+            let options = Options {
+                engine,
+                version_store_bytes: MIN_VERSION_STORE_BYTES,
+                memory_monitor_interval: None,
+                cache_rebalance_interval: None,
+                ..Options::default()
+            };
+            let db = Database::open(dir.path(), options).unwrap();
+            for i in (0..600).filter(|i| i % 2 == 0) {
+                db.put(&key(i), b"first").unwrap();
+            }
+            let first: BTreeMap<Vec<u8>, Vec<u8>> =
+                db.scan_from(b"").unwrap().map(Result::unwrap).collect();
+            let view = db.read_view();
+            // Overwrite, delete and insert enough to spill several runs.
+            for round in 0..4u8 {
+                for i in 0..600 {
+                    match (i + u64::from(round)) % 3 {
+                        0 => db.delete(&key(i)).unwrap(),
+                        _ => db.put(&key(i), &vec![round; 300]).unwrap(),
+                    }
+                }
+            }
+            assert!(db.stats().version_store.spilled_runs >= 2, "{engine:?}");
+            for i in 0..600 {
+                assert_eq!(
+                    view.get(&key(i)).unwrap().as_ref(),
+                    first.get(&key(i)),
+                    "{engine:?} key {i}"
+                );
+            }
+            let seen: BTreeMap<Vec<u8>, Vec<u8>> =
+                view.scan_from(b"").unwrap().map(Result::unwrap).collect();
+            assert_eq!(seen, first, "{engine:?}");
+            let from: Vec<_> = view
+                .scan_from(&key(301))
+                .unwrap()
+                .map(Result::unwrap)
+                .collect();
+            assert_eq!(
+                from,
+                first
+                    .range(key(301)..)
+                    .map(|(k, v)| (k.clone(), v.clone()))
+                    .collect::<Vec<_>>()
+            );
+
+            drop(view);
+            let stats = db.stats().version_store;
+            assert_eq!(
+                (stats.spilled_runs, stats.resident_versions),
+                (0, 0),
+                "{engine:?}"
+            );
+            assert_eq!(stats.collected, stats.recorded, "{engine:?}");
+        }
+    }
+}
@@ -0,0 +1,637 @@
+//! Before-images of overwritten keys, kept for open read views.
+//!
+//! Every write made while a read view is open first records the value it
+//! replaces, tagged with the write's LSN. A view at LSN `t` sees, for each
+//! key, the before-image of the oldest write newer than `t`, or the current
+//! value if there is none.
+//!
+//! Recent versions live in memory, charged to the budget up to a fixed
+//! quota. When the quota is full the in-memory versions are written out as
+//! one sorted spill run, and only a sparse index of it stays resident.
+//! Writes arrive in LSN order, so every run covers a later LSN range than
+//! the runs before it, and an older run always wins for the same key.
+//! Versions are discarded once the oldest open view no longer needs them.
+//! Whole runs are dropped at once, so a long-lived view costs disk, not
+//! memory.
+//!
+//! In-memory version headers are fixed-size records kept in a [`Slab`],
+//! linked into one chain per key. Collected headers free their slots for
+//! reuse, and a spill frees every page at once.
+
+use std::collections::BTreeMap;
+use std::ops::Bound;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::arena::{Slab, SlabKey};
+use crate::error::{Error, Result};
+use crate::exec::{Run, RunReader, RunWriter};
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::wal::Lsn;
+
+/// Spacing of sparse index entries in a spill run.
+const INDEX_INTERVAL: u64 = 16 << 10;
+/// Read buffer used when looking versions up in a spill run.
+const READ_BLOCK: usize = 16 << 10;
+/// Write buffer used when spilling.
+const WRITE_BLOCK: usize = 256 << 10;
+/// Smallest quota accepted.
+pub const MIN_VERSION_STORE_BYTES: usize = 64 << 10;
+
+/// In-memory cost of a version beyond its key and value bytes and its
+/// header.
+const VERSION_OVERHEAD: usize = 64;
+
+/// The value a write replaced; `None` if the key did not exist.
+pub type BeforeImage = Option<Vec<u8>>;
+
+/// Counters describing the version store.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct VersionStoreStats {
+    /// Versions currently held in memory.
+    pub resident_versions: u64,
+    /// Bytes charged for them.
+    pub resident_bytes: u64,
+    /// Spill runs currently on disk.
+    pub spilled_runs: u64,
+    /// Bytes in those runs.
+    pub spilled_bytes: u64,
+    /// Versions recorded since the store was created.
+    pub recorded: u64,
+    /// Versions discarded by garbage collection.
+    pub collected: u64,
+}
+
+fn version_cost(key: &[u8], before: &BeforeImage) -> usize {
+    key.len() + before.as_ref().map_or(0, Vec::len) + VERSION_OVERHEAD
+}
+
+fn encode(lsn: Lsn, before: &BeforeImage) -> Vec<u8> {
+    let mut value = Vec::with_capacity(9 + before.as_ref().map_or(0, Vec::len));
+    value.extend_from_slice(&lsn.to_le_bytes());
+    match before {
+        Some(bytes) => {
+            value.push(1);
+            value.extend_from_slice(bytes);
+        }
+        None => value.push(0),
+    }
+    value
+}
+
+fn decode(mut value: Vec<u8>) -> Result<(Lsn, BeforeImage)> {
+    if value.len() < 9 {
+        return Err(Error::Corruption("damaged version store run".into()));
+    }
+    let lsn = Lsn::from_le_bytes(value[..8].try_into().unwrap());
+    let before = (value[8] == 1).then(|| value.split_off(9));
+    Ok((lsn, before))
+}
+
+fn within(lower: Bound<&[u8]>, key: &[u8]) -> bool {
+    match lower {
+        Bound::Included(start) => key >= start,
+        Bound::Excluded(after) => key > after,
+        Bound::Unbounded => true,
+    }
+}
+
+/// Versions written to disk, with the sparse index that locates them.
+#[derive(Debug)]
+pub(crate) struct SpilledRun {
+    id: u64,
+    run: Run,
+    /// First key of an entry roughly every [`INDEX_INTERVAL`] bytes, with
+    /// that entry's offset.
+    index: Vec<(Vec<u8>, u64)>,
+    smallest: Vec<u8>,
+    largest: Vec<u8>,
+    max_lsn: Lsn,
+    versions: u64,
+    _reservation: Reservation,
+}
+
+impl SpilledRun {
+    /// Reads forward from the last indexed entry whose key passes `before`.
+    fn reader_from(&self, before: impl Fn(&[u8]) -> bool) -> Result<RunReader> {
+        let at = self.index.partition_point(|(key, _)| before(key));
+        let offset = at.checked_sub(1).map_or(0, |i| self.index[i].1);
+        self.run.reader_at(offset, READ_BLOCK)
+    }
+
+    /// The before-image for `key` of the oldest write in this run newer
+    /// than `lsn`.
+    fn lookup(&self, key: &[u8], lsn: Lsn) -> Result<Option<BeforeImage>> {
+        if self.max_lsn <= lsn || key < self.smallest.as_slice() || key > self.largest.as_slice() {
+            return Ok(None);
+        }
+        for entry in self.reader_from(|k| k < key)? {
+            let (entry_key, value) = entry?;
+            match entry_key.as_slice().cmp(key) {
+                std::cmp::Ordering::Less => continue,
+                std::cmp::Ordering::Greater => break,
+                std::cmp::Ordering::Equal => {
+                    let (version, before) = decode(value)?;
+                    if version > lsn {
+                        return Ok(Some(before));
+                    }
+                }
+            }
+        }
+        Ok(None)
+    }
+}
+
+/// One in-memory version of a key.
+#[derive(Debug)]
+struct Version {
+    lsn: Lsn,
+    before: BeforeImage,
+    /// The next newer version of the same key.
+    newer: Option<SlabKey>,
+}
+
+/// The in-memory versions of one key, linked oldest first.
+#[derive(Debug, Clone, Copy)]
+struct Chain {
+    oldest: SlabKey,
+    newest: SlabKey,
+}
+
+/// Iterates over the versions of `chain`, oldest first.
+fn versions(headers: &Slab<Version>, chain: Chain) -> impl Iterator<Item = &Version> {
+    std::iter::successors(Some(headers.get(chain.oldest)), |version| {
+        version.newer.map(|key| headers.get(key))
+    })
+}
+
+#[derive(Debug)]
+struct State {
+    memory: BTreeMap<Vec<u8>, Chain>,
+    headers: Slab<Version>,
+    resident_versions: u64,
+    /// Spill runs, oldest first.
+    runs: Vec<Arc<SpilledRun>>,
+    reservation: Reservation,
+    stats: VersionStoreStats,
+}
+
+/// Bounded storage for the versions open read views need.
+#[derive(Debug)]
+pub struct VersionStore {
+    budget: Arc<MemoryBudget>,
+    temp_dir: PathBuf,
+    quota: usize,
+    next_run: AtomicU64,
+    state: Mutex<State>,
+}
+
+impl VersionStore {
+    /// Creates an empty store that holds at most `quota` bytes of versions
+    /// in memory, charged to `budget`, and spills to `temp_dir`.
+    pub fn new(
+        budget: &Arc<MemoryBudget>,
+        temp_dir: impl AsRef<Path>,
+        quota: usize,
+    ) -> Result<Self> {
+        if quota < MIN_VERSION_STORE_BYTES {
+            return Err(Error::InvalidArgument(format!(
+                "the version store needs at least {MIN_VERSION_STORE_BYTES} bytes of memory"
+            )));
+        }
+        Ok(VersionStore {
+            budget: Arc::clone(budget),
+            temp_dir: temp_dir.as_ref().to_path_buf(),
+            quota,
+            next_run: AtomicU64::new(0),
+            state: Mutex::new(State {
+                memory: BTreeMap::new(),
+                headers: Slab::new(budget.try_reserve(Consumer::VersionStore, 0)?),
+                resident_versions: 0,
+                runs: Vec::new(),
+                reservation: budget.try_reserve(Consumer::VersionStore, 0)?,
+                stats: VersionStoreStats::default(),
+            }),
+        })
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> VersionStoreStats {
+        let state = self.state.lock().unwrap();
+        VersionStoreStats {
+            resident_versions: state.resident_versions,
+            resident_bytes: (state.reservation.size() + state.headers.held_bytes()) as u64,
+            spilled_runs: state.runs.len() as u64,
+            spilled_bytes: state.runs.iter().map(|r| r.run.bytes()).sum(),
+            ..state.stats
+        }
+    }
+
+    /// Records that the write at `lsn` replaced `before` under `key`.
+    /// Writes must be recorded in LSN order.
+    pub fn record(&self, key: &[u8], lsn: Lsn, before: BeforeImage) -> Result<()> {
+        self.prepare(key, before)?.commit(lsn);
+        Ok(())
+    }
+
+    /// Takes the memory and header a version of `key` replacing `before`
+    /// needs, spilling first if the quota is full, before the write's LSN
+    /// is known. Committing the returned version cannot fail; dropping it
+    /// instead gives both back. Only one version may be prepared at a time.
+    pub(crate) fn prepare(&self, key: &[u8], before: BeforeImage) -> Result<PreparedVersion<'_>> {
+        let cost = version_cost(key, &before);
+        let mut state = self.state.lock().unwrap();
+        let fits =
+            state.reservation.size() + state.headers.held_after_insert() + cost <= self.quota;
+        if !fits || state.reservation.try_grow(cost).is_err() {
+            if !state.memory.is_empty() {
+                self.spill(&mut state)?;
+            } else if !fits {
+                return Err(Error::InvalidArgument(format!(
+                    "a version of {cost} bytes does not fit the version store"
+                )));
+            }
+            state.reservation.try_grow(cost)?;
+        }
+        // Not linked into any chain until committed, so invisible to
+        // lookups, and not cleared by `collect` while it is not empty.
+        let version = Version {
+            lsn: 0,
+            before,
+            newer: None,
+        };
+        let header = match state.headers.insert(version) {
+            Ok(header) => header,
+            Err(err) => {
+                state.reservation.shrink(cost);
+                return Err(err);
+            }
+        };
+        Ok(PreparedVersion {
+            store: self,
+            key: key.to_vec(),
+            header: Some(header),
+            cost,
+        })
+    }
+
+    /// Writes the in-memory versions out as a new run and frees them.
+    fn spill(&self, state: &mut State) -> Result<()> {
+        let mut writer = RunWriter::create(&self.temp_dir, WRITE_BLOCK)?;
+        let mut index = Vec::new();
+        let mut next_index = 0;
+        let mut max_lsn = 0;
+        let mut index_bytes = 0;
+        for (key, &chain) in &state.memory {
+            for version in versions(&state.headers, chain) {
+                if writer.bytes() >= next_index {
+                    index_bytes += key.len() + std::mem::size_of::<(Vec<u8>, u64)>();
+                    index.push((key.clone(), writer.bytes()));
+                    next_index = writer.bytes() + INDEX_INTERVAL;
+                }
+                writer.push(key, &encode(version.lsn, &version.before))?;
+                max_lsn = max_lsn.max(version.lsn);
+            }
+        }
+        // Nothing changes until the run is complete, so a failure leaves
+        // the versions in memory.
+        let smallest = state.memory.keys().next().cloned().unwrap_or_default();
+        let largest = state.memory.keys().next_back().cloned().unwrap_or_default();
+        let reservation = self.budget.try_reserve(
+            Consumer::VersionStore,
+            index_bytes + smallest.len() + largest.len(),
+        )?;
+        let run = writer.finish()?;
+        state.memory.clear();
+        state.runs.push(Arc::new(SpilledRun {
+            id: self.next_run.fetch_add(1, Ordering::Relaxed),
+            run,
+            index,
+            smallest,
+            largest,
+            max_lsn,
+            versions: state.resident_versions,
+            _reservation: reservation,
+        }));
+        let resident = state.reservation.size();
+        state.reservation.shrink(resident);
+        state.headers.clear();
+        state.resident_versions = 0;
+        Ok(())
+    }
+
+    /// The before-image of the oldest write to `key` newer than `lsn`, if
+    /// any: the value a view at `lsn` sees instead of the current one.
+    pub fn lookup(&self, key: &[u8], lsn: Lsn) -> Result<Option<BeforeImage>> {
+        let (runs, resident) = {
+            let state = self.state.lock().unwrap();
+            let resident = state
+                .memory
+                .get(key)
+                .and_then(|&chain| versions(&state.headers, chain).find(|v| v.lsn > lsn))
+                .map(|version| version.before.clone());
+            (state.runs.clone(), resident)
+        };
+        // Runs hold older writes than memory; the oldest hit wins.
+        for run in &runs {
+            if let Some(before) = run.lookup(key, lsn)? {
+                return Ok(Some(before));
+            }
+        }
+        Ok(resident)
+    }
+
+    /// The smallest key within `lower` with a version newer than `lsn`,
+    /// with the before-image a view at `lsn` sees for it. `cursors` holds
+    /// the caller's position in each spill run between calls; `lower` must
+    /// not move backwards from one call to the next.
+    pub(crate) fn next_from(
+        &self,
+        lower: Bound<&[u8]>,
+        lsn: Lsn,
+        cursors: &mut Vec<RunCursor>,
+    ) -> Result<Option<(Vec<u8>, BeforeImage)>> {
+        let (runs, resident) = {
+            let state = self.state.lock().unwrap();
+            let resident = state
+                .memory
+                .range::<[u8], _>((lower, Bound::Unbounded))
+                .find_map(|(key, &chain)| {
+                    versions(&state.headers, chain)
+                        .find(|version| version.lsn > lsn)
+                        .map(|version| (key.clone(), version.before.clone()))
+                });
+            (state.runs.clone(), resident)
+        };
+        // Follow runs spilled since the last call; forget collected ones.
+        cursors.retain(|c| runs.iter().any(|r| r.id == c.run.id));
+        for run in runs.iter().filter(|r| r.max_lsn > lsn) {
+            if !cursors.iter().any(|c| c.run.id == run.id) {
+                cursors.push(RunCursor::new(Arc::clone(run), lower)?);
+            }
+        }
+        cursors.sort_by_key(|c| c.run.id);
+
+        let mut best: Option<(Vec<u8>, BeforeImage)> = None;
+        for cursor in cursors.iter_mut() {
+            if let Some((key, before)) = cursor.peek(lower, lsn)? {
+                if best.as_ref().is_none_or(|(b, _)| key < b.as_slice()) {
+                    best = Some((key.to_vec(), before.clone()));
+                }
+            }
+        }
+        Ok(match (best, resident) {
+            (Some(run), Some(mem)) if mem.0 < run.0 => Some(mem),
+            (Some(run), _) => Some(run),
+            (None, resident) => resident,
+        })
+    }
+
+    /// Discards versions no view at or after `oldest` needs, or all of
+    /// them when no view is open.
+    pub fn collect(&self, oldest: Option<Lsn>) {
+        let mut state = self.state.lock().unwrap();
+        let keep = |version: Lsn| oldest.is_some_and(|t| version > t);
+        let mut in_memory = 0;
+        let mut spilled = 0;
+        let mut freed = 0;
+        let State {
+            memory, headers, ..
+        } = &mut *state;
+        // Chains are in LSN order, so the versions to drop come first.
+        memory.retain(|key, chain| loop {
+            let oldest = headers.get(chain.oldest);
+            if keep(oldest.lsn) {
+                return true;
+            }
+            let newer = oldest.newer;
+            let version = headers.remove(chain.oldest);
+            in_memory += 1;
+            freed += version_cost(key, &version.before);
+            match newer {
+                Some(newer) => chain.oldest = newer,
+                None => return false,
+            }
+        });
+        if headers.is_empty() {
+            headers.clear();
+        }
+        state.runs.retain(|run| {
+            if keep(run.max_lsn) {
+                return true;
+            }
+            spilled += run.versions;
+            false
+        });
+        state.reservation.shrink(freed);
+        // Spilled versions stopped counting as resident when their run was
+        // written.
+        state.resident_versions -= in_memory;
+        state.stats.collected += in_memory + spilled;
+    }
+}
+
+/// A version whose memory is taken but which is not yet visible, returned
+/// by [`VersionStore::prepare`].
+#[derive(Debug)]
+pub(crate) struct PreparedVersion<'a> {
+    store: &'a VersionStore,
+    key: Vec<u8>,
+    /// Taken when committed.
+    header: Option<SlabKey>,
+    cost: usize,
+}
+
+impl PreparedVersion<'_> {
+    /// Records the version as replaced by the write at `lsn`, which must
+    /// be newer than every version recorded before.
+    pub(crate) fn commit(mut self, lsn: Lsn) {
+        let added = self.header.take().unwrap();
+        let mut state = self.store.state.lock().unwrap();
+        let State {
+            memory, headers, ..
+        } = &mut *state;
+        headers.get_mut(added).lsn = lsn;
+        match memory.get_mut(&self.key) {
+            Some(chain) => {
+                headers.get_mut(chain.newest).newer = Some(added);
+                chain.newest = added;
+            }
+            None => {
+                let chain = Chain {
+                    oldest: added,
+                    newest: added,
+                };
+                memory.insert(std::mem::take(&mut self.key), chain);
+            }
+        }
+        state.resident_versions += 1;
+        state.stats.recorded += 1;
+    }
+}
+
+impl Drop for PreparedVersion<'_> {
+    fn drop(&mut self) {
+        if let Some(header) = self.header {
+            let mut state = self.store.state.lock().unwrap();
+            state.headers.remove(header);
+            state.reservation.shrink(self.cost);
+        }
+    }
+}
+
+/// A scan's position in one spill run.
+#[derive(Debug)]
+pub(crate) struct RunCursor {
+    run: Arc<SpilledRun>,
+    reader: RunReader,
+    head: Option<(Vec<u8>, Lsn, BeforeImage)>,
+}
+
+impl RunCursor {
+    fn new(run: Arc<SpilledRun>, lower: Bound<&[u8]>) -> Result<Self> {
+        let reader = match lower {
+            Bound::Included(start) => run.reader_from(|k| k < start)?,
+            Bound::Excluded(after) => run.reader_from(|k| k <= after)?,
+            Bound::Unbounded => run.run.reader(READ_BLOCK)?,
+        };
+        Ok(RunCursor {
+            run,
+            reader,
+            head: None,
+        })
+    }
+
+    fn advance(&mut self) -> Result<()> {
+        self.head = match self.reader.next() {
+            Some(entry) => {
+                let (key, value) = entry?;
+                let (lsn, before) = decode(value)?;
+                Some((key, lsn, before))
+            }
+            None => None,
+        };
+        Ok(())
+    }
+
+    /// The first entry within `lower` with a version newer than `lsn`.
+    fn peek(&mut self, lower: Bound<&[u8]>, lsn: Lsn) -> Result<Option<(&[u8], &BeforeImage)>> {
+        loop {
+            if self.head.is_none() {
+                self.advance()?;
+                if self.head.is_none() {
+                    return Ok(None);
+                }
+            }
+            let (key, version, _) = self.head.as_ref().unwrap();
+            if !within(lower, key) || *version <= lsn {
+                self.advance()?;
+                if self.head.is_none() {
+                    return Ok(None);
+                }
+                continue;
+            }
+            let (key, _, before) = self.head.as_ref().unwrap();
+            return Ok(Some((key, before)));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn store(dir: &TempDir) -> VersionStore {
+        VersionStore::new(
+            &MemoryBudget::new(4 << 20),
+            dir.path(),
+            MIN_VERSION_STORE_BYTES,
+        )
+        .unwrap()
+    }
+
+    fn key(i: u64) -> Vec<u8> {
+        format!("key{i:04}").into_bytes()
+    }
+
+    #[test]
+    fn lookups_see_versions_across_spills() {
+        const KEYS: u64 = 50;
+        let dir = TempDir::new("versions-spill");
+        let store = store(&dir);
+        // history[k] lists (lsn, before-image) of every write to key k.
+        let mut history: Vec<Vec<(Lsn, BeforeImage)>> = vec![Vec::new(); KEYS as usize];
+        for lsn in 1..=3000 {
+            let k = lsn * 7 % KEYS;
+            let before = (lsn % 5 != 0).then(|| vec![lsn as u8; 100 + (lsn % 50) as usize]);
+            store.record(&key(k), lsn, before.clone()).unwrap();
+            history[k as usize].push((lsn, before));
+        }
+        assert!(store.stats().spilled_runs >= 2);
+        for view in (0..3000).step_by(37) {
+            for k in 0..KEYS {
+                let expected = history[k as usize]
+                    .iter()
+                    .find(|&&(lsn, _)| lsn > view)
+                    .map(|(_, before)| before.clone());
+                assert_eq!(
+                    store.lookup(&key(k), view).unwrap(),
+                    expected,
+                    "view {view} key {k}"
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn collect_keeps_counting_resident_versions() {
+        let dir = TempDir::new("versions-collect");
+        let store = store(&dir);
+        let mut lsn = 0;
+        while store.stats().spilled_runs == 0 {
+            lsn += 1;
+            store
+                .record(&key(lsn % 100), lsn, Some(vec![0; 200]))
+                .unwrap();
+        }
+        let spilled_up_to = lsn - 1;
+        for _ in 0..10 {
+            lsn += 1;
+            store.record(&key(lsn % 100), lsn, None).unwrap();
+        }
+        let resident = store.stats().resident_versions;
+        assert_eq!(resident, 11);
+
+        // Dropping the run must not touch the count of versions in memory.
+        store.collect(Some(spilled_up_to));
+        let stats = store.stats();
+        assert_eq!(stats.spilled_runs, 0);
+        assert_eq!(stats.resident_versions, resident);
+        assert_eq!(stats.collected, spilled_up_to);
+        assert_eq!(store.lookup(&key(lsn % 100), lsn - 1).unwrap(), Some(None));
+
+        store.collect(None);
+        let stats = store.stats();
+        assert_eq!(stats.resident_versions, 0);
+        assert_eq!(stats.collected, stats.recorded);
+    }
+
+    #[test]
+    fn a_dropped_preparation_leaves_no_trace() {
+        let dir = TempDir::new("versions-prepare");
+        let store = store(&dir);
+        store.record(&key(1), 1, None).unwrap();
+        let before = store.stats();
+        let prepared = store.prepare(&key(1), Some(vec![0; 500])).unwrap();
+        assert!(store.stats().resident_bytes > before.resident_bytes);
+        assert_eq!(store.lookup(&key(1), 1).unwrap(), None);
+        drop(prepared);
+        assert_eq!(store.stats(), before);
+
+        store.prepare(&key(1), Some(vec![2])).unwrap().commit(2);
+        assert_eq!(store.lookup(&key(1), 1).unwrap(), Some(Some(vec![2])));
+        assert_eq!(store.lookup(&key(1), 0).unwrap(), Some(None));
+    }
+}
@@ -0,0 +1,179 @@
+//! Configuration supplied when a database is opened.
+
+use std::path::PathBuf;
+use std::time::Duration;
+
+use crate::compress::Codec;
+use crate::wal::WalOptions;
+
+/// The structure that stores the primary key space.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum Engine {
+    /// An update-in-place B+tree in the main data file.
+    #[default]
+    BTree,
+    /// A log-structured merge tree, for write-heavy ingest.
+    Lsm,
+}
+
+/// Tunables fixed for the lifetime of an open [`Database`](crate::Database).
+#[derive(Debug, Clone)]
+pub struct Options {
+    /// Hard cap on memory reserved by all components together.
+    pub max_resident_bytes: usize,
+    /// Share of `max_resident_bytes` given to the page buffer pool.
+    pub buffer_pool_fraction: f64,
+    /// Read and write the data file and sorted runs with direct I/O, so
+    /// their pages are cached only in the buffer pool and not a second
+    /// time in the kernel's page cache, which a cgroup charges to the
+    /// process. Synced log records are dropped from the page cache too.
+    /// Ignored where direct I/O is unsupported.
+    pub direct_io: bool,
+    /// Share of `max_resident_bytes` the cache of decoded rows may fill.
+    /// It is charged as it fills. Zero turns the cache off.
+    pub row_cache_fraction: f64,
+    /// Storage engine used for the primary key space.
+    pub engine: Engine,
+    /// Share of `max_resident_bytes` given to LSM memtables. Half of it caps
+    /// the active memtable; the other half covers the one being flushed.
+    pub memtable_fraction: f64,
+    /// Codec for the blocks of new LSM sorted runs. The buffer pool caches
+    /// their pages compressed, so a better ratio means a larger effective
+    /// cache. B+tree pages are updated in place and stay uncompressed.
+    ///
+    /// The database holds a single key space, so this is its one table's
+    /// codec, and [`Database::compression_stats`] reports that table's
+    /// ratio and decode time, summed over its runs.
+    ///
+    /// [`Database::compression_stats`]: crate::Database::compression_stats
+    pub compression: Codec,
+    /// Bytes of preallocated write-ahead log buffer, charged to the budget.
+    pub wal_buffer_bytes: usize,
+    /// How long a group-commit leader waits for more commits before it
+    /// syncs the log. Zero syncs immediately; commits that arrive during a
+    /// sync still share the next one.
+    pub wal_fsync_interval: Duration,
+    /// A group-commit leader syncs early once this many bytes are batched.
+    pub wal_max_batch_bytes: usize,
+    /// Size at which the write-ahead log starts a new segment file. Only
+    /// whole segments are deleted after a checkpoint.
+    pub wal_segment_bytes: u64,
+    /// A B+tree checkpoint is taken once this many log bytes have been
+    /// written since the last one, bounding crash-recovery replay.
+    pub checkpoint_wal_bytes: u64,
+    /// Memory granted to each sort before it spills to disk, when the
+    /// query memory pool is not under pressure.
+    pub sort_memory_bytes: usize,
+    /// Memory granted to each hash join before it spills to disk, when the
+    /// query memory pool is not under pressure.
+    pub join_memory_bytes: usize,
+    /// Pool shared by the grants of all running sorts and joins. Once it is
+    /// exhausted, new operators queue and running ones are asked to shrink
+    /// to a fair share.
+    pub query_memory_bytes: usize,
+    /// How long a new sort or join waits for a grant from an exhausted
+    /// pool before it starts with whatever is free.
+    pub grant_wait: Duration,
+    /// Memory for the versions open read views need before they spill to
+    /// disk.
+    pub version_store_bytes: usize,
+    /// How often to sample the cgroup's memory use, limits and pressure
+    /// and move the budget to match, resizing the buffer pool, row cache,
+    /// memtables and query memory pool with it. `None` turns this off; it is also off
+    /// when the process has no cgroup v2 memory controller.
+    pub memory_monitor_interval: Option<Duration>,
+    /// The cgroup v2 directory to follow instead of the process's own.
+    pub cgroup_dir: Option<PathBuf>,
+    /// How often to move memory between the buffer pool, the row cache and
+    /// the LSM memtables, toward the one whose miss curve promises the most
+    /// hits from it. The fractions above set the starting split. `None`
+    /// keeps it.
+    pub cache_rebalance_interval: Option<Duration>,
+    /// Directory for sort and join spill files. Defaults to `tmp` inside
+    /// the database directory.
+    pub temp_dir: Option<PathBuf>,
+    /// Create the database directory if it does not exist.
+    pub create_if_missing: bool,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Options {
+            max_resident_bytes: 64 << 20,
+            buffer_pool_fraction: 0.5,
+            direct_io: false,
+            row_cache_fraction: 0.1,
+            engine: Engine::BTree,
+            memtable_fraction: 0.25,
+            compression: Codec::None,
+            wal_buffer_bytes: 256 << 10,
+            wal_fsync_interval: Duration::ZERO,
+            wal_max_batch_bytes: 64 << 10,
+            wal_segment_bytes: 8 << 20,
+            checkpoint_wal_bytes: 32 << 20,
+            sort_memory_bytes: 4 << 20,
+            join_memory_bytes: 4 << 20,
+            query_memory_bytes: 16 << 20,
+            grant_wait: Duration::from_millis(50),
+            version_store_bytes: 4 << 20,
+            memory_monitor_interval: Some(Duration::from_secs(1)),
+            cgroup_dir: None,
+            cache_rebalance_interval: Some(Duration::from_secs(1)),
+            temp_dir: None,
+            create_if_missing: true,
+        }
+    }
+}
+
+impl Options {
+    /// Bytes of the budget handed to the buffer pool.
+    pub fn buffer_pool_bytes(&self) -> usize {
+        self.buffer_pool_bytes_within(self.max_resident_bytes)
+    }
+
+    /// The buffer pool's share of a budget limited to `limit` bytes.
+    pub fn buffer_pool_bytes_within(&self, limit: usize) -> usize {
+        (limit as f64 * self.buffer_pool_fraction) as usize
+    }
+
+    /// Bytes the row cache may fill.
+    pub fn row_cache_bytes(&self) -> usize {
+        self.row_cache_bytes_within(self.max_resident_bytes)
+    }
+
+    /// The row cache's share of a budget limited to `limit` bytes.
+    pub fn row_cache_bytes_within(&self, limit: usize) -> usize {
+        (limit as f64 * self.row_cache_fraction) as usize
+    }
+
+    /// Group-commit settings for the write-ahead log.
+    pub fn wal_options(&self) -> WalOptions {
+        WalOptions {
+            buffer_bytes: self.wal_buffer_bytes,
+            fsync_interval: self.wal_fsync_interval,
+            max_batch_bytes: self.wal_max_batch_bytes,
+            segment_bytes: self.wal_segment_bytes,
+            discard_synced: self.direct_io,
+        }
+    }
+
+    /// Cap on a single LSM memtable.
+    pub fn memtable_bytes(&self) -> usize {
+        self.memtable_bytes_within(self.max_resident_bytes)
+    }
+
+    /// Cap on a single LSM memtable within a budget limited to `limit`
+    /// bytes.
+    pub fn memtable_bytes_within(&self, limit: usize) -> usize {
+        (limit as f64 * self.memtable_fraction / 2.0) as usize
+    }
+
+    /// The query memory pool within a budget limited to `limit` bytes: the
+    /// configured pool scaled down with the budget, but never below what a
+    /// single hash join needs.
+    pub fn query_memory_bytes_within(&self, limit: usize) -> usize {
+        let scaled = (self.query_memory_bytes as f64 * limit as f64
+            / self.max_resident_bytes as f64) as usize;
+        scaled.max(self.query_memory_bytes.min(crate::exec::MIN_JOIN_MEMORY))
+    }
+}
@@ -0,0 +1,510 @@
+//! Memory-pressure feedback from the process's cgroup.
+//!
+//! A [`MemoryMonitor`] samples the cgroup v2 files `memory.current`,
+//! `memory.high`, `memory.max`, `memory.stat` and `memory.pressure` at a
+//! fixed interval and moves the [`MemoryBudget`] limit to match. When the
+//! cgroup nears its limit or memory stalls become frequent, the budget
+//! limit is lowered and the owner's resize hook shrinks the buffer pool,
+//! the memtable cap and the query memory pool to their shares of the new
+//! limit. Once the pressure is gone, the limit is raised back toward the
+//! configured maximum a step at a time.
+//!
+//! Page cache charged to the cgroup is left out of its usage: the kernel
+//! reclaims it before anything else, so it does not make the database
+//! crowd the limit. A container resized live therefore sees the database
+//! give memory back before the kernel has to throttle or reclaim it.
+
+use std::fmt;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use crate::error::{Error, Result};
+use crate::memory::MemoryBudget;
+
+/// Usage above this share of the cgroup limit makes the budget shrink.
+const HIGH_WATERMARK_PERCENT: u64 = 90;
+/// Usage below this share of the cgroup limit lets the budget grow.
+const LOW_WATERMARK_PERCENT: u64 = 75;
+/// Share of the last 10 seconds, in percent, that some task stalled on
+/// memory above which the budget shrinks.
+const SHRINK_PRESSURE: f64 = 10.0;
+/// Stall share below which the budget may grow.
+const GROW_PRESSURE: f64 = 1.0;
+/// The budget moves by this fraction of its size per sample.
+const STEP_DIVISOR: usize = 8;
+/// The budget never shrinks below this fraction of its configured size.
+const MIN_LIMIT_DIVISOR: usize = 4;
+
+/// One reading of a cgroup's memory files.
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct CgroupSample {
+    /// Bytes charged to the cgroup.
+    pub current: u64,
+    /// Throttling threshold, if set.
+    pub high: Option<u64>,
+    /// Hard limit, if set.
+    pub max: Option<u64>,
+    /// Page cache among the bytes charged.
+    pub file: u64,
+    /// Share of the last 10 seconds, in percent, in which some task
+    /// stalled on memory.
+    pub some_avg10: f64,
+    /// Share in which every task stalled.
+    pub full_avg10: f64,
+}
+
+impl CgroupSample {
+    /// The lower of the throttling threshold and the hard limit.
+    pub fn ceiling(&self) -> Option<u64> {
+        match (self.high, self.max) {
+            (Some(high), Some(max)) => Some(high.min(max)),
+            (high, max) => high.or(max),
+        }
+    }
+
+    /// Bytes charged other than page cache.
+    pub fn resident(&self) -> u64 {
+        self.current.saturating_sub(self.file)
+    }
+}
+
+/// A cgroup v2 directory with the memory controller enabled.
+#[derive(Debug, Clone)]
+pub struct Cgroup {
+    dir: PathBuf,
+}
+
+impl Cgroup {
+    /// The cgroup at `dir`, or `None` if it has no memory controller.
+    pub fn at(dir: impl AsRef<Path>) -> Option<Cgroup> {
+        let dir = dir.as_ref();
+        dir.join("memory.current").is_file().then(|| Cgroup {
+            dir: dir.to_path_buf(),
+        })
+    }
+
+    /// The cgroup v2 group of the current process, or `None` if there is
+    /// none with a memory controller (other platforms, cgroup v1 only).
+    pub fn detect() -> Option<Cgroup> {
+        let groups = fs::read_to_string("/proc/self/cgroup").ok()?;
+        let group = groups.lines().find_map(|line| line.strip_prefix("0::"))?;
+        let mounts = fs::read_to_string("/proc/self/mountinfo").ok()?;
+        for line in mounts.lines() {
+            let Some((fields, filesystem)) = line.split_once(" - ") else {
+                continue;
+            };
+            if !filesystem.starts_with("cgroup2 ") {
+                continue;
+            }
+            let fields: Vec<&str> = fields.split(' ').collect();
+            let (Some(root), Some(mount_point)) = (fields.get(3), fields.get(4)) else {
+                continue;
+            };
+            let Some(relative) = group.strip_prefix(root) else {
+                continue;
+            };
+            return Cgroup::at(Path::new(mount_point).join(relative.trim_start_matches('/')));
+        }
+        None
+    }
+
+    /// The directory of the cgroup.
+    pub fn path(&self) -> &Path {
+        &self.dir
+    }
+
+    /// Reads the cgroup's usage, limits and memory pressure. Files other
+    /// than `memory.current` are optional and read as unset when missing.
+    pub fn sample(&self) -> Result<CgroupSample> {
+        let current = self.read_limit("memory.current")?.unwrap_or(0);
+        let optional = |name| self.read_limit(name).ok().flatten();
+        let mut sample = CgroupSample {
+            current,
+            high: optional("memory.high"),
+            max: optional("memory.max"),
+            ..CgroupSample::default()
+        };
+        if let Ok(stat) = fs::read_to_string(self.dir.join("memory.stat")) {
+            sample.file = stat
+                .lines()
+                .find_map(|line| line.strip_prefix("file "))
+                .and_then(|value| value.trim().parse().ok())
+                .unwrap_or(0);
+        }
+        if let Ok(pressure) = fs::read_to_string(self.dir.join("memory.pressure")) {
+            for line in pressure.lines() {
+                let mut fields = line.split(' ');
+                let kind = fields.next();
+                let avg10 = fields
+                    .find_map(|field| field.strip_prefix("avg10="))
+                    .and_then(|value| value.parse().ok())
+                    .unwrap_or(0.0);
+                match kind {
+                    Some("some") => sample.some_avg10 = avg10,
+                    Some("full") => sample.full_avg10 = avg10,
+                    _ => {}
+                }
+            }
+        }
+        Ok(sample)
+    }
+
+    /// Reads a file holding a byte count or `max`, which reads as `None`.
+    fn read_limit(&self, name: &str) -> Result<Option<u64>> {
+        let text = fs::read_to_string(self.dir.join(name))?;
+        let text = text.trim();
+        if text == "max" {
+            return Ok(None);
+        }
+        text.parse().map(Some).map_err(|_| {
+            Error::InvalidArgument(format!(
+                "unexpected contents {text:?} in cgroup file {name}"
+            ))
+        })
+    }
+}
+
+/// The budget limit to move to from `limit` after `sample`, given that
+/// `used` bytes of the budget are reserved and it was configured at
+/// `configured` bytes.
+pub fn next_limit(sample: &CgroupSample, limit: usize, used: usize, configured: usize) -> usize {
+    let mut fit = configured;
+    let mut crowded = false;
+    let mut roomy = true;
+    if let Some(ceiling) = sample.ceiling() {
+        let high = ceiling / 100 * HIGH_WATERMARK_PERCENT;
+        // What the rest of the process holds, outside the budget.
+        let other = sample.resident().saturating_sub(used as u64);
+        fit = fit.min(high.saturating_sub(other).try_into().unwrap_or(usize::MAX));
+        crowded = sample.resident() > high;
+        roomy = sample.resident() < ceiling / 100 * LOW_WATERMARK_PERCENT;
+    }
+    let next = if crowded || sample.some_avg10 >= SHRINK_PRESSURE {
+        limit - limit / STEP_DIVISOR
+    } else if roomy && sample.some_avg10 <= GROW_PRESSURE {
+        limit + configured / STEP_DIVISOR
+    } else {
+        limit
+    };
+    next.min(fit)
+        .clamp(configured / MIN_LIMIT_DIVISOR, configured)
+}
+
+/// Counters describing a [`MemoryMonitor`].
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct PressureStats {
+    pub samples: u64,
+    /// Samples that could not be read.
+    pub errors: u64,
+    /// Times the budget limit was lowered.
+    pub shrinks: u64,
+    /// Times the budget limit was raised.
+    pub grows: u64,
+    /// The latest sample.
+    pub last: CgroupSample,
+}
+
+type ResizeHook = Box<dyn Fn(usize) + Send + Sync>;
+
+struct Shared {
+    cgroup: Cgroup,
+    budget: Arc<MemoryBudget>,
+    configured: usize,
+    interval: Duration,
+    resize: ResizeHook,
+    state: Mutex<State>,
+    wake: Condvar,
+}
+
+#[derive(Default)]
+struct State {
+    shutdown: bool,
+    stats: PressureStats,
+}
+
+impl Shared {
+    fn run(&self) {
+        let mut state = self.state.lock().unwrap();
+        // Checked before the first wait too: the owner may have stopped
+        // the thread before it got here.
+        while !state.shutdown {
+            state = self.wake.wait_timeout(state, self.interval).unwrap().0;
+            if state.shutdown {
+                return;
+            }
+            drop(state);
+            self.poll();
+            state = self.state.lock().unwrap();
+        }
+    }
+
+    fn poll(&self) {
+        let sample = match self.cgroup.sample() {
+            Ok(sample) => sample,
+            Err(_) => {
+                self.state.lock().unwrap().stats.errors += 1;
+                return;
+            }
+        };
+        let limit = self.budget.limit();
+        let next = next_limit(&sample, limit, self.budget.used(), self.configured);
+        if next != limit {
+            self.budget.set_limit(next);
+            (self.resize)(next);
+        }
+        let mut state = self.state.lock().unwrap();
+        let stats = &mut state.stats;
+        stats.samples += 1;
+        stats.last = sample;
+        if next < limit {
+            stats.shrinks += 1;
+        } else if next > limit {
+            stats.grows += 1;
+        }
+    }
+}
+
+/// A background thread that resizes a [`MemoryBudget`] to follow its
+/// cgroup's limit and memory pressure. Stopped when dropped.
+pub struct MemoryMonitor {
+    shared: Arc<Shared>,
+    worker: Option<JoinHandle<()>>,
+}
+
+impl MemoryMonitor {
+    /// Starts sampling `cgroup` every `interval`. The budget's current
+    /// limit is taken as the most it may grow to. After each change of
+    /// limit, `resize` is called with the new one to resize the consumers
+    /// that hold memory long-term.
+    pub fn start(
+        cgroup: Cgroup,
+        budget: &Arc<MemoryBudget>,
+        interval: Duration,
+        resize: impl Fn(usize) + Send + Sync + 'static,
+    ) -> Result<MemoryMonitor> {
+        let shared = Arc::new(Shared {
+            cgroup,
+            budget: Arc::clone(budget),
+            configured: budget.limit(),
+            interval,
+            resize: Box::new(resize),
+            state: Mutex::new(State::default()),
+            wake: Condvar::new(),
+        });
+        let worker = {
+            let shared = Arc::clone(&shared);
+            thread::Builder::new()
+                .name("memory-monitor".into())
+                .spawn(move || shared.run())?
+        };
+        Ok(MemoryMonitor {
+            shared,
+            worker: Some(worker),
+        })
+    }
+
+    /// The cgroup being sampled.
+    pub fn cgroup(&self) -> &Cgroup {
+        &self.shared.cgroup
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> PressureStats {
+        self.shared.state.lock().unwrap().stats
+    }
+}
+
+impl fmt::Debug for MemoryMonitor {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("MemoryMonitor")
+            .field("cgroup", &self.shared.cgroup)
+            .field("interval", &self.shared.interval)
+            .finish()
+    }
+}
+
+impl Drop for MemoryMonitor {
+    fn drop(&mut self) {
+        self.shared.state.lock().unwrap().shutdown = true;
+        self.shared.wake.notify_all();
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::time::Instant;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    const MIB: u64 = 1 << 20;
+
+    /// Replaces a file whole, so the monitor never reads it half written.
+    fn write(dir: &TempDir, name: &str, contents: &str) {
+        let temp = dir.path().join("new");
+        fs::write(&temp, contents).unwrap();
+        fs::rename(temp, dir.path().join(name)).unwrap();
+    }
+
+    /// A cgroup directory charged `current` bytes under a `max` limit,
+    /// with no page cache and no memory stalls.
+    fn fixture(dir: &TempDir, current: u64, max: u64) -> Cgroup {
+        write(dir, "memory.current", &format!("{current}\n"));
+        write(dir, "memory.high", "max\n");
+        write(dir, "memory.max", &format!("{max}\n"));
+        Cgroup::at(dir.path()).unwrap()
+    }
+
+    #[test]
+    fn a_sample_reads_every_memory_file() {
+        let dir = TempDir::new("cgroup-sample");
+        assert!(Cgroup::at(dir.path()).is_none());
+        let cgroup = fixture(&dir, 1024 * MIB, 2048 * MIB);
+        write(&dir, "memory.high", "1610612736\n");
+        write(
+            &dir,
+            "memory.stat",
+            "anon 700000000\nfile 268435456\nfile_mapped 1000\n",
+        );
+        write(
+            &dir,
+            "memory.pressure",
+            "some avg10=12.50 avg60=3.00 avg300=1.00 total=123456\n\
+             full avg10=4.25 avg60=1.00 avg300=0.50 total=65432\n",
+        );
+        let sample = cgroup.sample().unwrap();
+        assert_eq!(
+            sample,
+            CgroupSample {
+                current: 1024 * MIB,
+                high: Some(1536 * MIB),
+                max: Some(2048 * MIB),
+                file: 256 * MIB,
+                some_avg10: 12.5,
+                full_avg10: 4.25,
+            }
+        );
+        assert_eq!(sample.ceiling(), Some(1536 * MIB));
+        assert_eq!(sample.resident(), 768 * MIB);
+    }
+
+    #[test]
+    fn missing_and_unlimited_files_read_as_unset() {
+        let dir = TempDir::new("cgroup-unset");
+        write(&dir, "memory.current", "4096\n");
+        let cgroup = Cgroup::at(dir.path()).unwrap();
+        let expected = CgroupSample {
+            current: 4096,
+            ..CgroupSample::default()
+        };
+        assert_eq!(cgroup.sample().unwrap(), expected);
+        write(&dir, "memory.max", "max\n");
+        assert_eq!(cgroup.sample().unwrap(), expected);
+        assert_eq!(expected.ceiling(), None);
+
+        write(&dir, "memory.current", "lots\n");
+        assert!(matches!(cgroup.sample(), Err(Error::InvalidArgument(_))));
+    }
+
+    #[test]
+    fn the_limit_follows_usage_and_stalls() {
+        const CONFIGURED: usize = 1 << 30;
+        let limited = |current: u64, some_avg10: f64| CgroupSample {
+            current: current * MIB,
+            max: Some(2048 * MIB),
+            some_avg10,
+            ..CgroupSample::default()
+        };
+        // The database holds most of what is charged.
+        let used = 1000 << 20;
+        // Crowding the cgroup, or stalling on memory, shrinks by a step.
+        let step = CONFIGURED / STEP_DIVISOR;
+        assert_eq!(
+            next_limit(&limited(1900, 0.0), CONFIGURED, used, CONFIGURED),
+            CONFIGURED - step
+        );
+        assert_eq!(
+            next_limit(&limited(1000, 25.0), CONFIGURED, used, CONFIGURED),
+            CONFIGURED - step
+        );
+        // Between the watermarks nothing moves.
+        assert_eq!(
+            next_limit(&limited(1700, 0.0), CONFIGURED / 2, used, CONFIGURED),
+            CONFIGURED / 2
+        );
+        // With room and no stalls it grows back to the configured size.
+        assert_eq!(
+            next_limit(&limited(1000, 0.5), CONFIGURED / 2, used, CONFIGURED),
+            CONFIGURED / 2 + step
+        );
+        assert_eq!(
+            next_limit(&limited(1000, 0.0), CONFIGURED, used, CONFIGURED),
+            CONFIGURED
+        );
+        // Never past what fits under the high watermark beside the rest of
+        // the process, nor below a quarter of the configured size.
+        let tight = CgroupSample {
+            current: 600 * MIB,
+            max: Some(1024 * MIB),
+            ..CgroupSample::default()
+        };
+        let fit = (1024 * MIB / 100 * HIGH_WATERMARK_PERCENT - 88 * MIB) as usize;
+        assert_eq!(next_limit(&tight, CONFIGURED, 512 << 20, CONFIGURED), fit);
+        assert_eq!(
+            next_limit(&limited(2000, 50.0), CONFIGURED / 4, used, CONFIGURED),
+            CONFIGURED / 4
+        );
+    }
+
+    #[test]
+    fn the_monitor_resizes_the_budget() {
+        let dir = TempDir::new("cgroup-monitor");
+        let cgroup = fixture(&dir, 1900 * MIB, 2048 * MIB);
+        let budget = MemoryBudget::new(1 << 30);
+        let resized = Arc::new(AtomicUsize::new(0));
+        let monitor = {
+            let resized = Arc::clone(&resized);
+            MemoryMonitor::start(cgroup, &budget, Duration::from_millis(5), move |limit| {
+                resized.store(limit, Ordering::Relaxed)
+            })
+            .unwrap()
+        };
+        let wait_until = |done: &dyn Fn() -> bool| {
+            let deadline = Instant::now() + Duration::from_secs(10);
+            while !done() {
+                assert!(Instant::now() < deadline);
+                thread::sleep(Duration::from_millis(1));
+            }
+        };
+        // The container is crowded by memory outside the budget: the
+        // budget drops to its floor.
+        wait_until(&|| budget.limit() == 256 << 20);
+        assert_eq!(resized.load(Ordering::Relaxed), 256 << 20);
+        assert!(monitor.stats().shrinks >= 1);
+        // The container was resized live: the budget steps back up.
+        write(&dir, "memory.max", "8589934592\n");
+        wait_until(&|| budget.limit() == 1 << 30);
+        assert_eq!(resized.load(Ordering::Relaxed), 1 << 30);
+        assert!(monitor.stats().grows >= 6);
+        assert_eq!(monitor.stats().errors, 0);
+    }
+
+    #[test]
+    fn a_monitor_stops_at_once() {
+        let dir = TempDir::new("cgroup-stop");
+        let budget = MemoryBudget::new(1 << 30);
+        for _ in 0..20 {
+            let cgroup = fixture(&dir, 0, 1 << 30);
+            let started = Instant::now();
+            drop(MemoryMonitor::start(cgroup, &budget, Duration::from_secs(3600), |_| {}).unwrap());
+            assert!(started.elapsed() < Duration::from_secs(60));
+        }
+    }
+}
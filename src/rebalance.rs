@@ -0,0 +1,576 @@
+//! Moving memory between caches toward where it saves the most misses.
+//!
+//! Each participating cache records the reuse distance of a sample of its
+//! accesses: how many bytes of cache the item would have needed to still be
+//! resident. An access at distance `d` hits in any cache of `d` bytes or
+//! more, so the histogram of distances, a [`MissCurve`], tells how many
+//! hits a cache would gain or lose if it were resized. Sampling follows
+//! SHARDS: a key is tracked only if its hash falls in a fixed 1-in-64
+//! slice, so every access to a tracked key is seen, and distances measured
+//! among tracked keys are scaled up by the sampling rate. Tracking costs a
+//! hash per access and a short critical section for sampled ones only.
+//!
+//! A [`Rebalancer`] compares, every interval, the hits each cache would
+//! gain from one more step of memory with the hits each would lose from
+//! one step less, and moves a step from the cache that would lose the
+//! fewest to the one that would gain the most when the gain clearly
+//! outweighs the loss. Every avoided miss counts the same. Curves decay by
+//! half each round, so the split follows the workload as it changes. The
+//! total stays fixed unless the owner changes it, which it does when the
+//! memory budget itself is resized.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use crate::error::Result;
+
+/// One key in `1 << SAMPLE_SHIFT` is sampled.
+const SAMPLE_SHIFT: u32 = 6;
+/// Weight of a sampled access: the accesses it stands for.
+const SAMPLE_WEIGHT: f64 = (1u64 << SAMPLE_SHIFT) as f64;
+/// Most sampled keys a distance tracker remembers.
+const MAX_TRACKED: usize = 1 << 15;
+/// Width of the buckets of a [`MissCurve`].
+const BUCKET_BYTES: usize = 64 << 10;
+/// Most buckets a curve keeps; longer distances count as cold misses.
+const MAX_BUCKETS: usize = 1 << 16;
+/// Memory moved per round, as a fraction of the total.
+const STEP_DIVISOR: usize = 32;
+/// The gain must exceed the loss by this factor for memory to move.
+const HYSTERESIS: f64 = 1.25;
+/// Fewest sampled hits a step must gain before memory moves for it.
+const MIN_GAIN: f64 = 4.0 * SAMPLE_WEIGHT;
+
+/// Whether an access to the key with hash `hash` is sampled.
+pub fn sampled(hash: u64) -> bool {
+    hash >> (64 - SAMPLE_SHIFT) == 0
+}
+
+/// Sampled hits by reuse distance in bytes.
+#[derive(Debug, Clone, Default)]
+pub struct MissCurve {
+    /// Hits per [`BUCKET_BYTES`] of distance.
+    hits: Vec<f64>,
+    accesses: f64,
+}
+
+impl MissCurve {
+    /// Records a sampled access whose item was last seen `distance` bytes
+    /// of cache ago, or never.
+    pub fn record(&mut self, distance: Option<usize>) {
+        self.accesses += SAMPLE_WEIGHT;
+        let Some(bucket) = distance.map(|d| d / BUCKET_BYTES) else {
+            return;
+        };
+        if bucket >= MAX_BUCKETS {
+            return;
+        }
+        if bucket >= self.hits.len() {
+            self.hits.resize(bucket + 1, 0.0);
+        }
+        self.hits[bucket] += SAMPLE_WEIGHT;
+    }
+
+    /// Estimated accesses since the curve was started.
+    pub fn accesses(&self) -> f64 {
+        self.accesses
+    }
+
+    /// Estimated hits a cache of `bytes` would have had.
+    pub fn hits_within(&self, bytes: usize) -> f64 {
+        let full = (bytes / BUCKET_BYTES).min(self.hits.len());
+        let mut hits: f64 = self.hits[..full].iter().sum();
+        if let Some(partial) = self.hits.get(full) {
+            let fraction = (bytes % BUCKET_BYTES) as f64 / BUCKET_BYTES as f64;
+            hits += partial * fraction;
+        }
+        hits
+    }
+
+    /// Estimated hits a cache would gain growing from `from` to `to` bytes.
+    pub fn hits_between(&self, from: usize, to: usize) -> f64 {
+        self.hits_within(to) - self.hits_within(from)
+    }
+
+    /// Halves every count, so older accesses weigh less.
+    pub fn decay(&mut self) {
+        self.accesses /= 2.0;
+        for hits in &mut self.hits {
+            *hits /= 2.0;
+        }
+    }
+
+    /// Adds the counts of `other`.
+    pub fn merge(&mut self, other: &MissCurve) {
+        self.accesses += other.accesses;
+        if other.hits.len() > self.hits.len() {
+            self.hits.resize(other.hits.len(), 0.0);
+        }
+        for (hits, more) in self.hits.iter_mut().zip(&other.hits) {
+            *hits += more;
+        }
+    }
+
+    /// Returns the counts so far and starts over.
+    pub fn take(&mut self) -> MissCurve {
+        std::mem::take(self)
+    }
+}
+
+/// Stack distances of sampled keys: how many distinct sampled keys were
+/// accessed since the last access to a key. Last-access times are kept in
+/// a Fenwick tree so each access costs a logarithmic number of steps.
+#[derive(Debug, Default)]
+pub struct StackDistance {
+    last: HashMap<u64, usize>,
+    /// Fenwick tree over access times, holding one for each key's latest.
+    tree: Vec<i32>,
+    clock: usize,
+}
+
+impl StackDistance {
+    /// Records an access to the sampled key with hash `hash` and returns
+    /// the estimated number of distinct keys, sampled or not, accessed
+    /// since its previous access, or `None` if it was not seen before.
+    pub fn access(&mut self, hash: u64) -> Option<usize> {
+        if self.clock == self.tree.len() {
+            self.compact();
+        }
+        let distance = self.last.get(&hash).copied().map(|time| {
+            let since = self.prefix(self.clock) - self.prefix(time + 1);
+            self.add(time, -1);
+            since as usize * SAMPLE_WEIGHT as usize
+        });
+        self.last.insert(hash, self.clock);
+        self.add(self.clock, 1);
+        self.clock += 1;
+        distance
+    }
+
+    /// Renumbers the remembered keys from zero in access order, forgetting
+    /// the oldest if too many are remembered.
+    fn compact(&mut self) {
+        let mut keys: Vec<(usize, u64)> = self.last.drain().map(|(k, t)| (t, k)).collect();
+        keys.sort_unstable();
+        let keep = keys.len().min(MAX_TRACKED / 2);
+        self.tree = vec![0; MAX_TRACKED];
+        self.clock = 0;
+        for &(_, hash) in &keys[keys.len() - keep..] {
+            self.last.insert(hash, self.clock);
+            self.add(self.clock, 1);
+            self.clock += 1;
+        }
+    }
+
+    fn add(&mut self, time: usize, delta: i32) {
+        let mut i = time + 1;
+        while i <= self.tree.len() {
+            self.tree[i - 1] += delta;
+            i += i & i.wrapping_neg();
+        }
+    }
+
+    /// Sum over times below `end`.
+    fn prefix(&self, end: usize) -> i32 {
+        let mut sum = 0;
+        let mut i = end;
+        while i > 0 {
+            sum += self.tree[i - 1];
+            i -= i & i.wrapping_neg();
+        }
+        sum
+    }
+}
+
+/// Distances in bytes written: how much was written after a sampled key
+/// was last written. A cache of recent writes still holds the key if it
+/// is larger than that.
+#[derive(Debug, Default)]
+pub struct WriteDistance {
+    last: HashMap<u64, u64>,
+}
+
+impl WriteDistance {
+    /// Records that the sampled key with hash `hash` was written when
+    /// `position` bytes had been written in all.
+    pub fn written(&mut self, hash: u64, position: u64) {
+        if self.last.len() >= MAX_TRACKED && !self.last.contains_key(&hash) {
+            // Forget the older half.
+            let mut positions: Vec<u64> = self.last.values().copied().collect();
+            let middle = positions.len() / 2;
+            let cutoff = *positions.select_nth_unstable(middle).1;
+            self.last.retain(|_, &mut written| written >= cutoff);
+        }
+        self.last.insert(hash, position);
+    }
+
+    /// Bytes written since the sampled key with hash `hash` was, when
+    /// `position` bytes have been written in all, or `None` if it was not
+    /// seen.
+    pub fn distance(&self, hash: u64, position: u64) -> Option<usize> {
+        let written = *self.last.get(&hash)?;
+        Some(position.saturating_sub(written) as usize)
+    }
+}
+
+/// A cache whose size the [`Rebalancer`] manages.
+pub trait Rebalance: Send + Sync {
+    /// Stable lower-case name used in reports.
+    fn name(&self) -> &'static str;
+    /// Bytes currently given to the cache.
+    fn size_bytes(&self) -> usize;
+    /// Resizes the cache to about `bytes` and returns the size reached.
+    fn resize_bytes(&self, bytes: usize) -> usize;
+    /// The hits recorded since the last call.
+    fn take_curve(&self) -> MissCurve;
+}
+
+/// Counters describing a [`Rebalancer`].
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct RebalanceStats {
+    pub rounds: u64,
+    /// Steps of memory moved from one cache to another.
+    pub moves: u64,
+    pub moved_bytes: u64,
+    /// Each cache's name and current size.
+    pub sizes: Vec<(&'static str, usize)>,
+}
+
+struct Member {
+    cache: Arc<dyn Rebalance>,
+    min: usize,
+    curve: Option<MissCurve>,
+}
+
+struct State {
+    members: Vec<Member>,
+    shutdown: bool,
+    stats: RebalanceStats,
+}
+
+struct Shared {
+    interval: Duration,
+    state: Mutex<State>,
+    wake: Condvar,
+}
+
+/// Moves memory between caches by their miss curves, in a background
+/// thread. Stopped when dropped.
+pub struct Rebalancer {
+    shared: Arc<Shared>,
+    worker: Option<JoinHandle<()>>,
+}
+
+impl Rebalancer {
+    /// Starts rebalancing `caches`, each with the fewest bytes it may be
+    /// shrunk to, every `interval`.
+    pub fn start(
+        caches: Vec<(Arc<dyn Rebalance>, usize)>,
+        interval: Duration,
+    ) -> Result<Arc<Rebalancer>> {
+        let members = caches
+            .into_iter()
+            .map(|(cache, min)| Member {
+                cache,
+                min,
+                curve: None,
+            })
+            .collect();
+        let shared = Arc::new(Shared {
+            interval,
+            state: Mutex::new(State {
+                members,
+                shutdown: false,
+                stats: RebalanceStats::default(),
+            }),
+            wake: Condvar::new(),
+        });
+        let worker = {
+            let shared = Arc::clone(&shared);
+            thread::Builder::new()
+                .name("cache-rebalancer".into())
+                .spawn(move || shared.run())?
+        };
+        Ok(Arc::new(Rebalancer {
+            shared,
+            worker: Some(worker),
+        }))
+    }
+
+    /// Bytes given to all the caches together.
+    pub fn total(&self) -> usize {
+        let state = self.shared.state.lock().unwrap();
+        state.members.iter().map(|m| m.cache.size_bytes()).sum()
+    }
+
+    /// Resizes the caches to give `bytes` in all, keeping their shares.
+    pub fn set_total(&self, bytes: usize) {
+        let state = self.shared.state.lock().unwrap();
+        let sizes: Vec<usize> = state.members.iter().map(|m| m.cache.size_bytes()).collect();
+        let total: usize = sizes.iter().sum();
+        // Shrink first, so the memory is free before anything grows.
+        let mut order: Vec<usize> = (0..sizes.len()).collect();
+        let target = |i: usize| {
+            let share = (sizes[i] as f64 / total.max(1) as f64 * bytes as f64) as usize;
+            share.max(state.members[i].min)
+        };
+        order.sort_by_key(|&i| target(i) > sizes[i]);
+        for i in order {
+            state.members[i].cache.resize_bytes(target(i));
+        }
+    }
+
+    /// Runs one round of rebalancing now.
+    pub fn rebalance(&self) {
+        self.shared.rebalance();
+    }
+
+    /// Counters so far.
+    pub fn stats(&self) -> RebalanceStats {
+        let state = self.shared.state.lock().unwrap();
+        RebalanceStats {
+            sizes: state
+                .members
+                .iter()
+                .map(|m| (m.cache.name(), m.cache.size_bytes()))
+                .collect(),
+            ..state.stats.clone()
+        }
+    }
+}
+
+impl Shared {
+    fn run(&self) {
+        let mut state = self.state.lock().unwrap();
+        // Checked before the first wait too: the owner may have stopped
+        // the thread before it got here.
+        while !state.shutdown {
+            state = self.wake.wait_timeout(state, self.interval).unwrap().0;
+            if state.shutdown {
+                return;
+            }
+            drop(state);
+            self.rebalance();
+            state = self.state.lock().unwrap();
+        }
+    }
+
+    fn rebalance(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.stats.rounds += 1;
+        let total: usize = state.members.iter().map(|m| m.cache.size_bytes()).sum();
+        let step = total / STEP_DIVISOR;
+        let mut gains = Vec::with_capacity(state.members.len());
+        let mut losses = Vec::with_capacity(state.members.len());
+        for member in &mut state.members {
+            let fresh = member.cache.take_curve();
+            let curve = match &mut member.curve {
+                Some(curve) => {
+                    curve.decay();
+                    curve.merge(&fresh);
+                    curve
+                }
+                None => member.curve.insert(fresh),
+            };
+            let size = member.cache.size_bytes();
+            gains.push(curve.hits_between(size, size + step));
+            losses.push(if size >= member.min + step {
+                curve.hits_between(size - step, size)
+            } else {
+                f64::INFINITY
+            });
+        }
+        if step == 0 || state.members.len() < 2 {
+            return;
+        }
+        let by = |values: &[f64], i: usize, j: usize| values[i].total_cmp(&values[j]);
+        let winner = (0..gains.len()).max_by(|&i, &j| by(&gains, i, j)).unwrap();
+        let Some(loser) = (0..losses.len())
+            .filter(|&i| i != winner)
+            .min_by(|&i, &j| by(&losses, i, j))
+        else {
+            return;
+        };
+        if gains[winner] < MIN_GAIN || gains[winner] <= losses[loser] * HYSTERESIS {
+            return;
+        }
+        let (from, to) = (&state.members[loser].cache, &state.members[winner].cache);
+        let before = from.size_bytes();
+        let freed = before - from.resize_bytes(before - step).min(before);
+        if freed == 0 {
+            return;
+        }
+        let had = to.size_bytes();
+        let reached = to.resize_bytes(had + freed);
+        if reached < had + freed {
+            // Give back what the winner could not take.
+            from.resize_bytes(from.size_bytes() + had + freed - reached);
+        }
+        state.stats.moves += 1;
+        state.stats.moved_bytes += reached.saturating_sub(had) as u64;
+    }
+}
+
+impl fmt::Debug for Rebalancer {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Rebalancer")
+            .field("interval", &self.shared.interval)
+            .finish()
+    }
+}
+
+impl Drop for Rebalancer {
+    fn drop(&mut self) {
+        self.shared.state.lock().unwrap().shutdown = true;
+        self.shared.wake.notify_all();
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::hash::hash_u64;
+
+    const MIB: usize = 1 << 20;
+
+    #[test]
+    fn stack_distances_count_distinct_keys_between() {
+        let mut distances = StackDistance::default();
+        // Hashes in the sampled slice, so each stands for 64 keys.
+        let (a, b, c) = (1, 2, 3);
+        assert!(sampled(a) && sampled(b) && sampled(c));
+        assert_eq!(distances.access(a), None);
+        assert_eq!(distances.access(b), None);
+        assert_eq!(distances.access(b), Some(0));
+        assert_eq!(distances.access(c), None);
+        assert_eq!(distances.access(a), Some(2 * 64));
+        assert_eq!(distances.access(a), Some(0));
+        assert_eq!(distances.access(b), Some(2 * 64));
+    }
+
+    #[test]
+    fn a_sampled_curve_estimates_a_cyclic_scan() {
+        const KEYS: u64 = 64_000;
+        const ROW: usize = 100;
+        let mut distances = StackDistance::default();
+        let mut curve = MissCurve::default();
+        // Three passes over the same keys: every access after the first
+        // pass is a hit for a cache of all of them, and a miss otherwise.
+        for _ in 0..3 {
+            for key in 0..KEYS {
+                let hash = hash_u64(key, 0);
+                if sampled(hash) {
+                    curve.record(distances.access(hash).map(|keys| keys * ROW));
+                }
+            }
+        }
+        let accesses = 3.0 * KEYS as f64;
+        let near = |estimate: f64, actual: f64| (estimate - actual).abs() < actual * 0.1;
+        assert!(near(curve.accesses(), accesses), "{}", curve.accesses());
+        let working_set = KEYS as usize * ROW;
+        assert!(curve.hits_within(working_set * 9 / 10) < accesses * 0.05);
+        let hits = curve.hits_within(working_set * 11 / 10);
+        assert!(near(hits, accesses * 2.0 / 3.0), "{hits}");
+
+        curve.decay();
+        assert!(near(curve.hits_within(2 * working_set), accesses / 3.0));
+        let mut merged = MissCurve::default();
+        merged.merge(&curve);
+        merged.merge(&curve);
+        assert_eq!(
+            merged.hits_within(2 * working_set),
+            2.0 * curve.hits_within(2 * working_set)
+        );
+    }
+
+    /// A cache whose accesses would hit at fixed reuse distances.
+    struct Fake {
+        name: &'static str,
+        size: Mutex<usize>,
+        distances: Vec<usize>,
+    }
+
+    impl Rebalance for Fake {
+        fn name(&self) -> &'static str {
+            self.name
+        }
+
+        fn size_bytes(&self) -> usize {
+            *self.size.lock().unwrap()
+        }
+
+        fn resize_bytes(&self, bytes: usize) -> usize {
+            *self.size.lock().unwrap() = bytes;
+            bytes
+        }
+
+        fn take_curve(&self) -> MissCurve {
+            let mut curve = MissCurve::default();
+            for &distance in &self.distances {
+                curve.record(Some(distance));
+            }
+            curve
+        }
+    }
+
+    fn fake(name: &'static str, size: usize, distances: Vec<usize>) -> Arc<Fake> {
+        Arc::new(Fake {
+            name,
+            size: Mutex::new(size),
+            distances,
+        })
+    }
+
+    #[test]
+    fn memory_moves_toward_the_steeper_curve() {
+        // Reuse spread evenly up to 16 MiB: every step of memory gains hits.
+        let steep = fake(
+            "steep",
+            4 * MIB,
+            (0..16 * MIB).step_by(BUCKET_BYTES / 8).collect(),
+        );
+        // All reuse within 512 KiB: memory past that gains nothing.
+        let flat = fake("flat", 4 * MIB, (0..MIB / 2).step_by(1024).collect());
+        let rebalancer = Rebalancer::start(
+            vec![(steep.clone(), MIB), (flat.clone(), MIB)],
+            Duration::from_secs(3600),
+        )
+        .unwrap();
+        for _ in 0..20 {
+            rebalancer.rebalance();
+        }
+        let step = 8 * MIB / STEP_DIVISOR;
+        let stats = rebalancer.stats();
+        // The flat cache gave up everything but its minimum.
+        assert_eq!(flat.size_bytes(), MIB, "{stats:?}");
+        assert_eq!(stats.moves, (3 * MIB / step) as u64);
+        assert_eq!(stats.moved_bytes, 3 * MIB as u64);
+        assert_eq!(rebalancer.total(), 8 * MIB);
+        assert_eq!(stats.sizes, [("steep", 7 * MIB), ("flat", MIB)]);
+
+        // A new total keeps the shares.
+        rebalancer.set_total(16 * MIB);
+        assert_eq!(steep.size_bytes(), 14 * MIB);
+        assert_eq!(flat.size_bytes(), 2 * MIB);
+    }
+
+    #[test]
+    fn equal_curves_move_nothing() {
+        let distances: Vec<usize> = (0..16 * MIB).step_by(BUCKET_BYTES / 8).collect();
+        let a = fake("a", 4 * MIB, distances.clone());
+        let b = fake("b", 4 * MIB, distances);
+        let rebalancer =
+            Rebalancer::start(vec![(a, MIB), (b, MIB)], Duration::from_secs(3600)).unwrap();
+        for _ in 0..10 {
+            rebalancer.rebalance();
+        }
+        assert_eq!(rebalancer.stats().moves, 0);
+        assert_eq!(rebalancer.stats().sizes, [("a", 4 * MIB), ("b", 4 * MIB)]);
+    }
+}
@@ -0,0 +1,216 @@
+//! Checkpoints of the page store and the LSN replay starts from.
+//!
+//! The B+tree engine never writes a modified page outside a checkpoint, so
+//! the data file always holds the state as of the last checkpoint LSN and
+//! crash recovery only has to replay the log records written after it. The
+//! LSM engine keeps its own checkpoint LSN in its manifest.
+//!
+//! Checkpoints overwrite pages in place, so they hold an exclusive lock on
+//! a small lock file for their whole duration; read-only snapshots in other
+//! processes hold it shared while they read the data file. The lock file
+//! also records whether a checkpoint is under way, so a reader can tell a
+//! checkpoint that died half-written from a finished one.
+
+use std::fs::{self, File, OpenOptions};
+use std::io::Write;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::Arc;
+
+use crate::error::{Error, Result};
+use crate::storage::{doublewrite, BufferPool, DiskManager};
+use crate::sys::FileLock;
+use crate::wal::Lsn;
+
+const CHECKPOINT_FILE: &str = "CHECKPOINT";
+const CHECKPOINT_TMP: &str = "CHECKPOINT.tmp";
+const CHECKPOINT_LOCK: &str = "CHECKPOINT.lock";
+const DOUBLEWRITE_FILE: &str = "doublewrite";
+
+const IDLE: u8 = 0;
+const RUNNING: u8 = 1;
+
+/// The lock that keeps snapshot readers and checkpoints of the data file
+/// apart.
+#[derive(Debug)]
+pub struct CheckpointLock {
+    file: File,
+}
+
+impl CheckpointLock {
+    /// Opens the lock file in `dir`, creating it if needed.
+    pub fn open(dir: &Path) -> Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(dir.join(CHECKPOINT_LOCK))?;
+        Ok(CheckpointLock { file })
+    }
+
+    fn set_state(&self, state: u8) -> Result<()> {
+        self.file.write_all_at(&[state], 0)?;
+        Ok(())
+    }
+
+    /// Runs `f` while no checkpoint can overwrite the data file. Fails if
+    /// the last checkpoint died part way: the data file then mixes two
+    /// checkpoints until the writer reopens and restores it.
+    pub fn read<T>(&self, f: impl FnOnce() -> Result<T>) -> Result<T> {
+        let _lock = FileLock::acquire(&self.file, false)?;
+        let mut state = [IDLE];
+        self.file.read_at(&mut state, 0)?;
+        if state[0] != IDLE {
+            return Err(Error::Background(
+                "a checkpoint of the data file was interrupted; the writer must reopen it".into(),
+            ));
+        }
+        f()
+    }
+}
+
+/// Brings the data file to its last checkpoint and returns the LSN replay
+/// must start from. Must run before the data file is opened by a pool.
+pub fn restore_page_store(dir: &Path, disk: &DiskManager) -> Result<Lsn> {
+    let lock = CheckpointLock::open(dir)?;
+    let _lock = FileLock::acquire(&lock.file, true)?;
+    let recorded = read_checkpoint(dir)?;
+    let restored = doublewrite::restore(&dir.join(DOUBLEWRITE_FILE), disk)?;
+    lock.set_state(IDLE)?;
+    Ok(restored.map_or(recorded, |lsn| lsn.max(recorded)))
+}
+
+/// Writes every dirty page of `pool` atomically and records that the data
+/// file now reflects the log up to `lsn`. The caller guarantees that no
+/// page is modified while this runs and that the log is durable to `lsn`.
+pub fn checkpoint_pages(dir: &Path, pool: &Arc<BufferPool>, lsn: Lsn) -> Result<()> {
+    let mut pages = pool.dirty_page_ids();
+    if pages.is_empty() {
+        return write_checkpoint(dir, lsn);
+    }
+    pages.sort_unstable();
+    let lock = CheckpointLock::open(dir)?;
+    let _lock = FileLock::acquire(&lock.file, true)?;
+    lock.set_state(RUNNING)?;
+    doublewrite::write(&dir.join(DOUBLEWRITE_FILE), lsn, pool, &pages)?;
+    pool.flush_pages(&pages)?;
+    pool.disk().sync()?;
+    write_checkpoint(dir, lsn)?;
+    lock.set_state(IDLE)
+}
+
+fn read_checkpoint(dir: &Path) -> Result<Lsn> {
+    match fs::read_to_string(dir.join(CHECKPOINT_FILE)) {
+        Ok(text) => text
+            .strip_prefix("lsn ")
+            .and_then(|v| v.trim().parse().ok())
+            .ok_or_else(|| Error::Corruption("malformed checkpoint file".into())),
+        Err(err) if err.kind() == std::io::ErrorKind::NotFound => Ok(0),
+        Err(err) => Err(err.into()),
+    }
+}
+
+fn write_checkpoint(dir: &Path, lsn: Lsn) -> Result<()> {
+    let tmp = dir.join(CHECKPOINT_TMP);
+    let mut file = File::create(&tmp)?;
+    file.write_all(format!("lsn {lsn}\n").as_bytes())?;
+    file.sync_all()?;
+    fs::rename(&tmp, dir.join(CHECKPOINT_FILE))?;
+    File::open(dir)?.sync_all()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::os::unix::fs::FileExt;
+
+    use super::*;
+    use crate::options::{Engine, Options};
+    use crate::test_util::TempDir;
+    use crate::wal::segment::{list_segments, segment_path};
+    use crate::Database;
+
+    fn options(engine: Engine) -> Options {
+        Options {
+            engine,
+            memory_monitor_interval: None,
+            cache_rebalance_interval: None,
+            ..Options::default()
+        }
+    }
+
+    fn key(i: u64) -> Vec<u8> {
+        format!("key{i:06}").into_bytes()
+    }
+
+    /// Abandons `db` without closing it, as a crash would: nothing is
+    /// flushed or checkpointed past what its writes already made durable.
+    fn crash(db: Database) {
+        std::mem::forget(db);
+    }
+
+    #[test]
+    fn committed_writes_survive_a_crash() {
+        for engine in [Engine::BTree, Engine::Lsm] {
+            let dir = TempDir::new("recovery-crash");
+            let db = Database::open(dir.path(), options(engine)).unwrap();
+            for i in 0..2000 {
+                db.put(&key(i), &i.to_le_bytes()).unwrap();
+            }
+            db.checkpoint().unwrap();
+            for i in 2000..3000 {
+                db.put(&key(i), &i.to_le_bytes()).unwrap();
+            }
+            for i in (0..3000).step_by(3) {
+                db.delete(&key(i)).unwrap();
+            }
+            crash(db);
+
+            let db = Database::open(dir.path(), options(engine)).unwrap();
+            for i in 0..3000u64 {
+                let expected = (i % 3 != 0).then(|| i.to_le_bytes().to_vec());
+                assert_eq!(db.get(&key(i)).unwrap(), expected, "{engine:?} key {i}");
+            }
+        }
+    }
+
+    #[test]
+    fn replay_resumes_from_the_checkpoint() {
+        let dir = TempDir::new("recovery-checkpoint");
+        let db = Database::open(dir.path(), options(Engine::BTree)).unwrap();
+        for i in 0..500 {
+            db.put(&key(i), b"before").unwrap();
+        }
+        db.checkpoint().unwrap();
+        let checkpoint = read_checkpoint(dir.path()).unwrap();
+        for i in 250..750 {
+            db.put(&key(i), b"after").unwrap();
+        }
+        crash(db);
+
+        // Records behind the checkpoint are already in the data file, so
+        // replay must not read them: damage the first one.
+        let start = list_segments(dir.path())
+            .unwrap()
+            .into_iter()
+            .find(|&start| start < checkpoint)
+            .expect("the checkpoint's segment starts before it");
+        std::fs::OpenOptions::new()
+            .write(true)
+            .open(segment_path(dir.path(), start))
+            .unwrap()
+            .write_at(&[0xff; 8], 0)
+            .unwrap();
+
+        let db = Database::open(dir.path(), options(Engine::BTree)).unwrap();
+        for i in 0..750 {
+            let expected: &[u8] = if i < 250 { b"before" } else { b"after" };
+            assert_eq!(
+                db.get(&key(i)).unwrap().as_deref(),
+                Some(expected),
+                "key {i}"
+            );
+        }
+    }
+}
@@ -0,0 +1,686 @@
+//! A cache of decoded rows keyed by primary key, beside the page cache.
+//!
+//! A point read that hits here returns the row without walking the index
+//! or searching a page, and a hot row costs only its own bytes rather than
+//! the whole page around it. Rows are filled in by reads and dropped by
+//! writes to their key; the engine stays the source of truth.
+//!
+//! Replacement follows W-TinyLFU. A new row enters a small LRU window of
+//! about 1% of the cache. When it falls out of the window it must win
+//! admission to the main area, a segmented LRU, by having been accessed
+//! more often than the row it would displace there. Access counts come
+//! from a count-min sketch of 4-bit counters that are all halved
+//! periodically, so they reflect recent popularity and cost a few bits per
+//! row. A key read once and never again passes through the window without
+//! displacing anything in the main area.
+//!
+//! The cache is split into shards by key hash, each behind its own lock.
+//! Memory is charged to the budget as rows are added, up to the capacity,
+//! so a cache that the working set does not fill holds no more than it
+//! needs.
+//!
+//! A read that misses takes a [`Ticket`] before going to the engine and
+//! hands it back with the row it found. A write to any key of the shard
+//! in between voids the ticket, so a row read before a write can never be
+//! filled in after the write dropped it.
+
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::error::Result;
+use crate::hash::hash64;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::rebalance::{sampled, MissCurve, Rebalance, StackDistance};
+
+const SEED: u64 = 0x726f_7763_6163_6865;
+const SHARDS: usize = 16;
+/// Bytes charged for a row beyond its key and value: the index entry and
+/// list links.
+const ENTRY_OVERHEAD: usize = 64;
+/// Share of each shard given to the admission window, in percent.
+const WINDOW_PERCENT: usize = 1;
+/// Share of the main area the protected segment may fill, in percent.
+const PROTECTED_PERCENT: usize = 80;
+/// Rows larger than this fraction of a shard are not cached.
+const MAX_ROW_DIVISOR: usize = 8;
+/// Row size assumed when sizing the frequency sketch and before any row is
+/// cached.
+const TYPICAL_ROW_BYTES: usize = 128;
+/// The budget is charged in steps of this many bytes.
+const CHARGE_STEP: usize = 16 << 10;
+/// Counters per sketched key.
+const SKETCH_DEPTH: u64 = 4;
+/// The sketch is halved after this many increments per counter word.
+const SKETCH_SAMPLE_FACTOR: usize = 10;
+const NIL: u32 = u32::MAX;
+
+/// Approximate recent access counts: a count-min sketch of 4-bit counters,
+/// sixteen to a word, halved once enough accesses have been counted.
+#[derive(Debug)]
+struct FrequencySketch {
+    words: Vec<u64>,
+    additions: usize,
+    sample: usize,
+}
+
+impl FrequencySketch {
+    /// A sketch for about `rows` distinct rows.
+    fn new(rows: usize) -> Self {
+        let words = Self::words_for(rows);
+        FrequencySketch {
+            words: vec![0; words],
+            additions: 0,
+            sample: words * SKETCH_SAMPLE_FACTOR,
+        }
+    }
+
+    /// Counter words for `rows` rows: four counters per row.
+    fn words_for(rows: usize) -> usize {
+        rows.div_ceil(4).max(1).next_power_of_two()
+    }
+
+    fn counters(&self, hash: u64) -> impl Iterator<Item = (usize, u32)> {
+        let counters = self.words.len() as u64 * 16;
+        let (h1, h2) = (hash as u32 as u64, (hash >> 32) | 1);
+        (0..SKETCH_DEPTH).map(move |i| {
+            let counter = h1.wrapping_add(i.wrapping_mul(h2)) & (counters - 1);
+            ((counter / 16) as usize, (counter % 16) as u32 * 4)
+        })
+    }
+
+    /// Estimated accesses to the key with hash `hash`, at most 15.
+    fn frequency(&self, hash: u64) -> u8 {
+        self.counters(hash)
+            .map(|(word, shift)| ((self.words[word] >> shift) & 0xf) as u8)
+            .min()
+            .unwrap_or(0)
+    }
+
+    /// Counts an access to the key with hash `hash`.
+    fn increment(&mut self, hash: u64) {
+        let mut added = false;
+        for (word, shift) in self.counters(hash) {
+            if (self.words[word] >> shift) & 0xf < 15 {
+                self.words[word] += 1 << shift;
+                added = true;
+            }
+        }
+        if added {
+            self.additions += 1;
+            if self.additions >= self.sample {
+                self.halve();
+            }
+        }
+    }
+
+    fn halve(&mut self) {
+        for word in &mut self.words {
+            *word = (*word >> 1) & 0x7777_7777_7777_7777;
+        }
+        self.additions /= 2;
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Segment {
+    Window,
+    Probation,
+    Protected,
+}
+
+#[derive(Debug)]
+struct Entry {
+    key: Box<[u8]>,
+    value: Box<[u8]>,
+    hash: u64,
+    segment: Segment,
+    prev: u32,
+    next: u32,
+}
+
+impl Entry {
+    fn charge(&self) -> usize {
+        charge(self.key.len(), self.value.len())
+    }
+}
+
+/// Bytes a row is charged for. The key is held twice, by the entry and
+/// the index.
+fn charge(key_len: usize, value_len: usize) -> usize {
+    2 * key_len + value_len + ENTRY_OVERHEAD
+}
+
+/// An LRU list threaded through the entries, most recent first.
+#[derive(Debug, Clone, Copy)]
+struct List {
+    head: u32,
+    tail: u32,
+    bytes: usize,
+}
+
+impl List {
+    const EMPTY: List = List {
+        head: NIL,
+        tail: NIL,
+        bytes: 0,
+    };
+}
+
+/// Counters describing a [`RowCache`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct RowCacheStats {
+    /// Bytes the cache may hold.
+    pub capacity: usize,
+    /// Bytes of cached rows.
+    pub bytes: usize,
+    pub entries: usize,
+    pub hits: u64,
+    pub misses: u64,
+    /// Rows moved from the window into the main area.
+    pub admissions: u64,
+    /// Rows dropped on leaving the window because they were accessed less
+    /// often than the row they would have displaced, or were too large.
+    pub rejections: u64,
+    /// Rows dropped from the main area to make room.
+    pub evictions: u64,
+    /// Rows dropped because their key was written.
+    pub invalidations: u64,
+}
+
+#[derive(Debug)]
+struct Shard {
+    index: HashMap<Box<[u8]>, u32>,
+    entries: Vec<Entry>,
+    free: Vec<u32>,
+    window: List,
+    probation: List,
+    protected: List,
+    sketch: FrequencySketch,
+    capacity: usize,
+    /// Bumped by every write to a key of the shard, voiding older tickets.
+    generation: u64,
+    /// Covers the cached rows, rounded up to [`CHARGE_STEP`].
+    reservation: Reservation,
+    stats: RowCacheStats,
+}
+
+impl Shard {
+    fn bytes(&self) -> usize {
+        self.window.bytes + self.probation.bytes + self.protected.bytes
+    }
+
+    fn window_capacity(&self) -> usize {
+        self.capacity * WINDOW_PERCENT / 100
+    }
+
+    fn main_capacity(&self) -> usize {
+        self.capacity - self.window_capacity()
+    }
+
+    fn list(&mut self, segment: Segment) -> &mut List {
+        match segment {
+            Segment::Window => &mut self.window,
+            Segment::Probation => &mut self.probation,
+            Segment::Protected => &mut self.protected,
+        }
+    }
+
+    fn unlink(&mut self, slot: u32) {
+        let (prev, next, segment, charge) = {
+            let entry = &self.entries[slot as usize];
+            (entry.prev, entry.next, entry.segment, entry.charge())
+        };
+        match prev {
+            NIL => self.list(segment).head = next,
+            prev => self.entries[prev as usize].next = next,
+        }
+        match next {
+            NIL => self.list(segment).tail = prev,
+            next => self.entries[next as usize].prev = prev,
+        }
+        self.list(segment).bytes -= charge;
+    }
+
+    fn push_front(&mut self, slot: u32, segment: Segment) {
+        let list = *self.list(segment);
+        let entry = &mut self.entries[slot as usize];
+        entry.segment = segment;
+        entry.prev = NIL;
+        entry.next = list.head;
+        let charge = entry.charge();
+        match list.head {
+            NIL => self.list(segment).tail = slot,
+            head => self.entries[head as usize].prev = slot,
+        }
+        let list = self.list(segment);
+        list.head = slot;
+        list.bytes += charge;
+    }
+
+    /// Moves the entry in `slot` to the front of `segment`.
+    fn move_to(&mut self, slot: u32, segment: Segment) {
+        self.unlink(slot);
+        self.push_front(slot, segment);
+    }
+
+    /// Unlinks and forgets the entry in `slot`.
+    fn remove(&mut self, slot: u32) {
+        self.unlink(slot);
+        let entry = &mut self.entries[slot as usize];
+        let key = std::mem::take(&mut entry.key);
+        entry.value = Box::default();
+        self.index.remove(&key);
+        self.free.push(slot);
+    }
+
+    /// Records a hit on the entry in `slot`.
+    fn touch(&mut self, slot: u32) {
+        match self.entries[slot as usize].segment {
+            Segment::Window => self.move_to(slot, Segment::Window),
+            Segment::Probation => {
+                self.move_to(slot, Segment::Protected);
+                // Demote the protected segment's least recent rows.
+                let limit = self.main_capacity() * PROTECTED_PERCENT / 100;
+                while self.protected.bytes > limit && self.protected.tail != slot {
+                    let tail = self.protected.tail;
+                    self.move_to(tail, Segment::Probation);
+                }
+            }
+            Segment::Protected => self.move_to(slot, Segment::Protected),
+        }
+    }
+
+    fn insert(&mut self, key: &[u8], value: &[u8], hash: u64) {
+        let entry = Entry {
+            key: key.into(),
+            value: value.into(),
+            hash,
+            segment: Segment::Window,
+            prev: NIL,
+            next: NIL,
+        };
+        let slot = match self.free.pop() {
+            Some(slot) => {
+                self.entries[slot as usize] = entry;
+                slot
+            }
+            None => {
+                self.entries.push(entry);
+                (self.entries.len() - 1) as u32
+            }
+        };
+        self.index.insert(key.into(), slot);
+        self.push_front(slot, Segment::Window);
+    }
+
+    /// Moves rows out of an overfull window, each into the main area if it
+    /// is accessed more often than the rows it would displace there.
+    fn admit(&mut self) {
+        let main_capacity = self.main_capacity();
+        while self.window.bytes > self.window_capacity() {
+            let candidate = self.window.tail;
+            let (hash, charge) = {
+                let entry = &self.entries[candidate as usize];
+                (entry.hash, entry.charge())
+            };
+            let frequency = self.sketch.frequency(hash);
+            loop {
+                if self.probation.bytes + self.protected.bytes + charge <= main_capacity {
+                    self.move_to(candidate, Segment::Probation);
+                    self.stats.admissions += 1;
+                    break;
+                }
+                let victim = match self.probation.tail {
+                    NIL => self.protected.tail,
+                    tail => tail,
+                };
+                if victim != NIL
+                    && frequency > self.sketch.frequency(self.entries[victim as usize].hash)
+                {
+                    self.remove(victim);
+                    self.stats.evictions += 1;
+                } else {
+                    self.remove(candidate);
+                    self.stats.rejections += 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    /// Evicts least recently used rows until the shard fits its capacity.
+    fn evict_to_capacity(&mut self) {
+        while self.bytes() > self.capacity {
+            let victim = [self.probation.tail, self.protected.tail, self.window.tail]
+                .into_iter()
+                .find(|&slot| slot != NIL)
+                .unwrap();
+            self.remove(victim);
+            self.stats.evictions += 1;
+        }
+    }
+
+    /// Returns charged memory the rows no longer need to the budget.
+    fn release_slack(&mut self) {
+        let needed = self.bytes().next_multiple_of(CHARGE_STEP);
+        if self.reservation.size() > needed + CHARGE_STEP {
+            self.reservation.shrink(self.reservation.size() - needed);
+        }
+    }
+}
+
+/// Proof that a read of a key started before any later write to it.
+#[derive(Debug, Clone, Copy)]
+pub struct Ticket {
+    shard: usize,
+    generation: u64,
+}
+
+/// What a lookup in a [`RowCache`] found.
+#[derive(Debug)]
+pub enum Probe {
+    Hit(Vec<u8>),
+    /// Not cached. Read the row from the engine and pass it to
+    /// [`RowCache::fill`] with the ticket.
+    Miss(Ticket),
+}
+
+/// A bounded, sharded cache of rows with W-TinyLFU admission.
+#[derive(Debug)]
+pub struct RowCache {
+    shards: Vec<Mutex<Shard>>,
+    capacity: AtomicUsize,
+    /// Bytes and number of cached rows, across shards.
+    bytes: AtomicUsize,
+    entries: AtomicUsize,
+    /// Reuse distances of sampled lookups.
+    reuse: Mutex<(StackDistance, MissCurve)>,
+}
+
+impl RowCache {
+    /// Creates an empty cache of up to `capacity_bytes`, charged to
+    /// `budget` as it fills.
+    pub fn new(budget: &Arc<MemoryBudget>, capacity_bytes: usize) -> Result<Arc<Self>> {
+        let per_shard = capacity_bytes / SHARDS;
+        let shards = (0..SHARDS)
+            .map(|_| {
+                Ok(Mutex::new(Shard {
+                    index: HashMap::new(),
+                    entries: Vec::new(),
+                    free: Vec::new(),
+                    window: List::EMPTY,
+                    probation: List::EMPTY,
+                    protected: List::EMPTY,
+                    sketch: FrequencySketch::new(per_shard / TYPICAL_ROW_BYTES),
+                    capacity: per_shard,
+                    generation: 0,
+                    reservation: budget.try_reserve(Consumer::RowCache, 0)?,
+                    stats: RowCacheStats::default(),
+                }))
+            })
+            .collect::<Result<_>>()?;
+        Ok(Arc::new(RowCache {
+            shards,
+            capacity: AtomicUsize::new(per_shard * SHARDS),
+            bytes: AtomicUsize::new(0),
+            entries: AtomicUsize::new(0),
+            reuse: Mutex::default(),
+        }))
+    }
+
+    /// Bytes the cache may hold.
+    pub fn capacity(&self) -> usize {
+        self.capacity.load(Ordering::Relaxed)
+    }
+
+    fn shard_of(hash: u64) -> usize {
+        (hash >> 48) as usize % SHARDS
+    }
+
+    /// Looks up the row stored under `key`.
+    pub fn probe(&self, key: &[u8]) -> Probe {
+        let hash = hash64(key, SEED);
+        let shard_id = Self::shard_of(hash);
+        let probe = {
+            let mut shard = self.shards[shard_id].lock().unwrap();
+            shard.sketch.increment(hash);
+            match shard.index.get(key).copied() {
+                Some(slot) => {
+                    shard.stats.hits += 1;
+                    shard.touch(slot);
+                    Probe::Hit(shard.entries[slot as usize].value.to_vec())
+                }
+                None => {
+                    shard.stats.misses += 1;
+                    Probe::Miss(Ticket {
+                        shard: shard_id,
+                        generation: shard.generation,
+                    })
+                }
+            }
+        };
+        if sampled(hash) {
+            let entries = self.entries.load(Ordering::Relaxed);
+            let row_bytes = match entries {
+                0 => TYPICAL_ROW_BYTES,
+                entries => self.bytes.load(Ordering::Relaxed) / entries,
+            };
+            let mut reuse = self.reuse.lock().unwrap();
+            let rows = reuse.0.access(hash);
+            reuse.1.record(rows.map(|rows| rows * row_bytes));
+        }
+        probe
+    }
+
+    /// Caches `value` as the row under `key`, read from the engine after
+    /// `ticket` was taken. Does nothing if the key was written since, if
+    /// the row is too large, or if the budget cannot cover it.
+    pub fn fill(&self, ticket: Ticket, key: &[u8], value: &[u8]) {
+        let hash = hash64(key, SEED);
+        debug_assert_eq!(Self::shard_of(hash), ticket.shard);
+        let mut shard = self.shards[ticket.shard].lock().unwrap();
+        if shard.generation != ticket.generation || shard.index.contains_key(key) {
+            return;
+        }
+        let charge = charge(key.len(), value.len());
+        if charge > shard.capacity / MAX_ROW_DIVISOR {
+            shard.stats.rejections += 1;
+            return;
+        }
+        let needed = shard.bytes() + charge;
+        if needed > shard.reservation.size() {
+            let grow = needed.next_multiple_of(CHARGE_STEP) - shard.reservation.size();
+            if shard.reservation.try_grow(grow).is_err() {
+                shard.stats.rejections += 1;
+                return;
+            }
+        }
+        let (bytes, entries) = (shard.bytes(), shard.index.len());
+        shard.insert(key, value, hash);
+        shard.admit();
+        shard.release_slack();
+        self.account(bytes, entries, &shard);
+    }
+
+    /// Drops any cached row under `key`. Call after the engine applied a
+    /// write to it, before the write is visible to new readers.
+    pub fn invalidate(&self, key: &[u8]) {
+        let hash = hash64(key, SEED);
+        let mut shard = self.shards[Self::shard_of(hash)].lock().unwrap();
+        shard.generation += 1;
+        if let Some(slot) = shard.index.get(key).copied() {
+            let (bytes, entries) = (shard.bytes(), shard.index.len());
+            shard.remove(slot);
+            shard.stats.invalidations += 1;
+            shard.release_slack();
+            self.account(bytes, entries, &shard);
+        }
+    }
+
+    /// Changes the capacity to about `bytes`, evicting rows if it shrinks,
+    /// and returns the new capacity.
+    pub fn resize(&self, bytes: usize) -> usize {
+        let per_shard = bytes / SHARDS;
+        for shard in &self.shards {
+            let mut shard = shard.lock().unwrap();
+            let (old_bytes, old_entries) = (shard.bytes(), shard.index.len());
+            shard.capacity = per_shard;
+            let rows = per_shard / TYPICAL_ROW_BYTES;
+            if FrequencySketch::words_for(rows) != shard.sketch.words.len() {
+                // Counts start over in a sketch sized for the new capacity.
+                shard.sketch = FrequencySketch::new(rows);
+            }
+            shard.evict_to_capacity();
+            shard.release_slack();
+            self.account(old_bytes, old_entries, &shard);
+        }
+        self.capacity.store(per_shard * SHARDS, Ordering::Relaxed);
+        per_shard * SHARDS
+    }
+
+    /// Carries a shard's change in size over to the totals.
+    fn account(&self, old_bytes: usize, old_entries: usize, shard: &Shard) {
+        let (bytes, entries) = (shard.bytes(), shard.index.len());
+        self.bytes
+            .fetch_add(bytes.wrapping_sub(old_bytes), Ordering::Relaxed);
+        self.entries
+            .fetch_add(entries.wrapping_sub(old_entries), Ordering::Relaxed);
+    }
+
+    /// Counters summed over the shards.
+    pub fn stats(&self) -> RowCacheStats {
+        let mut total = RowCacheStats {
+            capacity: self.capacity(),
+            ..RowCacheStats::default()
+        };
+        for shard in &self.shards {
+            let shard = shard.lock().unwrap();
+            total.bytes += shard.bytes();
+            total.entries += shard.index.len();
+            total.hits += shard.stats.hits;
+            total.misses += shard.stats.misses;
+            total.admissions += shard.stats.admissions;
+            total.rejections += shard.stats.rejections;
+            total.evictions += shard.stats.evictions;
+            total.invalidations += shard.stats.invalidations;
+        }
+        total
+    }
+}
+
+impl Rebalance for RowCache {
+    fn name(&self) -> &'static str {
+        "row_cache"
+    }
+
+    fn size_bytes(&self) -> usize {
+        self.capacity()
+    }
+
+    fn resize_bytes(&self, bytes: usize) -> usize {
+        self.resize(bytes)
+    }
+
+    fn take_curve(&self) -> MissCurve {
+        self.reuse.lock().unwrap().1.take()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MIB: usize = 1 << 20;
+
+    fn key(i: u32) -> Vec<u8> {
+        format!("row{i:08}").into_bytes()
+    }
+
+    /// Looks `key` up, filling it in on a miss; returns whether it hit.
+    fn read(cache: &RowCache, key: &[u8]) -> bool {
+        match cache.probe(key) {
+            Probe::Hit(value) => {
+                assert_eq!(value, [key, &[0; 90]].concat());
+                true
+            }
+            Probe::Miss(ticket) => {
+                cache.fill(ticket, key, &[key, &[0; 90]].concat());
+                false
+            }
+        }
+    }
+
+    #[test]
+    fn a_voided_ticket_fills_nothing() {
+        let budget = MemoryBudget::new(64 * MIB);
+        let cache = RowCache::new(&budget, MIB).unwrap();
+        let Probe::Miss(ticket) = cache.probe(b"key") else {
+            panic!("an empty cache hit");
+        };
+        // A write lands between the engine read and the fill.
+        cache.invalidate(b"key");
+        cache.fill(ticket, b"key", b"stale");
+        assert!(matches!(cache.probe(b"key"), Probe::Miss(_)));
+
+        let Probe::Miss(ticket) = cache.probe(b"key") else {
+            panic!("the stale row was cached");
+        };
+        cache.fill(ticket, b"key", b"fresh");
+        assert!(matches!(cache.probe(b"key"), Probe::Hit(value) if value == b"fresh"));
+        cache.invalidate(b"key");
+        assert!(matches!(cache.probe(b"key"), Probe::Miss(_)));
+        let stats = cache.stats();
+        assert_eq!((stats.entries, stats.invalidations), (0, 1));
+    }
+
+    #[test]
+    fn keys_read_once_do_not_displace_hot_rows() {
+        let budget = MemoryBudget::new(64 * MIB);
+        let cache = RowCache::new(&budget, MIB).unwrap();
+        let hot: Vec<Vec<u8>> = (0..1000).map(key).collect();
+        for _ in 0..5 {
+            for key in &hot {
+                read(&cache, key);
+            }
+        }
+        // A scan of 50,000 rows, each read once, many times what the cache
+        // holds. The hot rows stay in use, each read once per 10,000 scanned
+        // rows, which an LRU of this size would not keep.
+        let mut misses = 0;
+        for i in 0..50_000 {
+            read(&cache, &key(1_000_000 + i));
+            if i % 10 == 0 && !read(&cache, &hot[i as usize / 10 % hot.len()]) {
+                misses += 1;
+            }
+        }
+        let stats = cache.stats();
+        assert!(stats.rejections > 30_000, "{stats:?}");
+        // The sketch is approximate: a scanned key whose counters all
+        // collide now and then outweighs a hot row on probation.
+        assert!(misses < 50, "{misses} of 5000 hot reads missed");
+    }
+
+    #[test]
+    fn shrinking_evicts_rows_and_returns_memory() {
+        let budget = MemoryBudget::new(64 * MIB);
+        let cache = RowCache::new(&budget, 16 * MIB).unwrap();
+        for i in 0..100_000 {
+            read(&cache, &key(i));
+        }
+        let full = cache.stats();
+        assert!(full.bytes > 15 * MIB, "{full:?}");
+        assert!(budget.usage(Consumer::RowCache) >= full.bytes);
+
+        assert_eq!(cache.resize(2 * MIB), 2 * MIB);
+        let shrunk = cache.stats();
+        assert!(shrunk.bytes <= 2 * MIB);
+        assert!(shrunk.evictions > full.evictions);
+        // Each shard keeps at most two charge steps of slack.
+        assert!(budget.usage(Consumer::RowCache) <= 2 * MIB + SHARDS * 2 * CHARGE_STEP);
+        assert_eq!(budget.usage(Consumer::RowCache), budget.used());
+
+        drop(cache);
+        assert_eq!(budget.used(), 0);
+    }
+}
@@ -0,0 +1,108 @@
+//! Read-only access to a database from processes other than its writer.
+//!
+//! A snapshot maps the database's files instead of reading them through a
+//! buffer pool: lookups hand out value bytes in place and residency is left
+//! to the operating system's page cache, so any number of reader processes
+//! can run next to the single writer without budgets of their own beyond
+//! the LSM run indexes.
+//!
+//! Readers see what the writer has made durable outside its log:
+//!
+//! - With the B+tree engine, every call reads the data file as of the last
+//!   checkpoint, holding the checkpoint lock shared so pages are never
+//!   overwritten mid-read. A scan releases the lock between leaves and may
+//!   therefore cross a checkpoint; it resumes after the last key it
+//!   returned, so no key is seen twice.
+//! - With the LSM engine, the snapshot is fixed to the runs listed in the
+//!   manifest when it was opened, that is, the tree as of its last flush.
+//!   Open a new snapshot to see later flushes.
+
+use std::path::Path;
+use std::sync::Arc;
+
+use crate::db::{DATA_FILE, PRIMARY_INDEX_META_PAGE};
+use crate::error::{Error, Result};
+use crate::index::MappedBTree;
+use crate::lsm::LsmSnapshot;
+use crate::memory::MemoryBudget;
+use crate::options::{Engine, Options};
+use crate::recovery::CheckpointLock;
+
+#[derive(Debug)]
+enum Inner {
+    BTree {
+        lock: CheckpointLock,
+        tree: MappedBTree,
+    },
+    Lsm(LsmSnapshot),
+}
+
+/// A read-only, memory-mapped view of a database directory.
+#[derive(Debug)]
+pub struct Snapshot {
+    inner: Inner,
+    _budget: Arc<MemoryBudget>,
+}
+
+impl Snapshot {
+    /// Opens the database in `dir` read-only. `options.engine` must match
+    /// the writer's; `max_resident_bytes` caps the LSM run indexes.
+    pub fn open(dir: impl AsRef<Path>, options: &Options) -> Result<Self> {
+        let dir = dir.as_ref();
+        if !dir.exists() {
+            return Err(Error::InvalidArgument(format!(
+                "{} does not exist",
+                dir.display()
+            )));
+        }
+        let budget = MemoryBudget::new(options.max_resident_bytes);
+        let inner = match options.engine {
+            Engine::BTree => {
+                let lock = CheckpointLock::open(dir)?;
+                let tree =
+                    lock.read(|| MappedBTree::open(dir.join(DATA_FILE), PRIMARY_INDEX_META_PAGE))?;
+                Inner::BTree { lock, tree }
+            }
+            Engine::Lsm => Inner::Lsm(LsmSnapshot::open(dir, &budget)?),
+        };
+        Ok(Snapshot {
+            inner,
+            _budget: budget,
+        })
+    }
+
+    /// Calls `f` with the value stored under `key`, without copying it.
+    pub fn get_with<T>(&self, key: &[u8], f: impl FnOnce(&[u8]) -> T) -> Result<Option<T>> {
+        match &self.inner {
+            Inner::BTree { lock, tree } => lock.read(|| tree.get_with(key, f)),
+            Inner::Lsm(snapshot) => snapshot.get_with(key, f),
+        }
+    }
+
+    /// Returns a copy of the value stored under `key`.
+    pub fn get(&self, key: &[u8]) -> Result<Option<Vec<u8>>> {
+        self.get_with(key, <[u8]>::to_vec)
+    }
+
+    /// Calls `f` with every entry whose key is at or above `start`, in key
+    /// order, until it returns `false`.
+    pub fn visit_from(&self, start: &[u8], mut f: impl FnMut(&[u8], &[u8]) -> bool) -> Result<()> {
+        match &self.inner {
+            Inner::BTree { lock, tree } => {
+                let mut resume = lock.read(|| tree.visit_leaf(start, false, &mut f))?;
+                while let Some(last) = resume {
+                    resume = lock.read(|| tree.visit_leaf(&last, true, &mut f))?;
+                }
+            }
+            Inner::Lsm(snapshot) => {
+                for entry in snapshot.scan_from(start) {
+                    let (key, value) = entry?;
+                    if !f(&key, &value) {
+                        break;
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,472 @@
+//! Latency histograms and the database-wide statistics report.
+//!
+//! [`Histogram`] records durations into HDR-style log-linear buckets: exact
+//! below 16 ns, then 16 buckets per power of two, so every reported value
+//! is within about 6% of the true one. Each thread records into its own
+//! shard with relaxed atomic adds, which keeps recording to a few
+//! nanoseconds without contention; shards are summed only when the
+//! histogram is read.
+//!
+//! [`DatabaseStats`] gathers memory, cache, log and latency figures in one
+//! place. Its `Display` form is a flat `name value` list meant to be scraped.
+
+use std::cell::Cell;
+use std::fmt;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+use crate::aio::{Backend, IoStats};
+use crate::exec::GrantStats;
+use crate::lsm::{CompressionStats, FilterStats};
+use crate::memory::{Consumer, MemoryBudget};
+use crate::mvcc::VersionStoreStats;
+use crate::pressure::PressureStats;
+use crate::rebalance::RebalanceStats;
+use crate::row_cache::RowCacheStats;
+use crate::storage::BufferPoolStats;
+use crate::wal::WalStats;
+
+const SUB_BUCKET_BITS: u32 = 4;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+/// Values at or above 2^40 ns (about 18 minutes) share the last bucket.
+const MAX_MAGNITUDE: u32 = 40;
+const BUCKETS: usize = SUB_BUCKETS * (MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) as usize;
+const SHARDS: usize = 8;
+
+fn bucket_of(nanos: u64) -> usize {
+    if nanos < SUB_BUCKETS as u64 {
+        return nanos as usize;
+    }
+    let magnitude = (63 - nanos.leading_zeros()).min(MAX_MAGNITUDE);
+    if magnitude == MAX_MAGNITUDE {
+        return BUCKETS - 1;
+    }
+    let shift = magnitude - SUB_BUCKET_BITS;
+    let sub = (nanos >> shift) as usize & (SUB_BUCKETS - 1);
+    SUB_BUCKETS * (magnitude - SUB_BUCKET_BITS + 1) as usize + sub
+}
+
+/// Largest value that falls in `bucket`.
+fn bucket_high(bucket: usize) -> u64 {
+    if bucket < SUB_BUCKETS {
+        return bucket as u64;
+    }
+    let magnitude = (bucket / SUB_BUCKETS) as u32 + SUB_BUCKET_BITS - 1;
+    let sub = (bucket % SUB_BUCKETS) as u64;
+    let shift = magnitude - SUB_BUCKET_BITS;
+    ((SUB_BUCKETS as u64 + sub + 1) << shift) - 1
+}
+
+thread_local! {
+    static SHARD: Cell<usize> = const { Cell::new(usize::MAX) };
+}
+
+static NEXT_SHARD: AtomicUsize = AtomicUsize::new(0);
+
+/// Shard of the calling thread, assigned round-robin on first use.
+fn shard_index() -> usize {
+    SHARD.with(|shard| {
+        if shard.get() == usize::MAX {
+            shard.set(NEXT_SHARD.fetch_add(1, Ordering::Relaxed) % SHARDS);
+        }
+        shard.get()
+    })
+}
+
+#[derive(Debug)]
+struct Shard {
+    buckets: Box<[AtomicU64]>,
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Default for Shard {
+    fn default() -> Self {
+        Shard {
+            buckets: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+}
+
+/// A concurrent latency histogram with per-thread shards.
+#[derive(Debug)]
+pub struct Histogram {
+    shards: Box<[Shard]>,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            shards: (0..SHARDS).map(|_| Shard::default()).collect(),
+        }
+    }
+}
+
+impl Histogram {
+    /// Records one duration.
+    pub fn record(&self, elapsed: Duration) {
+        let nanos = elapsed.as_nanos().min(u64::MAX as u128) as u64;
+        let shard = &self.shards[shard_index()];
+        shard.buckets[bucket_of(nanos)].fetch_add(1, Ordering::Relaxed);
+        shard.count.fetch_add(1, Ordering::Relaxed);
+        shard.sum.fetch_add(nanos, Ordering::Relaxed);
+        shard.max.fetch_max(nanos, Ordering::Relaxed);
+    }
+
+    /// Records the time elapsed since `started`.
+    pub fn record_since(&self, started: Instant) {
+        self.record(started.elapsed());
+    }
+
+    /// Merges the shards into a point-in-time copy.
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        let mut snapshot = HistogramSnapshot {
+            buckets: vec![0; BUCKETS],
+            ..HistogramSnapshot::default()
+        };
+        for shard in self.shards.iter() {
+            for (total, bucket) in snapshot.buckets.iter_mut().zip(shard.buckets.iter()) {
+                *total += bucket.load(Ordering::Relaxed);
+            }
+            snapshot.count += shard.count.load(Ordering::Relaxed);
+            snapshot.sum += shard.sum.load(Ordering::Relaxed);
+            snapshot.max = snapshot.max.max(shard.max.load(Ordering::Relaxed));
+        }
+        snapshot
+    }
+}
+
+/// A merged copy of a [`Histogram`]; values are in nanoseconds.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct HistogramSnapshot {
+    buckets: Vec<u64>,
+    pub count: u64,
+    pub sum: u64,
+    pub max: u64,
+}
+
+impl HistogramSnapshot {
+    /// The value below which a fraction `q` of the samples fall, rounded up
+    /// to its bucket's upper edge; zero when empty.
+    pub fn quantile(&self, q: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        let rank = ((self.count as f64 * q).ceil() as u64).clamp(1, self.count);
+        let mut seen = 0;
+        for (bucket, &n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                return bucket_high(bucket).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    /// Mean sample; zero when empty.
+    pub fn mean(&self) -> u64 {
+        self.sum / self.count.max(1)
+    }
+}
+
+/// Bytes held by one consumer of the memory budget.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ConsumerUsage {
+    pub bytes: usize,
+    /// Most the consumer has held at once.
+    pub peak_bytes: usize,
+}
+
+/// The memory budget broken down by consumer.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct MemoryStats {
+    pub limit: usize,
+    pub used: usize,
+    pub peak: usize,
+    pub consumers: [(Consumer, ConsumerUsage); Consumer::ALL.len()],
+}
+
+impl MemoryStats {
+    /// Reads the current figures of `budget`.
+    pub fn of(budget: &MemoryBudget) -> Self {
+        MemoryStats {
+            limit: budget.limit(),
+            used: budget.used(),
+            peak: budget.peak(),
+            consumers: Consumer::ALL.map(|consumer| {
+                (
+                    consumer,
+                    ConsumerUsage {
+                        bytes: budget.usage(consumer),
+                        peak_bytes: budget.peak_usage(consumer),
+                    },
+                )
+            }),
+        }
+    }
+
+    /// The consumer holding the most memory right now.
+    pub fn largest_consumer(&self) -> Consumer {
+        self.consumers
+            .iter()
+            .max_by_key(|(_, usage)| usage.bytes)
+            .map_or(Consumer::Other, |&(consumer, _)| consumer)
+    }
+}
+
+/// Everything [`Database::stats`](crate::Database::stats) reports.
+#[derive(Debug, Clone)]
+pub struct DatabaseStats {
+    pub memory: MemoryStats,
+    pub buffer_pool: BufferPoolStats,
+    pub dirty_pages: usize,
+    /// All zero when the row cache is off.
+    pub row_cache: RowCacheStats,
+    pub wal: WalStats,
+    pub compression: CompressionStats,
+    pub filters: FilterStats,
+    /// Time to read a page into the buffer pool on a miss.
+    pub page_read_latency: HistogramSnapshot,
+    /// Time to write and sync one group-commit batch.
+    pub fsync_latency: HistogramSnapshot,
+    /// Time from a write's arrival until it is durable.
+    pub commit_latency: HistogramSnapshot,
+    pub version_store: VersionStoreStats,
+    /// Admission and shrinking of sort and join memory grants.
+    pub grants: GrantStats,
+    /// Budget resizes made to follow the cgroup's memory limit and
+    /// pressure. All zero when the monitor is off.
+    pub pressure: PressureStats,
+    /// Memory moved between caches by their miss curves. Empty when
+    /// rebalancing is off.
+    pub rebalance: RebalanceStats,
+    /// Mechanism behind batched and overlapped I/O.
+    pub io_backend: Backend,
+    /// Activity of the process-wide I/O queue, shared by every database
+    /// in the process.
+    pub io: IoStats,
+}
+
+fn ratio(part: u64, whole: u64) -> f64 {
+    if whole == 0 {
+        0.0
+    } else {
+        part as f64 / whole as f64
+    }
+}
+
+fn write_histogram(f: &mut fmt::Formatter<'_>, name: &str, h: &HistogramSnapshot) -> fmt::Result {
+    writeln!(f, "{name}.count {}", h.count)?;
+    writeln!(f, "{name}.mean_ns {}", h.mean())?;
+    writeln!(f, "{name}.p50_ns {}", h.quantile(0.50))?;
+    writeln!(f, "{name}.p99_ns {}", h.quantile(0.99))?;
+    writeln!(f, "{name}.p999_ns {}", h.quantile(0.999))?;
+    writeln!(f, "{name}.max_ns {}", h.max)
+}
+
+impl fmt::Display for DatabaseStats {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let memory = &self.memory;
+        writeln!(f, "memory.limit_bytes {}", memory.limit)?;
+        writeln!(f, "memory.used_bytes {}", memory.used)?;
+        writeln!(f, "memory.peak_bytes {}", memory.peak)?;
+        writeln!(
+            f,
+            "memory.used_ratio {:.3}",
+            ratio(memory.used as u64, memory.limit as u64)
+        )?;
+        writeln!(
+            f,
+            "memory.largest_consumer {}",
+            memory.largest_consumer().name()
+        )?;
+        for (consumer, usage) in &memory.consumers {
+            let name = consumer.name();
+            writeln!(f, "memory.{name}.bytes {}", usage.bytes)?;
+            writeln!(f, "memory.{name}.peak_bytes {}", usage.peak_bytes)?;
+            writeln!(
+                f,
+                "memory.{name}.limit_ratio {:.3}",
+                ratio(usage.bytes as u64, memory.limit as u64)
+            )?;
+        }
+
+        let pool = &self.buffer_pool;
+        writeln!(f, "buffer_pool.hits {}", pool.hits)?;
+        writeln!(f, "buffer_pool.misses {}", pool.misses)?;
+        writeln!(
+            f,
+            "buffer_pool.hit_ratio {:.4}",
+            ratio(pool.hits, pool.hits + pool.misses)
+        )?;
+        writeln!(f, "buffer_pool.evictions {}", pool.evictions)?;
+        writeln!(f, "buffer_pool.dirty_writebacks {}", pool.dirty_writebacks)?;
+        writeln!(f, "buffer_pool.promotions {}", pool.promotions)?;
+        writeln!(f, "buffer_pool.ring_reads {}", pool.ring_reads)?;
+        writeln!(f, "buffer_pool.read_ahead_pages {}", pool.read_ahead_pages)?;
+        writeln!(f, "buffer_pool.read_ahead_hits {}", pool.read_ahead_hits)?;
+        writeln!(f, "buffer_pool.read_ahead_waits {}", pool.read_ahead_waits)?;
+        writeln!(
+            f,
+            "buffer_pool.read_ahead_discards {}",
+            pool.read_ahead_discards
+        )?;
+        writeln!(f, "buffer_pool.dirty_pages {}", self.dirty_pages)?;
+        write_histogram(f, "buffer_pool.page_read", &self.page_read_latency)?;
+
+        let rows = &self.row_cache;
+        writeln!(f, "row_cache.capacity {}", rows.capacity)?;
+        writeln!(f, "row_cache.bytes {}", rows.bytes)?;
+        writeln!(f, "row_cache.entries {}", rows.entries)?;
+        writeln!(f, "row_cache.hits {}", rows.hits)?;
+        writeln!(f, "row_cache.misses {}", rows.misses)?;
+        writeln!(
+            f,
+            "row_cache.hit_ratio {:.4}",
+            ratio(rows.hits, rows.hits + rows.misses)
+        )?;
+        writeln!(f, "row_cache.admissions {}", rows.admissions)?;
+        writeln!(f, "row_cache.rejections {}", rows.rejections)?;
+        writeln!(f, "row_cache.evictions {}", rows.evictions)?;
+        writeln!(f, "row_cache.invalidations {}", rows.invalidations)?;
+
+        writeln!(f, "wal.records {}", self.wal.records)?;
+        writeln!(f, "wal.bytes {}", self.wal.bytes)?;
+        writeln!(f, "wal.syncs {}", self.wal.syncs)?;
+        write_histogram(f, "wal.fsync", &self.fsync_latency)?;
+        write_histogram(f, "commit", &self.commit_latency)?;
+
+        let compression = &self.compression;
+        writeln!(f, "lsm.raw_bytes {}", compression.raw_bytes)?;
+        writeln!(f, "lsm.stored_bytes {}", compression.stored_bytes)?;
+        writeln!(f, "lsm.compression_ratio {:.3}", compression.ratio())?;
+        writeln!(f, "lsm.blocks_decoded {}", compression.blocks_decoded)?;
+        writeln!(f, "lsm.mean_decode_ns {}", compression.mean_decode_nanos())?;
+        writeln!(f, "lsm.filter_bytes {}", self.filters.bytes)?;
+        writeln!(f, "lsm.filter_probes {}", self.filters.probes)?;
+        writeln!(f, "lsm.filter_negatives {}", self.filters.negatives)?;
+
+        let versions = &self.version_store;
+        writeln!(f, "mvcc.resident_versions {}", versions.resident_versions)?;
+        writeln!(f, "mvcc.resident_bytes {}", versions.resident_bytes)?;
+        writeln!(f, "mvcc.spilled_runs {}", versions.spilled_runs)?;
+        writeln!(f, "mvcc.spilled_bytes {}", versions.spilled_bytes)?;
+        writeln!(f, "mvcc.recorded {}", versions.recorded)?;
+        writeln!(f, "mvcc.collected {}", versions.collected)?;
+
+        let grants = &self.grants;
+        writeln!(f, "grants.active {}", grants.active)?;
+        writeln!(f, "grants.waiting {}", grants.waiting)?;
+        writeln!(f, "grants.granted_bytes {}", grants.granted_bytes)?;
+        writeln!(f, "grants.admitted {}", grants.admitted)?;
+        writeln!(f, "grants.queued {}", grants.queued)?;
+        writeln!(f, "grants.timeouts {}", grants.timeouts)?;
+        writeln!(f, "grants.overcommits {}", grants.overcommits)?;
+        writeln!(f, "grants.shrink_requests {}", grants.shrink_requests)?;
+        writeln!(f, "grants.wait_ns {}", grants.wait_nanos)?;
+
+        let pressure = &self.pressure;
+        writeln!(f, "pressure.samples {}", pressure.samples)?;
+        writeln!(f, "pressure.errors {}", pressure.errors)?;
+        writeln!(f, "pressure.shrinks {}", pressure.shrinks)?;
+        writeln!(f, "pressure.grows {}", pressure.grows)?;
+        writeln!(f, "pressure.cgroup_current_bytes {}", pressure.last.current)?;
+        writeln!(
+            f,
+            "pressure.cgroup_ceiling_bytes {}",
+            pressure.last.ceiling().unwrap_or(0)
+        )?;
+        writeln!(f, "pressure.some_avg10 {:.2}", pressure.last.some_avg10)?;
+        writeln!(f, "pressure.full_avg10 {:.2}", pressure.last.full_avg10)?;
+
+        let rebalance = &self.rebalance;
+        writeln!(f, "rebalance.rounds {}", rebalance.rounds)?;
+        writeln!(f, "rebalance.moves {}", rebalance.moves)?;
+        writeln!(f, "rebalance.moved_bytes {}", rebalance.moved_bytes)?;
+        for (name, bytes) in &rebalance.sizes {
+            writeln!(f, "rebalance.{name}.bytes {bytes}")?;
+        }
+
+        writeln!(f, "io.backend {}", self.io_backend.name())?;
+        writeln!(f, "io.submissions {}", self.io.submissions)?;
+        writeln!(f, "io.requests {}", self.io.requests)?;
+        writeln!(f, "io.max_batch {}", self.io.max_batch)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    #[test]
+    fn buckets_cover_every_value_in_order() {
+        for bucket in 0..BUCKETS - 1 {
+            let high = bucket_high(bucket);
+            assert_eq!(bucket_of(high), bucket, "upper edge of {bucket}");
+            assert_eq!(bucket_of(high + 1), bucket + 1, "past the edge of {bucket}");
+        }
+        assert_eq!(bucket_of(1 << MAX_MAGNITUDE), BUCKETS - 1);
+        assert_eq!(bucket_of(u64::MAX), BUCKETS - 1);
+    }
+
+    #[test]
+    fn a_bucket_edge_is_within_a_sixteenth_of_its_values() {
+        let mut nanos = 1u64;
+        while nanos < 1 << MAX_MAGNITUDE {
+            let high = bucket_high(bucket_of(nanos));
+            assert!(high >= nanos);
+            assert!(
+                (high - nanos) as f64 <= nanos as f64 / 16.0,
+                "{nanos}: {high}"
+            );
+            nanos = nanos * 9 / 8 + 1;
+        }
+    }
+
+    #[test]
+    fn quantiles_of_uniform_samples() {
+        let histogram = Histogram::default();
+        assert_eq!(histogram.snapshot().quantile(0.5), 0);
+        for micros in 1..=10_000 {
+            histogram.record(Duration::from_micros(micros));
+        }
+        let snapshot = histogram.snapshot();
+        assert_eq!(snapshot.count, 10_000);
+        assert_eq!(snapshot.max, 10_000_000);
+        assert_eq!(snapshot.mean(), 5_000_500);
+        for q in [0.5, 0.9, 0.99, 0.999] {
+            let exact = q * 10_000_000.0;
+            let reported = snapshot.quantile(q) as f64;
+            assert!(
+                reported >= exact && reported <= exact * 1.07,
+                "p{q}: {reported}"
+            );
+        }
+        assert_eq!(snapshot.quantile(1.0), snapshot.max);
+    }
+
+    #[test]
+    fn threads_recording_at_once_are_all_counted() {
+        let histogram = Histogram::default();
+        thread::scope(|s| {
+            for t in 1..=16u64 {
+                let histogram = &histogram;
+                s.spawn(move || {
+                    for _ in 0..1000 {
+                        histogram.record(Duration::from_nanos(t * 100));
+                    }
+                });
+            }
+        });
+        let snapshot = histogram.snapshot();
+        assert_eq!(snapshot.count, 16_000);
+        assert_eq!(snapshot.sum, 1000 * 100 * (1..=16).sum::<u64>());
+        assert_eq!(snapshot.max, 1600);
+    }
+}
@@ -0,0 +1,1439 @@
+//! A bounded page cache with scan-resistant 2Q replacement.
+//!
+//! The pool owns a fixed number of frames, sized once from the memory budget.
+//! It can be shrunk below that while running, by evicting pages and
+//! returning their frames' memory to the budget, and grown back later, or
+//! past its initial size up to a maximum fixed at creation. A sample of
+//! page accesses feeds a miss curve so a [`Rebalancer`] can tell what
+//! resizing would gain or lose.
+//!
+//! [`Rebalancer`]: crate::rebalance::Rebalancer
+//!
+//! Callers pin a page by fetching it and get back a [`PageGuard`]; the frame
+//! cannot be evicted until every guard for it is dropped.
+//!
+//! Replacement follows 2Q. A page read for the first time is admitted on
+//! probation, to a FIFO queue of about a quarter of the pool. Hits soon
+//! after admission do not count, since they usually come from the same
+//! operation; a page hit again later in its probation is moved to the
+//! protected set when it reaches the head of the queue, rather than
+//! evicted. A page evicted from probation has its id remembered in a ghost
+//! list, and if it is read again while still remembered it is admitted
+//! straight to the protected set, which is managed by clock sweep. A scan
+//! touching each page once therefore cycles through the probation queue and
+//! leaves the protected working set alone.
+//!
+//! Scans long enough to churn even the probation queue read through a
+//! [`ScanRing`] instead: a few private frames reused round-robin, so pages
+//! that are not already resident never enter the pool at all. A
+//! [`PageScan`] makes that switch for a scan and reads ahead of it.
+//!
+//! [`PageScan`]: crate::storage::PageScan
+//!
+//! Dirty frames are never chosen as eviction victims ("no-steal"): modified
+//! pages reach the data file only through an explicit flush, which lets
+//! checkpoints write a consistent set of pages atomically. The owner is
+//! responsible for checkpointing before dirty pages crowd out clean ones.
+//!
+//! Besides the main data file, further files (such as LSM sorted runs) can be
+//! attached so that all page reads share the same bounded set of frames.
+//!
+//! A hit only takes the page table's read lock, so concurrent readers of
+//! resident pages do not serialise on the pool. Misses and evictions go
+//! through the pool mutex, but no disk transfer happens under it or under
+//! the page table's lock: a miss reserves a frame and marks its page as
+//! being loaded, then reads it with the mutex released, and other threads
+//! missing on the same page wait for that read instead of starting their
+//! own. Write-back pins the dirty frames and then writes them unlocked.
+//! Each frame carries a version that changes
+//! whenever its page may have been modified, so a caller can tell without
+//! latching that a page it read earlier is unchanged.
+//!
+//! Callers that know they need several pages at once fetch or flush them as
+//! a batch, so the transfers reach the device together through
+//! [`crate::aio`] instead of one after another.
+
+use std::collections::{HashMap, HashSet, VecDeque};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex, RwLock, RwLockReadGuard, RwLockWriteGuard};
+use std::time::Instant;
+
+use crate::aio;
+use crate::error::{Error, Result};
+use crate::hash::hash_u64;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::rebalance::{sampled, MissCurve, Rebalance, StackDistance};
+use crate::stats::{Histogram, HistogramSnapshot};
+use crate::storage::disk::DiskManager;
+use crate::storage::page::{PageBuf, PageId, INVALID_PAGE_ID, PAGE_SIZE};
+
+type FrameId = usize;
+
+/// Identifies a file attached to the pool. The main data file is
+/// [`MAIN_FILE`].
+pub type FileId = u32;
+
+/// The file the pool was created over.
+pub const MAIN_FILE: FileId = 0;
+
+type PageKey = (FileId, PageId);
+
+const NO_PAGE: PageKey = (MAIN_FILE, INVALID_PAGE_ID);
+
+#[derive(Debug)]
+struct Frame {
+    data: RwLock<PageBuf>,
+    pin_count: AtomicU32,
+    referenced: AtomicBool,
+    dirty: AtomicBool,
+    /// Bumped whenever the frame's bytes are handed out for writing or
+    /// replaced by another page.
+    version: AtomicU64,
+    /// Admission number of the page, counted across the pool.
+    admitted: AtomicU64,
+    /// Set by a hit past the correlation window while on probation.
+    rereferenced: AtomicBool,
+}
+
+#[derive(Debug)]
+struct PoolState {
+    frame_pages: Vec<PageKey>,
+    free_list: Vec<FrameId>,
+    clock_hand: FrameId,
+    /// Whether each frame is in the protected set rather than on probation.
+    protected: Vec<bool>,
+    /// Frames on probation, oldest admission first.
+    probation: VecDeque<FrameId>,
+    /// Pages recently evicted from probation, oldest first, each with the
+    /// sequence number it was remembered under.
+    ghosts: VecDeque<(PageKey, u64)>,
+    /// The latest sequence number of each remembered page.
+    ghost_index: HashMap<PageKey, u64>,
+    next_ghost: u64,
+    /// Frames taken out of use by [`BufferPool::resize`], holding no memory.
+    retired: Vec<FrameId>,
+    /// Pages being read, into frames reserved for them, which are neither
+    /// free nor mapped until the read finishes, or into scan rings.
+    loading: HashSet<PageKey>,
+    /// Covers the frames in use.
+    reservation: Reservation,
+}
+
+impl PoolState {
+    fn remember(&mut self, key: PageKey, capacity: usize) {
+        let seq = self.next_ghost;
+        self.next_ghost += 1;
+        self.ghosts.push_back((key, seq));
+        self.ghost_index.insert(key, seq);
+        while self.ghosts.len() > capacity {
+            let (old, seq) = self.ghosts.pop_front().unwrap();
+            if self.ghost_index.get(&old) == Some(&seq) {
+                self.ghost_index.remove(&old);
+            }
+        }
+    }
+}
+
+/// Counters describing buffer-pool behaviour since it was created.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct BufferPoolStats {
+    pub hits: u64,
+    pub misses: u64,
+    pub evictions: u64,
+    pub dirty_writebacks: u64,
+    /// Pages moved to the protected set because they were read again late
+    /// in their probation or soon after leaving it.
+    pub promotions: u64,
+    /// Misses served into a scan ring instead of a pool frame.
+    pub ring_reads: u64,
+    /// Pages read ahead of a sequential scan.
+    pub read_ahead_pages: u64,
+    /// Pages read ahead that their scan went on to use.
+    pub read_ahead_hits: u64,
+    /// Read-ahead pages their scan had to wait for.
+    pub read_ahead_waits: u64,
+    /// Read-ahead pages dropped because a write may have overtaken them.
+    pub read_ahead_discards: u64,
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    hits: AtomicU64,
+    misses: AtomicU64,
+    evictions: AtomicU64,
+    dirty_writebacks: AtomicU64,
+    promotions: AtomicU64,
+    ring_reads: AtomicU64,
+    read_ahead_pages: AtomicU64,
+    read_ahead_hits: AtomicU64,
+    read_ahead_waits: AtomicU64,
+    read_ahead_discards: AtomicU64,
+}
+
+/// Share of the frames the probation queue may hold before eviction
+/// prefers it over the protected set.
+const PROBATION_DIVISOR: usize = 4;
+/// Share of the frames admitted after a page within which hits to it are
+/// taken as correlated with its first use: half the probation queue.
+const CORRELATION_DIVISOR: usize = 2 * PROBATION_DIVISOR;
+/// Share of the frames the ghost list remembers pages for.
+const GHOST_DIVISOR: usize = 2;
+/// Frames in a scan ring.
+pub const SCAN_RING_PAGES: usize = 16;
+
+/// A bounded cache of disk pages shared by every access path.
+#[derive(Debug)]
+pub struct BufferPool {
+    disk: Arc<DiskManager>,
+    files: RwLock<HashMap<FileId, Arc<DiskManager>>>,
+    next_file_id: AtomicU32,
+    frames: Vec<Frame>,
+    /// Frames in use, the rest being retired.
+    active: AtomicUsize,
+    /// Resident pages. Pins are taken under its read lock and evictions
+    /// under its write lock, so an evicted frame is never pinned.
+    page_table: RwLock<HashMap<PageKey, FrameId>>,
+    state: Mutex<PoolState>,
+    /// Signalled, with the pool mutex, when pages finish loading.
+    loaded: Condvar,
+    /// Pages admitted so far.
+    admissions: AtomicU64,
+    dirty_pages: AtomicUsize,
+    counters: Counters,
+    read_latency: Histogram,
+    /// Reuse distances of sampled page accesses.
+    reuse: Mutex<(StackDistance, MissCurve)>,
+    /// Charged for scan rings.
+    budget: Arc<MemoryBudget>,
+}
+
+impl BufferPool {
+    /// Creates a pool over `disk` holding as many frames as fit in
+    /// `capacity_bytes`, reserved from `budget` up front.
+    pub fn new(
+        disk: Arc<DiskManager>,
+        budget: &Arc<MemoryBudget>,
+        capacity_bytes: usize,
+    ) -> Result<Arc<Self>> {
+        Self::with_max_capacity(disk, budget, capacity_bytes, capacity_bytes)
+    }
+
+    /// Creates a pool like [`BufferPool::new`] that can later be resized
+    /// up to `max_capacity_bytes`.
+    pub fn with_max_capacity(
+        disk: Arc<DiskManager>,
+        budget: &Arc<MemoryBudget>,
+        capacity_bytes: usize,
+        max_capacity_bytes: usize,
+    ) -> Result<Arc<Self>> {
+        let num_frames = capacity_bytes / PAGE_SIZE;
+        if num_frames == 0 {
+            return Err(Error::InvalidArgument(format!(
+                "buffer pool of {capacity_bytes} bytes cannot hold a single page"
+            )));
+        }
+        let max_frames = (max_capacity_bytes / PAGE_SIZE).max(num_frames);
+        let reservation = budget.try_reserve(Consumer::BufferPool, num_frames * PAGE_SIZE)?;
+        let frames = (0..max_frames)
+            .map(|frame_id| Frame {
+                data: RwLock::new(if frame_id < num_frames {
+                    PageBuf::zeroed()
+                } else {
+                    PageBuf::empty()
+                }),
+                pin_count: AtomicU32::new(0),
+                referenced: AtomicBool::new(false),
+                dirty: AtomicBool::new(false),
+                version: AtomicU64::new(0),
+                admitted: AtomicU64::new(0),
+                rereferenced: AtomicBool::new(false),
+            })
+            .collect();
+        let files = HashMap::from([(MAIN_FILE, Arc::clone(&disk))]);
+        Ok(Arc::new(BufferPool {
+            disk,
+            files: RwLock::new(files),
+            next_file_id: AtomicU32::new(MAIN_FILE + 1),
+            frames,
+            active: AtomicUsize::new(num_frames),
+            page_table: RwLock::new(HashMap::with_capacity(num_frames)),
+            state: Mutex::new(PoolState {
+                frame_pages: vec![NO_PAGE; max_frames],
+                free_list: (0..num_frames).rev().collect(),
+                clock_hand: 0,
+                protected: vec![false; max_frames],
+                probation: VecDeque::new(),
+                ghosts: VecDeque::new(),
+                ghost_index: HashMap::new(),
+                next_ghost: 0,
+                retired: (num_frames..max_frames).rev().collect(),
+                loading: HashSet::new(),
+                reservation,
+            }),
+            loaded: Condvar::new(),
+            admissions: AtomicU64::new(0),
+            dirty_pages: AtomicUsize::new(0),
+            counters: Counters::default(),
+            read_latency: Histogram::default(),
+            reuse: Mutex::default(),
+            budget: Arc::clone(budget),
+        }))
+    }
+
+    /// Number of frames in use.
+    pub fn capacity(&self) -> usize {
+        self.active.load(Ordering::Relaxed)
+    }
+
+    /// The most frames the pool can grow to.
+    pub fn max_capacity(&self) -> usize {
+        self.frames.len()
+    }
+
+    /// Changes the number of frames in use to `frames`, kept between one and
+    /// [`BufferPool::max_capacity`], and returns the number reached.
+    /// Shrinking evicts clean, unpinned pages and returns their frames'
+    /// memory to the budget; it stops early if only pinned or dirty pages
+    /// are left. Growing stops early if the budget cannot cover more frames.
+    pub fn resize(&self, frames: usize) -> usize {
+        let frames = frames.clamp(1, self.frames.len());
+        let mut state = self.state.lock().unwrap();
+        let mut active = self.capacity();
+        while active > frames {
+            let frame_id = match state.free_list.pop() {
+                Some(frame_id) => frame_id,
+                None => {
+                    let victim = self
+                        .evict_probation(&mut state)
+                        .or_else(|| self.evict_protected(&mut state));
+                    let Some(frame_id) = victim else {
+                        break;
+                    };
+                    self.counters.evictions.fetch_add(1, Ordering::Relaxed);
+                    frame_id
+                }
+            };
+            *self.frames[frame_id].data.write().unwrap() = PageBuf::empty();
+            state.retired.push(frame_id);
+            state.reservation.shrink(PAGE_SIZE);
+            active -= 1;
+        }
+        while active < frames {
+            let Some(frame_id) = state.retired.pop() else {
+                break;
+            };
+            if state.reservation.try_grow(PAGE_SIZE).is_err() {
+                state.retired.push(frame_id);
+                break;
+            }
+            *self.frames[frame_id].data.write().unwrap() = PageBuf::zeroed();
+            state.free_list.push(frame_id);
+            active += 1;
+        }
+        self.active.store(active, Ordering::Relaxed);
+        active
+    }
+
+    /// The main data file the pool pages from.
+    pub fn disk(&self) -> &Arc<DiskManager> {
+        &self.disk
+    }
+
+    /// Whether the main data file, and every file opened through
+    /// [`BufferPool::open_file`], bypasses the kernel page cache.
+    pub fn direct_io(&self) -> bool {
+        self.disk.is_direct()
+    }
+
+    /// Opens the file at `path` with the same kind of I/O as the main data
+    /// file and attaches it.
+    pub fn open_file(&self, path: impl AsRef<Path>) -> Result<FileId> {
+        let disk = if self.direct_io() {
+            DiskManager::open_direct(path)?
+        } else {
+            DiskManager::open(path)?
+        };
+        Ok(self.attach(Arc::new(disk)))
+    }
+
+    /// Makes the pages of `disk` readable through the pool.
+    pub fn attach(&self, disk: Arc<DiskManager>) -> FileId {
+        let file_id = self.next_file_id.fetch_add(1, Ordering::Relaxed);
+        self.files.write().unwrap().insert(file_id, disk);
+        file_id
+    }
+
+    /// Forgets `file_id`, dropping its resident pages without writing them
+    /// back. The caller guarantees none of them are pinned.
+    pub fn detach(&self, file_id: FileId) {
+        let mut state = self.state.lock().unwrap();
+        let mut table = self.page_table.write().unwrap();
+        self.files.write().unwrap().remove(&file_id);
+        let frames: Vec<FrameId> = table
+            .iter()
+            .filter(|((file, _), _)| *file == file_id)
+            .map(|(_, &frame_id)| frame_id)
+            .collect();
+        for frame_id in frames {
+            debug_assert_eq!(self.frames[frame_id].pin_count.load(Ordering::Acquire), 0);
+            let key = state.frame_pages[frame_id];
+            table.remove(&key);
+            state.frame_pages[frame_id] = NO_PAGE;
+            state.protected[frame_id] = false;
+            if self.frames[frame_id].dirty.swap(false, Ordering::AcqRel) {
+                self.dirty_pages.fetch_sub(1, Ordering::Relaxed);
+            }
+            state.free_list.push(frame_id);
+        }
+        let frame_pages = std::mem::take(&mut state.frame_pages);
+        state
+            .probation
+            .retain(|&frame_id| frame_pages[frame_id] != NO_PAGE);
+        state.frame_pages = frame_pages;
+    }
+
+    /// Pins page `page_id` of the main file, reading it from disk if it is
+    /// not resident.
+    pub fn fetch_page(self: &Arc<Self>, page_id: PageId) -> Result<PageGuard> {
+        self.fetch_file_page(MAIN_FILE, page_id)
+    }
+
+    /// Pins page `page_id` of an attached file.
+    pub fn fetch_file_page(
+        self: &Arc<Self>,
+        file_id: FileId,
+        page_id: PageId,
+    ) -> Result<PageGuard> {
+        let key = (file_id, page_id);
+        self.sample_access(key);
+        if let Some(guard) = self.pin_resident(key) {
+            return Ok(guard);
+        }
+        let mut state = self.state.lock().unwrap();
+        // Another thread may have read the page while this one waited, or
+        // may be reading it now.
+        loop {
+            if let Some(guard) = self.pin_resident(key) {
+                return Ok(guard);
+            }
+            if !state.loading.contains(&key) {
+                break;
+            }
+            state = self.loaded.wait(state).unwrap();
+        }
+        self.counters.misses.fetch_add(1, Ordering::Relaxed);
+        let disk = self.file(file_id)?;
+        let frame_id = self.acquire_frame(&mut state)?;
+        state.loading.insert(key);
+        drop(state);
+        let started = Instant::now();
+        let result = disk.read_page(page_id, &mut self.frames[frame_id].data.write().unwrap());
+        if result.is_ok() {
+            self.read_latency.record_since(started);
+        }
+        self.finish_loads(&[(frame_id, key)], result.is_ok());
+        result.map(|()| self.guard(frame_id, key))
+    }
+
+    /// Pins pages `page_ids` of an attached file, reading the ones that are
+    /// not resident in a single batch. The ids must be distinct, and every
+    /// page not yet resident needs a frame of its own.
+    pub fn fetch_file_pages(
+        self: &Arc<Self>,
+        file_id: FileId,
+        page_ids: &[PageId],
+    ) -> Result<Vec<PageGuard>> {
+        for &page_id in page_ids {
+            self.sample_access((file_id, page_id));
+        }
+        let mut guards: Vec<Option<PageGuard>> = page_ids
+            .iter()
+            .map(|&page_id| self.pin_resident((file_id, page_id)))
+            .collect();
+        if guards.iter().all(Option::is_some) {
+            return Ok(guards.into_iter().flatten().collect());
+        }
+        let mut state = self.state.lock().unwrap();
+        loop {
+            for (guard, &page_id) in guards.iter_mut().zip(page_ids) {
+                if guard.is_none() {
+                    *guard = self.pin_resident((file_id, page_id));
+                }
+            }
+            let waiting = guards.iter().zip(page_ids).any(|(guard, &page_id)| {
+                guard.is_none() && state.loading.contains(&(file_id, page_id))
+            });
+            if !waiting {
+                break;
+            }
+            state = self.loaded.wait(state).unwrap();
+        }
+        let disk = self.file(file_id)?;
+        let mut loads = Vec::new();
+        for (i, guard) in guards.iter().enumerate() {
+            if guard.is_some() {
+                continue;
+            }
+            match self.acquire_frame(&mut state) {
+                Ok(frame_id) => loads.push((i, frame_id)),
+                Err(err) => {
+                    state
+                        .free_list
+                        .extend(loads.iter().map(|&(_, frame_id)| frame_id));
+                    return Err(err);
+                }
+            }
+        }
+        self.counters
+            .misses
+            .fetch_add(loads.len() as u64, Ordering::Relaxed);
+        let keys: Vec<(FrameId, PageKey)> = loads
+            .iter()
+            .map(|&(i, frame_id)| (frame_id, (file_id, page_ids[i])))
+            .collect();
+        state.loading.extend(keys.iter().map(|&(_, key)| key));
+        drop(state);
+        let started = Instant::now();
+        let result = {
+            let mut latches: Vec<_> = loads
+                .iter()
+                .map(|&(_, frame_id)| self.frames[frame_id].data.write().unwrap())
+                .collect();
+            let mut pages: Vec<(PageId, &mut [u8])> = loads
+                .iter()
+                .zip(latches.iter_mut())
+                .map(|(&(i, _), data)| (page_ids[i], &mut data[..]))
+                .collect();
+            disk.read_pages(&mut pages)
+        };
+        if result.is_ok() {
+            self.read_latency.record_since(started);
+        }
+        self.finish_loads(&keys, result.is_ok());
+        result?;
+        for (&(i, _), &(frame_id, key)) in loads.iter().zip(&keys) {
+            guards[i] = Some(self.guard(frame_id, key));
+        }
+        Ok(guards.into_iter().flatten().collect())
+    }
+
+    /// Ends the loads of pages into the frames reserved for them, and wakes
+    /// the threads waiting for any of them. Each page is installed and
+    /// pinned if its read succeeded, and its frame freed otherwise.
+    fn finish_loads(&self, loads: &[(FrameId, PageKey)], read: bool) {
+        let mut state = self.state.lock().unwrap();
+        for &(frame_id, key) in loads {
+            state.loading.remove(&key);
+            if read {
+                self.install(&mut state, frame_id, key);
+            } else {
+                state.free_list.push(frame_id);
+            }
+        }
+        drop(state);
+        self.loaded.notify_all();
+    }
+
+    /// Feeds the miss curve if `key` is among the sampled pages.
+    fn sample_access(&self, (file_id, page_id): PageKey) {
+        // Seed with the file's own hash so that pages of different files
+        // do not collide.
+        let hash = hash_u64(page_id, hash_u64(file_id as u64, 0));
+        if !sampled(hash) {
+            return;
+        }
+        let mut reuse = self.reuse.lock().unwrap();
+        let pages = reuse.0.access(hash);
+        reuse.1.record(pages.map(|pages| pages * PAGE_SIZE));
+    }
+
+    /// Whether page `page_id` of `file_id` is resident, without pinning it.
+    pub(super) fn is_resident(&self, file_id: FileId, page_id: PageId) -> bool {
+        self.page_table
+            .read()
+            .unwrap()
+            .contains_key(&(file_id, page_id))
+    }
+
+    fn pin_resident(self: &Arc<Self>, key: PageKey) -> Option<PageGuard> {
+        let table = self.page_table.read().unwrap();
+        let &frame_id = table.get(&key)?;
+        self.pin(frame_id);
+        self.counters.hits.fetch_add(1, Ordering::Relaxed);
+        let frame = &self.frames[frame_id];
+        let age = self.admissions.load(Ordering::Relaxed) - frame.admitted.load(Ordering::Relaxed);
+        if age >= (self.capacity() / CORRELATION_DIVISOR) as u64 {
+            frame.rereferenced.store(true, Ordering::Relaxed);
+        }
+        Some(self.guard(frame_id, key))
+    }
+
+    pub(super) fn budget(&self) -> &Arc<MemoryBudget> {
+        &self.budget
+    }
+
+    pub(super) fn file(&self, file_id: FileId) -> Result<Arc<DiskManager>> {
+        self.files
+            .read()
+            .unwrap()
+            .get(&file_id)
+            .cloned()
+            .ok_or_else(|| Error::InvalidArgument(format!("file {file_id} is not attached")))
+    }
+
+    /// Allocates a fresh zeroed page on disk and returns it pinned.
+    pub fn new_page(self: &Arc<Self>) -> Result<PageGuard> {
+        let mut state = self.state.lock().unwrap();
+        let frame_id = self.acquire_frame(&mut state)?;
+        let page_id = self.disk.allocate_page();
+        self.frames[frame_id].data.write().unwrap().fill(0);
+        // A new page has no on-disk image yet, so it must be written back.
+        self.mark_dirty(frame_id);
+        let key = (MAIN_FILE, page_id);
+        self.install(&mut state, frame_id, key);
+        Ok(self.guard(frame_id, key))
+    }
+
+    /// Writes page `page_id` of the main file back to disk if it is
+    /// resident and dirty.
+    pub fn flush_page(&self, page_id: PageId) -> Result<()> {
+        let key = (MAIN_FILE, page_id);
+        let table = self.page_table.read().unwrap();
+        let Some(frame_id) = self.pin_dirty(&table, key) else {
+            return Ok(());
+        };
+        drop(table);
+        let result = self.write_back(frame_id, key);
+        self.unpin(frame_id);
+        result
+    }
+
+    /// Writes the resident, dirty pages among `page_ids` of the main file
+    /// back to disk, keeping up to [`aio::QUEUE_DEPTH`] writes in flight.
+    pub fn flush_pages(&self, page_ids: &[PageId]) -> Result<()> {
+        let table = self.page_table.read().unwrap();
+        let dirty: Vec<(PageId, FrameId)> = page_ids
+            .iter()
+            .filter_map(|&page_id| {
+                let frame_id = self.pin_dirty(&table, (MAIN_FILE, page_id))?;
+                // A concurrent flush may have claimed the page meanwhile.
+                if !self.frames[frame_id].dirty.swap(false, Ordering::AcqRel) {
+                    self.unpin(frame_id);
+                    return None;
+                }
+                Some((page_id, frame_id))
+            })
+            .collect();
+        drop(table);
+        self.dirty_pages.fetch_sub(dirty.len(), Ordering::Relaxed);
+        let result = self.write_pinned(&dirty);
+        for &(_, frame_id) in &dirty {
+            self.unpin(frame_id);
+        }
+        result
+    }
+
+    /// Writes `dirty`, pinned pages of the main file whose dirty flags were
+    /// cleared, in batches of [`aio::QUEUE_DEPTH`]. Pages left unwritten by
+    /// a failure are marked dirty again.
+    fn write_pinned(&self, dirty: &[(PageId, FrameId)]) -> Result<()> {
+        for (done, batch) in dirty.chunks(aio::QUEUE_DEPTH).enumerate() {
+            let latches: Vec<_> = batch
+                .iter()
+                .map(|&(_, frame_id)| self.frames[frame_id].data.read().unwrap())
+                .collect();
+            let pages: Vec<(PageId, &[u8])> = batch
+                .iter()
+                .zip(&latches)
+                .map(|(&(page_id, _), data)| (page_id, &data[..]))
+                .collect();
+            let result = self.disk.write_pages(&pages);
+            drop(latches);
+            if let Err(err) = result {
+                for &(_, frame_id) in &dirty[done * aio::QUEUE_DEPTH..] {
+                    self.mark_dirty(frame_id);
+                }
+                return Err(err);
+            }
+            self.counters
+                .dirty_writebacks
+                .fetch_add(batch.len() as u64, Ordering::Relaxed);
+        }
+        Ok(())
+    }
+
+    /// Number of resident pages modified since they were last written.
+    pub fn dirty_pages(&self) -> usize {
+        self.dirty_pages.load(Ordering::Relaxed)
+    }
+
+    /// Ids of the main-file pages that are currently dirty.
+    pub fn dirty_page_ids(&self) -> Vec<PageId> {
+        let table = self.page_table.read().unwrap();
+        table
+            .iter()
+            .filter(|&(&(file_id, _), &frame_id)| {
+                file_id == MAIN_FILE && self.frames[frame_id].dirty.load(Ordering::Acquire)
+            })
+            .map(|(&(_, page_id), _)| page_id)
+            .collect()
+    }
+
+    /// Writes every dirty resident page back to disk and syncs the file.
+    /// The pages are written one by one, so a crash part-way through leaves
+    /// a mix of old and new pages; checkpoints go through a double-write
+    /// file instead.
+    pub fn flush_all(&self) -> Result<()> {
+        let table = self.page_table.read().unwrap();
+        let dirty: Vec<(PageKey, FrameId)> = table
+            .keys()
+            .filter_map(|&key| Some((key, self.pin_dirty(&table, key)?)))
+            .collect();
+        drop(table);
+        let result = dirty
+            .iter()
+            .try_for_each(|&(key, frame_id)| self.write_back(frame_id, key));
+        for &(_, frame_id) in &dirty {
+            self.unpin(frame_id);
+        }
+        result?;
+        self.disk.sync()
+    }
+
+    /// Snapshot of the pool's hit, miss and eviction counters.
+    pub fn stats(&self) -> BufferPoolStats {
+        BufferPoolStats {
+            hits: self.counters.hits.load(Ordering::Relaxed),
+            misses: self.counters.misses.load(Ordering::Relaxed),
+            evictions: self.counters.evictions.load(Ordering::Relaxed),
+            dirty_writebacks: self.counters.dirty_writebacks.load(Ordering::Relaxed),
+            promotions: self.counters.promotions.load(Ordering::Relaxed),
+            ring_reads: self.counters.ring_reads.load(Ordering::Relaxed),
+            read_ahead_pages: self.counters.read_ahead_pages.load(Ordering::Relaxed),
+            read_ahead_hits: self.counters.read_ahead_hits.load(Ordering::Relaxed),
+            read_ahead_waits: self.counters.read_ahead_waits.load(Ordering::Relaxed),
+            read_ahead_discards: self.counters.read_ahead_discards.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Latency of the disk reads behind misses.
+    pub fn read_latency(&self) -> HistogramSnapshot {
+        self.read_latency.snapshot()
+    }
+
+    fn guard(self: &Arc<Self>, frame_id: FrameId, (_, page_id): PageKey) -> PageGuard {
+        PageGuard {
+            pool: Arc::clone(self),
+            slot: Slot::Frame(frame_id),
+            page_id,
+        }
+    }
+
+    fn pin(&self, frame_id: FrameId) {
+        let frame = &self.frames[frame_id];
+        frame.pin_count.fetch_add(1, Ordering::AcqRel);
+        frame.referenced.store(true, Ordering::Relaxed);
+    }
+
+    fn mark_dirty(&self, frame_id: FrameId) {
+        if !self.frames[frame_id].dirty.swap(true, Ordering::AcqRel) {
+            self.dirty_pages.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn unpin(&self, frame_id: FrameId) {
+        self.frames[frame_id]
+            .pin_count
+            .fetch_sub(1, Ordering::AcqRel);
+    }
+
+    /// Maps `frame_id` to `key` and pins it. The page is protected if it
+    /// left probation recently, and goes on probation otherwise.
+    fn install(&self, state: &mut PoolState, frame_id: FrameId, key: PageKey) {
+        self.frames[frame_id]
+            .version
+            .fetch_add(1, Ordering::Release);
+        state.frame_pages[frame_id] = key;
+        let frame = &self.frames[frame_id];
+        frame.admitted.store(
+            self.admissions.fetch_add(1, Ordering::Relaxed),
+            Ordering::Relaxed,
+        );
+        frame.rereferenced.store(false, Ordering::Relaxed);
+        if state.ghost_index.remove(&key).is_some() {
+            state.protected[frame_id] = true;
+            self.counters.promotions.fetch_add(1, Ordering::Relaxed);
+        } else {
+            state.protected[frame_id] = false;
+            state.probation.push_back(frame_id);
+        }
+        self.pin(frame_id);
+        self.page_table.write().unwrap().insert(key, frame_id);
+    }
+
+    /// Finds a frame to hold a new page: a free one if available, otherwise
+    /// a clean, unpinned victim, taken from probation while the queue is over
+    /// its share and from the protected set otherwise. Fails when every
+    /// frame is pinned or dirty.
+    fn acquire_frame(&self, state: &mut PoolState) -> Result<FrameId> {
+        if let Some(frame_id) = state.free_list.pop() {
+            return Ok(frame_id);
+        }
+        let victim = if state.probation.len() > self.capacity() / PROBATION_DIVISOR {
+            self.evict_probation(state)
+                .or_else(|| self.evict_protected(state))
+        } else {
+            self.evict_protected(state)
+                .or_else(|| self.evict_probation(state))
+        };
+        let frame_id = victim.ok_or(Error::BufferPoolExhausted)?;
+        self.counters.evictions.fetch_add(1, Ordering::Relaxed);
+        Ok(frame_id)
+    }
+
+    /// Evicts the oldest evictable page on probation and remembers it in
+    /// the ghost list. Pages passed on the way that were hit again after
+    /// the correlation window are protected instead.
+    fn evict_probation(&self, state: &mut PoolState) -> Option<FrameId> {
+        let mut at = 0;
+        while at < state.probation.len() {
+            let frame_id = state.probation[at];
+            if self.frames[frame_id]
+                .rereferenced
+                .swap(false, Ordering::Relaxed)
+            {
+                state.probation.remove(at);
+                state.protected[frame_id] = true;
+                self.counters.promotions.fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+            if self.try_unmap(state, frame_id) {
+                state.probation.remove(at);
+                let key = std::mem::replace(&mut state.frame_pages[frame_id], NO_PAGE);
+                state.remember(key, self.capacity() / GHOST_DIVISOR);
+                return Some(frame_id);
+            }
+            at += 1;
+        }
+        None
+    }
+
+    /// Evicts a protected page by clock sweep. Two full sweeps are enough:
+    /// the first clears reference bits, the second must find any evictable
+    /// frame.
+    fn evict_protected(&self, state: &mut PoolState) -> Option<FrameId> {
+        for _ in 0..2 * self.frames.len() {
+            let frame_id = state.clock_hand;
+            state.clock_hand = (state.clock_hand + 1) % self.frames.len();
+            if !state.protected[frame_id] {
+                continue;
+            }
+            if self.frames[frame_id]
+                .referenced
+                .swap(false, Ordering::Relaxed)
+            {
+                continue;
+            }
+            if self.try_unmap(state, frame_id) {
+                state.protected[frame_id] = false;
+                state.frame_pages[frame_id] = NO_PAGE;
+                return Some(frame_id);
+            }
+        }
+        None
+    }
+
+    /// Removes the page in `frame_id` from the page table if the frame is
+    /// clean and unpinned.
+    fn try_unmap(&self, state: &PoolState, frame_id: FrameId) -> bool {
+        let frame = &self.frames[frame_id];
+        if frame.pin_count.load(Ordering::Acquire) > 0 || frame.dirty.load(Ordering::Acquire) {
+            return false;
+        }
+        // Recheck under the write lock: a hit may have pinned the frame
+        // since it was looked at, and may even have modified the page and
+        // unpinned it again. No hit can pin it while the lock is held, and
+        // a writer marks the page dirty before unpinning, so a frame that
+        // is unpinned here and still clean is safe to evict.
+        let mut table = self.page_table.write().unwrap();
+        if frame.pin_count.load(Ordering::Acquire) > 0 || frame.dirty.load(Ordering::Acquire) {
+            return false;
+        }
+        table.remove(&state.frame_pages[frame_id]);
+        true
+    }
+
+    /// Pins the frame of `key` if the page is resident and dirty, so that
+    /// it can be written back with `table` released: once its dirty flag is
+    /// cleared, only the pin keeps it from being evicted mid-write.
+    fn pin_dirty(&self, table: &HashMap<PageKey, FrameId>, key: PageKey) -> Option<FrameId> {
+        let &frame_id = table.get(&key)?;
+        let frame = &self.frames[frame_id];
+        if !frame.dirty.load(Ordering::Acquire) {
+            return None;
+        }
+        frame.pin_count.fetch_add(1, Ordering::AcqRel);
+        Some(frame_id)
+    }
+
+    /// Writes the page in `frame_id`, pinned by the caller, back to disk if
+    /// it is dirty.
+    fn write_back(&self, frame_id: FrameId, (file_id, page_id): PageKey) -> Result<()> {
+        let frame = &self.frames[frame_id];
+        if !frame.dirty.swap(false, Ordering::AcqRel) {
+            return Ok(());
+        }
+        self.dirty_pages.fetch_sub(1, Ordering::Relaxed);
+        let data = frame.data.read().unwrap();
+        if let Err(err) = self
+            .file(file_id)
+            .and_then(|disk| disk.write_page(page_id, &data))
+        {
+            drop(data);
+            self.mark_dirty(frame_id);
+            return Err(err);
+        }
+        self.counters
+            .dirty_writebacks
+            .fetch_add(1, Ordering::Relaxed);
+        Ok(())
+    }
+}
+
+/// Hand-over of pages read ahead by a [`PageScan`].
+///
+/// [`PageScan`]: crate::storage::PageScan
+impl BufferPool {
+    /// Counts `pages` pages read ahead.
+    pub(super) fn count_read_ahead(&self, pages: usize) {
+        self.counters
+            .read_ahead_pages
+            .fetch_add(pages as u64, Ordering::Relaxed);
+    }
+
+    /// Counts a read-ahead page its scan had to wait for.
+    pub(super) fn count_read_ahead_wait(&self) {
+        self.counters
+            .read_ahead_waits
+            .fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Pins page `page_id` of `file_id` given `data`, a copy read ahead
+    /// of it. The resident page is pinned if there is one. Otherwise, if
+    /// `fresh` confirms no write overtook the read, the copy is installed
+    /// in a pool frame; if not, returns `None` and the page must be read
+    /// again.
+    pub(super) fn install_copy(
+        self: &Arc<Self>,
+        file_id: FileId,
+        page_id: PageId,
+        data: &[u8],
+        fresh: impl FnOnce() -> bool,
+    ) -> Result<Option<PageGuard>> {
+        let key = (file_id, page_id);
+        self.sample_access(key);
+        // With the pool mutex held no page can become resident, and a page
+        // that is not resident cannot be written.
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if let Some(guard) = self.pin_resident(key) {
+                return Ok(Some(guard));
+            }
+            if !state.loading.contains(&key) {
+                break;
+            }
+            state = self.loaded.wait(state).unwrap();
+        }
+        if !fresh() {
+            self.counters
+                .read_ahead_discards
+                .fetch_add(1, Ordering::Relaxed);
+            return Ok(None);
+        }
+        let frame_id = self.acquire_frame(&mut state)?;
+        self.frames[frame_id]
+            .data
+            .write()
+            .unwrap()
+            .copy_from_slice(data);
+        self.counters.misses.fetch_add(1, Ordering::Relaxed);
+        self.counters
+            .read_ahead_hits
+            .fetch_add(1, Ordering::Relaxed);
+        self.install(&mut state, frame_id, key);
+        Ok(Some(self.guard(frame_id, key)))
+    }
+
+    /// Like [`BufferPool::install_copy`], but hands the copy in `slot` out
+    /// as a private page, like a scan ring's, rather than installing it.
+    pub(super) fn private_copy(
+        self: &Arc<Self>,
+        file_id: FileId,
+        page_id: PageId,
+        slot: &Arc<RingSlot>,
+        fresh: impl FnOnce() -> bool,
+    ) -> Option<PageGuard> {
+        let key = (file_id, page_id);
+        let _state = self.state.lock().unwrap();
+        if let Some(guard) = self.pin_resident(key) {
+            return Some(guard);
+        }
+        if !fresh() {
+            self.counters
+                .read_ahead_discards
+                .fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+        self.counters.misses.fetch_add(1, Ordering::Relaxed);
+        self.counters.ring_reads.fetch_add(1, Ordering::Relaxed);
+        self.counters
+            .read_ahead_hits
+            .fetch_add(1, Ordering::Relaxed);
+        Some(PageGuard {
+            pool: Arc::clone(self),
+            slot: Slot::Ring(Arc::clone(slot)),
+            page_id,
+        })
+    }
+}
+
+impl Rebalance for BufferPool {
+    fn name(&self) -> &'static str {
+        "buffer_pool"
+    }
+
+    fn size_bytes(&self) -> usize {
+        self.capacity() * PAGE_SIZE
+    }
+
+    fn resize_bytes(&self, bytes: usize) -> usize {
+        self.resize(bytes / PAGE_SIZE) * PAGE_SIZE
+    }
+
+    fn take_curve(&self) -> MissCurve {
+        self.reuse.lock().unwrap().1.take()
+    }
+}
+
+/// A page buffer private to one [`ScanRing`] or [`PageScan`].
+///
+/// [`PageScan`]: crate::storage::PageScan
+#[derive(Debug)]
+pub(super) struct RingSlot {
+    data: RwLock<PageBuf>,
+}
+
+impl RingSlot {
+    pub(super) fn new(buf: PageBuf) -> Self {
+        RingSlot {
+            data: RwLock::new(buf),
+        }
+    }
+
+    pub(super) fn into_buf(self) -> PageBuf {
+        self.data.into_inner().unwrap()
+    }
+}
+
+/// A few private frames through which one long sequential scan reads the
+/// pages that are not resident, reusing them round-robin so the scan never
+/// displaces pages from the pool. Pages that are resident are still served
+/// from the pool.
+///
+/// Created by [`BufferPool::scan_ring`]; its frames are charged to the
+/// memory budget until it is dropped.
+#[derive(Debug)]
+pub struct ScanRing {
+    pool: Arc<BufferPool>,
+    slots: Vec<Arc<RingSlot>>,
+    next: usize,
+    _reservation: Reservation,
+}
+
+impl BufferPool {
+    /// Pages a scan reads through the pool before it should switch to a
+    /// scan ring: the probation queue's share, since a longer scan would
+    /// cycle through all of it.
+    pub fn scan_ring_threshold(&self) -> usize {
+        self.capacity() / PROBATION_DIVISOR
+    }
+
+    /// Creates a scan ring over this pool, or returns `None` if the memory
+    /// budget cannot spare its frames; the scan then reads through the pool.
+    pub fn scan_ring(self: &Arc<Self>) -> Option<ScanRing> {
+        let pages = SCAN_RING_PAGES
+            .min(self.capacity() / PROBATION_DIVISOR)
+            .max(1);
+        let reservation = self
+            .budget
+            .try_reserve(Consumer::BufferPool, pages * PAGE_SIZE)
+            .ok()?;
+        let slots = (0..pages)
+            .map(|_| Arc::new(RingSlot::new(PageBuf::zeroed())))
+            .collect();
+        Some(ScanRing {
+            pool: Arc::clone(self),
+            slots,
+            next: 0,
+            _reservation: reservation,
+        })
+    }
+}
+
+impl ScanRing {
+    /// Pins page `page_id` of the main file if it is resident, and otherwise
+    /// reads it into the next free ring frame.
+    pub fn fetch_page(&mut self, page_id: PageId) -> Result<PageGuard> {
+        self.fetch_file_page(MAIN_FILE, page_id)
+    }
+
+    /// Pins page `page_id` of an attached file if it is resident, and
+    /// otherwise reads it into the next free ring frame.
+    pub fn fetch_file_page(&mut self, file_id: FileId, page_id: PageId) -> Result<PageGuard> {
+        self.fetch_file_pages(file_id, &[page_id])
+            .map(|mut guards| guards.pop().unwrap())
+    }
+
+    /// Like [`ScanRing::fetch_file_page`] for several distinct pages, reading
+    /// the ones that are not resident in a single batch. Falls back to the
+    /// pool when the ring has too few free frames.
+    pub fn fetch_file_pages(
+        &mut self,
+        file_id: FileId,
+        page_ids: &[PageId],
+    ) -> Result<Vec<PageGuard>> {
+        let pool = Arc::clone(&self.pool);
+        let mut guards: Vec<Option<PageGuard>> = page_ids
+            .iter()
+            .map(|&page_id| pool.pin_resident((file_id, page_id)))
+            .collect();
+        if guards.iter().all(Option::is_some) {
+            return Ok(guards.into_iter().flatten().collect());
+        }
+        // Missing pages are marked as loading while they are read, so none
+        // can become resident, and be modified, until the read is over.
+        let mut state = pool.state.lock().unwrap();
+        loop {
+            for (guard, &page_id) in guards.iter_mut().zip(page_ids) {
+                if guard.is_none() {
+                    *guard = pool.pin_resident((file_id, page_id));
+                }
+            }
+            let waiting = guards.iter().zip(page_ids).any(|(guard, &page_id)| {
+                guard.is_none() && state.loading.contains(&(file_id, page_id))
+            });
+            if !waiting {
+                break;
+            }
+            state = pool.loaded.wait(state).unwrap();
+        }
+        let missing: Vec<usize> = (0..guards.len()).filter(|&i| guards[i].is_none()).collect();
+        let slots: Option<Vec<Arc<RingSlot>>> = missing.iter().map(|_| self.take_slot()).collect();
+        let Some(slots) = slots else {
+            drop(state);
+            return pool.fetch_file_pages(file_id, page_ids);
+        };
+        let disk = pool.file(file_id)?;
+        let keys: Vec<PageKey> = missing.iter().map(|&i| (file_id, page_ids[i])).collect();
+        state.loading.extend(keys.iter().copied());
+        drop(state);
+        let started = Instant::now();
+        let result = {
+            let mut latches: Vec<_> = slots
+                .iter()
+                .map(|slot| slot.data.write().unwrap())
+                .collect();
+            let mut pages: Vec<(PageId, &mut [u8])> = missing
+                .iter()
+                .zip(latches.iter_mut())
+                .map(|(&i, data)| (page_ids[i], &mut data[..]))
+                .collect();
+            disk.read_pages(&mut pages)
+        };
+        let mut state = pool.state.lock().unwrap();
+        for key in &keys {
+            state.loading.remove(key);
+        }
+        drop(state);
+        pool.loaded.notify_all();
+        result?;
+        pool.read_latency.record_since(started);
+        let n = missing.len() as u64;
+        pool.counters.misses.fetch_add(n, Ordering::Relaxed);
+        pool.counters.ring_reads.fetch_add(n, Ordering::Relaxed);
+        for (i, slot) in missing.into_iter().zip(slots) {
+            guards[i] = Some(PageGuard {
+                pool: Arc::clone(&pool),
+                slot: Slot::Ring(slot),
+                page_id: page_ids[i],
+            });
+        }
+        Ok(guards.into_iter().flatten().collect())
+    }
+
+    /// The next ring frame no guard still refers to.
+    fn take_slot(&mut self) -> Option<Arc<RingSlot>> {
+        let n = self.slots.len();
+        let at = (0..n)
+            .map(|i| (self.next + i) % n)
+            .find(|&at| Arc::strong_count(&self.slots[at]) == 1)?;
+        self.next = (at + 1) % n;
+        Some(Arc::clone(&self.slots[at]))
+    }
+}
+
+#[derive(Debug)]
+enum Slot {
+    Frame(FrameId),
+    Ring(Arc<RingSlot>),
+}
+
+/// A pinned page. The frame stays resident until the guard is dropped.
+#[derive(Debug)]
+pub struct PageGuard {
+    pool: Arc<BufferPool>,
+    slot: Slot,
+    page_id: PageId,
+}
+
+impl PageGuard {
+    /// The id of the pinned page.
+    pub fn page_id(&self) -> PageId {
+        self.page_id
+    }
+
+    /// The frame's current version. It changes whenever the page may have
+    /// been written since, so equal versions mean equal contents. Always 0
+    /// for a page read into a scan ring.
+    pub fn version(&self) -> u64 {
+        match &self.slot {
+            Slot::Frame(frame_id) => self.pool.frames[*frame_id].version.load(Ordering::Acquire),
+            Slot::Ring(_) => 0,
+        }
+    }
+
+    /// Whether the page was read into a scan ring rather than a pool frame.
+    /// Such a copy does not see later writes to the page.
+    pub fn is_private(&self) -> bool {
+        matches!(self.slot, Slot::Ring(_))
+    }
+
+    /// Shared access to the page bytes.
+    pub fn read(&self) -> RwLockReadGuard<'_, PageBuf> {
+        match &self.slot {
+            Slot::Frame(frame_id) => self.pool.frames[*frame_id].data.read().unwrap(),
+            Slot::Ring(slot) => slot.data.read().unwrap(),
+        }
+    }
+
+    /// Exclusive access to the page bytes; marks the page dirty. Pages read
+    /// into a scan ring are read-only.
+    pub fn write(&self) -> RwLockWriteGuard<'_, PageBuf> {
+        let Slot::Frame(frame_id) = self.slot else {
+            panic!("page {} was read into a scan ring", self.page_id);
+        };
+        let frame = &self.pool.frames[frame_id];
+        let data = frame.data.write().unwrap();
+        frame.version.fetch_add(1, Ordering::Release);
+        self.pool.mark_dirty(frame_id);
+        data
+    }
+}
+
+impl Clone for PageGuard {
+    fn clone(&self) -> Self {
+        let slot = match &self.slot {
+            Slot::Frame(frame_id) => {
+                self.pool.pin(*frame_id);
+                Slot::Frame(*frame_id)
+            }
+            Slot::Ring(slot) => Slot::Ring(Arc::clone(slot)),
+        };
+        PageGuard {
+            pool: Arc::clone(&self.pool),
+            slot,
+            page_id: self.page_id,
+        }
+    }
+}
+
+impl Drop for PageGuard {
+    fn drop(&mut self) {
+        if let Slot::Frame(frame_id) = self.slot {
+            self.pool.unpin(frame_id);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+    use crate::test_util::TempDir;
+
+    fn pool(dir: &TempDir, frames: usize) -> Arc<BufferPool> {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        let budget = MemoryBudget::new(64 << 20);
+        BufferPool::new(disk, &budget, frames * PAGE_SIZE).unwrap()
+    }
+
+    /// Writes `count` new pages straight to disk, each starting with its
+    /// id, without reading them into the pool.
+    fn write_pages(pool: &BufferPool, count: usize) -> Vec<PageId> {
+        (0..count)
+            .map(|_| {
+                let page_id = pool.disk().allocate_page();
+                let mut page = PageBuf::zeroed();
+                page[..8].copy_from_slice(&page_id.to_le_bytes());
+                pool.disk().write_page(page_id, &page).unwrap();
+                page_id
+            })
+            .collect()
+    }
+
+    fn read_id(guard: &PageGuard) -> PageId {
+        PageId::from_le_bytes(guard.read()[..8].try_into().unwrap())
+    }
+
+    /// Fetches `pages` through the pool and returns how many missed.
+    fn misses(pool: &Arc<BufferPool>, pages: &[PageId]) -> u64 {
+        let before = pool.stats().misses;
+        for &page_id in pages {
+            assert_eq!(read_id(&pool.fetch_page(page_id).unwrap()), page_id);
+        }
+        pool.stats().misses - before
+    }
+
+    #[test]
+    fn pinned_and_dirty_pages_are_never_evicted() {
+        let dir = TempDir::new("pool-no-steal");
+        let pool = pool(&dir, 4);
+        let pages = write_pages(&pool, 20);
+        let pinned = pool.fetch_page(pages[0]).unwrap();
+        let dirty = {
+            let guard = pool.new_page().unwrap();
+            guard.write()[0] = 9;
+            guard.page_id()
+        };
+        // The two other frames serve everything else.
+        assert_eq!(misses(&pool, &pages[1..]), 19);
+        assert_eq!(pool.stats().evictions, 17);
+        assert_eq!(misses(&pool, &[pages[0]]), 0);
+        assert_eq!(pool.fetch_page(dirty).unwrap().read()[0], 9);
+        assert_eq!(read_id(&pinned), pages[0]);
+
+        // With the last clean frames pinned too, nothing can be evicted.
+        let more = [
+            pool.fetch_page(pages[1]).unwrap(),
+            pool.fetch_page(pages[2]).unwrap(),
+        ];
+        assert!(matches!(
+            pool.fetch_page(pages[3]),
+            Err(Error::BufferPoolExhausted)
+        ));
+        // Writing the dirty page back makes its frame evictable again.
+        pool.flush_page(dirty).unwrap();
+        assert_eq!(read_id(&pool.fetch_page(pages[3]).unwrap()), pages[3]);
+        drop((pinned, more));
+        assert_eq!(pool.fetch_page(dirty).unwrap().read()[0], 9);
+    }
+
+    #[test]
+    fn a_pool_resizes_within_its_budget() {
+        let dir = TempDir::new("pool-resize");
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        let budget = MemoryBudget::new(24 * PAGE_SIZE);
+        let pool =
+            BufferPool::with_max_capacity(disk, &budget, 16 * PAGE_SIZE, 32 * PAGE_SIZE).unwrap();
+        assert_eq!(budget.usage(Consumer::BufferPool), 16 * PAGE_SIZE);
+        let pages = write_pages(&pool, 16);
+        misses(&pool, &pages);
+        let dirty = {
+            let guard = pool.new_page().unwrap();
+            guard.write()[0] = 9;
+            guard.page_id()
+        };
+
+        // Shrinking evicts clean pages but keeps the dirty one.
+        assert_eq!(pool.resize(4), 4);
+        assert_eq!(budget.usage(Consumer::BufferPool), 4 * PAGE_SIZE);
+        assert_eq!(pool.fetch_page(dirty).unwrap().read()[0], 9);
+        assert!(misses(&pool, &pages) >= 12);
+
+        // Growing stops where the budget runs out.
+        assert_eq!(pool.resize(32), 24);
+        assert_eq!(budget.usage(Consumer::BufferPool), 24 * PAGE_SIZE);
+        misses(&pool, &pages);
+        assert_eq!(misses(&pool, &pages), 0);
+        assert_eq!(pool.fetch_page(dirty).unwrap().read()[0], 9);
+    }
+
+    #[test]
+    fn a_scan_through_a_ring_leaves_the_pool_alone() {
+        let dir = TempDir::new("pool-scan-ring");
+        let pool = pool(&dir, 64);
+        let hot = write_pages(&pool, 16);
+        let scanned = write_pages(&pool, 200);
+        assert_eq!(misses(&pool, &hot), 16);
+
+        let mut ring = pool.scan_ring().unwrap();
+        for &page_id in scanned.iter().chain(&hot) {
+            assert_eq!(read_id(&ring.fetch_page(page_id).unwrap()), page_id);
+        }
+        drop(ring);
+        // Only the pages that were not resident went through the ring, and
+        // none of them displaced a resident page.
+        assert_eq!(pool.stats().ring_reads, 200);
+        assert_eq!(pool.stats().evictions, 0);
+        assert_eq!(misses(&pool, &hot), 0);
+    }
+
+    #[test]
+    fn a_page_read_again_soon_after_eviction_is_protected() {
+        let dir = TempDir::new("pool-ghost");
+        let pool = pool(&dir, 64);
+        let pages = write_pages(&pool, 300);
+        let (page, rest) = pages.split_first().unwrap();
+        // Once the pool is full the oldest probationary page goes first,
+        // and is remembered in the ghost list.
+        misses(&pool, &[*page]);
+        misses(&pool, &rest[..70]);
+        assert!(pool.stats().evictions > 0);
+        assert_eq!(pool.stats().promotions, 0);
+        assert_eq!(misses(&pool, &[*page]), 1);
+        assert_eq!(pool.stats().promotions, 1);
+
+        // Protected, it outlives a scan of several times the pool.
+        assert_eq!(misses(&pool, &rest[70..]), 229);
+        assert_eq!(misses(&pool, &[*page]), 0);
+    }
+
+    #[test]
+    fn a_page_dirtied_while_its_eviction_waits_is_kept() {
+        let dir = TempDir::new("pool-evict-race");
+        let pool = pool(&dir, 1);
+        let page_id = pool.new_page().unwrap().page_id();
+        pool.flush_page(page_id).unwrap();
+        let other = pool.disk().allocate_page();
+        thread::scope(|s| {
+            // Holding the page table keeps an evictor waiting between its
+            // first look at the clean frame and the page's removal.
+            let table = pool.page_table.read().unwrap();
+            let evictor = s.spawn(|| pool.fetch_page(other).map(|page| page.page_id()));
+            thread::sleep(std::time::Duration::from_millis(50));
+            // Meanwhile a hit pins the page, modifies it and unpins it.
+            let frame_id = table[&(MAIN_FILE, page_id)];
+            pool.pin(frame_id);
+            pool.guard(frame_id, (MAIN_FILE, page_id)).write()[0] = 7;
+            drop(table);
+            assert!(matches!(
+                evictor.join().unwrap(),
+                Err(Error::BufferPoolExhausted)
+            ));
+        });
+        assert_eq!(pool.fetch_page(page_id).unwrap().read()[0], 7);
+        assert_eq!(pool.dirty_pages(), 1);
+    }
+}
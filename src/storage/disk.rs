@@ -0,0 +1,368 @@
+//! Page-granular access to a single data file.
+//!
+//! A file can be opened for direct I/O, so its pages are cached once, in
+//! the buffer pool, rather than a second time in the kernel's page cache.
+//! Direct transfers need page-aligned buffers; pool frames are, and other
+//! buffers are copied through an aligned one.
+//!
+//! Pages can also be read in the background, for read-ahead. Such a read
+//! may overlap a write-back of the same page, so every page write is
+//! counted when it starts and when it finishes, and a reader can tell
+//! afterwards whether its copy may be stale. The counts are kept per
+//! stripe of page ranges, so a write only casts doubt on reads of pages
+//! near it.
+
+use std::fs::{File, OpenOptions};
+use std::io::ErrorKind;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use crate::aio::{self, Pending, Request};
+use crate::error::{Error, Result};
+use crate::storage::page::{is_page_aligned, PageBuf, PageId, PAGE_SIZE};
+use crate::sys;
+
+/// Pages in each range of consecutive pages sharing a write count.
+const STRIPE_PAGES: u64 = 64;
+/// Write counts kept per file; ranges this many apart share one.
+const WRITE_STRIPES: usize = 64;
+
+/// Page writes to one stripe of page ranges.
+#[derive(Debug, Default)]
+struct WriteCount {
+    /// Page writes begun so far.
+    started: AtomicU64,
+    /// Page writes finished so far, successfully or not.
+    finished: AtomicU64,
+}
+
+/// Reads and writes fixed-size pages at `page_id * PAGE_SIZE` offsets.
+#[derive(Debug)]
+pub struct DiskManager {
+    file: Arc<File>,
+    num_pages: AtomicU64,
+    /// Whether the file bypasses the page cache.
+    direct: bool,
+    writes: [WriteCount; WRITE_STRIPES],
+}
+
+impl DiskManager {
+    /// Opens (or creates) the data file at `path`.
+    pub fn open(path: impl AsRef<Path>) -> Result<Self> {
+        Self::open_with(path.as_ref(), false)
+    }
+
+    /// Opens (or creates) the data file at `path` for direct I/O. Pages of
+    /// the file left in the page cache by earlier buffered access, such as
+    /// the writer of a new sorted run, are dropped. Falls back to buffered
+    /// I/O where the platform or file system does not support it;
+    /// [`DiskManager::is_direct`] tells which was used.
+    pub fn open_direct(path: impl AsRef<Path>) -> Result<Self> {
+        match Self::open_with(path.as_ref(), true) {
+            Err(Error::Io(err)) if err.kind() == ErrorKind::InvalidInput => {
+                Self::open_with(path.as_ref(), false)
+            }
+            result => result,
+        }
+    }
+
+    fn open_with(path: &Path, direct: bool) -> Result<Self> {
+        let mut options = OpenOptions::new();
+        options.read(true).write(true).create(true).truncate(false);
+        let direct = direct && sys::set_direct(&mut options);
+        let file = options.open(path)?;
+        let len = file.metadata()?.len();
+        if direct {
+            sys::discard_cached(&file, 0, len);
+        }
+        Ok(DiskManager {
+            file: Arc::new(file),
+            num_pages: AtomicU64::new(len / PAGE_SIZE as u64),
+            direct,
+            writes: std::array::from_fn(|_| WriteCount::default()),
+        })
+    }
+
+    /// Whether reads and writes bypass the kernel page cache.
+    pub fn is_direct(&self) -> bool {
+        self.direct
+    }
+
+    /// The write counts of the stripe holding `page_id`.
+    fn writes(&self, page_id: PageId) -> &WriteCount {
+        &self.writes[(page_id / STRIPE_PAGES) as usize % WRITE_STRIPES]
+    }
+
+    /// Whether `buf` must be copied through an aligned buffer.
+    fn needs_bounce(&self, buf: &[u8]) -> bool {
+        self.direct && !is_page_aligned(buf)
+    }
+
+    /// Number of pages currently allocated in the file.
+    pub fn num_pages(&self) -> u64 {
+        self.num_pages.load(Ordering::Acquire)
+    }
+
+    /// Reserves a new page id at the end of the file. The page is
+    /// materialised on disk the first time it is written.
+    pub fn allocate_page(&self) -> PageId {
+        self.num_pages.fetch_add(1, Ordering::AcqRel)
+    }
+
+    /// Reads page `page_id` into `buf`. Pages allocated but never written
+    /// read back as zeroes.
+    pub fn read_page(&self, page_id: PageId, buf: &mut [u8]) -> Result<()> {
+        debug_assert_eq!(buf.len(), PAGE_SIZE);
+        if page_id >= self.num_pages() {
+            return Err(Error::InvalidArgument(format!(
+                "page {page_id} is beyond the end of the file"
+            )));
+        }
+        if self.needs_bounce(buf) {
+            let mut bounce = PageBuf::zeroed();
+            self.read_page(page_id, &mut bounce)?;
+            buf.copy_from_slice(&bounce);
+            return Ok(());
+        }
+        let offset = page_id * PAGE_SIZE as u64;
+        let mut read = 0;
+        while read < buf.len() {
+            match self.file.read_at(&mut buf[read..], offset + read as u64)? {
+                0 => break,
+                n => read += n,
+            }
+        }
+        buf[read..].fill(0);
+        Ok(())
+    }
+
+    /// Writes `buf` as the contents of page `page_id`.
+    pub fn write_page(&self, page_id: PageId, buf: &[u8]) -> Result<()> {
+        debug_assert_eq!(buf.len(), PAGE_SIZE);
+        if self.needs_bounce(buf) {
+            let mut bounce = PageBuf::zeroed();
+            bounce.copy_from_slice(buf);
+            return self.write_page(page_id, &bounce);
+        }
+        let writes = self.writes(page_id);
+        writes.started.fetch_add(1, Ordering::SeqCst);
+        let result = self.file.write_all_at(buf, page_id * PAGE_SIZE as u64);
+        writes.finished.fetch_add(1, Ordering::SeqCst);
+        result?;
+        self.num_pages.fetch_max(page_id + 1, Ordering::AcqRel);
+        Ok(())
+    }
+
+    /// Reads several pages at once, keeping the reads in flight together.
+    /// Each entry is a page id and the buffer to read it into.
+    pub fn read_pages(&self, pages: &mut [(PageId, &mut [u8])]) -> Result<()> {
+        if let Some((page_id, _)) = pages.iter().find(|(id, _)| *id >= self.num_pages()) {
+            return Err(Error::InvalidArgument(format!(
+                "page {page_id} is beyond the end of the file"
+            )));
+        }
+        if pages.iter().any(|(_, buf)| self.needs_bounce(buf)) {
+            let mut bounce: Vec<PageBuf> = pages.iter().map(|_| PageBuf::zeroed()).collect();
+            let mut aligned: Vec<(PageId, &mut [u8])> = pages
+                .iter()
+                .zip(bounce.iter_mut())
+                .map(|((page_id, _), buf)| (*page_id, &mut buf[..]))
+                .collect();
+            self.read_pages(&mut aligned)?;
+            for ((_, buf), read) in pages.iter_mut().zip(&bounce) {
+                buf.copy_from_slice(read);
+            }
+            return Ok(());
+        }
+        let requests = pages
+            .iter_mut()
+            .map(|(page_id, buf)| {
+                debug_assert_eq!(buf.len(), PAGE_SIZE);
+                Request::Read {
+                    file: &self.file,
+                    offset: *page_id * PAGE_SIZE as u64,
+                    buf,
+                }
+            })
+            .collect();
+        let results = aio::shared().run(requests);
+        for ((_, buf), result) in pages.iter_mut().zip(results) {
+            buf[result?..].fill(0);
+        }
+        Ok(())
+    }
+
+    /// Writes several pages at once, keeping the writes in flight together.
+    pub fn write_pages(&self, pages: &[(PageId, &[u8])]) -> Result<()> {
+        if pages.iter().any(|(_, buf)| self.needs_bounce(buf)) {
+            let bounce: Vec<PageBuf> = pages
+                .iter()
+                .map(|(_, buf)| {
+                    let mut copy = PageBuf::zeroed();
+                    copy.copy_from_slice(buf);
+                    copy
+                })
+                .collect();
+            let aligned: Vec<(PageId, &[u8])> = pages
+                .iter()
+                .zip(&bounce)
+                .map(|((page_id, _), buf)| (*page_id, &buf[..]))
+                .collect();
+            return self.write_pages(&aligned);
+        }
+        let requests = pages
+            .iter()
+            .map(|&(page_id, buf)| {
+                debug_assert_eq!(buf.len(), PAGE_SIZE);
+                Request::Write {
+                    file: &self.file,
+                    offset: page_id * PAGE_SIZE as u64,
+                    buf,
+                }
+            })
+            .collect();
+        for &(page_id, _) in pages {
+            self.writes(page_id).started.fetch_add(1, Ordering::SeqCst);
+        }
+        let results = aio::shared().run(requests);
+        for &(page_id, _) in pages {
+            self.writes(page_id).finished.fetch_add(1, Ordering::SeqCst);
+        }
+        for result in results {
+            result?;
+        }
+        if let Some(last) = pages.iter().map(|&(page_id, _)| page_id).max() {
+            self.num_pages.fetch_max(last + 1, Ordering::AcqRel);
+        }
+        Ok(())
+    }
+
+    /// Starts reading each of `pages`, a page id and the buffer to read it
+    /// into, in the background. Parts past the end of the file are left
+    /// unread, as the returned byte counts show.
+    pub fn read_pages_ahead(
+        &self,
+        pages: Vec<(PageId, PageBuf)>,
+    ) -> Vec<Pending<'static, PageBuf>> {
+        let reads = pages
+            .into_iter()
+            .map(|(page_id, buf)| (page_id * PAGE_SIZE as u64, buf))
+            .collect();
+        aio::shared().read_batch(&self.file, reads)
+    }
+
+    /// A stamp to take before starting a background read of `page_id`,
+    /// for [`DiskManager::unchanged_since`].
+    pub fn write_stamp(&self, page_id: PageId) -> u64 {
+        self.writes(page_id).finished.load(Ordering::SeqCst)
+    }
+
+    /// Whether no write to a page sharing `page_id`'s stripe has started
+    /// since the write stamp `stamp` was taken, nor was still running then:
+    /// a copy of the page read after taking the stamp matches the file.
+    pub fn unchanged_since(&self, page_id: PageId, stamp: u64) -> bool {
+        self.writes(page_id).started.load(Ordering::SeqCst) == stamp
+    }
+
+    /// Flushes written pages to stable storage.
+    pub fn sync(&self) -> Result<()> {
+        self.file.sync_data()?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_util::TempDir;
+
+    /// A page-sized buffer that is deliberately not page-aligned.
+    fn unaligned(backing: &mut [u8]) -> &mut [u8] {
+        let at = (1..PAGE_SIZE)
+            .find(|&at| !is_page_aligned(&backing[at..at + PAGE_SIZE]))
+            .unwrap();
+        &mut backing[at..at + PAGE_SIZE]
+    }
+
+    fn page(fill: u8) -> PageBuf {
+        let mut page = PageBuf::zeroed();
+        page.fill(fill);
+        page
+    }
+
+    #[test]
+    fn direct_io_accepts_unaligned_buffers() {
+        let dir = TempDir::new("disk-direct");
+        let path = dir.path().join("data.db");
+        let disk = DiskManager::open_direct(&path).unwrap();
+        // Where the file system refuses O_DIRECT this only tests buffered
+        // I/O; ext4, xfs and tmpfs take it.
+
+        let mut backing = vec![0u8; 2 * PAGE_SIZE];
+        let buf = unaligned(&mut backing);
+        buf.fill(1);
+        disk.write_page(0, buf).unwrap();
+        disk.write_page(1, &page(2)).unwrap();
+        let mut second = vec![0u8; 2 * PAGE_SIZE];
+        let other = unaligned(&mut second);
+        other.fill(4);
+        disk.write_pages(&[(2, &page(3)), (3, other)]).unwrap();
+        disk.allocate_page();
+        disk.sync().unwrap();
+        assert_eq!(disk.num_pages(), 5);
+
+        let mut backing = vec![0xffu8; 2 * PAGE_SIZE];
+        let buf = unaligned(&mut backing);
+        disk.read_page(1, buf).unwrap();
+        assert!(buf.iter().all(|&b| b == 2));
+        let mut aligned = PageBuf::zeroed();
+        disk.read_page(0, &mut aligned).unwrap();
+        assert!(aligned.iter().all(|&b| b == 1));
+
+        let mut frames: Vec<PageBuf> = (0..4).map(|_| page(0xff)).collect();
+        let mut pages: Vec<(PageId, &mut [u8])> = frames
+            .iter_mut()
+            .enumerate()
+            .map(|(i, frame)| (i as PageId + 1, &mut frame[..]))
+            .collect();
+        pages[1].1 = buf;
+        disk.read_pages(&mut pages).unwrap();
+        for ((page_id, buf), fill) in pages.iter().zip([2, 3, 4, 0]) {
+            assert!(buf.iter().all(|&b| b == fill), "page {page_id}");
+        }
+        let err = disk.read_page(5, &mut aligned).unwrap_err();
+        assert!(matches!(err, Error::InvalidArgument(_)), "{err:?}");
+
+        // The same bytes are seen through the page cache.
+        drop(disk);
+        let contents = std::fs::read(&path).unwrap();
+        assert_eq!(contents.len(), 4 * PAGE_SIZE);
+        for (page_id, fill) in [1u8, 2, 3, 4].into_iter().enumerate() {
+            let page = &contents[page_id * PAGE_SIZE..(page_id + 1) * PAGE_SIZE];
+            assert!(page.iter().all(|&b| b == fill), "page {page_id}");
+        }
+    }
+
+    #[test]
+    fn background_reads_fill_aligned_frames() {
+        let dir = TempDir::new("disk-ahead");
+        let disk = DiskManager::open_direct(dir.path().join("data.db")).unwrap();
+        for page_id in 0..3 {
+            disk.write_page(page_id, &page(page_id as u8 + 1)).unwrap();
+        }
+        let reads = (0..4).map(|page_id| (page_id, PageBuf::zeroed())).collect();
+        let done: Vec<(PageBuf, usize)> = disk
+            .read_pages_ahead(reads)
+            .into_iter()
+            .map(|pending| pending.wait().unwrap())
+            .collect();
+        for (page_id, (buf, read)) in done.iter().enumerate().take(3) {
+            assert_eq!(*read, PAGE_SIZE);
+            assert!(buf.iter().all(|&b| b == page_id as u8 + 1));
+        }
+        // Past the end of the file nothing is read.
+        assert_eq!(done[3].1, 0);
+    }
+}
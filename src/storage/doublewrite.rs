@@ -0,0 +1,213 @@
+//! Atomic multi-page writes through a double-write file.
+//!
+//! A checkpoint first writes every page it is about to overwrite, together
+//! with the checkpoint LSN, into a side file and syncs it; only then are the
+//! pages written in place. If the process dies while the data file is being
+//! updated, the complete copy in the side file is re-applied on the next
+//! open, so the data file always reflects exactly one checkpoint.
+//!
+//! ```text
+//! [magic 8][lsn u64][count u64] { [page_id u64][page PAGE_SIZE] } x count [crc32 u32]
+//! ```
+
+use std::fs::{File, OpenOptions};
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::Path;
+use std::sync::Arc;
+
+use crate::checksum::crc32_extend;
+use crate::error::Result;
+use crate::storage::{BufferPool, DiskManager, PageId, PAGE_SIZE};
+use crate::sys;
+
+const MAGIC: &[u8; 8] = b"DIGDBLWR";
+const HEADER_SIZE: usize = 24;
+const SLOT_SIZE: usize = 8 + PAGE_SIZE;
+
+/// Copies `pages` from the pool into the double-write file at `path`,
+/// tagged with `lsn`, and syncs it. The pages must be resident.
+pub fn write(path: &Path, lsn: u64, pool: &Arc<BufferPool>, pages: &[PageId]) -> Result<()> {
+    let file = OpenOptions::new()
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(path)?;
+    let mut out = BufWriter::with_capacity(4 * SLOT_SIZE, file);
+    let mut header = [0u8; HEADER_SIZE];
+    header[..8].copy_from_slice(MAGIC);
+    header[8..16].copy_from_slice(&lsn.to_le_bytes());
+    header[16..].copy_from_slice(&(pages.len() as u64).to_le_bytes());
+    let mut crc = crc32_extend(0, &header);
+    out.write_all(&header)?;
+    for &page_id in pages {
+        let guard = pool.fetch_page(page_id)?;
+        let data = guard.read();
+        let id = page_id.to_le_bytes();
+        crc = crc32_extend(crc32_extend(crc, &id), &data);
+        out.write_all(&id)?;
+        out.write_all(&data)?;
+    }
+    out.write_all(&crc.to_le_bytes())?;
+    out.flush()?;
+    out.get_ref().sync_data()?;
+    if pool.direct_io() {
+        // Read back only after a crash; keep it out of the page cache like
+        // the data file.
+        sys::discard_cached(out.get_ref(), 0, 0);
+    }
+    Ok(())
+}
+
+/// Re-applies a complete double-write file at `path` to `disk`, returning
+/// the LSN of the checkpoint it belongs to. A missing, empty or torn file
+/// is ignored: its checkpoint never started overwriting the data file.
+pub fn restore(path: &Path, disk: &DiskManager) -> Result<Option<u64>> {
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(err) if err.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+        Err(err) => return Err(err.into()),
+    };
+    let len = file.metadata()?.len() as usize;
+    if len < HEADER_SIZE + 4 {
+        return Ok(None);
+    }
+    let mut header = [0u8; HEADER_SIZE];
+    let mut reader = BufReader::with_capacity(4 * SLOT_SIZE, file);
+    reader.read_exact(&mut header)?;
+    let lsn = u64::from_le_bytes(header[8..16].try_into().unwrap());
+    let count = u64::from_le_bytes(header[16..].try_into().unwrap()) as usize;
+    if &header[..8] != MAGIC || len != HEADER_SIZE + count * SLOT_SIZE + 4 {
+        return Ok(None);
+    }
+
+    // First pass: verify the checksum without holding more than one slot.
+    let mut crc = crc32_extend(0, &header);
+    let mut slot = vec![0u8; SLOT_SIZE];
+    for _ in 0..count {
+        reader.read_exact(&mut slot)?;
+        crc = crc32_extend(crc, &slot);
+    }
+    let mut stored = [0u8; 4];
+    reader.read_exact(&mut stored)?;
+    if u32::from_le_bytes(stored) != crc {
+        return Ok(None);
+    }
+
+    // Second pass: write the pages in place.
+    let mut reader = BufReader::with_capacity(4 * SLOT_SIZE, File::open(path)?);
+    reader.read_exact(&mut header)?;
+    for _ in 0..count {
+        reader.read_exact(&mut slot)?;
+        let page_id = u64::from_le_bytes(slot[..8].try_into().unwrap());
+        disk.write_page(page_id, &slot[8..])?;
+    }
+    disk.sync()?;
+    if disk.is_direct() {
+        sys::discard_cached(reader.get_ref(), 0, 0);
+    }
+    Ok(Some(lsn))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::OpenOptions;
+    use std::os::unix::fs::FileExt;
+
+    use super::*;
+    use crate::memory::MemoryBudget;
+    use crate::test_util::TempDir;
+
+    const PAGES: u64 = 8;
+
+    fn page(page_id: PageId, round: u8) -> Vec<u8> {
+        let mut data = vec![round; PAGE_SIZE];
+        data[..8].copy_from_slice(&page_id.to_le_bytes());
+        data
+    }
+
+    fn read(disk: &DiskManager, page_id: PageId) -> Vec<u8> {
+        let mut data = vec![0; PAGE_SIZE];
+        disk.read_page(page_id, &mut data).unwrap();
+        data
+    }
+
+    /// Writes round 1 of every page to the data file, then makes round 2
+    /// dirty in the pool and copies it to the double-write file.
+    fn prepare(dir: &TempDir) -> (Arc<BufferPool>, Vec<PageId>) {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        let budget = MemoryBudget::new(1 << 20);
+        let pool = BufferPool::new(disk, &budget, 64 * PAGE_SIZE).unwrap();
+        let pages: Vec<PageId> = (0..PAGES)
+            .map(|_| {
+                let guard = pool.new_page().unwrap();
+                guard.write().copy_from_slice(&page(guard.page_id(), 1));
+                guard.page_id()
+            })
+            .collect();
+        pool.flush_all().unwrap();
+        for &page_id in &pages {
+            let guard = pool.fetch_page(page_id).unwrap();
+            guard.write().copy_from_slice(&page(page_id, 2));
+        }
+        write(&dir.path().join("doublewrite"), 42, &pool, &pages).unwrap();
+        (pool, pages)
+    }
+
+    #[test]
+    fn restore_repairs_a_torn_checkpoint() {
+        let dir = TempDir::new("doublewrite-repair");
+        let (pool, pages) = prepare(&dir);
+        // The checkpoint died part way: one page written, one torn, the
+        // rest still old.
+        pool.flush_pages(&pages[..1]).unwrap();
+        let torn = page(pages[1], 2);
+        pool.disk()
+            .write_page(
+                pages[1],
+                &[&torn[..PAGE_SIZE / 2], &page(pages[1], 1)[PAGE_SIZE / 2..]].concat(),
+            )
+            .unwrap();
+        drop(pool);
+
+        let disk = DiskManager::open(dir.path().join("data.db")).unwrap();
+        let lsn = restore(&dir.path().join("doublewrite"), &disk).unwrap();
+        assert_eq!(lsn, Some(42));
+        for &page_id in &pages {
+            assert_eq!(read(&disk, page_id), page(page_id, 2), "page {page_id}");
+        }
+    }
+
+    #[test]
+    fn restore_ignores_a_torn_double_write_file() {
+        let dir = TempDir::new("doublewrite-torn");
+        let (pool, pages) = prepare(&dir);
+        drop(pool);
+        let path = dir.path().join("doublewrite");
+        let file = OpenOptions::new().write(true).open(&path).unwrap();
+        let len = file.metadata().unwrap().len();
+        file.set_len(len - 100).unwrap();
+
+        let disk = DiskManager::open(dir.path().join("data.db")).unwrap();
+        assert_eq!(restore(&path, &disk).unwrap(), None);
+        for &page_id in &pages {
+            assert_eq!(read(&disk, page_id), page(page_id, 1), "page {page_id}");
+        }
+    }
+
+    #[test]
+    fn restore_ignores_a_corrupt_double_write_file() {
+        let dir = TempDir::new("doublewrite-corrupt");
+        let (pool, pages) = prepare(&dir);
+        drop(pool);
+        let path = dir.path().join("doublewrite");
+        let file = OpenOptions::new().write(true).open(&path).unwrap();
+        file.write_at(b"X", (HEADER_SIZE + SLOT_SIZE + 100) as u64)
+            .unwrap();
+
+        let disk = DiskManager::open(dir.path().join("data.db")).unwrap();
+        assert_eq!(restore(&path, &disk).unwrap(), None);
+        for &page_id in &pages {
+            assert_eq!(read(&disk, page_id), page(page_id, 1), "page {page_id}");
+        }
+    }
+}
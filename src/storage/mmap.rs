@@ -0,0 +1,88 @@
+//! Read-only memory mappings of page files.
+//!
+//! A mapped file is read straight out of the operating system's page
+//! cache: there is no copy into a buffer-pool frame and residency is left
+//! entirely to the kernel, which keeps hot pages and drops cold ones under
+//! its own memory pressure. The mapping is shared, so pages another process
+//! writes to the file become visible in place. Files mapped here must only
+//! ever grow; truncating a mapped file faults readers of the lost range.
+
+use std::fs::File;
+use std::path::Path;
+
+use crate::error::{Error, Result};
+use crate::storage::{PageId, PAGE_SIZE};
+use crate::sys;
+
+/// A file mapped read-only in its length at the time it was opened.
+#[derive(Debug)]
+pub struct MappedFile {
+    ptr: *const u8,
+    len: usize,
+    _file: File,
+}
+
+// SAFETY: the mapping is read-only and owned by the value; it is released
+// only in `drop`, after every borrow of `bytes` has ended.
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl MappedFile {
+    /// Maps the whole of the file at `path`.
+    pub fn open(path: impl AsRef<Path>) -> Result<Self> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        let ptr = if len == 0 {
+            std::ptr::NonNull::dangling().as_ptr()
+        } else {
+            sys::map_readonly(&file, len)?
+        };
+        Ok(MappedFile {
+            ptr,
+            len,
+            _file: file,
+        })
+    }
+
+    /// Mapped length in bytes.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Whether the file was empty when mapped.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Number of whole pages mapped.
+    pub fn num_pages(&self) -> u64 {
+        (self.len / PAGE_SIZE) as u64
+    }
+
+    /// The mapped bytes.
+    pub fn bytes(&self) -> &[u8] {
+        // SAFETY: `ptr` is valid for `len` bytes until the mapping is
+        // dropped, and the file never shrinks.
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    /// The bytes of page `page_id`.
+    pub fn page(&self, page_id: PageId) -> Result<&[u8]> {
+        if page_id >= self.num_pages() {
+            return Err(Error::InvalidArgument(format!(
+                "page {page_id} is beyond the end of the mapping"
+            )));
+        }
+        let at = page_id as usize * PAGE_SIZE;
+        Ok(&self.bytes()[at..at + PAGE_SIZE])
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        if self.len > 0 {
+            // SAFETY: `&mut self` guarantees no slice of the mapping is alive.
+            unsafe { sys::unmap(self.ptr, self.len) };
+        }
+    }
+}
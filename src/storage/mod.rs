@@ -0,0 +1,16 @@
+//! On-disk page storage and the bounded buffer pool that caches it.
+
+pub mod buffer_pool;
+pub mod disk;
+pub mod doublewrite;
+pub mod mmap;
+pub mod page;
+pub mod read_ahead;
+
+pub use buffer_pool::{
+    BufferPool, BufferPoolStats, FileId, PageGuard, ScanRing, MAIN_FILE, SCAN_RING_PAGES,
+};
+pub use disk::DiskManager;
+pub use mmap::MappedFile;
+pub use page::{PageBuf, PageId, INVALID_PAGE_ID, PAGE_SIZE};
+pub use read_ahead::PageScan;
@@ -0,0 +1,127 @@
+//! Page identifiers, sizing and page-aligned buffers.
+
+use std::alloc::{self, Layout};
+use std::fmt;
+use std::ops::{Deref, DerefMut};
+use std::ptr::NonNull;
+
+use crate::aio::IoBuf;
+
+/// Size of every on-disk page and buffer-pool frame.
+pub const PAGE_SIZE: usize = 4096;
+
+/// Index of a page within a data file.
+pub type PageId = u64;
+
+/// Sentinel for "no page", used in on-disk links.
+pub const INVALID_PAGE_ID: PageId = u64::MAX;
+
+/// Whether `buf` starts on a page boundary and covers whole pages, as
+/// direct I/O requires.
+pub fn is_page_aligned(buf: &[u8]) -> bool {
+    (buf.as_ptr() as usize).is_multiple_of(PAGE_SIZE) && buf.len().is_multiple_of(PAGE_SIZE)
+}
+
+/// A zeroed, page-aligned buffer of one page, or an empty one holding no
+/// memory. Frames are allocated this way so direct I/O can read into them
+/// without an intermediate copy.
+pub struct PageBuf {
+    /// `None` for an empty buffer.
+    ptr: Option<NonNull<u8>>,
+}
+
+// SAFETY: the buffer owns its allocation exclusively, like a `Box<[u8]>`.
+unsafe impl Send for PageBuf {}
+// SAFETY: shared access only hands out `&[u8]`.
+unsafe impl Sync for PageBuf {}
+
+impl PageBuf {
+    const LAYOUT: Layout = match Layout::from_size_align(PAGE_SIZE, PAGE_SIZE) {
+        Ok(layout) => layout,
+        Err(_) => panic!("invalid page layout"),
+    };
+
+    /// A zero-filled page.
+    pub fn zeroed() -> Self {
+        // SAFETY: the layout has a non-zero size.
+        let ptr = unsafe { alloc::alloc_zeroed(Self::LAYOUT) };
+        match NonNull::new(ptr) {
+            Some(ptr) => PageBuf { ptr: Some(ptr) },
+            None => alloc::handle_alloc_error(Self::LAYOUT),
+        }
+    }
+
+    /// A buffer of no bytes.
+    pub fn empty() -> Self {
+        PageBuf { ptr: None }
+    }
+}
+
+impl Default for PageBuf {
+    fn default() -> Self {
+        PageBuf::empty()
+    }
+}
+
+impl Deref for PageBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self.ptr {
+            // SAFETY: the allocation is PAGE_SIZE initialised bytes owned
+            // by `self`.
+            Some(ptr) => unsafe { std::slice::from_raw_parts(ptr.as_ptr(), PAGE_SIZE) },
+            None => &[],
+        }
+    }
+}
+
+impl DerefMut for PageBuf {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        match self.ptr {
+            // SAFETY: as above, and `&mut self` makes the access exclusive.
+            Some(ptr) => unsafe { std::slice::from_raw_parts_mut(ptr.as_ptr(), PAGE_SIZE) },
+            None => &mut [],
+        }
+    }
+}
+
+impl Drop for PageBuf {
+    fn drop(&mut self) {
+        if let Some(ptr) = self.ptr {
+            // SAFETY: allocated in `zeroed` with the same layout.
+            unsafe { alloc::dealloc(ptr.as_ptr(), Self::LAYOUT) };
+        }
+    }
+}
+
+// SAFETY: the page lives in its own allocation, which moving the buffer
+// leaves in place.
+unsafe impl IoBuf for PageBuf {}
+
+impl fmt::Debug for PageBuf {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("PageBuf").field("len", &self.len()).finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn a_page_buffer_is_aligned_and_zeroed() {
+        let mut page = PageBuf::zeroed();
+        assert!(is_page_aligned(&page));
+        assert!(page.iter().all(|&b| b == 0));
+        page[PAGE_SIZE - 1] = 7;
+        // Moving the buffer leaves its bytes where they were.
+        let at = page.as_ptr();
+        let moved = page;
+        assert_eq!((moved.as_ptr(), moved[PAGE_SIZE - 1]), (at, 7));
+
+        assert!(!is_page_aligned(&moved[1..]));
+        assert!(!is_page_aligned(&moved[..PAGE_SIZE / 2]));
+        assert!(PageBuf::empty().is_empty());
+    }
+}
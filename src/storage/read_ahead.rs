@@ -0,0 +1,476 @@
+//! Sequential read-ahead for range scans.
+//!
+//! A [`PageScan`] reads the pages of one range scan, such as the leaves of
+//! a B+tree or the blocks of a sorted run. Once the scan has moved forward
+//! through its file a few times in a row, the pages after the one it is on
+//! are read in the background, so with a small pool the scan waits on the
+//! device's bandwidth rather than on one read latency after another. Pages
+//! are not read ahead for other access patterns, which would waste them.
+//!
+//! The read-ahead window is the number of pages kept read or in flight
+//! ahead of the scan. By Little's law, the scan stops waiting once the
+//! window covers the pages it consumes during one read's latency, so the
+//! window aims at twice that, from moving averages of the time the scan
+//! spends on each page and of the latency of reads it caught up with. It
+//! grows by the pages the scan steps over, so a short scan reads little it
+//! does not use, and is capped by a share of the memory budget left free,
+//! which its buffers are charged to.
+//!
+//! A read-ahead copy is only handed out if the page is not resident and no
+//! write to a page in its range overlapped or followed its read, as the
+//! file's per-range write counts tell; otherwise the resident page is used
+//! or the page is read again, so read-ahead never returns stale contents. Like scans without read-ahead, a scan reads
+//! through the pool until it has read the pool's scan-ring threshold of
+//! pages, and through a [`ScanRing`] after that. Read-ahead copies are
+//! installed in pool frames in the first phase and handed out as private
+//! pages in the second.
+
+use std::collections::VecDeque;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use crate::aio::Pending;
+use crate::error::Result;
+use crate::memory::{Consumer, Reservation};
+use crate::storage::buffer_pool::RingSlot;
+use crate::storage::disk::DiskManager;
+use crate::storage::page::{PageBuf, PageId, PAGE_SIZE};
+use crate::storage::{BufferPool, FileId, PageGuard, ScanRing};
+
+/// Forward steps in a row after which a scan counts as sequential.
+const SEQUENTIAL_STEPS: u32 = 2;
+/// Largest jump, in pages, that still counts as a forward step. B+tree
+/// leaves written in key order are interleaved with inner nodes.
+const MAX_STEP: u64 = 4;
+/// Smallest read-ahead window, in pages.
+const MIN_WINDOW: usize = 4;
+/// Largest read-ahead window, in pages.
+const MAX_WINDOW: usize = 256;
+/// A scan reads ahead into at most this fraction of the free budget.
+const FREE_BUDGET_DIVISOR: usize = 8;
+/// Assumed read latency before any read has been timed.
+const DEFAULT_LATENCY: Duration = Duration::from_micros(100);
+/// A wait for a read-ahead page longer than this means it was still in
+/// flight.
+const STALL: Duration = Duration::from_micros(20);
+/// New samples move the moving averages by this fraction of the gap.
+const SMOOTHING: u64 = 4;
+
+/// A page being read ahead.
+#[derive(Debug)]
+struct Ahead {
+    page_id: PageId,
+    read: Pending<'static, PageBuf>,
+    started: Instant,
+    /// The page's write stamp when the read started.
+    stamp: u64,
+}
+
+/// Reads the pages of one range scan, switching to a [`ScanRing`] once the
+/// scan is long and reading ahead while it is sequential.
+///
+/// Created by [`BufferPool::page_scan`]; its read-ahead buffers are charged
+/// to the memory budget until it is dropped.
+#[derive(Debug)]
+pub struct PageScan {
+    pool: Arc<BufferPool>,
+    file_id: FileId,
+    /// Pages at and past this one are never read ahead.
+    end: PageId,
+    /// Looked up when the scan first reads ahead.
+    disk: Option<Arc<DiskManager>>,
+    /// Pages fetched so far.
+    pages: usize,
+    ring: Option<ScanRing>,
+    /// The last page fetched.
+    last: Option<PageId>,
+    last_at: Instant,
+    /// Forward steps in a row.
+    steps: u32,
+    /// Target number of pages to keep ahead of the scan.
+    window: usize,
+    /// Pages being read ahead, in page order.
+    ahead: VecDeque<Ahead>,
+    /// The page after the last one read ahead or found resident.
+    next: PageId,
+    /// Buffers free for reads.
+    spare: Vec<PageBuf>,
+    /// Buffers handed out as private pages, free again once no guard refers
+    /// to them.
+    lent: Vec<Arc<RingSlot>>,
+    /// Covers every buffer above.
+    reservation: Option<Reservation>,
+    /// Moving average of the time between pages, in nanoseconds.
+    interval: u64,
+    /// Moving average of read latency, in nanoseconds; zero until needed.
+    latency: u64,
+}
+
+impl BufferPool {
+    /// Starts a scan over the pages of attached file `file_id`, reading
+    /// ahead no further than page `end`.
+    pub fn page_scan(self: &Arc<Self>, file_id: FileId, end: PageId) -> PageScan {
+        PageScan {
+            pool: Arc::clone(self),
+            file_id,
+            end,
+            disk: None,
+            pages: 0,
+            ring: None,
+            last: None,
+            last_at: Instant::now(),
+            steps: 0,
+            window: 0,
+            ahead: VecDeque::new(),
+            next: 0,
+            spare: Vec::new(),
+            lent: Vec::new(),
+            reservation: None,
+            interval: 0,
+            latency: 0,
+        }
+    }
+}
+
+impl PageScan {
+    /// Pins page `page_id`, reading it through the pool or the scan's ring
+    /// unless it was read ahead.
+    pub fn fetch(&mut self, page_id: PageId) -> Result<PageGuard> {
+        self.fetch_pages(&[page_id])
+            .map(|mut guards| guards.pop().unwrap())
+    }
+
+    /// Like [`PageScan::fetch`] for several distinct pages in ascending
+    /// order, reading the ones neither resident nor read ahead in a single
+    /// batch.
+    pub fn fetch_pages(&mut self, page_ids: &[PageId]) -> Result<Vec<PageGuard>> {
+        let (Some(&first), Some(&last)) = (page_ids.first(), page_ids.last()) else {
+            return Ok(Vec::new());
+        };
+        let threshold = self.pool.scan_ring_threshold();
+        if self.pages < threshold && self.pages + page_ids.len() >= threshold {
+            self.ring = self.pool.scan_ring();
+        }
+        self.pages += page_ids.len();
+        self.step(first, last, page_ids.len());
+        self.read_ahead(last, page_ids.len())?;
+
+        let mut guards = Vec::with_capacity(page_ids.len());
+        let mut missing = Vec::new();
+        for (i, &page_id) in page_ids.iter().enumerate() {
+            let guard = self.take_ahead(page_id)?;
+            if guard.is_none() {
+                missing.push(i);
+            }
+            guards.push(guard);
+        }
+        if let [i] = missing[..] {
+            guards[i] = Some(match &mut self.ring {
+                Some(ring) => ring.fetch_file_page(self.file_id, page_ids[i])?,
+                None => self.pool.fetch_file_page(self.file_id, page_ids[i])?,
+            });
+        } else if !missing.is_empty() {
+            let ids: Vec<PageId> = missing.iter().map(|&i| page_ids[i]).collect();
+            let read = match &mut self.ring {
+                Some(ring) => ring.fetch_file_pages(self.file_id, &ids)?,
+                None => self.pool.fetch_file_pages(self.file_id, &ids)?,
+            };
+            for (i, guard) in missing.into_iter().zip(read) {
+                guards[i] = Some(guard);
+            }
+        }
+        Ok(guards.into_iter().flatten().collect())
+    }
+
+    /// Tracks whether the scan keeps moving forward, and how fast. Any
+    /// other step ends read-ahead until the scan is sequential again.
+    fn step(&mut self, first: PageId, last: PageId, pages: usize) {
+        let now = Instant::now();
+        let forward = self
+            .last
+            .is_some_and(|prev| first > prev && first - prev <= MAX_STEP);
+        if forward {
+            let nanos = now.duration_since(self.last_at).as_nanos() as u64 / pages as u64;
+            self.interval = average(self.interval, nanos);
+            self.steps = self.steps.saturating_add(1);
+        } else {
+            self.steps = 0;
+            self.window = 0;
+            self.cancel();
+            self.next = last + 1;
+        }
+        self.last = Some(last);
+        self.last_at = now;
+    }
+
+    /// Resizes the window after a step over `pages` pages ending at `last`
+    /// and, once half of it has been consumed, starts reading the pages
+    /// that bring it back to full size.
+    fn read_ahead(&mut self, last: PageId, pages: usize) -> Result<()> {
+        if self.steps < SEQUENTIAL_STEPS {
+            return Ok(());
+        }
+        if self.latency == 0 {
+            let mean = self.pool.read_latency().mean();
+            self.latency = if mean > 0 {
+                mean
+            } else {
+                DEFAULT_LATENCY.as_nanos() as u64
+            };
+        }
+        // Pages consumed during one read, with as many again for slack.
+        let needed = 2 * self.latency.div_ceil(self.interval.max(1)) as usize;
+        let free = self.pool.budget().available() / PAGE_SIZE / FREE_BUDGET_DIVISOR;
+        let target = needed
+            .clamp(MIN_WINDOW, MAX_WINDOW)
+            .min(self.ahead.len() + free);
+        self.window = (self.window + pages).max(MIN_WINDOW).min(target);
+
+        let from = self.next.max(last + 1);
+        if from > last + 1 + (self.window / 2) as u64 {
+            return Ok(());
+        }
+        let disk = match &self.disk {
+            Some(disk) => Arc::clone(disk),
+            None => Arc::clone(self.disk.insert(self.pool.file(self.file_id)?)),
+        };
+        let to = (last + 1 + self.window as u64)
+            .min(self.end)
+            .min(disk.num_pages());
+        let mut reads = Vec::new();
+        let mut page_id = from;
+        while page_id < to {
+            if !self.pool.is_resident(self.file_id, page_id) {
+                let Some(buf) = self.buffer() else {
+                    break;
+                };
+                reads.push((page_id, buf));
+            }
+            page_id += 1;
+        }
+        self.next = self.next.max(page_id);
+        if reads.is_empty() {
+            return Ok(());
+        }
+        let stamps: Vec<(PageId, u64)> = reads
+            .iter()
+            .map(|&(page_id, _)| (page_id, disk.write_stamp(page_id)))
+            .collect();
+        self.pool.count_read_ahead(stamps.len());
+        let started = Instant::now();
+        for ((page_id, stamp), read) in stamps.into_iter().zip(disk.read_pages_ahead(reads)) {
+            self.ahead.push_back(Ahead {
+                page_id,
+                read,
+                started,
+                stamp,
+            });
+        }
+        Ok(())
+    }
+
+    /// Pins `page_id` from its read-ahead copy, if it has a usable one.
+    /// Pages read ahead before it were skipped and are dropped.
+    fn take_ahead(&mut self, page_id: PageId) -> Result<Option<PageGuard>> {
+        while self
+            .ahead
+            .front()
+            .is_some_and(|ahead| ahead.page_id < page_id)
+        {
+            let skipped = self.ahead.pop_front().unwrap();
+            self.retire(skipped);
+        }
+        if self
+            .ahead
+            .front()
+            .is_none_or(|ahead| ahead.page_id != page_id)
+        {
+            return Ok(None);
+        }
+        let ahead = self.ahead.pop_front().unwrap();
+        let waited = Instant::now();
+        let (mut buf, n) = match ahead.read.wait() {
+            Ok(done) => done,
+            Err(err) => {
+                self.release(1);
+                return Err(err.into());
+            }
+        };
+        if waited.elapsed() >= STALL {
+            // The read just completed, so this is its full latency.
+            let latency = ahead.started.elapsed().as_nanos() as u64;
+            self.latency = average(self.latency, latency);
+            self.pool.count_read_ahead_wait();
+        }
+        buf[n..].fill(0);
+        let disk = self.disk.as_ref().unwrap();
+        let fresh = || disk.unchanged_since(page_id, ahead.stamp);
+        if self.ring.is_none() {
+            let guard = self.pool.install_copy(self.file_id, page_id, &buf, fresh);
+            self.spare.push(buf);
+            return guard;
+        }
+        let slot = Arc::new(RingSlot::new(buf));
+        let guard = self.pool.private_copy(self.file_id, page_id, &slot, fresh);
+        self.lent.push(slot);
+        Ok(guard)
+    }
+
+    /// A buffer to read a page ahead into: a spare one, one lent out that
+    /// is free again, or a new one if the budget allows.
+    fn buffer(&mut self) -> Option<PageBuf> {
+        if let Some(buf) = self.spare.pop() {
+            return Some(buf);
+        }
+        if let Some(at) = self
+            .lent
+            .iter()
+            .position(|slot| Arc::strong_count(slot) == 1)
+        {
+            let slot = Arc::into_inner(self.lent.swap_remove(at)).unwrap();
+            return Some(slot.into_buf());
+        }
+        match &mut self.reservation {
+            Some(reservation) => reservation.try_grow(PAGE_SIZE).ok()?,
+            None => {
+                let budget = self.pool.budget();
+                self.reservation = Some(budget.try_reserve(Consumer::BufferPool, PAGE_SIZE).ok()?);
+            }
+        }
+        Some(PageBuf::zeroed())
+    }
+
+    /// Waits for a read nobody needs any more and keeps its buffer.
+    fn retire(&mut self, ahead: Ahead) {
+        match ahead.read.wait() {
+            Ok((buf, _)) => self.spare.push(buf),
+            Err(_) => self.release(1),
+        }
+    }
+
+    /// Drops every page being read ahead, and spare buffers with them.
+    fn cancel(&mut self) {
+        while let Some(ahead) = self.ahead.pop_front() {
+            self.retire(ahead);
+        }
+        let spare = self.spare.len();
+        self.spare.clear();
+        self.release(spare);
+    }
+
+    /// Returns the memory of `buffers` buffers that are gone.
+    fn release(&mut self, buffers: usize) {
+        if let Some(reservation) = &mut self.reservation {
+            reservation.shrink(buffers * PAGE_SIZE);
+        }
+    }
+}
+
+/// Moves the moving average `average` towards `sample`.
+fn average(average: u64, sample: u64) -> u64 {
+    if average == 0 {
+        return sample;
+    }
+    if sample >= average {
+        average + (sample - average) / SMOOTHING
+    } else {
+        average - (average - sample) / SMOOTHING
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::memory::MemoryBudget;
+    use crate::storage::buffer_pool::MAIN_FILE;
+    use crate::test_util::TempDir;
+
+    const PAGES: u64 = 200;
+
+    /// A pool of 64 frames over `PAGES` pages, each starting with its id.
+    fn pool(dir: &TempDir) -> (Arc<MemoryBudget>, Arc<BufferPool>) {
+        let disk = Arc::new(DiskManager::open(dir.path().join("data.db")).unwrap());
+        for _ in 0..PAGES {
+            let page_id = disk.allocate_page();
+            write(&disk, page_id, page_id);
+        }
+        let budget = MemoryBudget::new(64 << 20);
+        let pool = BufferPool::new(disk, &budget, 64 * PAGE_SIZE).unwrap();
+        (budget, pool)
+    }
+
+    fn write(disk: &DiskManager, page_id: PageId, contents: u64) {
+        let mut page = PageBuf::zeroed();
+        page[..8].copy_from_slice(&contents.to_le_bytes());
+        disk.write_page(page_id, &page).unwrap();
+    }
+
+    fn read(scan: &mut PageScan, page_id: PageId) -> u64 {
+        let guard = scan.fetch(page_id).unwrap();
+        let data = guard.read();
+        u64::from_le_bytes(data[..8].try_into().unwrap())
+    }
+
+    #[test]
+    fn a_sequential_scan_is_read_ahead() {
+        let dir = TempDir::new("read-ahead-sequential");
+        let (budget, pool) = pool(&dir);
+        let used = budget.used();
+        let mut scan = pool.page_scan(MAIN_FILE, PAGES);
+        for page_id in 0..PAGES {
+            assert_eq!(read(&mut scan, page_id), page_id);
+        }
+        let stats = pool.stats();
+        // Every page after the first few, through the pool and then
+        // through the scan's ring.
+        assert!(stats.read_ahead_pages >= PAGES - 8, "{stats:?}");
+        assert!(stats.read_ahead_hits >= PAGES - 8, "{stats:?}");
+        assert!(stats.ring_reads > 0, "{stats:?}");
+        assert_eq!(stats.read_ahead_discards, 0);
+        drop(scan);
+        assert_eq!(budget.used(), used);
+    }
+
+    #[test]
+    fn a_random_scan_is_not_read_ahead() {
+        let dir = TempDir::new("read-ahead-random");
+        let (_budget, pool) = pool(&dir);
+        let mut scan = pool.page_scan(MAIN_FILE, PAGES);
+        // Jumps of 97 pages, forward or wrapping back, never a short step.
+        for i in 0..PAGES {
+            let page_id = i * 97 % PAGES;
+            assert_eq!(read(&mut scan, page_id), page_id);
+        }
+        assert_eq!(pool.stats().read_ahead_pages, 0);
+
+        // Nor is a scan that turns random after a sequential start once
+        // the pages it read ahead are gone.
+        let mut scan = pool.page_scan(MAIN_FILE, PAGES);
+        for page_id in [0, 1, 2, 3] {
+            read(&mut scan, page_id);
+        }
+        let ahead = pool.stats().read_ahead_pages;
+        assert!(ahead > 0);
+        for page_id in [150, 20, 120, 60, 180] {
+            assert_eq!(read(&mut scan, page_id), page_id);
+        }
+        assert_eq!(pool.stats().read_ahead_pages, ahead);
+    }
+
+    #[test]
+    fn a_page_written_after_it_was_read_ahead_is_read_again() {
+        let dir = TempDir::new("read-ahead-stale");
+        let (_budget, pool) = pool(&dir);
+        let mut scan = pool.page_scan(MAIN_FILE, PAGES);
+        for page_id in [0, 1, 2] {
+            read(&mut scan, page_id);
+        }
+        assert!(pool.stats().read_ahead_pages >= 2);
+        write(pool.disk(), 4, 1000);
+        assert_eq!(read(&mut scan, 3), 3);
+        assert_eq!(read(&mut scan, 4), 1000);
+        // Writes are counted per range of pages, so a neighbour read ahead
+        // with it may have been read again too.
+        assert!(pool.stats().read_ahead_discards >= 1);
+    }
+}
@@ -0,0 +1,173 @@
+//! Thin wrappers over operating-system calls not exposed by `std`: I/O
+//! hints, direct I/O, read-only memory mappings and advisory file locks.
+//!
+//! Hints are advisory: on platforms without them, or when the call fails,
+//! they do nothing and I/O proceeds as usual.
+
+use std::fs::{File, OpenOptions};
+
+#[cfg(target_os = "linux")]
+mod ffi {
+    use std::os::raw::c_int;
+
+    pub const POSIX_FADV_SEQUENTIAL: c_int = 2;
+    pub const POSIX_FADV_DONTNEED: c_int = 4;
+
+    extern "C" {
+        pub fn posix_fadvise(fd: c_int, offset: i64, len: i64, advice: c_int) -> c_int;
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn fadvise(file: &File, offset: u64, len: u64, advice: std::os::raw::c_int) {
+    use std::os::unix::io::AsRawFd;
+    // SAFETY: the descriptor is owned by `file` and stays open for the call.
+    unsafe {
+        ffi::posix_fadvise(file.as_raw_fd(), offset as i64, len as i64, advice);
+    }
+}
+
+/// Tells the kernel `file` will be read sequentially, enlarging its
+/// read-ahead window.
+pub fn advise_sequential(file: &File) {
+    #[cfg(target_os = "linux")]
+    fadvise(file, 0, 0, ffi::POSIX_FADV_SEQUENTIAL);
+    #[cfg(not(target_os = "linux"))]
+    let _ = file;
+}
+
+/// Lets the kernel drop cached pages of a range that will not be read
+/// again, so spill files do not crowd the page cache.
+pub fn discard_cached(file: &File, offset: u64, len: u64) {
+    #[cfg(target_os = "linux")]
+    fadvise(file, offset, len, ffi::POSIX_FADV_DONTNEED);
+    #[cfg(not(target_os = "linux"))]
+    let _ = (file, offset, len);
+}
+
+/// The `O_DIRECT` open flag, where it is known.
+#[cfg(all(
+    target_os = "linux",
+    any(target_arch = "x86", target_arch = "x86_64", target_arch = "riscv64")
+))]
+const O_DIRECT: Option<i32> = Some(0o40000);
+#[cfg(all(target_os = "linux", any(target_arch = "arm", target_arch = "aarch64")))]
+const O_DIRECT: Option<i32> = Some(0o200000);
+#[cfg(not(all(
+    target_os = "linux",
+    any(
+        target_arch = "x86",
+        target_arch = "x86_64",
+        target_arch = "riscv64",
+        target_arch = "arm",
+        target_arch = "aarch64"
+    )
+)))]
+const O_DIRECT: Option<i32> = None;
+
+/// Makes `options` open files for direct I/O, which bypasses the kernel
+/// page cache. Returns `false`, leaving `options` alone, on platforms
+/// where this is not supported.
+pub fn set_direct(options: &mut OpenOptions) -> bool {
+    use std::os::unix::fs::OpenOptionsExt;
+    match O_DIRECT {
+        Some(flag) => {
+            options.custom_flags(flag);
+            true
+        }
+        None => false,
+    }
+}
+
+#[cfg(unix)]
+mod unix {
+    use std::os::raw::{c_int, c_void};
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_SHARED: c_int = 1;
+    pub const LOCK_SH: c_int = 1;
+    pub const LOCK_EX: c_int = 2;
+    pub const LOCK_UN: c_int = 8;
+
+    extern "C" {
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+        pub fn flock(fd: c_int, operation: c_int) -> c_int;
+    }
+}
+
+/// Maps the first `len` bytes of `file` read-only and shared, so the
+/// mapping follows writes made to the file by other processes.
+pub fn map_readonly(file: &File, len: usize) -> std::io::Result<*const u8> {
+    use std::os::unix::io::AsRawFd;
+    // SAFETY: a fresh read-only mapping of an open descriptor aliases no
+    // Rust memory; failure is reported through MAP_FAILED.
+    let ptr = unsafe {
+        unix::mmap(
+            std::ptr::null_mut(),
+            len,
+            unix::PROT_READ,
+            unix::MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    if ptr as isize == -1 {
+        return Err(std::io::Error::last_os_error());
+    }
+    Ok(ptr as *const u8)
+}
+
+/// Removes a mapping created by [`map_readonly`].
+///
+/// # Safety
+///
+/// `ptr` and `len` must describe a live mapping that nothing borrows.
+pub unsafe fn unmap(ptr: *const u8, len: usize) {
+    unix::munmap(ptr as *mut _, len);
+}
+
+/// An advisory whole-file lock, released when dropped.
+#[derive(Debug)]
+pub struct FileLock<'a> {
+    file: &'a File,
+}
+
+impl<'a> FileLock<'a> {
+    /// Blocks until `file` is locked, shared or exclusively.
+    pub fn acquire(file: &'a File, exclusive: bool) -> std::io::Result<Self> {
+        use std::os::unix::io::AsRawFd;
+        let operation = if exclusive {
+            unix::LOCK_EX
+        } else {
+            unix::LOCK_SH
+        };
+        loop {
+            // SAFETY: flock only reads the descriptor number.
+            if unsafe { unix::flock(file.as_raw_fd(), operation) } == 0 {
+                return Ok(FileLock { file });
+            }
+            let err = std::io::Error::last_os_error();
+            if err.kind() != std::io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+    }
+}
+
+impl Drop for FileLock<'_> {
+    fn drop(&mut self) {
+        use std::os::unix::io::AsRawFd;
+        // SAFETY: as above.
+        unsafe {
+            unix::flock(self.file.as_raw_fd(), unix::LOCK_UN);
+        }
+    }
+}
@@ -0,0 +1,379 @@
+//! The append-only write-ahead log and its group-commit protocol.
+//!
+//! Records are framed as `[crc32 u32][len u32][payload]` and addressed by
+//! their log sequence number (LSN): the byte offset just past the record in
+//! the logical log, which is stored as a sequence of segment files.
+//!
+//! Committers copy their record into a preallocated buffer and then wait for
+//! the log to become durable up to their LSN. The first waiter to find no
+//! flush in progress becomes the leader: it optionally lingers for
+//! `fsync_interval` to let more committers join, swaps the filled buffer
+//! with the spare one, and writes and syncs the whole batch with a single
+//! `fdatasync` while new records accumulate in the other buffer. Everyone
+//! covered by the batch is then released together. Both buffers are charged
+//! to the memory budget for the life of the log.
+
+use std::collections::VecDeque;
+use std::fs::{self, File, OpenOptions};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
+
+use crate::aio::{self, Request};
+use crate::checksum::crc32;
+use crate::error::{Error, Result};
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::stats::{Histogram, HistogramSnapshot};
+use crate::storage::PAGE_SIZE;
+use crate::sys;
+use crate::wal::segment::{list_segments, segment_path};
+
+/// Log sequence number: a byte offset into the log.
+pub type Lsn = u64;
+
+/// Size of the per-record frame header.
+pub const RECORD_HEADER: usize = 8;
+
+/// Largest record payload accepted.
+pub const MAX_RECORD_BYTES: usize = 64 << 10;
+
+/// Group-commit tuning.
+#[derive(Debug, Clone)]
+pub struct WalOptions {
+    /// Total size of the two log buffers.
+    pub buffer_bytes: usize,
+    /// How long a commit leader waits for more records before syncing.
+    /// Zero syncs as soon as the previous batch is durable.
+    pub fsync_interval: Duration,
+    /// A leader stops waiting once this many bytes are batched.
+    pub max_batch_bytes: usize,
+    /// A new segment is started once the current one reaches this size.
+    pub segment_bytes: u64,
+    /// Drop synced records from the kernel's page cache. The log is only
+    /// read back during recovery.
+    pub discard_synced: bool,
+}
+
+#[derive(Debug)]
+struct Segment {
+    start: Lsn,
+    file: File,
+}
+
+#[derive(Debug)]
+struct State {
+    filling: Vec<u8>,
+    filling_start: Lsn,
+    spare: Option<Vec<u8>>,
+    durable: Lsn,
+    flushing: bool,
+    error: Option<String>,
+}
+
+/// Counters describing log activity since it was opened.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct WalStats {
+    pub records: u64,
+    pub bytes: u64,
+    pub syncs: u64,
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    records: AtomicU64,
+    bytes: AtomicU64,
+    syncs: AtomicU64,
+}
+
+/// A durable, append-only record log with group commit.
+#[derive(Debug)]
+pub struct Wal {
+    dir: PathBuf,
+    /// Written only by the current flush leader.
+    segment: Mutex<Segment>,
+    /// Start LSNs of all live segments, oldest first.
+    segments: Mutex<VecDeque<Lsn>>,
+    options: WalOptions,
+    half: usize,
+    state: Mutex<State>,
+    durable_changed: Condvar,
+    batch_ready: Condvar,
+    counters: Counters,
+    fsync_latency: Histogram,
+    _reservation: Reservation,
+}
+
+impl Wal {
+    /// Opens the log in `dir` for appending at `end`, the end of the valid
+    /// log found by replay. Anything after `end` (a torn tail) is discarded.
+    pub fn open(
+        dir: impl AsRef<Path>,
+        end: Lsn,
+        budget: &Arc<MemoryBudget>,
+        options: WalOptions,
+    ) -> Result<Self> {
+        let dir = dir.as_ref().to_path_buf();
+        let half = options.buffer_bytes / 2;
+        if half < 2 * crate::storage::PAGE_SIZE {
+            return Err(Error::InvalidArgument(format!(
+                "a log buffer of {} bytes is too small",
+                options.buffer_bytes
+            )));
+        }
+        let reservation = budget.try_reserve(Consumer::WalBuffer, 2 * half)?;
+        let options = WalOptions {
+            max_batch_bytes: options.max_batch_bytes.min(half),
+            ..options
+        };
+        let mut segments: VecDeque<Lsn> = list_segments(&dir)?.into();
+        while segments.back().is_some_and(|&start| start > end) {
+            fs::remove_file(segment_path(&dir, segments.pop_back().unwrap()))?;
+        }
+        // Start a fresh segment when there is none, or when `end` lies past
+        // the tail segment: an LSM flush may persist writes whose records
+        // never reached the log, and the gap must not read back as records.
+        let tail_end = match segments.back() {
+            Some(&start) => start + fs::metadata(segment_path(&dir, start))?.len(),
+            None => 0,
+        };
+        let start = match segments.back() {
+            Some(&start) if tail_end >= end => start,
+            _ => {
+                segments.push_back(end);
+                end
+            }
+        };
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(segment_path(&dir, start))?;
+        file.set_len(end - start)?;
+        file.sync_all()?;
+        File::open(&dir)?.sync_all()?;
+        Ok(Wal {
+            dir,
+            segment: Mutex::new(Segment { start, file }),
+            segments: Mutex::new(segments),
+            half,
+            state: Mutex::new(State {
+                filling: Vec::with_capacity(half),
+                filling_start: end,
+                spare: Some(Vec::with_capacity(half)),
+                durable: end,
+                flushing: false,
+                error: None,
+            }),
+            options,
+            durable_changed: Condvar::new(),
+            batch_ready: Condvar::new(),
+            counters: Counters::default(),
+            fsync_latency: Histogram::default(),
+            _reservation: reservation,
+        })
+    }
+
+    /// LSN just past the last appended record, durable or not.
+    pub fn end_lsn(&self) -> Lsn {
+        let state = self.state.lock().unwrap();
+        state.filling_start + state.filling.len() as u64
+    }
+
+    /// Deletes segments that hold only records before `lsn`. The segment
+    /// being appended to is always kept.
+    pub fn truncate_before(&self, lsn: Lsn) -> Result<()> {
+        let mut segments = self.segments.lock().unwrap();
+        while segments.len() > 1 && segments[1] <= lsn {
+            let start = segments.pop_front().unwrap();
+            fs::remove_file(segment_path(&self.dir, start))?;
+        }
+        Ok(())
+    }
+
+    /// Number of segment files currently on disk.
+    pub fn segment_count(&self) -> usize {
+        self.segments.lock().unwrap().len()
+    }
+
+    /// LSN up to which the log is known to be on stable storage.
+    pub fn durable_lsn(&self) -> Lsn {
+        self.state.lock().unwrap().durable
+    }
+
+    /// Snapshot of the log's activity counters.
+    pub fn stats(&self) -> WalStats {
+        WalStats {
+            records: self.counters.records.load(Ordering::Relaxed),
+            bytes: self.counters.bytes.load(Ordering::Relaxed),
+            syncs: self.counters.syncs.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Latency of writing and syncing each group-commit batch.
+    pub fn fsync_latency(&self) -> HistogramSnapshot {
+        self.fsync_latency.snapshot()
+    }
+
+    /// Buffers `payload` as a new record and returns its LSN. The record is
+    /// not durable until [`Wal::wait_durable`] returns for that LSN.
+    pub fn append(&self, payload: &[u8]) -> Result<Lsn> {
+        let size = RECORD_HEADER + payload.len();
+        if payload.len() > MAX_RECORD_BYTES || size > self.half {
+            return Err(Error::InvalidArgument(format!(
+                "log record of {size} bytes exceeds the log buffer"
+            )));
+        }
+        let mut state = self.state.lock().unwrap();
+        loop {
+            if let Some(err) = &state.error {
+                return Err(Error::Background(err.clone()));
+            }
+            if state.filling.len() + size <= self.half {
+                break;
+            }
+            // The buffer is full: drain it, or cut short a lingering leader
+            // and wait for it.
+            state = if state.flushing {
+                self.batch_ready.notify_one();
+                self.durable_changed.wait(state).unwrap()
+            } else {
+                self.lead_flush(state)?
+            };
+        }
+        let mut header = [0u8; RECORD_HEADER];
+        header[..4].copy_from_slice(&crc32(payload).to_le_bytes());
+        header[4..].copy_from_slice(&(payload.len() as u32).to_le_bytes());
+        state.filling.extend_from_slice(&header);
+        state.filling.extend_from_slice(payload);
+        if state.filling.len() >= self.options.max_batch_bytes {
+            self.batch_ready.notify_one();
+        }
+        self.counters.records.fetch_add(1, Ordering::Relaxed);
+        self.counters
+            .bytes
+            .fetch_add(size as u64, Ordering::Relaxed);
+        Ok(state.filling_start + state.filling.len() as u64)
+    }
+
+    /// Blocks until every record up to `lsn` is on stable storage, leading
+    /// a group flush if nobody else is.
+    pub fn wait_durable(&self, lsn: Lsn) -> Result<()> {
+        let mut state = self.state.lock().unwrap();
+        while state.durable < lsn {
+            if let Some(err) = &state.error {
+                return Err(Error::Background(err.clone()));
+            }
+            state = if state.flushing {
+                self.durable_changed.wait(state).unwrap()
+            } else {
+                self.lead_flush(state)?
+            };
+        }
+        Ok(())
+    }
+
+    /// Appends `payload` and waits for it to become durable.
+    pub fn commit(&self, payload: &[u8]) -> Result<Lsn> {
+        let lsn = self.append(payload)?;
+        self.wait_durable(lsn)?;
+        Ok(lsn)
+    }
+
+    /// Makes every buffered record durable.
+    pub fn sync(&self) -> Result<Lsn> {
+        let end = {
+            let state = self.state.lock().unwrap();
+            state.filling_start + state.filling.len() as u64
+        };
+        self.wait_durable(end)?;
+        Ok(end)
+    }
+
+    fn lead_flush<'a>(&'a self, mut state: MutexGuard<'a, State>) -> Result<MutexGuard<'a, State>> {
+        state.flushing = true;
+        if !self.options.fsync_interval.is_zero() {
+            let deadline = Instant::now() + self.options.fsync_interval;
+            while state.filling.len() < self.options.max_batch_bytes {
+                let now = Instant::now();
+                if now >= deadline {
+                    break;
+                }
+                state = self
+                    .batch_ready
+                    .wait_timeout(state, deadline - now)
+                    .unwrap()
+                    .0;
+            }
+        }
+        let spare = state.spare.take().expect("spare log buffer in use");
+        let batch = std::mem::replace(&mut state.filling, spare);
+        let start = state.filling_start;
+        let end = start + batch.len() as u64;
+        state.filling_start = end;
+        drop(state);
+
+        let started = Instant::now();
+        let result = self.write_batch(&batch, start, end);
+        self.fsync_latency.record_since(started);
+
+        let mut state = self.state.lock().unwrap();
+        let mut batch = batch;
+        batch.clear();
+        state.spare = Some(batch);
+        state.flushing = false;
+        match result {
+            Ok(()) => {
+                self.counters.syncs.fetch_add(1, Ordering::Relaxed);
+                state.durable = end;
+            }
+            Err(err) => state.error = Some(err.to_string()),
+        }
+        self.durable_changed.notify_all();
+        match &state.error {
+            Some(err) => Err(Error::Background(err.clone())),
+            None => Ok(state),
+        }
+    }
+
+    /// Writes and syncs one batch, starting a new segment afterwards if the
+    /// current one has grown past `segment_bytes`. Only the flush leader
+    /// calls this.
+    fn write_batch(&self, batch: &[u8], start: Lsn, end: Lsn) -> std::io::Result<()> {
+        let mut segment = self.segment.lock().unwrap();
+        // The sync is linked behind the write, so both go to the kernel in
+        // one submission.
+        aio::shared().run_chain(vec![
+            Request::Write {
+                file: &segment.file,
+                offset: start - segment.start,
+                buf: batch,
+            },
+            Request::Sync {
+                file: &segment.file,
+            },
+        ])?;
+        if self.options.discard_synced {
+            // Only whole pages can be dropped. The page `end` falls in is
+            // kept: the next batch appends to it.
+            let from = (start - segment.start) / PAGE_SIZE as u64 * PAGE_SIZE as u64;
+            let to = (end - segment.start) / PAGE_SIZE as u64 * PAGE_SIZE as u64;
+            if to > from {
+                sys::discard_cached(&segment.file, from, to - from);
+            }
+        }
+        if end - segment.start >= self.options.segment_bytes {
+            let file = OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .truncate(true)
+                .open(segment_path(&self.dir, end))?;
+            File::open(&self.dir)?.sync_all()?;
+            *segment = Segment { start: end, file };
+            self.segments.lock().unwrap().push_back(end);
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,10 @@
+//! Write-ahead logging.
+
+pub mod log;
+pub mod reader;
+pub mod record;
+pub(crate) mod segment;
+
+pub use log::{Lsn, Wal, WalOptions, WalStats};
+pub use reader::WalReader;
+pub use record::LogRecord;
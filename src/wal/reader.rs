@@ -0,0 +1,221 @@
+//! Streaming log replay.
+//!
+//! Records are read sequentially through a fixed-size buffer, so replaying a
+//! log of any length needs only that buffer plus the record being applied.
+//! Reading stops at the first record that is incomplete or fails its
+//! checksum: that is the torn tail of the last write before a crash.
+
+use std::fs::File;
+use std::io::{BufReader, ErrorKind, Read, Seek, SeekFrom};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use crate::checksum::crc32;
+use crate::error::Result;
+use crate::memory::{Consumer, MemoryBudget, Reservation};
+use crate::wal::log::{Lsn, MAX_RECORD_BYTES, RECORD_HEADER};
+use crate::wal::segment::{list_segments, segment_path};
+
+/// Size of the read-ahead buffer used during replay.
+pub const REPLAY_BUFFER_BYTES: usize = 64 << 10;
+
+/// Iterates over log records starting at a given LSN.
+#[derive(Debug)]
+pub struct WalReader {
+    dir: PathBuf,
+    segments: Vec<Lsn>,
+    segment: usize,
+    reader: Option<BufReader<File>>,
+    position: Lsn,
+    done: bool,
+    _reservation: Reservation,
+}
+
+impl WalReader {
+    /// Positions a reader at `from`, which must be a record boundary such as
+    /// a checkpoint LSN.
+    pub fn open(dir: impl AsRef<Path>, from: Lsn, budget: &Arc<MemoryBudget>) -> Result<Self> {
+        let dir = dir.as_ref().to_path_buf();
+        let reservation = budget.try_reserve(Consumer::WalBuffer, REPLAY_BUFFER_BYTES)?;
+        let segments = list_segments(&dir)?;
+        let segment = segments.partition_point(|&start| start <= from);
+        let mut reader = WalReader {
+            dir,
+            segments,
+            segment,
+            reader: None,
+            position: from,
+            done: segment == 0,
+            _reservation: reservation,
+        };
+        if !reader.done {
+            reader.segment -= 1;
+            let start = reader.segments[reader.segment];
+            reader.open_segment(from - start)?;
+        }
+        Ok(reader)
+    }
+
+    fn open_segment(&mut self, offset: u64) -> Result<()> {
+        let start = self.segments[self.segment];
+        let mut file = File::open(segment_path(&self.dir, start))?;
+        file.seek(SeekFrom::Start(offset))?;
+        self.reader = Some(BufReader::with_capacity(REPLAY_BUFFER_BYTES, file));
+        Ok(())
+    }
+
+    /// LSN just past the last valid record returned so far: where new
+    /// records should be appended once replay is complete.
+    pub fn end_lsn(&self) -> Lsn {
+        self.position
+    }
+
+    /// Returns the next record's payload and LSN, or `None` at the end of
+    /// the valid log.
+    pub fn next_record(&mut self) -> Result<Option<(Lsn, Vec<u8>)>> {
+        while !self.done {
+            let reader = self.reader.as_mut().unwrap();
+            let mut header = [0u8; RECORD_HEADER];
+            match read_full(reader, &mut header)? {
+                0 => {
+                    // Clean end of segment: continue only if the next one
+                    // starts exactly here.
+                    let next = self.segment + 1;
+                    if self.segments.get(next) == Some(&self.position) {
+                        self.segment = next;
+                        self.open_segment(0)?;
+                        continue;
+                    }
+                    self.done = true;
+                }
+                n if n < RECORD_HEADER => self.done = true,
+                _ => {
+                    let crc = u32::from_le_bytes(header[..4].try_into().unwrap());
+                    let len = u32::from_le_bytes(header[4..].try_into().unwrap()) as usize;
+                    if len > MAX_RECORD_BYTES {
+                        self.done = true;
+                        continue;
+                    }
+                    let mut payload = vec![0u8; len];
+                    if read_full(reader, &mut payload)? < len || crc32(&payload) != crc {
+                        self.done = true;
+                        continue;
+                    }
+                    self.position += (RECORD_HEADER + len) as u64;
+                    return Ok(Some((self.position, payload)));
+                }
+            }
+        }
+        Ok(None)
+    }
+}
+
+/// Reads until `buf` is full or the input ends, returning the bytes read.
+fn read_full(reader: &mut impl Read, buf: &mut [u8]) -> Result<usize> {
+    let mut read = 0;
+    while read < buf.len() {
+        match reader.read(&mut buf[read..]) {
+            Ok(0) => break,
+            Ok(n) => read += n,
+            Err(err) if err.kind() == ErrorKind::Interrupted => {}
+            Err(err) => return Err(err.into()),
+        }
+    }
+    Ok(read)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{self, OpenOptions};
+    use std::io::Write;
+    use std::os::unix::fs::FileExt;
+
+    use super::*;
+    use crate::options::Options;
+    use crate::test_util::TempDir;
+    use crate::wal::Wal;
+
+    fn budget() -> Arc<MemoryBudget> {
+        MemoryBudget::new(4 << 20)
+    }
+
+    /// Commits `count` records to a new log in `dir` and returns their LSNs.
+    fn write_log(dir: &TempDir, count: usize) -> Vec<Lsn> {
+        let wal = Wal::open(dir.path(), 0, &budget(), Options::default().wal_options()).unwrap();
+        (0..count)
+            .map(|i| wal.commit(format!("record {i}").as_bytes()).unwrap())
+            .collect()
+    }
+
+    fn replay(dir: &TempDir, from: Lsn) -> (Vec<(Lsn, Vec<u8>)>, Lsn) {
+        let mut reader = WalReader::open(dir.path(), from, &budget()).unwrap();
+        let mut records = Vec::new();
+        while let Some(record) = reader.next_record().unwrap() {
+            records.push(record);
+        }
+        (records, reader.end_lsn())
+    }
+
+    #[test]
+    fn replay_stops_at_a_torn_tail() {
+        let dir = TempDir::new("wal-torn-tail");
+        let lsns = write_log(&dir, 10);
+        let path = segment_path(dir.path(), 0);
+        assert_eq!(fs::metadata(&path).unwrap().len(), lsns[9]);
+        // Cut the last record short and leave part of a header after it.
+        let file = OpenOptions::new().append(true).open(&path).unwrap();
+        file.set_len(lsns[9] - 3).unwrap();
+        (&file).write_all(&[0xff; 5]).unwrap();
+        drop(file);
+
+        let (records, end) = replay(&dir, 0);
+        assert_eq!(records.len(), 9);
+        for (i, (lsn, payload)) in records.iter().enumerate() {
+            assert_eq!(*lsn, lsns[i]);
+            assert_eq!(payload, format!("record {i}").as_bytes());
+        }
+        assert_eq!(end, lsns[8]);
+
+        // Reopening at the end of the valid log drops the torn tail, so
+        // records appended next follow the survivors.
+        let wal = Wal::open(dir.path(), end, &budget(), Options::default().wal_options()).unwrap();
+        let after = wal.commit(b"after").unwrap();
+        drop(wal);
+        let (records, end) = replay(&dir, 0);
+        assert_eq!(records.len(), 10);
+        assert_eq!(records[9], (after, b"after".to_vec()));
+        assert_eq!(end, after);
+    }
+
+    #[test]
+    fn replay_stops_at_a_checksum_mismatch() {
+        let dir = TempDir::new("wal-checksum");
+        let lsns = write_log(&dir, 10);
+        let file = OpenOptions::new()
+            .write(true)
+            .open(segment_path(dir.path(), 0))
+            .unwrap();
+        // Flip the last payload byte of record 5.
+        file.write_at(b"X", lsns[5] - 1).unwrap();
+        let (records, end) = replay(&dir, 0);
+        assert_eq!(records.len(), 5);
+        assert_eq!(end, lsns[4]);
+    }
+
+    #[test]
+    fn replay_starts_at_a_record_boundary() {
+        let dir = TempDir::new("wal-from");
+        let lsns = write_log(&dir, 10);
+        // Damage a record before the starting point: it is never read.
+        let file = OpenOptions::new()
+            .write(true)
+            .open(segment_path(dir.path(), 0))
+            .unwrap();
+        file.write_at(&[0; RECORD_HEADER], 0).unwrap();
+        let (records, end) = replay(&dir, lsns[3]);
+        let lsns_read: Vec<Lsn> = records.iter().map(|&(lsn, _)| lsn).collect();
+        assert_eq!(lsns_read, lsns[4..]);
+        assert_eq!(records[0].1, b"record 4");
+        assert_eq!(end, lsns[9]);
+    }
+}
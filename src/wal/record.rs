@@ -0,0 +1,56 @@
+//! Logical redo records stored in the write-ahead log.
+
+use crate::error::{Error, Result};
+
+const KIND_PUT: u8 = 1;
+const KIND_DELETE: u8 = 2;
+
+/// A logged change to the primary key space.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum LogRecord {
+    Put { key: Vec<u8>, value: Vec<u8> },
+    Delete { key: Vec<u8> },
+}
+
+impl LogRecord {
+    /// Encodes a put of `value` under `key`.
+    pub fn encode_put(key: &[u8], value: &[u8]) -> Vec<u8> {
+        let mut out = Vec::with_capacity(5 + key.len() + value.len());
+        out.push(KIND_PUT);
+        out.extend_from_slice(&(key.len() as u32).to_le_bytes());
+        out.extend_from_slice(key);
+        out.extend_from_slice(value);
+        out
+    }
+
+    /// Encodes a deletion of `key`.
+    pub fn encode_delete(key: &[u8]) -> Vec<u8> {
+        let mut out = Vec::with_capacity(5 + key.len());
+        out.push(KIND_DELETE);
+        out.extend_from_slice(&(key.len() as u32).to_le_bytes());
+        out.extend_from_slice(key);
+        out
+    }
+
+    /// Decodes a record payload produced by one of the `encode_*` functions.
+    pub fn decode(payload: &[u8]) -> Result<Self> {
+        let corrupt = || Error::Corruption("malformed log record".into());
+        if payload.len() < 5 {
+            return Err(corrupt());
+        }
+        let key_len = u32::from_le_bytes(payload[1..5].try_into().unwrap()) as usize;
+        let rest = &payload[5..];
+        if rest.len() < key_len {
+            return Err(corrupt());
+        }
+        let (key, value) = rest.split_at(key_len);
+        match payload[0] {
+            KIND_PUT => Ok(LogRecord::Put {
+                key: key.to_vec(),
+                value: value.to_vec(),
+            }),
+            KIND_DELETE if value.is_empty() => Ok(LogRecord::Delete { key: key.to_vec() }),
+            _ => Err(corrupt()),
+        }
+    }
+}
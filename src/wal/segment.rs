@@ -0,0 +1,34 @@
+//! Naming and discovery of log segment files.
+//!
+//! The log is split into segments named after the LSN of their first byte,
+//! so a record at LSN `l` lives in the last segment starting at or before
+//! `l`, and whole segments can be deleted once a checkpoint passes them.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use crate::error::Result;
+use crate::wal::log::Lsn;
+
+/// Path of the segment starting at `start` in `dir`.
+pub fn segment_path(dir: &Path, start: Lsn) -> PathBuf {
+    dir.join(format!("wal-{start:020}.log"))
+}
+
+/// Start LSNs of every segment in `dir`, in ascending order.
+pub fn list_segments(dir: &Path) -> Result<Vec<Lsn>> {
+    let mut starts = Vec::new();
+    for entry in fs::read_dir(dir)? {
+        let name = entry?.file_name();
+        if let Some(start) = name
+            .to_str()
+            .and_then(|n| n.strip_prefix("wal-"))
+            .and_then(|n| n.strip_suffix(".log"))
+            .and_then(|n| n.parse::<Lsn>().ok())
+        {
+            starts.push(start);
+        }
+    }
+    starts.sort_unstable();
+    Ok(starts)
+}